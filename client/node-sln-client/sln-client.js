@@ -325,6 +325,34 @@ Repo.prototype.submitFile = function(buf, type, opts, cb) {
 		res.resume(); // Drain
 	});
 };
+// opts: (none)
+// cb: err: Error, URIs: array (the subset of `uris` the repo has)
+Repo.prototype.have = function(uris, opts, cb) {
+	var repo = this;
+	var req = repo.protocol.request({
+		method: "POST",
+		hostname: repo.hostname,
+		port: repo.port,
+		path: repo.path+"/sln/have",
+		headers: {
+			"Cookie": repo.cookie,
+			"Content-Type": "text/uri-list; charset=utf-8",
+		},
+		agent: repo.agent,
+	});
+	req.end(uris.join("\r\n")+"\r\n", "utf8");
+	var stream = new URIListStream({ meta: false, req: req });
+	var URIs = [];
+	stream.on("data", function(URI) {
+		URIs.push(URI);
+	});
+	stream.on("end", function() {
+		cb(null, URIs);
+	});
+	stream.on("error", function(err) {
+		cb(err, null);
+	});
+};
 // opts: { uri: string, size: number }
 // returns: stream.Writable (emits "submission": { location: string })
 Repo.prototype.createSubmissionStream = function(type, opts) {
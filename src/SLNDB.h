@@ -41,6 +41,10 @@ enum {
 	// Multi-byte table IDs aren't a big deal
 	SLNLastFileURIBySyncID = 1000, // Every SyncID is a SessionID.
 	SLNLastMetaURIBySyncID = 1001,
+	SLNStatByName = 1002,
+	SLNFileCountByType = 1003,
+	SLNDigestByPrefix = 1004,
+	SLNBucketAndFileID = 1005,
 };
 
 
@@ -161,6 +165,11 @@ static void SLNPullByIDValUnpack(KVS_val *const val, KVS_txn *const txn, uint64_
 	kvs_bind_uint64((range)->min, SLNFileByID); \
 	kvs_range_genmax((range)); \
 	KVS_RANGE_STORAGE_VERIFY(range);
+static void SLNFileByIDKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const fileID) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(SLNFileByID == table);
+	*fileID = kvs_read_uint64(val);
+}
 #define SLNFileByIDValPack(val, txn, internalHash, type, size) \
 	KVS_VAL_STORAGE(val, KVS_VARINT_MAX * 1 + KVS_INLINE_MAX * 2); \
 	kvs_bind_string((val), (internalHash), (txn)); \
@@ -191,6 +200,12 @@ static void SLNPullByIDValUnpack(KVS_val *const val, KVS_txn *const txn, uint64_
 	kvs_bind_uint64((range)->min, (fileID)); \
 	kvs_range_genmax((range)); \
 	KVS_RANGE_STORAGE_VERIFY(range);
+static void SLNFileByIDValUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const internalHash, strarg_t *const type, uint64_t *const size) {
+	*internalHash = kvs_read_string(val, txn);
+	*type = kvs_read_string(val, txn);
+	*size = kvs_read_uint64(val);
+}
+
 static void SLNFileIDAndURIKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const fileID, strarg_t *const URI) {
 	uint64_t const table = kvs_read_uint64(val);
 	assert(SLNFileIDAndURI == table);
@@ -291,6 +306,12 @@ static void SLNTargetURIAndMetaFileIDKeyUnpack(KVS_val *const val, KVS_txn *cons
 	kvs_bind_string((val), (field), (txn)); \
 	kvs_bind_string((val), (value), (txn)); \
 	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNMetaFileIDFieldAndValueRange1(range, txn, metaFileID) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX * 2); \
+	kvs_bind_uint64((range)->min, SLNMetaFileIDFieldAndValue); \
+	kvs_bind_uint64((range)->min, (metaFileID)); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 #define SLNMetaFileIDFieldAndValueRange2(range, txn, metaFileID, field) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX * 2 + KVS_INLINE_MAX * 1); \
 	kvs_bind_uint64((range)->min, SLNMetaFileIDFieldAndValue); \
@@ -313,6 +334,17 @@ static void SLNMetaFileIDFieldAndValueKeyUnpack(KVS_val *const val, KVS_txn *con
 	kvs_bind_string((val), value, (txn)); \
 	kvs_bind_uint64((val), (metaFileID)); \
 	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNFieldValueAndMetaFileIDRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+#define SLNFieldValueAndMetaFileIDRange1(range, txn, field) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
+	kvs_bind_string((range)->min, (field), (txn)); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 #define SLNFieldValueAndMetaFileIDRange2(range, txn, field, value) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX * 1 + KVS_INLINE_MAX * 2); \
 	kvs_bind_uint64((range)->min, SLNFieldValueAndMetaFileID); \
@@ -335,6 +367,11 @@ static void SLNFieldValueAndMetaFileIDKeyUnpack(KVS_val *const val, KVS_txn *con
 	kvs_bind_uint64((val), (metaFileID)); \
 	kvs_bind_uint64((val), (position)); \
 	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNTermMetaFileIDAndPositionRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 #define SLNTermMetaFileIDAndPositionRange1(range, txn, token) \
 	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX + KVS_INLINE_MAX); \
 	kvs_bind_uint64((range)->min, SLNTermMetaFileIDAndPosition); \
@@ -405,6 +442,11 @@ static void SLNFileIDAndSessionIDKeyUnpack(KVS_val *const val, KVS_txn *const tx
 	kvs_bind_uint64((range)->min, (sessionID)); \
 	kvs_range_genmax((range)); \
 	KVS_RANGE_STORAGE_VERIFY(range);
+#define SLNSessionIDAndHintIDToMetaURIAndTargetURIRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX*1); \
+	kvs_bind_uint64((range)->min, SLNSessionIDAndHintIDToMetaURIAndTargetURI); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
 static void SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const sessionID, uint64_t *const hintID) {
 	uint64_t const table = kvs_read_uint64(val);
 	assert(SLNSessionIDAndHintIDToMetaURIAndTargetURI == table);
@@ -484,3 +526,171 @@ static void SLNTargetURISessionIDAndHintIDKeyUnpack(KVS_val *const val, KVS_txn
 	kvs_bind_uint64((val), (fileID)); \
 	KVS_VAL_STORAGE_VERIFY(val);
 
+///
+
+// Aggregate counts, updated in the same transaction as the tables they
+// describe. Write transactions are serialized, so they're always exact.
+// They can also be recomputed from scratch (see SLNRepoRebuildStats).
+// The version is only written by a rebuild. Repos without the current
+// version (including ones from before stats existed) have to be rebuilt
+// with --rebuild-stats, which also fills in the digests below. Until
+// then, digests aren't served (see SLNSessionGetDigests).
+#define SLN_STAT_VERSION "version"
+#define SLN_STATS_VERSION 1
+#define SLN_STAT_FILES "files"
+#define SLN_STAT_BYTES "bytes"
+#define SLN_STAT_METAFILES "metafiles"
+#define SLN_STAT_TERMS "terms"
+#define SLN_STAT_FIELDS "fields"
+
+#define SLNStatByNameKeyPack(val, txn, name) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), SLNStatByName); \
+	kvs_bind_string((val), (name), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNStatByNameRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNStatByName); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+static void SLNStatByNameKeyUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const name) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(SLNStatByName == table);
+	*name = kvs_read_string(val, txn);
+}
+
+#define SLNFileCountByTypeKeyPack(val, txn, type) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX + KVS_INLINE_MAX); \
+	kvs_bind_uint64((val), SLNFileCountByType); \
+	kvs_bind_string((val), (type), (txn)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNFileCountByTypeRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNFileCountByType); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+static void SLNFileCountByTypeKeyUnpack(KVS_val *const val, KVS_txn *const txn, strarg_t *const type) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(SLNFileCountByType == table);
+	*type = kvs_read_string(val, txn);
+}
+
+// Shared by both stat tables.
+#define SLNStatValPack(val, txn, count) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX); \
+	kvs_bind_uint64((val), (count)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static uint64_t SLNStatValUnpack(KVS_val *const val, KVS_txn *const txn) {
+	return kvs_read_uint64(val);
+}
+
+static int SLNStatAddInternal(KVS_txn *const txn, KVS_val const *const key, int64_t const n) {
+	if(!n) return 0;
+	KVS_val old[1];
+	uint64_t count = 0;
+	int rc = kvs_get(txn, key, old);
+	if(rc >= 0) count = SLNStatValUnpack(old, txn);
+	else if(KVS_NOTFOUND != rc) return rc;
+	KVS_val val[1];
+	SLNStatValPack(val, txn, count + n);
+	return kvs_put(txn, key, val, 0);
+}
+static int SLNStatAdd(KVS_txn *const txn, strarg_t const name, int64_t const n) {
+	KVS_val key[1];
+	SLNStatByNameKeyPack(key, txn, name);
+	return SLNStatAddInternal(txn, key, n);
+}
+static int SLNStatAddType(KVS_txn *const txn, strarg_t const type, int64_t const n) {
+	KVS_val key[1];
+	SLNFileCountByTypeKeyPack(key, txn, type);
+	return SLNStatAddInternal(txn, key, n);
+}
+
+///
+
+// Digests of internal hashes, for reconciling with peers. Every prefix
+// up to SLN_DIGEST_DEPTH hex digits has a count and a sum of hash values,
+// so two repos only have to compare the prefixes where they differ.
+// Prefixes are stored as integers, e.g. "3f" is depth 2, prefix 0x3f.
+// The deepest prefixes are buckets, which also index their files.
+#define SLNDigestByPrefixKeyPack(val, txn, depth, prefix) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*3); \
+	kvs_bind_uint64((val), SLNDigestByPrefix); \
+	kvs_bind_uint64((val), (depth)); \
+	kvs_bind_uint64((val), (prefix)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNDigestByPrefixRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNDigestByPrefix); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+#define SLNDigestValPack(val, txn, count, sum) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*2); \
+	kvs_bind_uint64((val), (count)); \
+	kvs_bind_uint64((val), (sum)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+static void SLNDigestValUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const count, uint64_t *const sum) {
+	*count = kvs_read_uint64(val);
+	*sum = kvs_read_uint64(val);
+}
+
+#define SLNBucketAndFileIDKeyPack(val, txn, bucket, fileID) \
+	KVS_VAL_STORAGE(val, KVS_VARINT_MAX*3); \
+	kvs_bind_uint64((val), SLNBucketAndFileID); \
+	kvs_bind_uint64((val), (bucket)); \
+	kvs_bind_uint64((val), (fileID)); \
+	KVS_VAL_STORAGE_VERIFY(val);
+#define SLNBucketAndFileIDRange0(range, txn) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX); \
+	kvs_bind_uint64((range)->min, SLNBucketAndFileID); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+#define SLNBucketAndFileIDRange1(range, txn, bucket) \
+	KVS_RANGE_STORAGE(range, KVS_VARINT_MAX*2); \
+	kvs_bind_uint64((range)->min, SLNBucketAndFileID); \
+	kvs_bind_uint64((range)->min, (bucket)); \
+	kvs_range_genmax((range)); \
+	KVS_RANGE_STORAGE_VERIFY(range);
+static void SLNBucketAndFileIDKeyUnpack(KVS_val *const val, KVS_txn *const txn, uint64_t *const bucket, uint64_t *const fileID) {
+	uint64_t const table = kvs_read_uint64(val);
+	assert(SLNBucketAndFileID == table);
+	*bucket = kvs_read_uint64(val);
+	*fileID = kvs_read_uint64(val);
+}
+
+// Returns UINT64_MAX if there aren't enough valid hex digits.
+static uint64_t SLNHexPrefix(strarg_t const hash, size_t const len) {
+	assert(len <= 16);
+	uint64_t x = 0;
+	for(size_t i = 0; i < len; i++) {
+		char const c = hash[i];
+		x <<= 4;
+		if(c >= '0' && c <= '9') x |= c - '0';
+		else if(c >= 'a' && c <= 'f') x |= c - 'a' + 10;
+		else return UINT64_MAX;
+	}
+	return x;
+}
+static int SLNDigestAdd(KVS_txn *const txn, strarg_t const internalHash, uint64_t const fileID) {
+	size_t const len = strlen(internalHash);
+	if(len < 16) return KVS_EINVAL;
+	// The prefix is fixed within a bucket, so use the other end.
+	uint64_t const value = SLNHexPrefix(internalHash+len-16, 16);
+	int rc;
+	for(uint64_t depth = 1; depth <= SLN_DIGEST_DEPTH; depth++) {
+		KVS_val key[1], old[1];
+		SLNDigestByPrefixKeyPack(key, txn, depth, SLNHexPrefix(internalHash, depth));
+		uint64_t count = 0, sum = 0;
+		rc = kvs_get(txn, key, old);
+		if(rc >= 0) SLNDigestValUnpack(old, txn, &count, &sum);
+		else if(KVS_NOTFOUND != rc) return rc;
+		KVS_val val[1];
+		SLNDigestValPack(val, txn, count+1, sum+value);
+		rc = kvs_put(txn, key, val, 0);
+		if(rc < 0) return rc;
+	}
+	KVS_val bucket_key[1], null[1];
+	SLNBucketAndFileIDKeyPack(bucket_key, txn, SLNHexPrefix(internalHash, SLN_DIGEST_DEPTH), fileID);
+	kvs_nullval(null);
+	return kvs_put(txn, bucket_key, null, KVS_NOOVERWRITE_FAST);
+}
@@ -2,6 +2,7 @@
 // MIT licensed (see LICENSE for details)
 
 #include <openssl/sha.h>
+#include "util/metrics.h"
 #include "StrongLink.h"
 
 #define HASHLEN_MIN 8 // Sanity check.
@@ -17,17 +18,21 @@ static SLNAlgo const *const algos[];
 static size_t const algocount;
 
 struct SLNHasher {
+	async_pool_t *pool;
+	SLNPriority priority;
 	str_t *type;
 	size_t count;
 	void **algos;
 	str_t *internalHash;
 };
 
-SLNHasherRef SLNHasherCreate(strarg_t const type) {
+SLNHasherRef SLNHasherCreate(strarg_t const type, async_pool_t *const pool, SLNPriority const priority) {
 	assert(type);
 	SLNHasherRef hasher = calloc(1, sizeof(struct SLNHasher));
 	if(!hasher) return NULL;
 
+	hasher->pool = pool;
+	hasher->priority = priority;
 	hasher->type = strdup(type);
 	hasher->count = algocount;
 	hasher->algos = calloc(hasher->count, sizeof(hasher->algos[0]));
@@ -49,6 +54,8 @@ SLNHasherRef SLNHasherCreate(strarg_t const type) {
 void SLNHasherFree(SLNHasherRef *const hasherptr) {
 	SLNHasherRef hasher = *hasherptr;
 	if(!hasher) return;
+	hasher->pool = NULL;
+	hasher->priority = 0;
 	FREE(&hasher->type);
 	if(hasher->algos) {
 		for(size_t i = 0; i < hasher->count; i++) {
@@ -67,13 +74,15 @@ int SLNHasherWrite(SLNHasherRef const hasher, byte_t const *const buf, size_t co
 	if(!hasher) return 0;
 	if(!len) return 0;
 	assert(buf);
-	async_pool_enter(NULL);
+	metrics_pool_enter(hasher->pool, SLN_BULK == hasher->priority ?
+		METRIC_POOL_BULK : METRIC_POOL_INTERACTIVE);
+	metrics_count(METRIC_HASHED_BYTES, len);
 	int rc = 0;
 	for(size_t i = 0; i < hasher->count; i++) {
 		rc = algos[i]->update(hasher->algos[i], buf, len);
 		if(rc < 0) break;
 	}
-	async_pool_leave(NULL);
+	async_pool_leave(hasher->pool);
 	return rc;
 }
 
@@ -6,39 +6,64 @@
 #include <async/http/QueryString.h>
 #include "StrongLink.h"
 
-#define WORKER_COUNT 32
+#define WORKER_COUNT 16
+#define PIPELINE_DEPTH 4 // Requests in flight per worker connection
+#define BATCH_MAX 16 // Files per /sln/batch request, if the peer supports it
+#define RETRY_MAX 3 // Consecutive connection failures before giving up
+#define RECONCILE_BATCH 64 // Prefixes per /sln/digest request
+#define SEGMENT_MIN (1024 * 1024 * 64) // Smallest range to fetch separately
+#define SEGMENT_MAX 4 // Connections per file, including the worker's own
+#define BULK_MIN (1024 * 1024 * 8) // Files this big shouldn't hold up small ones
 
 struct SLNPull {
 	SLNSessionRef session;
 	SLNSyncRef sync;
+	SLNPullSchedulerRef sched;
+	size_t peer; // Our ID in sched, if scheduled
+	bool scheduled;
 	str_t *certhash; // TODO
 	str_t *host;
 	str_t *path;
 	str_t *query;
 	str_t *cookie;
 	bool run;
+	async_mutex_t mutex[1];
+	async_cond_t cond[1]; // Broadcast when the last worker exits
+	unsigned workers;
+	bool nobatch; // Peer doesn't support /sln/batch
+	str_t *fileStart; // Set by reconcile()
+	str_t *metaStart;
 };
 
-int SLNPullCreate(SLNSessionCacheRef const cache, uint64_t const sessionID, strarg_t const certhash, strarg_t const host, strarg_t const path, strarg_t const query, strarg_t const cookie, SLNPullRef *const out) {
+int SLNPullCreate(SLNSessionCacheRef const cache, SLNPullSchedulerRef const sched, uint64_t const sessionID, strarg_t const certhash, strarg_t const host, strarg_t const path, strarg_t const query, strarg_t const cookie, SLNPullRef *const out) {
 	assert(out);
+	if(!sched) return UV_EINVAL;
 	if(!sessionID) return UV_EINVAL;
 	if(!host) return UV_EINVAL;
 
+	SLNSessionRef shared = NULL;
 	SLNSessionRef session = NULL;
 	SLNPullRef pull = NULL;
 	int rc;
 
-	rc = SLNSessionCacheLoadSessionUnsafe(cache, sessionID, &session);
+	rc = SLNSessionCacheLoadSessionUnsafe(cache, sessionID, &shared);
+	if(rc < 0) goto cleanup;
+	// Everything done on behalf of the pull (fetching, hashing and
+	// storing) is background work.
+	rc = SLNSessionCopyWithPriority(shared, SLN_BULK, &session);
 	if(rc < 0) goto cleanup;
 
 	pull = calloc(1, sizeof(struct SLNPull));
 	if(!pull) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
+	async_mutex_init(pull->mutex, 0);
+	async_cond_init(pull->cond, 0);
 
 	pull->session = session; session = NULL;
 
 	rc = SLNSyncCreate(pull->session, &pull->sync);
 	if(rc < 0) goto cleanup;
+	pull->sched = sched;
 
 	pull->certhash = NULL;
 	if(certhash) {
@@ -55,10 +80,13 @@ int SLNPullCreate(SLNSessionCacheRef const cache, uint64_t const sessionID, stra
 	if(rc < 0) goto cleanup;
 
 	pull->run = false;
+	pull->workers = 0;
+	pull->nobatch = false;
 
 	*out = pull; pull = NULL;
 
 cleanup:
+	SLNSessionRelease(&shared);
 	SLNSessionRelease(&session);
 	SLNPullFree(&pull);
 	return rc;
@@ -72,17 +100,150 @@ void SLNPullFree(SLNPullRef *const pullptr) {
 
 	SLNSessionRelease(&pull->session);
 	SLNSyncFree(&pull->sync);
+	pull->sched = NULL;
+	pull->peer = 0;
 	FREE(&pull->certhash);
 	FREE(&pull->host);
 	FREE(&pull->path);
 	FREE(&pull->query);
 	FREE(&pull->cookie);
+	assert(0 == pull->workers);
+	async_mutex_destroy(pull->mutex);
+	async_cond_destroy(pull->cond);
+	pull->nobatch = false;
+	FREE(&pull->fileStart);
+	FREE(&pull->metaStart);
 
 	assert_zeroed(pull, 1);
 	FREE(pullptr); pull = NULL;
 }
 
 
+// Buffers the body of a response, so that lines, frames and records can
+// be read without caring where the underlying chunks begin and end.
+typedef struct {
+	HTTPConnectionRef conn;
+	uv_buf_t buf[1]; // Unread part of the last chunk
+} body_reader;
+
+static int body_fill(body_reader *const r) {
+	if(r->buf->len) return 0;
+	int rc = HTTPConnectionReadBody(r->conn, r->buf);
+	if(rc < 0) return rc;
+	if(0 == r->buf->len) return UV_EOF;
+	return 0;
+}
+static int body_line(body_reader *const r, str_t *const out, size_t const max) {
+	size_t len = 0;
+	for(;;) {
+		int rc = body_fill(r);
+		if(rc < 0) return rc;
+		char const c = r->buf->base[0];
+		r->buf->base++;
+		r->buf->len--;
+		if('\n' == c) break;
+		if('\r' == c) continue;
+		if(len+1 >= max) return UV_EMSGSIZE;
+		out[len++] = c;
+	}
+	out[len] = '\0';
+	return 0;
+}
+static int body_read(body_reader *const r, uint64_t const max, uv_buf_t *const out) {
+	int rc = body_fill(r);
+	if(rc < 0) return rc;
+	size_t const len = MIN(max, r->buf->len);
+	*out = uv_buf_init(r->buf->base, len);
+	r->buf->base += len;
+	r->buf->len -= len;
+	return 0;
+}
+static int body_bytes(body_reader *const r, byte_t *const out, size_t const len) {
+	size_t pos = 0;
+	while(pos < len) {
+		uv_buf_t buf[1];
+		int rc = body_read(r, len-pos, buf);
+		if(UV_EOF == rc && pos > 0) return UV_EPROTO;
+		if(rc < 0) return rc;
+		memcpy(out+pos, buf->base, buf->len);
+		pos += buf->len;
+	}
+	return 0;
+}
+
+static int read_line(body_reader *const r, bool const meta, str_t *const URI, str_t *const targetURI) {
+	str_t line[SLN_URI_MAX*2];
+	URI[0] = '\0';
+	targetURI[0] = '\0';
+	int rc = body_line(r, line, sizeof(line));
+	if(rc < 0) return rc;
+
+	if('\0' == line[0]) return 0; // Ignore blank lines.
+	if('#' == line[0]) return 0; // Ignore comments.
+
+	if(meta) {
+		int len = 0;
+		sscanf(line, SLN_URI_FMT " -> " SLN_URI_FMT "%n",
+			URI, targetURI, &len);
+		if('\0' != line[len]) return SLN_INVALIDTARGET; // TODO: Parse error?
+		if('\0' == URI[0]) return SLN_INVALIDTARGET; // TODO
+		if('\0' == targetURI[0]) return SLN_INVALIDTARGET;
+	} else {
+		if(strlcpy(URI, line, SLN_URI_MAX) >= SLN_URI_MAX) return SLN_INVALIDTARGET;
+	}
+	return 0;
+}
+static int read_record(body_reader *const r, bool const meta, str_t *const URI, str_t *const targetURI) {
+	byte_t buf[SLN_URI_RECORD_MAX];
+	URI[0] = '\0';
+	targetURI[0] = '\0';
+	int rc = body_bytes(r, buf, 2);
+	if(rc < 0) return rc;
+	size_t const len = (size_t)buf[0] << 8 | (size_t)buf[1] << 0;
+	if(0 == len) return 0; // Keep-alive.
+	if(len > sizeof(buf)) return UV_EPROTO;
+	rc = body_bytes(r, buf, len);
+	if(UV_EOF == rc) rc = UV_EPROTO;
+	if(rc < 0) return rc;
+
+	if(len < 2 || 2+(size_t)buf[1] > len) return UV_EPROTO;
+	size_t const hashlen = buf[1];
+	rc = SLNURIRecordUnpackHash(buf[0], buf+2, hashlen, URI, SLN_URI_MAX);
+	if(rc < 0) return SLN_INVALIDTARGET;
+
+	size_t const pos = 2+hashlen;
+	if(!meta) {
+		if(pos != len) return UV_EPROTO;
+		return 0;
+	}
+	if(pos+1 > len) return SLN_INVALIDTARGET;
+	if(0 == buf[pos]) {
+		size_t const textlen = len-pos-1;
+		if(textlen+1 > SLN_URI_MAX) return SLN_INVALIDTARGET;
+		memcpy(targetURI, buf+pos+1, textlen);
+		targetURI[textlen] = '\0';
+	} else {
+		rc = SLNURIRecordUnpackHash(buf[pos], buf+pos+1, len-pos-1, targetURI, SLN_URI_MAX);
+		if(rc < 0) return SLN_INVALIDTARGET;
+	}
+	return 0;
+}
+
+static int ingest(SLNPullRef const pull, strarg_t const URI, strarg_t const targetURI, bool const reconciled) {
+	// Tell the scheduler first, in case a worker gets to it right away.
+	int rc = SLNPullSchedulerWant(pull->sched, pull->peer, URI);
+	if(rc < 0) return rc;
+	strarg_t const target = '\0' != targetURI[0] ? targetURI : NULL;
+	if(reconciled) rc = SLNSyncIngestReconciledURI(pull->sync, URI, target);
+	else if(target) rc = SLNSyncIngestMetaURI(pull->sync, URI, target);
+	else rc = SLNSyncIngestFileURI(pull->sync, URI);
+	if(rc <= 0) {
+		// Not queued, so no worker will release it.
+		SLNPullSchedulerRelease(pull->sched, pull->peer, URI, NULL);
+	}
+	return rc;
+}
+
 static void reader(SLNPullRef const pull, bool const meta) {
 	HTTPConnectionRef conn = NULL;
 	int rc = 0;
@@ -91,6 +252,13 @@ static void reader(SLNPullRef const pull, bool const meta) {
 	str_t metaURI[SLN_URI_MAX];
 	rc = SLNSyncCopyLastSubmissionURIs(pull->sync, fileURI, metaURI);
 	if(rc < 0) goto cleanup;
+	// If we reconciled, we already have everything up to here.
+	if(!meta && pull->fileStart && '\0' == fileURI[0]) {
+		strlcpy(fileURI, pull->fileStart, sizeof(fileURI));
+	}
+	if(meta && pull->metaStart && '\0' == metaURI[0]) {
+		strlcpy(metaURI, pull->metaStart, sizeof(metaURI));
+	}
 
 	str_t path[URI_MAX]; // TODO: Escaping
 	if(meta) {
@@ -114,6 +282,8 @@ static void reader(SLNPullRef const pull, bool const meta) {
 
 	rc = rc < 0 ? rc : HTTPConnectionWriteRequest(conn, HTTP_GET, path, pull->host);
 	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cookie", pull->cookie);
+	// Older peers ignore this and send text.
+	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Accept", SLN_URI_LIST_BINARY_TYPE ", text/uri-list");
 	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
 	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
 	if(rc < 0) goto cleanup;
@@ -125,38 +295,27 @@ static void reader(SLNPullRef const pull, bool const meta) {
 	if(403 == status) rc = UV_EACCES;
 	if(rc < 0) goto cleanup;
 
-	// TODO
 	HTTPHeadersRef headers = NULL;
 	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	strarg_t const type = rc < 0 ? NULL : HTTPHeadersGet(headers, "content-type");
+	bool const binary = type && 0 == strcmp(type, SLN_URI_LIST_BINARY_TYPE);
 	HTTPHeadersFree(&headers);
 	if(rc < 0) goto cleanup;
 
+	body_reader body[1] = {{ .conn = conn }};
 	for(;;) {
 		if(!pull->run) goto cleanup;
 
-		str_t URI[SLN_URI_MAX*2];
-		rc = HTTPConnectionReadBodyLine(conn, URI, sizeof(URI));
+		str_t URI[SLN_URI_MAX];
+		str_t targetURI[SLN_URI_MAX];
+		rc = binary ?
+			read_record(body, meta, URI, targetURI) :
+			read_line(body, meta, URI, targetURI);
 		if(rc < 0) goto cleanup;
+		if('\0' == URI[0]) continue;
 
-		if('\0' == URI[0]) continue; // Ignore blank lines.
-		if('#' == URI[0]) continue; // Ignore comments.
-
-		if(meta) {
-			str_t metaURI[SLN_URI_MAX]; metaURI[0] = '\0';
-			str_t targetURI[SLN_URI_MAX]; targetURI[0] = '\0';
-			int len = 0;
-			sscanf(URI, SLN_URI_FMT " -> " SLN_URI_FMT "%n",
-				metaURI, targetURI, &len);
-			if('\0' != URI[len]) rc = SLN_INVALIDTARGET; // TODO: Parse error?
-			if('\0' == metaURI[0]) rc = SLN_INVALIDTARGET; // TODO
-			if('\0' == targetURI[0]) rc = SLN_INVALIDTARGET;
-			if(rc < 0) goto cleanup;
-			rc = SLNSyncIngestMetaURI(pull->sync, metaURI, targetURI);
-			if(rc < 0) goto cleanup;
-		} else {
-			rc = SLNSyncIngestFileURI(pull->sync, URI);
-			if(rc < 0) goto cleanup;
-		}
+		rc = ingest(pull, URI, targetURI, false);
+		if(rc < 0) goto cleanup;
 	}
 
 cleanup:
@@ -175,93 +334,833 @@ static void metareader(void *const arg) {
 	reader(pull, true);
 }
 
+// Asks for [start, end), or from start to the end of the file if end
+// is zero. Sends a plain request if both are zero.
+static int send_request(SLNPullRef const pull, HTTPConnectionRef const conn, SLNSubmissionRef const sub, uint64_t const start, uint64_t const end) {
+	strarg_t const URI = SLNSubmissionGetKnownURI(sub);
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	SLNParseURI(URI, algo, hash);
+	str_t path[URI_MAX];
+	int rc = snprintf(path, sizeof(path), "%s/sln/file/%s/%s", pull->path, algo, hash);
+	if(rc >= sizeof(path)) rc = UV_ENAMETOOLONG;
+	if(rc < 0) return rc;
+
+	str_t range[64]; range[0] = '\0';
+	if(end) {
+		snprintf(range, sizeof(range), "bytes=%llu-%llu",
+			(unsigned long long)start, (unsigned long long)end-1);
+	} else if(start) {
+		snprintf(range, sizeof(range), "bytes=%llu-",
+			(unsigned long long)start);
+	}
+
+	rc = HTTPConnectionWriteRequest(conn, HTTP_GET, path, pull->host);
+	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cookie", pull->cookie);
+	if(range[0]) rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Range", range);
+	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
+	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
+	return rc;
+}
+static int parse_content_range(strarg_t const str, uint64_t *const start, uint64_t *const total) {
+	if(!str) return UV_EPROTO;
+	unsigned long long a = 0, b = 0, c = 0;
+	if(3 != sscanf(str, "bytes %llu-%llu/%llu", &a, &b, &c)) return UV_EPROTO;
+	if(b < a || b >= c) return UV_EPROTO;
+	*start = a;
+	*total = c;
+	return 0;
+}
+
+// One of the later parts of a large file, downloaded on its own
+// connection while the worker downloads the first part.
+typedef struct {
+	SLNPullRef pull;
+	SLNSubmissionRef sub;
+	uint64_t start;
+	uint64_t end;
+	uint64_t done; // Bytes written so far, from start
+	int rc;
+	async_sem_t *sem;
+} segment;
+
+static int fetch_segment(segment *const seg) {
+	SLNPullRef const pull = seg->pull;
+	HTTPConnectionRef conn = NULL;
+	HTTPHeadersRef headers = NULL;
+	int rc = HTTPConnectionConnect(pull->host, NULL, false, 0, &conn);
+	if(rc < 0) goto cleanup;
+	rc = send_request(pull, conn, seg->sub, seg->start, seg->end);
+	if(rc < 0) goto cleanup;
+
+	int status = 0;
+	rc = HTTPConnectionReadResponseStatus(conn, &status);
+	if(rc < 0) goto cleanup;
+	if(206 != status) rc = UV_EIO;
+	if(rc < 0) goto cleanup;
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) goto cleanup;
+	uint64_t start = 0, total = 0;
+	rc = parse_content_range(HTTPHeadersGet(headers, "content-range"), &start, &total);
+	if(rc < 0) goto cleanup;
+	if(start != seg->start || total < seg->end) rc = UV_EPROTO;
+	if(rc < 0) goto cleanup;
+
+	while(seg->start+seg->done < seg->end) {
+		if(!pull->run) rc = UV_ECANCELED;
+		if(rc < 0) goto cleanup;
+		uv_buf_t buf[1];
+		rc = HTTPConnectionReadBody(conn, buf);
+		if(rc < 0) goto cleanup;
+		if(0 == buf->len) rc = UV_EPROTO;
+		if(rc < 0) goto cleanup;
+		size_t const len = MIN(buf->len, seg->end - seg->start - seg->done);
+		rc = SLNSubmissionWriteAt(seg->sub, (byte_t *)buf->base, len, seg->start+seg->done);
+		if(rc < 0) goto cleanup;
+		seg->done += len;
+		SLNPullSchedulerThrottle(pull->sched, pull->peer, len);
+	}
+
+cleanup:
+	HTTPHeadersFree(&headers);
+	HTTPConnectionFree(&conn);
+	return rc;
+}
+static void segment_fiber(void *const arg) {
+	segment *const seg = arg;
+	seg->rc = fetch_segment(seg);
+	SLNPullSchedulerLeave(seg->pull->sched, seg->pull->peer, SLN_PULL_BULK);
+	async_sem_post(seg->sem);
+}
+
+// If *partial is set, we stopped reading early and the connection
+// can't be used for anything else. Large files are moved to the bulk
+// class, which is updated in *class.
+static int read_response(SLNPullRef const pull, HTTPConnectionRef const conn, SLNSubmissionRef const sub, SLNPullClass *const class, int *const status, bool *const partial) {
+	HTTPHeadersRef headers = NULL;
+	async_sem_t sem[1];
+	segment segs[SEGMENT_MAX] = {};
+	size_t nsegs = 0;
+	uint64_t stop = UINT64_MAX;
+	*partial = false;
+	int rc = HTTPConnectionReadResponseStatus(conn, status);
+	if(rc < 0) goto cleanup;
+	if(200 != *status && 206 != *status && 416 != *status) goto cleanup;
+
+	// TODO: HTTPConnectionReadHeadersStatic?
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) goto cleanup;
+
+	if(416 == *status) {
+		// Our partial file is bigger than theirs somehow.
+		// Start over on a new connection.
+		rc = SLNSubmissionReset(sub);
+		if(rc >= 0) rc = UV_ERANGE;
+		goto cleanup;
+	}
+
+	uint64_t total = 0;
+	if(206 == *status) {
+		uint64_t start = 0;
+		rc = parse_content_range(HTTPHeadersGet(headers, "content-range"), &start, &total);
+		if(rc < 0) goto cleanup;
+		if(start != SLNSubmissionGetSize(sub)) rc = UV_EPROTO;
+		if(rc < 0) goto cleanup;
+		*status = 200;
+	} else {
+		// The peer ignored our Range, if we sent one.
+		rc = SLNSubmissionReset(sub);
+		if(rc < 0) goto cleanup;
+		strarg_t const length = HTTPHeadersGet(headers, "content-length");
+		if(length) total = strtoull(length, NULL, 10);
+	}
+
+	strarg_t const type = HTTPHeadersGet(headers, "content-type");
+	rc = SLNSubmissionSetType(sub, type);
+	if(rc < 0) goto cleanup;
+
+	// Split up what's left of large files, if the peer supports ranges.
+	// The worker keeps reading the first part on this connection.
+	strarg_t const ranges = HTTPHeadersGet(headers, "accept-ranges");
+	uint64_t const offset = SLNSubmissionGetSize(sub);
+	uint64_t const remaining = total > offset ? total - offset : 0;
+	if(SLN_PULL_BULK != *class && remaining >= BULK_MIN) {
+		rc = SLNPullSchedulerReclassify(pull->sched, pull->peer, *class, SLN_PULL_BULK);
+		if(rc < 0) goto cleanup;
+		*class = SLN_PULL_BULK;
+	}
+	if(ranges && 0 == strcmp(ranges, "bytes") && remaining >= SEGMENT_MIN*2) {
+		// Each extra connection needs its own slot, if there are any.
+		size_t const max = MIN(SEGMENT_MAX, remaining / SEGMENT_MIN);
+		size_t n = 1;
+		while(n < max && SLNPullSchedulerTryEnter(pull->sched, pull->peer, SLN_PULL_BULK)) n++;
+		if(n > 1 && async_sem_init(sem, 0, 0) >= 0) nsegs = n;
+		for(size_t i = 1; i < n && !nsegs; i++) {
+			SLNPullSchedulerLeave(pull->sched, pull->peer, SLN_PULL_BULK);
+		}
+	}
+	if(nsegs) {
+		uint64_t const seglen = remaining / nsegs;
+		for(size_t i = 0; i < nsegs; i++) {
+			segs[i].pull = pull;
+			segs[i].sub = sub;
+			segs[i].start = offset + seglen*i;
+			segs[i].end = i+1 == nsegs ? total : offset + seglen*(i+1);
+			segs[i].sem = sem;
+		}
+		for(size_t i = 1; i < nsegs; i++) {
+			async_spawn(STACK_DEFAULT, segment_fiber, &segs[i]);
+		}
+		stop = segs[0].end;
+		alogf("Pull fetching %s in %llu segments\n",
+			SLNSubmissionGetKnownURI(sub), (unsigned long long)nsegs);
+	}
+
+	while(SLNSubmissionGetSize(sub) < stop) {
+		if(!pull->run) rc = UV_ECANCELED;
+		if(rc < 0) goto cleanup;
+		uv_buf_t buf[1];
+		rc = HTTPConnectionReadBody(conn, buf);
+		if(rc < 0) goto cleanup;
+		if(0 == buf->len) break;
+		size_t const len = MIN(buf->len, stop - SLNSubmissionGetSize(sub));
+		rc = SLNSubmissionWrite(sub, (byte_t *)buf->base, len);
+		if(rc < 0) goto cleanup;
+		SLNPullSchedulerThrottle(pull->sched, pull->peer, len);
+	}
+	if(nsegs) *partial = true;
+
+cleanup:
+	if(nsegs) {
+		// The segments write into sub, so always wait for them.
+		for(size_t i = 1; i < nsegs; i++) async_sem_wait(sem);
+		async_sem_destroy(sem);
+		*partial = true;
+
+		// Keep as much as we can use for resuming.
+		bool contiguous = SLNSubmissionGetSize(sub) == segs[0].end;
+		uint64_t size = SLNSubmissionGetSize(sub);
+		for(size_t i = 1; i < nsegs; i++) {
+			if(!contiguous) break;
+			size = segs[i].start + segs[i].done;
+			contiguous = segs[i].start + segs[i].done == segs[i].end;
+			if(rc >= 0) rc = segs[i].rc;
+		}
+		if(rc >= 0 && !contiguous) rc = UV_EPROTO;
+		int const rc2 = SLNSubmissionSetSize(sub, size);
+		if(rc >= 0) rc = rc2;
+	}
+	HTTPHeadersFree(&headers);
+	return rc;
+}
+static int send_batch(SLNPullRef const pull, HTTPConnectionRef const conn, SLNSubmissionRef const *const subs, size_t const count, int *const status) {
+	assert(count <= BATCH_MAX);
+	str_t path[URI_MAX];
+	int rc = snprintf(path, sizeof(path), "%s/sln/batch", pull->path);
+	if(rc >= sizeof(path)) rc = UV_ENAMETOOLONG;
+	if(rc < 0) return rc;
+
+	uv_buf_t parts[BATCH_MAX*2];
+	uint64_t length = 0;
+	for(size_t i = 0; i < count; i++) {
+		strarg_t const URI = SLNSubmissionGetKnownURI(subs[i]);
+		parts[i*2+0] = uv_buf_init((char *)URI, strlen(URI));
+		parts[i*2+1] = uv_buf_init((char *)"\r\n", 2);
+		length += parts[i*2+0].len + parts[i*2+1].len;
+	}
+
+	rc = HTTPConnectionWriteRequest(conn, HTTP_POST, path, pull->host);
+	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cookie", pull->cookie);
+	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn,
+		"Content-Type", "text/uri-list; charset=utf-8");
+	rc = rc < 0 ? rc : HTTPConnectionWriteContentLength(conn, length);
+	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
+	rc = rc < 0 ? rc : HTTPConnectionWritev(conn, parts, count*2);
+	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
+	if(rc < 0) return rc;
+
+	rc = HTTPConnectionReadResponseStatus(conn, status);
+	if(rc < 0) return rc;
+
+	HTTPHeadersRef headers = NULL;
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) return rc;
+	// Something that doesn't know the path might still answer 200,
+	// e.g. with an HTML page. Treat it like any other refusal.
+	strarg_t const type = HTTPHeadersGet(headers, "Content-Type");
+	bool const batch = type && 0 == strcasecmp(SLN_BATCH_TYPE, type);
+	if(200 == *status && !batch) *status = 415; // Unsupported Media Type
+	HTTPHeadersFree(&headers);
+	return 0;
+}
+static int read_frame(SLNPullRef const pull, body_reader *const r, SLNSubmissionRef const sub, int *const status) {
+	// See writeBatchFrame() in SLNServer.c for the format.
+	str_t line[SLN_URI_MAX+URI_MAX];
+	int rc = body_line(r, line, sizeof(line));
+	if(rc < 0) return rc;
+
+	str_t URI[SLN_URI_MAX]; URI[0] = '\0';
+	int len = 0;
+	*status = 0;
+	sscanf(line, "%d " SLN_URI_FMT "%n", status, URI, &len);
+	if(!len) return UV_EPROTO;
+	// Frames always come back in the order we asked for them.
+	if(0 != strcmp(URI, SLNSubmissionGetKnownURI(sub))) return UV_EPROTO;
+	if(200 != *status) return '\0' == line[len] ? 0 : UV_EPROTO;
+
+	unsigned long long size = 0;
+	int type = 0;
+	sscanf(line+len, " %llu %n", &size, &type);
+	if(!type) return UV_EPROTO;
+	rc = SLNSubmissionSetType(sub, line+len+type);
+	if(rc < 0) return rc;
+
+	while(size > 0) {
+		if(!pull->run) return UV_ECANCELED;
+		uv_buf_t buf[1];
+		rc = body_read(r, size, buf);
+		if(rc < 0) return rc;
+		rc = SLNSubmissionWrite(sub, (byte_t *)buf->base, buf->len);
+		if(rc < 0) return rc;
+		size -= buf->len;
+		SLNPullSchedulerThrottle(pull->sched, pull->peer, buf->len);
+	}
+	rc = body_line(r, line, sizeof(line));
+	if(rc < 0) return rc;
+	if('\0' != line[0]) return UV_EPROTO;
+	return 0;
+}
+// Asks the scheduler whether we should fetch a file. If another peer
+// already has, we record theirs and finish it right away. Unless we get
+// 0 (ours to fetch) or UV_EAGAIN (try again later), the submission is
+// released and no longer ours.
+static int claim(SLNPullRef const pull, SLNSubmissionRef const sub, bool const wait) {
+	strarg_t const URI = SLNSubmissionGetKnownURI(sub);
+	SLNFileInfo info[1] = {};
+	str_t **URIs = NULL;
+	int rc = SLNPullSchedulerClaim(pull->sched, pull->peer, URI, wait, info, &URIs);
+	if(0 == rc || UV_EAGAIN == rc) return rc;
+	if(SLN_PULL_FETCHED == rc) {
+		// It was already hashed and verified, so don't read it again.
+		rc = SLNSubmissionEndExisting(sub, info, (str_t const *const *)URIs);
+	}
+	SLNFileInfoCleanup(info);
+	if(URIs) for(size_t i = 0; URIs[i]; i++) FREE(&URIs[i]);
+	FREE(&URIs);
+	SLNPullSchedulerRelease(pull->sched, pull->peer, URI, NULL);
+	if(rc < 0) return rc;
+	rc = SLNSyncWorkDone(pull->sync, sub);
+	if(rc < 0) return rc;
+	return SLN_PULL_FETCHED;
+}
+// Like claim(), these always release the submission.
+static int done(SLNPullRef const pull, SLNSubmissionRef const sub) {
+	// Other peers waiting for the same file can record ours.
+	int rc = SLNSubmissionEnd(sub);
+	SLNPullSchedulerRelease(pull->sched, pull->peer, SLNSubmissionGetKnownURI(sub), rc < 0 ? NULL : sub);
+	if(rc < 0) return rc;
+	return SLNSyncWorkDone(pull->sync, sub);
+}
+static int skip(SLNPullRef const pull, SLNSubmissionRef const sub) {
+	// Nothing is coming to finish a partial download, so don't keep
+	// it around. Emptied partial files are deleted when freed.
+	if(SLNSubmissionIsResumable(sub)) SLNSubmissionReset(sub);
+	// Another peer might still have it.
+	SLNPullSchedulerRelease(pull->sched, pull->peer, SLNSubmissionGetKnownURI(sub), NULL);
+	return SLNSyncWorkSkip(pull->sync, sub);
+}
+static SLNPullClass classify(SLNSubmissionRef const *const subs, size_t const count) {
+	// Resumed files were probably big enough to get interrupted.
+	SLNPullClass class = SLN_PULL_META;
+	for(size_t i = 0; i < count; i++) {
+		if(SLNSubmissionGetSize(subs[i]) > 0) return SLN_PULL_BULK;
+		if(!SLNSubmissionGetKnownTarget(subs[i])) class = SLN_PULL_SMALL;
+	}
+	return class;
+}
 static void worker(void *const arg) {
 	SLNPullRef const pull = arg;
 	HTTPConnectionRef conn = NULL;
-	HTTPHeadersRef headers = NULL;
+	// Requests in flight, in the order they were sent.
+	// Responses always come back in the same order.
+	SLNSubmissionRef queue[BATCH_MAX] = {};
+	size_t count = 0;
+	size_t sent = 0;
+	bool pending = false; // queue[count-1] is left to another peer for now
+	bool entered = false; // Holding a scheduler slot
+	SLNPullClass class = SLN_PULL_SMALL;
+	unsigned failures = 0;
+	uint64_t resumed = 0; // Size of queue[0] when we last retried
 	int rc = 0;
 
 	for(;;) {
 		if(!pull->run) goto cleanup;
 
-		SLNSubmissionRef sub = NULL;
-		rc = SLNSyncWorkAwait(pull->sync, &sub);
-		if(rc < 0) goto cleanup;
+		if(pending && 1 == count) {
+			// Nothing else to do, so wait for it.
+			if(entered) SLNPullSchedulerLeave(pull->sched, pull->peer, class);
+			entered = false;
+			pending = false;
+			rc = claim(pull, queue[0], true);
+			if(0 != rc) queue[--count] = NULL;
+			if(rc < 0) goto cleanup;
+		}
 
-		strarg_t const URI = SLNSubmissionGetKnownURI(sub);
-		str_t algo[SLN_ALGO_SIZE];
-		str_t hash[SLN_HASH_SIZE];
-		SLNParseURI(URI, algo, hash);
-		str_t path[URI_MAX];
-		rc = snprintf(path, sizeof(path), "%s/sln/file/%s/%s", pull->path, algo, hash);
-		if(rc >= sizeof(path)) rc = UV_ENAMETOOLONG;
-		if(rc < 0) goto cleanup;
+		// Only block waiting for work if we have nothing else to do.
+		size_t const max = pull->nobatch ? PIPELINE_DEPTH : BATCH_MAX;
+		while(!pending && count < max) {
+			SLNSubmissionRef sub = NULL;
+			if(0 == count && entered) {
+				SLNPullSchedulerLeave(pull->sched, pull->peer, class);
+				entered = false;
+			}
+			// SLNPullStop only wakes up workers already waiting,
+			// so check right before we start.
+			if(!pull->run) goto cleanup;
+			if(0 == count) rc = SLNSyncWorkAwait(pull->sync, &sub);
+			else rc = SLNSyncWorkTryAwait(pull->sync, &sub);
+			if(UV_EAGAIN == rc) break;
+			if(UV_ECANCELED == rc) {
+				// Woken up by SLNPullStop, or a leftover wakeup.
+				if(!pull->run) goto cleanup;
+				rc = 0;
+				if(count) break;
+				continue;
+			}
+			if(rc < 0) goto cleanup;
+			queue[count++] = sub;
+			// Files another peer is fetching wait at the end until
+			// we're done with the rest.
+			rc = claim(pull, sub, 1 == count);
+			if(UV_EAGAIN == rc) pending = true;
+			else if(0 != rc) queue[--count] = NULL;
+			if(UV_EAGAIN != rc && rc < 0) goto cleanup;
+		}
+		size_t const ready = count - pending;
+		if(!ready) continue;
+
+		// Partially downloaded files have to be resumed one at a time,
+		// so only batch up to the first one.
+		size_t fresh = 0;
+		while(fresh < ready && 0 == SLNSubmissionGetSize(queue[fresh])) fresh++;
+		bool const batch = !pull->nobatch && fresh > 0 && 0 == sent;
+
+		SLNPullClass const next = batch ?
+			classify(queue, fresh) :
+			classify(queue, 1);
+		if(entered && next != class) {
+			SLNPullSchedulerLeave(pull->sched, pull->peer, class);
+			entered = false;
+		}
+		if(!entered) {
+			rc = SLNPullSchedulerEnter(pull->sched, pull->peer, next);
+			if(rc < 0) goto cleanup;
+			entered = true;
+			class = next;
+		}
 
 		if(!conn) {
 			// TODO: Support HTTPS?
 			rc = HTTPConnectionConnect(pull->host, NULL, false, 0, &conn);
+			if(rc < 0) goto retry;
+			sent = 0;
+		}
+
+		if(batch) {
+			int status = 0;
+			rc = send_batch(pull, conn, queue, fresh, &status);
+			if(rc < 0) goto retry;
+			if(403 == status) rc = UV_EACCES;
 			if(rc < 0) goto cleanup;
+			if(200 != status) {
+				// Older peers don't know the path and answer 400,
+				// or 200 with the wrong type (see send_batch).
+				alogf("Pull peer doesn't support batches (%d)\n", status);
+				pull->nobatch = true;
+				HTTPConnectionFree(&conn);
+				continue;
+			}
+
+			// Files the peer doesn't have are reported inline. We
+			// skip them instead of stalling the rest of the sync.
+			body_reader reader[1] = {{ .conn = conn }};
+			for(; fresh > 0; fresh--) {
+				rc = read_frame(pull, reader, queue[0], &status);
+				if(!pull->run) goto cleanup;
+				if(rc < 0) goto retry;
+				if(200 != status && 404 != status) {
+					// The peer has it but couldn't send it, which
+					// might not last. Don't leave a gap in the sync.
+					alogf("Pull peer error for %s (%d)\n",
+						SLNSubmissionGetKnownURI(queue[0]), status);
+					rc = UV_EIO;
+					goto retry;
+				}
+				failures = 0;
+
+				if(200 == status) {
+					rc = done(pull, queue[0]);
+				} else {
+					alogf("Pull skipping %s (%d)\n",
+						SLNSubmissionGetKnownURI(queue[0]), status);
+					rc = skip(pull, queue[0]);
+				}
+				count--;
+				memmove(queue+0, queue+1, sizeof(*queue) * count);
+				queue[count] = NULL;
+				if(rc < 0) goto cleanup;
+			}
+			rc = body_fill(reader);
+			if(UV_EOF == rc) continue;
+			if(rc >= 0) rc = UV_EPROTO;
+			goto retry;
 		}
 
-		rc = rc < 0 ? rc : HTTPConnectionWriteRequest(conn, HTTP_GET, path, pull->host);
-		rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cookie", pull->cookie);
-		rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
-		rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
-		if(rc < 0) goto cleanup;
+		size_t const depth = pull->nobatch ? ready : 1;
+		for(; sent < depth; sent++) {
+			uint64_t const offset = SLNSubmissionGetSize(queue[sent]);
+			rc = send_request(pull, conn, queue[sent], offset, 0);
+			if(rc < 0) goto retry;
+		}
 
 		int status = 0;
-		rc = HTTPConnectionReadResponseStatus(conn, &status);
-		if(rc < 0) goto cleanup;
-		if(200 != status) rc = UV_EIO;
+		bool partial = false;
+		rc = read_response(pull, conn, queue[0], &class, &status, &partial);
+		if(!pull->run) goto cleanup;
+		if(rc < 0) goto retry;
 		if(403 == status) rc = UV_EACCES;
 		if(rc < 0) goto cleanup;
+		if(404 == status) {
+			// Same as in a batch. The rest of the response wasn't
+			// read, so later requests have to be sent again.
+			alogf("Pull skipping %s (%d)\n",
+				SLNSubmissionGetKnownURI(queue[0]), status);
+			HTTPConnectionFree(&conn);
+			sent = 0;
+			failures = 0;
+			rc = skip(pull, queue[0]);
+			count--;
+			memmove(queue+0, queue+1, sizeof(*queue) * count);
+			queue[count] = NULL;
+			if(rc < 0) goto cleanup;
+			continue;
+		}
+		if(200 != status) {
+			rc = UV_EIO;
+			goto retry;
+		}
+		failures = 0;
+		resumed = 0;
+		if(partial) {
+			// Requests after this one have to be sent again.
+			HTTPConnectionFree(&conn);
+		}
 
-		// TODO: HTTPConnectionReadHeadersStatic?
-		rc = HTTPHeadersCreateFromConnection(conn, &headers);
+		rc = done(pull, queue[0]);
+		count--;
+		sent--;
+		memmove(queue+0, queue+1, sizeof(*queue) * count);
+		queue[count] = NULL;
 		if(rc < 0) goto cleanup;
+		continue;
 
-		strarg_t const type = HTTPHeadersGet(headers, "content-type");
-		rc = SLNSubmissionSetType(sub, type);
+	retry:
+		// The connection failed somewhere in the pipeline. Responses
+		// we've already read are complete, so start over from the
+		// first one we haven't finished. Large files can take many
+		// tries, so only give up if we aren't making any progress.
+		if(count && SLNSubmissionIsResumable(queue[0]) &&
+			SLNSubmissionGetSize(queue[0]) > resumed) failures = 0;
+		resumed = count ? SLNSubmissionGetSize(queue[0]) : 0;
+		if(++failures > RETRY_MAX) goto cleanup;
+		alogf("Pull worker reconnecting (%s)\n", sln_strerror(rc));
+		HTTPConnectionFree(&conn);
+		rc = count ? SLNSubmissionInterrupt(queue[0]) : 0;
 		if(rc < 0) goto cleanup;
+		if(entered) SLNPullSchedulerLeave(pull->sched, pull->peer, class);
+		entered = false;
+		async_sleep(1000 * failures);
+	}
 
-		HTTPHeadersFree(&headers);
+cleanup:
+	pull->run = false;
+	if(rc < 0) {
+		alogf("Pull worker error: %s\n", sln_strerror(rc));
+	}
+	// Give back whatever we were holding so the sync queues can move
+	// past it (and free it), and other peers can fetch it.
+	for(size_t i = 0; i < count; i++) {
+		int const err = skip(pull, queue[i]);
+		if(err < 0) alogf("Pull worker skip error: %s\n", sln_strerror(err));
+		queue[i] = NULL;
+	}
+	if(entered) SLNPullSchedulerLeave(pull->sched, pull->peer, class);
+	HTTPConnectionFree(&conn);
 
-		for(;;) {
-			if(!pull->run) goto cleanup;
-			uv_buf_t buf[1];
-			rc = HTTPConnectionReadBody(conn, buf);
+	async_mutex_lock(pull->mutex);
+	assert(pull->workers > 0);
+	if(0 == --pull->workers) async_cond_broadcast(pull->cond);
+	async_mutex_unlock(pull->mutex);
+}
+
+static int send_get(SLNPullRef const pull, HTTPConnectionRef const conn, strarg_t const path) {
+	int rc = HTTPConnectionWriteRequest(conn, HTTP_GET, path, pull->host);
+	rc = rc < 0 ? rc : HTTPConnectionWriteHeader(conn, "Cookie", pull->cookie);
+	rc = rc < 0 ? rc : HTTPConnectionBeginBody(conn);
+	rc = rc < 0 ? rc : HTTPConnectionEnd(conn);
+	if(rc < 0) return rc;
+
+	int status = 0;
+	rc = HTTPConnectionReadResponseStatus(conn, &status);
+	if(rc < 0) return rc;
+	HTTPHeadersRef headers = NULL;
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	HTTPHeadersFree(&headers);
+	if(rc < 0) return rc;
+	if(403 == status) return UV_EACCES;
+	// Older peers answer 400 for paths under /sln they don't know.
+	if(400 == status || 404 == status) return UV_ENOSYS;
+	if(200 != status) return UV_EIO;
+	return 0;
+}
+static int get_latest(SLNPullRef const pull, HTTPConnectionRef const conn, bool const meta, str_t **const out) {
+	str_t path[URI_MAX];
+	int rc = meta ?
+		snprintf(path, sizeof(path), "%s/sln/metafiles?dir=z&count=1&wait=0", pull->path) :
+		snprintf(path, sizeof(path), "%s/sln/query?q=%s&dir=z&count=1&wait=0", pull->path, pull->query);
+	if(rc >= sizeof(path)) rc = UV_ENAMETOOLONG;
+	if(rc < 0) return rc;
+	rc = send_get(pull, conn, path);
+	if(rc < 0) return rc;
+
+	body_reader reader[1] = {{ .conn = conn }};
+	str_t URI[SLN_URI_MAX]; URI[0] = '\0';
+	for(;;) {
+		str_t line[SLN_URI_MAX*2];
+		rc = body_line(reader, line, sizeof(line));
+		if(UV_EOF == rc) break;
+		if(rc < 0) return rc;
+		if('\0' == line[0] || '#' == line[0]) continue;
+		// For meta-files, we only want the part before " -> ".
+		sscanf(line, SLN_URI_FMT, URI);
+	}
+	*out = strdup(URI);
+	if(!*out) return UV_ENOMEM;
+	return 0;
+}
+static int get_digests(SLNPullRef const pull, HTTPConnectionRef const conn, strarg_t const *const prefixes, SLNDigest *const out, size_t const count, uint64_t *const files) {
+	str_t path[URI_MAX];
+	int rc = snprintf(path, sizeof(path), "%s/sln/digest?prefix=", pull->path);
+	if(rc < 0) return rc;
+	size_t len = rc;
+	for(size_t i = 0; i < count; i++) {
+		rc = snprintf(path+len, sizeof(path)-len, i ? ",%s" : "%s", prefixes[i]);
+		if(rc < 0) return rc;
+		len += rc;
+		if(len >= sizeof(path)) return UV_ENAMETOOLONG;
+	}
+	rc = send_get(pull, conn, path);
+	if(rc < 0) return rc;
+
+	// Empty children aren't listed.
+	memset(out, 0, sizeof(*out) * count * SLN_DIGEST_CHILDREN);
+	*files = 0;
+	body_reader reader[1] = {{ .conn = conn }};
+	for(;;) {
+		str_t line[256];
+		rc = body_line(reader, line, sizeof(line));
+		if(UV_EOF == rc) break;
+		if(rc < 0) return rc;
+		unsigned long long f = 0;
+		if(1 == sscanf(line, "# files %llu", &f)) *files = f;
+		str_t child[SLN_DIGEST_DEPTH+1]; child[0] = '\0';
+		unsigned long long c = 0, sum = 0;
+		if(3 != sscanf(line, "%4[0-9a-f] %llu %llx", child, &c, &sum)) continue;
+		size_t const n = strlen(child);
+		if(!n) continue;
+		for(size_t i = 0; i < count; i++) {
+			if(strlen(prefixes[i])+1 != n) continue;
+			if(0 != strncmp(prefixes[i], child, n-1)) continue;
+			size_t const j = strtoul(child+n-1, NULL, 16);
+			out[i*SLN_DIGEST_CHILDREN+j] = (SLNDigest){ c, sum };
+			break;
+		}
+	}
+	return 0;
+}
+static int ingest_buckets(SLNPullRef const pull, HTTPConnectionRef const conn, strarg_t const *const buckets, size_t const count) {
+	str_t path[URI_MAX];
+	int rc = snprintf(path, sizeof(path), "%s/sln/digest?bucket=", pull->path);
+	if(rc < 0) return rc;
+	size_t len = rc;
+	for(size_t i = 0; i < count; i++) {
+		rc = snprintf(path+len, sizeof(path)-len, i ? ",%s" : "%s", buckets[i]);
+		if(rc < 0) return rc;
+		len += rc;
+		if(len >= sizeof(path)) return UV_ENAMETOOLONG;
+	}
+	rc = send_get(pull, conn, path);
+	if(rc < 0) return rc;
+
+	body_reader reader[1] = {{ .conn = conn }};
+	for(;;) {
+		if(!pull->run) return UV_ECANCELED;
+		str_t line[SLN_URI_MAX*2];
+		rc = body_line(reader, line, sizeof(line));
+		if(UV_EOF == rc) break;
+		if(rc < 0) return rc;
+		if('\0' == line[0] || '#' == line[0]) continue;
+
+		str_t URI[SLN_URI_MAX]; URI[0] = '\0';
+		str_t targetURI[SLN_URI_MAX]; targetURI[0] = '\0';
+		sscanf(line, SLN_URI_FMT " -> " SLN_URI_FMT, URI, targetURI);
+		if('\0' == URI[0]) return SLN_INVALIDTARGET;
+		// Ingesting checks whether we have it already.
+		rc = ingest(pull, URI, targetURI, true);
+		if(rc < 0) return rc;
+	}
+	return 0;
+}
+static int reconcile_level(SLNPullRef const pull, HTTPConnectionRef const conn, strarg_t const *const prefixes, size_t const count, str_t (*const next)[SLN_DIGEST_DEPTH+1], size_t *const nextCount, bool *const skip) {
+	SLNDigest remote[RECONCILE_BATCH*SLN_DIGEST_CHILDREN];
+	SLNDigest local[RECONCILE_BATCH*SLN_DIGEST_CHILDREN];
+	assert(count <= RECONCILE_BATCH);
+	uint64_t remoteFiles = 0, localFiles = 0;
+	int rc = get_digests(pull, conn, prefixes, remote, count, &remoteFiles);
+	if(rc < 0) return rc;
+	rc = SLNSessionGetDigests(pull->session, prefixes, local, count, &localFiles);
+	if(rc < 0) return rc;
+
+	if(skip) {
+		// Only worth it if we already have most of what they have.
+		// Otherwise just stream the whole list as usual.
+		uint64_t r = 0, l = 0;
+		for(size_t j = 0; j < SLN_DIGEST_CHILDREN; j++) {
+			r += remote[j].count;
+			l += local[j].count;
+		}
+		*skip = l*2 < r;
+		// Missing or incomplete digests would make us skip files,
+		// so only trust them if they cover every file (on both
+		// sides). Older peers don't say, so we never trust them.
+		if(!remoteFiles || r != remoteFiles) *skip = true;
+		if(l != localFiles) *skip = true;
+		if(*skip) return 0;
+	}
+
+	for(size_t i = 0; i < count*SLN_DIGEST_CHILDREN; i++) {
+		if(!remote[i].count) continue; // Nothing to get.
+		if(remote[i].count == local[i].count && remote[i].sum == local[i].sum) continue;
+		snprintf(next[(*nextCount)++], sizeof(*next), "%s%x",
+			prefixes[i / SLN_DIGEST_CHILDREN], (unsigned)(i % SLN_DIGEST_CHILDREN));
+	}
+	return 0;
+}
+// Compares digests with the peer, narrowing in on the buckets where we
+// differ, and only ingests the files in those. See SLNDigestByPrefix.
+// Only used for an initial sync of everything, since otherwise we can
+// just pick up from the last URIs we stored. Those aren't recorded
+// until everything we reconciled is stored, so if we're interrupted,
+// we reconcile again next time (with less left to do).
+static int reconcile(SLNPullRef const pull) {
+	str_t fileURI[SLN_URI_MAX];
+	str_t metaURI[SLN_URI_MAX];
+	int rc = SLNSyncCopyLastSubmissionURIs(pull->sync, fileURI, metaURI);
+	if(rc < 0) return rc;
+	if('\0' != fileURI[0] || '\0' != metaURI[0]) return 0;
+	if('\0' != pull->query[0]) return 0;
+
+	HTTPConnectionRef conn = NULL;
+	str_t (*level)[SLN_DIGEST_DEPTH+1] = NULL;
+	str_t (*next)[SLN_DIGEST_DEPTH+1] = NULL;
+	size_t count = 0;
+	str_t *fileStart = NULL;
+	str_t *metaStart = NULL;
+
+	// The deepest level can't have more than one entry per bucket.
+	size_t const max = 1 << (4*SLN_DIGEST_DEPTH);
+	level = calloc(max, sizeof(*level));
+	next = calloc(max, sizeof(*next));
+	if(!level || !next) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = HTTPConnectionConnect(pull->host, NULL, false, 0, &conn);
+	if(rc < 0) goto cleanup;
+
+	// Anything newer than this gets picked up by the readers.
+	rc = get_latest(pull, conn, false, &fileStart);
+	rc = rc < 0 ? rc : get_latest(pull, conn, true, &metaStart);
+	if(rc < 0) goto cleanup;
+
+	level[0][0] = '\0';
+	count = 1;
+	for(size_t depth = 0; depth < SLN_DIGEST_DEPTH; depth++) {
+		size_t nextCount = 0;
+		for(size_t i = 0; i < count; i += RECONCILE_BATCH) {
+			if(!pull->run) rc = UV_ECANCELED;
 			if(rc < 0) goto cleanup;
-			if(0 == buf->len) break;
-			rc = SLNSubmissionWrite(sub, (byte_t *)buf->base, buf->len);
+			strarg_t prefixes[RECONCILE_BATCH];
+			size_t const n = MIN(RECONCILE_BATCH, count-i);
+			for(size_t j = 0; j < n; j++) prefixes[j] = level[i+j];
+			bool skip = false;
+			rc = reconcile_level(pull, conn, prefixes, n, next, &nextCount, 0 == depth ? &skip : NULL);
 			if(rc < 0) goto cleanup;
+			if(skip) goto cleanup;
 		}
+		str_t (*const tmp)[SLN_DIGEST_DEPTH+1] = level;
+		level = next;
+		next = tmp;
+		count = nextCount;
+	}
 
-		rc = SLNSubmissionEnd(sub);
-		if(rc < 0) goto cleanup;
-		rc = SLNSyncWorkDone(pull->sync, sub);
+	alogf("Pull reconciling %llu buckets\n", (unsigned long long)count);
+	for(size_t i = 0; i < count; i += RECONCILE_BATCH) {
+		strarg_t buckets[RECONCILE_BATCH];
+		size_t const n = MIN(RECONCILE_BATCH, count-i);
+		for(size_t j = 0; j < n; j++) buckets[j] = level[i+j];
+		rc = ingest_buckets(pull, conn, buckets, n);
 		if(rc < 0) goto cleanup;
-
 	}
 
+	pull->fileStart = fileStart; fileStart = NULL;
+	pull->metaStart = metaStart; metaStart = NULL;
+
 cleanup:
-	pull->run = false;
-	if(rc < 0) {
-		alogf("Pull worker error: %s\n", sln_strerror(rc));
-	}
 	HTTPConnectionFree(&conn);
-	HTTPHeadersFree(&headers);
+	FREE(&level);
+	FREE(&next);
+	FREE(&fileStart);
+	FREE(&metaStart);
+	return rc;
+}
+static void starter(void *const arg) {
+	SLNPullRef const pull = arg;
+	int rc = reconcile(pull);
+	if(UV_ENOSYS == rc) alogf("Pull peer doesn't support reconciliation\n");
+	else if(rc < 0) alogf("Pull reconciliation error: %s\n", sln_strerror(rc));
+	if(!pull->run) return;
+	async_spawn(STACK_DEFAULT, filereader, pull);
+	async_spawn(STACK_DEFAULT, metareader, pull);
 }
 
 int SLNPullStart(SLNPullRef const pull) {
 	if(!pull) return UV_EINVAL;
 	if(pull->run) return 0;
 
+	if(!pull->scheduled) {
+		int rc = SLNPullSchedulerAddPeer(pull->sched, &pull->peer);
+		if(rc < 0) return rc;
+		pull->scheduled = true;
+	}
 	pull->run = true;
 
-	async_spawn(STACK_DEFAULT, filereader, pull);
-	async_spawn(STACK_DEFAULT, metareader, pull);
+	// The readers start once we've reconciled, if necessary.
+	async_spawn(STACK_DEFAULT, starter, pull);
 
 	for(size_t i = 0; i < WORKER_COUNT; i++) {
+		async_mutex_lock(pull->mutex);
+		pull->workers++;
+		async_mutex_unlock(pull->mutex);
 		async_spawn(STACK_DEFAULT, worker, pull);
 	}
 
@@ -269,8 +1168,20 @@ int SLNPullStart(SLNPullRef const pull) {
 }
 void SLNPullStop(SLNPullRef const pull) {
 	if(!pull) return;
-	if(!pull->run) return;
+	// Workers might have stopped on their own after an error.
 	pull->run = false;
-	async_yield(); // TODO
+	if(pull->scheduled) {
+		// Also wakes up any of our workers waiting on the scheduler.
+		SLNPullSchedulerRemovePeer(pull->sched, pull->peer);
+		pull->scheduled = false;
+	}
+
+	// Workers hold scheduler slots under our peer ID, which can't be
+	// reused until they're gone. Ones in the middle of a request
+	// finish it first.
+	SLNSyncWorkWake(pull->sync);
+	async_mutex_lock(pull->mutex);
+	while(pull->workers) async_cond_wait(pull->cond, pull->mutex);
+	async_mutex_unlock(pull->mutex);
 }
 
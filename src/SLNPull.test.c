@@ -0,0 +1,449 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Pulls a repository into another one through a local relay that holds
+// everything back by LATENCY in each direction, standing in for a peer
+// across a slow link. A worker that waited out a round trip per file
+// would take at least FILE_COUNT * LATENCY * 2, so we expect to finish
+// in well under half of that with batches or pipelining.
+// Usage: make test (or build/tests/SLNPull.test)
+
+#include <stddef.h>
+#include <async/http/HTTPServer.h>
+#include "StrongLink.h"
+
+#define LATENCY 25 // Milliseconds each way
+#define FILE_COUNT 200
+#define FILE_SIZE 1024
+#define SERVER_PORT 8061
+#define RELAY_PORT 8062
+#define DROP_AFTER (FILE_SIZE * 5 + 100) // Somewhere in the middle of a response
+#define TIMEOUT (1000 * 60)
+
+#define USERNAME "test"
+#define PASSWORD "test"
+
+int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
+
+static str_t dir[] = "/tmp/sln-pull-test-XXXXXX";
+static SLNRepoRef src = NULL;
+static HTTPServerRef server = NULL;
+static bool nobatch = false; // Answer like a peer that predates /sln/batch
+static unsigned requests = 0;
+static int status = 0;
+
+
+// The relay. Each chunk read from one side is written to the other once
+// LATENCY has passed. Worker connections can be cut partway through a
+// response, to check that we recover without losing our place.
+
+typedef struct relay_chunk relay_chunk;
+struct relay_chunk {
+	relay_chunk *next;
+	uint64_t due;
+	ssize_t len; // UV_EOF once the sender is done
+	uv_write_t req[1];
+	char data[];
+};
+typedef struct relay_link relay_link;
+typedef struct {
+	relay_link *link;
+	uv_tcp_t *from;
+	uv_tcp_t *to;
+	uv_timer_t timer[1];
+	relay_chunk *head;
+	relay_chunk *tail;
+	uint64_t bytes; // Written so far
+} relay_pipe;
+struct relay_link {
+	uv_tcp_t client[1];
+	uv_tcp_t server[1];
+	uv_connect_t connect[1];
+	uv_shutdown_t shutdown[1];
+	relay_pipe up[1]; // Client to server
+	relay_pipe down[1]; // Server to client
+	uint64_t drop; // Bytes down before we cut it, or 0
+	unsigned open; // Handles not closed yet
+	bool shutting;
+	bool closing;
+};
+
+static uv_tcp_t relay[1];
+static unsigned relay_drops = 0; // Worker connections left to cut
+
+static void relay_closed(uv_handle_t *const handle) {
+	relay_pipe *const p = handle->data;
+	relay_link *const link = p->link;
+	if(--link->open) return;
+	relay_pipe *const pipes[] = { link->up, link->down };
+	for(size_t i = 0; i < numberof(pipes); i++) {
+		while(pipes[i]->head) {
+			relay_chunk *const next = pipes[i]->head->next;
+			free(pipes[i]->head);
+			pipes[i]->head = next;
+		}
+	}
+	free(link);
+}
+static void relay_close(relay_link *const link) {
+	if(link->closing) return;
+	link->closing = true;
+	uv_close((uv_handle_t *)link->client, relay_closed);
+	uv_close((uv_handle_t *)link->server, relay_closed);
+	uv_close((uv_handle_t *)link->up->timer, relay_closed);
+	uv_close((uv_handle_t *)link->down->timer, relay_closed);
+}
+static void relay_shut(uv_shutdown_t *const req, int const status) {
+	relay_close(req->data);
+}
+static void relay_shutdown(relay_pipe *const p) {
+	// Lets the writes we already started finish first.
+	relay_link *const link = p->link;
+	if(link->closing || link->shutting) return;
+	link->shutting = true;
+	link->shutdown->data = link;
+	int rc = uv_shutdown(link->shutdown, (uv_stream_t *)p->to, relay_shut);
+	if(rc < 0) relay_close(link);
+}
+static void relay_written(uv_write_t *const req, int const status) {
+	free(req->data);
+}
+static void relay_flush(uv_timer_t *const timer) {
+	relay_pipe *const p = timer->data;
+	relay_link *const link = p->link;
+	uint64_t const now = uv_now(async_loop);
+	while(p->head && p->head->due <= now) {
+		relay_chunk *const chunk = p->head;
+		p->head = chunk->next;
+		if(!p->head) p->tail = NULL;
+		if(chunk->len < 0) {
+			free(chunk);
+			relay_shutdown(p);
+			return;
+		}
+		size_t len = chunk->len;
+		bool cut = false;
+		if(p == link->down && link->drop && p->bytes + len >= link->drop) {
+			len = link->drop - p->bytes;
+			cut = true;
+		}
+		p->bytes += len;
+		uv_buf_t buf = uv_buf_init(chunk->data, len);
+		chunk->req->data = chunk;
+		int rc = uv_write(chunk->req, (uv_stream_t *)p->to, &buf, 1, relay_written);
+		if(rc < 0) {
+			free(chunk);
+			relay_close(link);
+			return;
+		}
+		if(cut) {
+			relay_shutdown(p);
+			return;
+		}
+	}
+	if(p->head) uv_timer_start(timer, relay_flush, p->head->due - now, 0);
+}
+static void relay_alloc(uv_handle_t *const handle, size_t const suggested, uv_buf_t *const buf) {
+	relay_chunk *const chunk = malloc(sizeof(relay_chunk) + suggested);
+	*buf = uv_buf_init(chunk ? chunk->data : NULL, chunk ? suggested : 0);
+}
+static void relay_read(uv_stream_t *const stream, ssize_t const nread, uv_buf_t const *const buf) {
+	relay_pipe *const p = stream->data;
+	relay_link *const link = p->link;
+	relay_chunk *chunk = !buf->base ? NULL :
+		(relay_chunk *)(buf->base - offsetof(relay_chunk, data));
+	if(0 == nread) {
+		free(chunk);
+		return;
+	}
+	if(nread < 0) {
+		uv_read_stop(stream);
+		if(!chunk) chunk = malloc(sizeof(relay_chunk));
+	}
+	if(!chunk) {
+		relay_close(link);
+		return;
+	}
+	if(p == link->up && 0 == p->bytes && !p->head && relay_drops && nread > 0) {
+		// Listings are read by a single long request, and the pull
+		// gives up on those. Only cut workers.
+		strarg_t const prefix = "GET /sln/file/";
+		size_t const len = strlen(prefix);
+		if(nread >= len && 0 == memcmp(chunk->data, prefix, len)) {
+			link->drop = DROP_AFTER;
+			relay_drops--;
+		}
+	}
+	chunk->next = NULL;
+	chunk->due = uv_now(async_loop) + LATENCY;
+	chunk->len = nread < 0 ? UV_EOF : nread;
+	if(p->tail) p->tail->next = chunk;
+	else p->head = chunk;
+	p->tail = chunk;
+	if(!uv_is_active((uv_handle_t *)p->timer)) {
+		uv_timer_start(p->timer, relay_flush, LATENCY, 0);
+	}
+}
+static void relay_connected(uv_connect_t *const req, int const status) {
+	relay_link *const link = req->data;
+	if(link->closing) return;
+	int rc = status;
+	rc = rc < 0 ? rc : uv_read_start((uv_stream_t *)link->client, relay_alloc, relay_read);
+	rc = rc < 0 ? rc : uv_read_start((uv_stream_t *)link->server, relay_alloc, relay_read);
+	if(rc < 0) relay_close(link);
+}
+static void relay_connection(uv_stream_t *const listener, int const status) {
+	if(status < 0) return;
+	relay_link *const link = calloc(1, sizeof(relay_link));
+	if(!link) return;
+	link->up->link = link;
+	link->up->from = link->client;
+	link->up->to = link->server;
+	link->down->link = link;
+	link->down->from = link->server;
+	link->down->to = link->client;
+	uv_tcp_init(async_loop, link->client);
+	uv_tcp_init(async_loop, link->server);
+	uv_timer_init(async_loop, link->up->timer);
+	uv_timer_init(async_loop, link->down->timer);
+	link->client->data = link->up;
+	link->server->data = link->down;
+	link->up->timer->data = link->up;
+	link->down->timer->data = link->down;
+	link->open = 4;
+
+	struct sockaddr_in addr[1];
+	int rc = uv_accept(listener, (uv_stream_t *)link->client);
+	rc = rc < 0 ? rc : uv_ip4_addr("127.0.0.1", SERVER_PORT, addr);
+	if(rc < 0) {
+		relay_close(link);
+		return;
+	}
+	link->connect->data = link;
+	rc = uv_tcp_connect(link->connect, link->server, (struct sockaddr const *)addr, relay_connected);
+	if(rc < 0) relay_close(link);
+}
+static int relay_start(void) {
+	struct sockaddr_in addr[1];
+	int rc = uv_tcp_init(async_loop, relay);
+	if(rc < 0) return rc;
+	rc = uv_ip4_addr("127.0.0.1", RELAY_PORT, addr);
+	rc = rc < 0 ? rc : uv_tcp_bind(relay, (struct sockaddr const *)addr, 0);
+	rc = rc < 0 ? rc : uv_listen((uv_stream_t *)relay, 128, relay_connection);
+	return rc;
+}
+
+
+// The peer, serving src.
+
+static void listener(void *ctx, HTTPServerRef const server, HTTPConnectionRef const conn) {
+	HTTPMethod method = 99; // 0 is HTTP_DELETE...
+	str_t URI[URI_MAX];
+	HTTPHeadersRef headers = NULL;
+	SLNSessionRef session = NULL;
+	int rc;
+
+	ssize_t const len = HTTPConnectionReadRequest(conn, &method, URI, sizeof(URI));
+	if(len < 0) return;
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) goto cleanup;
+	strarg_t const cookie = HTTPHeadersGet(headers, "cookie");
+	rc = SLNSessionCacheCopyActiveSession(SLNRepoGetSessionCache(src), cookie, &session);
+	if(rc < 0) goto cleanup;
+
+	requests++;
+	if(nobatch && 0 == uripathcmp("/sln/batch", URI, NULL)) rc = 400;
+	else rc = SLNServerDispatch(src, session, conn, method, URI, headers);
+	if(rc < 0) rc = 404;
+	if(rc > 0) HTTPConnectionSendStatus(conn, rc);
+
+cleanup:
+	SLNSessionRelease(&session);
+	HTTPHeadersFree(&headers);
+}
+
+
+static int create_repo(strarg_t const name, SLNRepoRef *const out, SLNSessionRef *const sessionptr) {
+	str_t *path = aasprintf("%s/%s", dir, name);
+	SLNRepoRef repo = NULL;
+	SLNSessionRef root = NULL;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc = path ? 0 : UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = async_fs_mkdir(path, 0700);
+	if(rc < 0) goto cleanup;
+	rc = SLNRepoCreate(path, name, &repo);
+	if(rc < 0) goto cleanup;
+
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
+	rc = SLNSessionCreateInternal(cache, 0, NULL, NULL, 0, SLN_ROOT, NULL, &root);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionDBOpen(root, SLN_RDWR, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionCreateUserInternal(root, txn, USERNAME, PASSWORD, SLN_ROOT);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_commit(txn); txn = NULL;
+	if(rc < 0) goto cleanup;
+	SLNSessionDBClose(root, &db);
+
+	rc = SLNSessionCacheCreateSession(cache, USERNAME, PASSWORD, NULL, sessionptr);
+	if(rc < 0) goto cleanup;
+
+	*out = repo; repo = NULL;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(root, &db);
+	SLNSessionRelease(&root);
+	SLNRepoFree(&repo);
+	FREE(&path);
+	return rc;
+}
+static int add_files(SLNSessionRef const session, str_t **const URIs, size_t const count) {
+	SLNSubmissionRef sub = NULL;
+	int rc = 0;
+	for(size_t i = 0; i < count; i++) {
+		str_t buf[FILE_SIZE];
+		memset(buf, 'x', sizeof(buf));
+		snprintf(buf, sizeof(buf), "Test file %zu\n", i);
+		rc = SLNSubmissionCreate(session, NULL, NULL, &sub);
+		rc = rc < 0 ? rc : SLNSubmissionSetType(sub, "text/plain; charset=utf-8");
+		rc = rc < 0 ? rc : SLNSubmissionWrite(sub, (byte_t const *)buf, sizeof(buf));
+		rc = rc < 0 ? rc : SLNSubmissionEnd(sub);
+		rc = rc < 0 ? rc : SLNSubmissionStoreBatch(&sub, 1);
+		if(rc < 0) break;
+		URIs[i] = strdup(SLNSubmissionGetPrimaryURI(sub));
+		if(!URIs[i]) rc = UV_ENOMEM;
+		if(rc < 0) break;
+		SLNSubmissionFree(&sub);
+	}
+	SLNSubmissionFree(&sub);
+	return rc;
+}
+static int wait_files(SLNSessionRef const session, str_t *const *const URIs, size_t const count) {
+	uint64_t const start = uv_now(async_loop);
+	size_t i = 0;
+	while(i < count) {
+		SLNFileInfo info[1] = {};
+		int rc = SLNSessionGetFileInfo(session, URIs[i], info);
+		SLNFileInfoCleanup(info);
+		if(rc >= 0) {
+			i++;
+			continue;
+		}
+		if(KVS_NOTFOUND != rc) return rc;
+		if(uv_now(async_loop) - start > TIMEOUT) return UV_ETIMEDOUT;
+		async_sleep(50);
+	}
+	return 0;
+}
+
+static int pull_once(strarg_t const name, str_t *const *const URIs, strarg_t const cookie) {
+	SLNRepoRef dst = NULL;
+	SLNSessionRef session = NULL;
+	SLNPullRef pull = NULL;
+	int rc = create_repo(name, &dst, &session);
+	if(rc < 0) goto cleanup;
+
+	// One connection at a time, so that only pipelining or batches
+	// can hide the latency.
+	SLNPullSchedulerRef const sched = SLNRepoGetPullScheduler(dst);
+	SLNPullSchedulerConfig(sched, 0, 0, 1, 0, 1);
+
+	str_t host[31+1];
+	snprintf(host, sizeof(host), "127.0.0.1:%d", RELAY_PORT);
+	rc = SLNPullCreate(SLNRepoGetSessionCache(dst), sched, SLNSessionGetID(session), NULL, host, "", "", cookie, &pull);
+	if(rc < 0) goto cleanup;
+
+	requests = 0;
+	uint64_t const start = uv_hrtime();
+	rc = SLNPullStart(pull);
+	rc = rc < 0 ? rc : wait_files(session, URIs, FILE_COUNT);
+	uint64_t const elapsed = (uv_hrtime() - start) / 1000 / 1000;
+	if(rc < 0) goto cleanup;
+
+	uint64_t const serial = FILE_COUNT * LATENCY * 2;
+	fprintf(stderr, "%s: %u files in %llu ms (%u requests, %llu ms one at a time)\n",
+		name, FILE_COUNT, (unsigned long long)elapsed, requests,
+		(unsigned long long)serial);
+	if(elapsed > serial / 2) rc = UV_ETIMEDOUT;
+	if(relay_drops) {
+		fprintf(stderr, "%s: no connections were cut\n", name);
+		rc = UV_EIO;
+	}
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "%s: %s\n", name, sln_strerror(rc));
+	SLNPullFree(&pull);
+	SLNSessionRelease(&session);
+	SLNRepoFree(&dst);
+	return rc;
+}
+
+static void test(void *const unused) {
+	str_t *URIs[FILE_COUNT] = {};
+	SLNSessionRef session = NULL;
+	str_t *cookie = NULL;
+	int rc;
+
+	rc = async_random((byte_t *)&SLNSeed, sizeof(SLNSeed));
+	if(rc < 0) goto cleanup;
+	if(!mkdtemp(dir)) rc = -errno;
+	if(rc < 0) goto cleanup;
+
+	rc = create_repo("src", &src, &session);
+	rc = rc < 0 ? rc : add_files(session, URIs, FILE_COUNT);
+	if(rc < 0) goto cleanup;
+	// The pull adds "s=" itself.
+	str_t *full = SLNSessionCopyCookie(session);
+	cookie = full ? strdup(full+2) : NULL;
+	FREE(&full);
+	if(!cookie) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = HTTPServerCreate((HTTPListener)listener, NULL, &server);
+	rc = rc < 0 ? rc : HTTPServerListen(server, "127.0.0.1", SERVER_PORT);
+	rc = rc < 0 ? rc : relay_start();
+	if(rc < 0) goto cleanup;
+
+	nobatch = false;
+	rc = pull_once("batch", URIs, cookie);
+	if(rc < 0) goto cleanup;
+	nobatch = true;
+	rc = pull_once("pipeline", URIs, cookie);
+	if(rc < 0) goto cleanup;
+	relay_drops = 1;
+	rc = pull_once("pipeline-dropped", URIs, cookie);
+	if(rc < 0) goto cleanup;
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Pull test failed: %s\n", sln_strerror(rc));
+	else fprintf(stderr, "Pull test passed\n");
+	status = rc;
+	HTTPServerClose(server);
+	HTTPServerFree(&server);
+	SLNSessionRelease(&session);
+	SLNRepoFree(&src);
+	for(size_t i = 0; i < FILE_COUNT; i++) FREE(&URIs[i]);
+	FREE(&cookie);
+	str_t cmd[63+1];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if('X' != dir[strlen(dir)-1]) system(cmd);
+	// Keep-alive connections would hold the loop open.
+	uv_stop(async_loop);
+}
+
+int main(int const argc, char const *const *const argv) {
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, test, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	return status < 0 ? 1 : 0;
+}
@@ -0,0 +1,444 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "StrongLink.h"
+
+#define PEER_MAX 64 // Bits in a want mask
+#define TABLE_SIZE 1024 // Hash buckets for files in flight
+#define PREFER_RATIO 2 // How much faster another peer has to be
+#define PREFER_WAIT (1000 * 10) // Longest we hold a file for a faster peer
+#define SPEED_WINDOW 1000 // Milliseconds per throughput sample
+
+// Token bucket, allowing up to a second's worth of burst.
+typedef struct {
+	uint64_t rate; // Bytes per second, 0 for unlimited
+	int64_t tokens;
+	uint64_t last;
+} bucket;
+
+typedef struct {
+	bool used;
+	bucket limit[1];
+	uint64_t speed; // Smoothed bytes per second, 0 if unknown
+	uint64_t sample_bytes;
+	uint64_t sample_start;
+	unsigned active;
+} peer;
+
+// A file queued by at least one peer. Once one of them has fetched it,
+// the rest record that copy instead of fetching it again.
+typedef struct entry entry;
+struct entry {
+	entry *next;
+	str_t *URI;
+	uint64_t wants; // Peers that have it queued
+	ssize_t fetcher; // -1 if nobody
+	unsigned waiters;
+	SLNFileInfo info[1]; // Set once fetched
+	str_t **URIs;
+};
+
+struct SLNPullScheduler {
+	async_mutex_t mutex[1];
+	async_cond_t cond[1]; // Broadcast when a fetch ends or a slot opens
+	entry *table[TABLE_SIZE];
+	peer peers[PEER_MAX];
+	bucket limit[1];
+	unsigned max_active; // 0 for unlimited
+	unsigned max_peer;
+	unsigned max_bulk;
+	unsigned active[SLN_PULL_CLASS_COUNT];
+	unsigned waiting[SLN_PULL_CLASS_COUNT];
+};
+
+static void entry_free(entry **const eptr);
+
+int SLNPullSchedulerCreate(SLNPullSchedulerRef *const out) {
+	assert(out);
+	SLNPullSchedulerRef sched = calloc(1, sizeof(struct SLNPullScheduler));
+	if(!sched) return UV_ENOMEM;
+	async_mutex_init(sched->mutex, 0);
+	async_cond_init(sched->cond, 0);
+	*out = sched;
+	return 0;
+}
+void SLNPullSchedulerFree(SLNPullSchedulerRef *const schedptr) {
+	assert(schedptr);
+	SLNPullSchedulerRef sched = *schedptr;
+	if(!sched) return;
+	async_mutex_destroy(sched->mutex);
+	async_cond_destroy(sched->cond);
+	for(size_t i = 0; i < TABLE_SIZE; i++) {
+		while(sched->table[i]) {
+			entry *e = sched->table[i];
+			sched->table[i] = e->next;
+			entry_free(&e);
+		}
+	}
+	memset(sched->peers, 0, sizeof(sched->peers));
+	memset(sched->limit, 0, sizeof(sched->limit));
+	sched->max_active = 0;
+	sched->max_peer = 0;
+	sched->max_bulk = 0;
+	memset(sched->active, 0, sizeof(sched->active));
+	memset(sched->waiting, 0, sizeof(sched->waiting));
+	assert_zeroed(sched, 1);
+	FREE(schedptr); sched = NULL;
+}
+void SLNPullSchedulerConfig(SLNPullSchedulerRef const sched, uint64_t const rate, uint64_t const peerRate, unsigned const active, unsigned const peerActive, unsigned const bulk) {
+	if(!sched) return;
+	async_mutex_lock(sched->mutex);
+	sched->limit->rate = rate;
+	for(size_t i = 0; i < PEER_MAX; i++) {
+		sched->peers[i].limit->rate = peerRate;
+	}
+	sched->max_active = active;
+	sched->max_peer = peerActive;
+	sched->max_bulk = bulk;
+	// Raising the limits might let some waiters in.
+	async_cond_broadcast(sched->cond);
+	async_mutex_unlock(sched->mutex);
+}
+
+int SLNPullSchedulerAddPeer(SLNPullSchedulerRef const sched, size_t *const out) {
+	assert(out);
+	if(!sched) return UV_EINVAL;
+	int rc = UV_ENOSPC;
+	async_mutex_lock(sched->mutex);
+	for(size_t i = 0; i < PEER_MAX; i++) {
+		peer *const p = &sched->peers[i];
+		if(p->used) continue;
+		// Workers of a removed peer might not have left yet.
+		if(p->active) continue;
+		uint64_t const rate = p->limit->rate;
+		memset(p, 0, sizeof(*p));
+		p->used = true;
+		p->limit->rate = rate;
+		p->limit->last = uv_now(async_loop);
+		*out = i;
+		rc = 0;
+		break;
+	}
+	async_mutex_unlock(sched->mutex);
+	return rc;
+}
+static bool entry_gc(SLNPullSchedulerRef const sched, entry **const eptr);
+void SLNPullSchedulerRemovePeer(SLNPullSchedulerRef const sched, size_t const i) {
+	if(!sched) return;
+	assert(i < PEER_MAX);
+	async_mutex_lock(sched->mutex);
+	sched->peers[i].used = false;
+	// Nobody else should wait on files this peer won't fetch now.
+	for(size_t j = 0; j < TABLE_SIZE; j++) {
+		entry **eptr = &sched->table[j];
+		while(*eptr) {
+			entry *const e = *eptr;
+			e->wants &= ~((uint64_t)1 << i);
+			if(i == e->fetcher) e->fetcher = -1;
+			if(!entry_gc(sched, eptr)) eptr = &e->next;
+		}
+	}
+	// Wakes up our own workers too, so they can exit.
+	async_cond_broadcast(sched->cond);
+	async_mutex_unlock(sched->mutex);
+}
+
+static size_t hash_uri(strarg_t const URI) {
+	// FNV-1a
+	uint32_t h = 2166136261;
+	for(size_t i = 0; URI[i]; i++) {
+		h ^= (unsigned char)URI[i];
+		h *= 16777619;
+	}
+	return h % TABLE_SIZE;
+}
+static entry **entry_find(SLNPullSchedulerRef const sched, strarg_t const URI) {
+	entry **eptr = &sched->table[hash_uri(URI)];
+	while(*eptr && 0 != strcmp((*eptr)->URI, URI)) eptr = &(*eptr)->next;
+	return eptr;
+}
+static entry *entry_get(SLNPullSchedulerRef const sched, strarg_t const URI) {
+	entry **const eptr = entry_find(sched, URI);
+	if(*eptr) return *eptr;
+	entry *e = calloc(1, sizeof(entry));
+	if(!e) return NULL;
+	e->URI = strdup(URI);
+	if(!e->URI) {
+		FREE(&e);
+		return NULL;
+	}
+	e->fetcher = -1;
+	*eptr = e;
+	return e;
+}
+static void uris_free(str_t ***const URIsptr) {
+	str_t **URIs = *URIsptr;
+	if(!URIs) return;
+	for(size_t i = 0; URIs[i]; i++) FREE(&URIs[i]);
+	FREE(URIsptr); URIs = NULL;
+}
+static str_t **uris_copy(str_t const *const *const URIs) {
+	size_t count = 0;
+	while(URIs[count]) count++;
+	str_t **copy = calloc(count+1, sizeof(str_t *));
+	if(!copy) return NULL;
+	for(size_t i = 0; i < count; i++) {
+		copy[i] = strdup(URIs[i]);
+		if(copy[i]) continue;
+		uris_free(&copy);
+		return NULL;
+	}
+	return copy;
+}
+static int info_copy(SLNFileInfo const *const info, SLNFileInfo *const out) {
+	out->hash = strdup(info->hash);
+	out->path = strdup(info->path);
+	out->type = strdup(info->type);
+	out->size = info->size;
+	if(out->hash && out->path && out->type) return 0;
+	SLNFileInfoCleanup(out);
+	return UV_ENOMEM;
+}
+static void entry_free(entry **const eptr) {
+	entry *e = *eptr;
+	FREE(&e->URI);
+	SLNFileInfoCleanup(e->info);
+	uris_free(&e->URIs);
+	FREE(eptr); e = NULL;
+}
+static bool entry_gc(SLNPullSchedulerRef const sched, entry **const eptr) {
+	// Returns true if the entry was freed.
+	entry *e = *eptr;
+	if(e->wants || e->fetcher >= 0 || e->waiters) return false;
+	*eptr = e->next;
+	entry_free(&e);
+	return true;
+}
+
+int SLNPullSchedulerWant(SLNPullSchedulerRef const sched, size_t const i, strarg_t const URI) {
+	if(!sched) return UV_EINVAL;
+	if(!URI) return UV_EINVAL;
+	assert(i < PEER_MAX);
+	async_mutex_lock(sched->mutex);
+	entry *const e = entry_get(sched, URI);
+	if(e) e->wants |= (uint64_t)1 << i;
+	async_mutex_unlock(sched->mutex);
+	if(!e) return UV_ENOMEM;
+	return 0;
+}
+static ssize_t preferred(SLNPullSchedulerRef const sched, entry const *const e, size_t const i) {
+	// Only defer once we know how fast we are, so new peers get measured.
+	uint64_t const ours = sched->peers[i].speed;
+	if(!ours) return i;
+	ssize_t best = i;
+	uint64_t speed = ours * PREFER_RATIO;
+	for(size_t j = 0; j < PEER_MAX; j++) {
+		if(!(e->wants & ((uint64_t)1 << j))) continue;
+		if(!sched->peers[j].used) continue;
+		if(sched->peers[j].speed <= speed) continue;
+		best = j;
+		speed = sched->peers[j].speed;
+	}
+	return best;
+}
+int SLNPullSchedulerClaim(SLNPullSchedulerRef const sched, size_t const i, strarg_t const URI, bool const wait, SLNFileInfo *const info, str_t ***const URIs) {
+	assert(info);
+	assert(URIs);
+	if(!sched) return UV_EINVAL;
+	if(!URI) return UV_EINVAL;
+	assert(i < PEER_MAX);
+	uint64_t const future = uv_now(async_loop) + PREFER_WAIT;
+	int rc = 0;
+	async_mutex_lock(sched->mutex);
+	entry *const e = entry_get(sched, URI);
+	if(!e) {
+		async_mutex_unlock(sched->mutex);
+		return UV_ENOMEM;
+	}
+	e->wants |= (uint64_t)1 << i;
+	e->waiters++;
+	for(;;) {
+		if(!sched->peers[i].used) {
+			rc = UV_ECANCELED;
+			break;
+		}
+		if(e->URIs) {
+			rc = info_copy(e->info, info);
+			if(rc < 0) break;
+			*URIs = uris_copy((str_t const *const *)e->URIs);
+			if(!*URIs) {
+				SLNFileInfoCleanup(info);
+				rc = UV_ENOMEM;
+				break;
+			}
+			rc = SLN_PULL_FETCHED;
+			break;
+		}
+		if(e->fetcher < 0) {
+			if(uv_now(async_loop) >= future || i == preferred(sched, e, i)) {
+				e->fetcher = i;
+				rc = 0;
+				break;
+			}
+		}
+		if(!wait) {
+			rc = UV_EAGAIN;
+			break;
+		}
+		// If someone is already fetching it, wait as long as it takes.
+		// Otherwise give the faster peer a chance to get to it.
+		if(e->fetcher >= 0) async_cond_wait(sched->cond, sched->mutex);
+		else async_cond_timedwait(sched->cond, sched->mutex, future);
+	}
+	e->waiters--;
+	async_mutex_unlock(sched->mutex);
+	return rc;
+}
+void SLNPullSchedulerRelease(SLNPullSchedulerRef const sched, size_t const i, strarg_t const URI, SLNSubmissionRef const fetched) {
+	if(!sched) return;
+	if(!URI) return;
+	assert(i < PEER_MAX);
+	async_mutex_lock(sched->mutex);
+	entry **const eptr = entry_find(sched, URI);
+	entry *const e = *eptr;
+	if(e) {
+		if(i == e->fetcher) {
+			e->fetcher = -1;
+			str_t const *const *const URIs = SLNSubmissionGetURIs(fetched);
+			if(URIs && !e->URIs) {
+				// If these fail, the others just fetch it themselves.
+				if(SLNSubmissionGetFileInfo(fetched, e->info) >= 0) {
+					e->URIs = uris_copy(URIs);
+					if(!e->URIs) SLNFileInfoCleanup(e->info);
+				}
+			}
+		}
+		e->wants &= ~((uint64_t)1 << i);
+		entry_gc(sched, eptr);
+	}
+	async_cond_broadcast(sched->cond);
+	async_mutex_unlock(sched->mutex);
+}
+
+static bool full(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const class) {
+	unsigned total = 0;
+	for(size_t c = 0; c < SLN_PULL_CLASS_COUNT; c++) total += sched->active[c];
+	if(sched->max_active && total >= sched->max_active) return true;
+	if(sched->max_peer && sched->peers[i].active >= sched->max_peer) return true;
+	if(SLN_PULL_BULK == class && sched->max_bulk && sched->active[class] >= sched->max_bulk) return true;
+	// Higher priority classes go first.
+	for(size_t c = 0; c < class; c++) {
+		if(sched->waiting[c]) return true;
+	}
+	return false;
+}
+static void enter(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const class) {
+	peer *const p = &sched->peers[i];
+	if(0 == p->active++) {
+		// Don't count idle time against the peer's speed.
+		p->sample_bytes = 0;
+		p->sample_start = uv_now(async_loop);
+	}
+	sched->active[class]++;
+}
+int SLNPullSchedulerEnter(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const class) {
+	if(!sched) return UV_EINVAL;
+	assert(i < PEER_MAX);
+	assert(class < SLN_PULL_CLASS_COUNT);
+	int rc = 0;
+	async_mutex_lock(sched->mutex);
+	sched->waiting[class]++;
+	for(;;) {
+		if(!sched->peers[i].used) rc = UV_ECANCELED;
+		if(rc < 0) break;
+		if(!full(sched, i, class)) break;
+		async_cond_wait(sched->cond, sched->mutex);
+	}
+	sched->waiting[class]--;
+	if(rc >= 0) enter(sched, i, class);
+	// Lower priority waiters might have been held up by us.
+	async_cond_broadcast(sched->cond);
+	async_mutex_unlock(sched->mutex);
+	return rc;
+}
+bool SLNPullSchedulerTryEnter(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const class) {
+	if(!sched) return false;
+	assert(i < PEER_MAX);
+	assert(class < SLN_PULL_CLASS_COUNT);
+	async_mutex_lock(sched->mutex);
+	bool const ok = !full(sched, i, class);
+	if(ok) enter(sched, i, class);
+	async_mutex_unlock(sched->mutex);
+	return ok;
+}
+void SLNPullSchedulerLeave(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const class) {
+	if(!sched) return;
+	assert(i < PEER_MAX);
+	assert(class < SLN_PULL_CLASS_COUNT);
+	async_mutex_lock(sched->mutex);
+	assert(sched->active[class] > 0);
+	assert(sched->peers[i].active > 0);
+	sched->active[class]--;
+	sched->peers[i].active--;
+	async_cond_broadcast(sched->cond);
+	async_mutex_unlock(sched->mutex);
+}
+int SLNPullSchedulerReclassify(SLNPullSchedulerRef const sched, size_t const i, SLNPullClass const from, SLNPullClass const to) {
+	if(!sched) return UV_EINVAL;
+	assert(i < PEER_MAX);
+	assert(from < SLN_PULL_CLASS_COUNT);
+	assert(to < SLN_PULL_CLASS_COUNT);
+	int rc = 0;
+	async_mutex_lock(sched->mutex);
+	assert(sched->active[from] > 0);
+	// We already hold a slot, so only the bulk limit applies. Waiting
+	// for anything else could deadlock with the waiters behind us.
+	for(;;) {
+		if(!sched->peers[i].used) rc = UV_ECANCELED;
+		if(rc < 0) break;
+		if(SLN_PULL_BULK != to || !sched->max_bulk) break;
+		if(sched->active[to] < sched->max_bulk) break;
+		async_cond_wait(sched->cond, sched->mutex);
+	}
+	if(rc >= 0) {
+		sched->active[from]--;
+		sched->active[to]++;
+		async_cond_broadcast(sched->cond);
+	}
+	async_mutex_unlock(sched->mutex);
+	return rc;
+}
+
+static uint64_t bucket_take(bucket *const b, uint64_t const now, size_t const len) {
+	// Returns how long to wait before using what we took.
+	if(!b->rate) return 0;
+	uint64_t const elapsed = MIN(now - b->last, 1000);
+	b->last = now;
+	b->tokens += (int64_t)(elapsed * b->rate / 1000);
+	if(b->tokens > (int64_t)b->rate) b->tokens = b->rate;
+	b->tokens -= len;
+	if(b->tokens >= 0) return 0;
+	return (uint64_t)-b->tokens * 1000 / b->rate;
+}
+void SLNPullSchedulerThrottle(SLNPullSchedulerRef const sched, size_t const i, size_t const len) {
+	if(!sched) return;
+	assert(i < PEER_MAX);
+	peer *const p = &sched->peers[i];
+	uint64_t const now = uv_now(async_loop);
+	async_mutex_lock(sched->mutex);
+	p->sample_bytes += len;
+	uint64_t const elapsed = now - p->sample_start;
+	if(elapsed >= SPEED_WINDOW) {
+		uint64_t const speed = p->sample_bytes * 1000 / elapsed;
+		p->speed = p->speed ? (p->speed*3 + speed) / 4 : speed;
+		p->sample_bytes = 0;
+		p->sample_start = now;
+	}
+
+	uint64_t const a = bucket_take(sched->limit, now, len);
+	uint64_t const b = bucket_take(p->limit, now, len);
+	async_mutex_unlock(sched->mutex);
+	uint64_t const delay = MAX(a, b);
+	if(delay) async_sleep(delay);
+}
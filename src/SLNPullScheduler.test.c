@@ -0,0 +1,272 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Pulls a repository from several local stand-in servers at once, all
+// serving the same files, and checks that the scheduler keeps to its
+// limits: each file is fetched from only one peer, no peer gets more
+// than PEER_ACTIVE file requests at a time, all of them together no more
+// than ACTIVE, and the whole pull takes as long as RATE says it should.
+// Usage: make test (or build/tests/SLNPullScheduler.test)
+
+#include <async/http/HTTPServer.h>
+#include "StrongLink.h"
+
+#define SERVER_COUNT 3
+#define SERVER_PORT 8071 // And up
+#define FILE_COUNT 200
+#define FILE_SIZE 2048
+#define DELAY 5 // Milliseconds each file request is held open
+#define ACTIVE 4
+#define PEER_ACTIVE 2
+#define RATE (1024 * 100)
+#define TIMEOUT (1000 * 60)
+
+#define USERNAME "test"
+#define PASSWORD "test"
+
+int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
+
+typedef struct {
+	HTTPServerRef server;
+	unsigned files; // File requests served
+	unsigned active;
+	unsigned peak;
+} standin;
+
+static str_t dir[] = "/tmp/sln-sched-test-XXXXXX";
+static SLNRepoRef src = NULL;
+static standin servers[SERVER_COUNT] = {};
+static unsigned active = 0;
+static unsigned peak = 0;
+static int status = 0;
+
+static void listener(standin *const s, HTTPServerRef const server, HTTPConnectionRef const conn) {
+	HTTPMethod method = 99; // 0 is HTTP_DELETE...
+	str_t URI[URI_MAX];
+	HTTPHeadersRef headers = NULL;
+	SLNSessionRef session = NULL;
+	int rc;
+
+	ssize_t const len = HTTPConnectionReadRequest(conn, &method, URI, sizeof(URI));
+	if(len < 0) return;
+	rc = HTTPHeadersCreateFromConnection(conn, &headers);
+	if(rc < 0) goto cleanup;
+	strarg_t const cookie = HTTPHeadersGet(headers, "cookie");
+	rc = SLNSessionCacheCopyActiveSession(SLNRepoGetSessionCache(src), cookie, &session);
+	if(rc < 0) goto cleanup;
+
+	// One file per request, so that we can count them.
+	if(0 == uripathcmp("/sln/batch", URI, NULL)) {
+		HTTPConnectionSendStatus(conn, 400);
+		goto cleanup;
+	}
+
+	if(0 == strncmp(URI, "/sln/file/", 10)) {
+		s->files++;
+		s->peak = MAX(s->peak, ++s->active);
+		peak = MAX(peak, ++active);
+		// Long enough for the other workers to pile up behind us.
+		// Done before responding, because the slot is free as soon
+		// as the response has been read.
+		async_sleep(DELAY);
+		s->active--;
+		active--;
+	}
+	rc = SLNServerDispatch(src, session, conn, method, URI, headers);
+	if(rc < 0) rc = 404;
+	if(rc > 0) HTTPConnectionSendStatus(conn, rc);
+
+cleanup:
+	SLNSessionRelease(&session);
+	HTTPHeadersFree(&headers);
+}
+
+static int create_repo(strarg_t const name, SLNRepoRef *const out, SLNSessionRef *const sessionptr) {
+	str_t *path = aasprintf("%s/%s", dir, name);
+	SLNRepoRef repo = NULL;
+	SLNSessionRef root = NULL;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc = path ? 0 : UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = async_fs_mkdir(path, 0700);
+	if(rc < 0) goto cleanup;
+	rc = SLNRepoCreate(path, name, &repo);
+	if(rc < 0) goto cleanup;
+
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
+	rc = SLNSessionCreateInternal(cache, 0, NULL, NULL, 0, SLN_ROOT, NULL, &root);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionDBOpen(root, SLN_RDWR, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionCreateUserInternal(root, txn, USERNAME, PASSWORD, SLN_ROOT);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_commit(txn); txn = NULL;
+	if(rc < 0) goto cleanup;
+	SLNSessionDBClose(root, &db);
+
+	rc = SLNSessionCacheCreateSession(cache, USERNAME, PASSWORD, NULL, sessionptr);
+	if(rc < 0) goto cleanup;
+
+	*out = repo; repo = NULL;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(root, &db);
+	SLNSessionRelease(&root);
+	SLNRepoFree(&repo);
+	FREE(&path);
+	return rc;
+}
+static int add_files(SLNSessionRef const session, str_t **const URIs, size_t const count) {
+	SLNSubmissionRef sub = NULL;
+	int rc = 0;
+	for(size_t i = 0; i < count; i++) {
+		str_t buf[FILE_SIZE];
+		memset(buf, 'x', sizeof(buf));
+		snprintf(buf, sizeof(buf), "Test file %zu\n", i);
+		rc = SLNSubmissionCreate(session, NULL, NULL, &sub);
+		rc = rc < 0 ? rc : SLNSubmissionSetType(sub, "text/plain; charset=utf-8");
+		rc = rc < 0 ? rc : SLNSubmissionWrite(sub, (byte_t const *)buf, sizeof(buf));
+		rc = rc < 0 ? rc : SLNSubmissionEnd(sub);
+		rc = rc < 0 ? rc : SLNSubmissionStoreBatch(&sub, 1);
+		if(rc < 0) break;
+		URIs[i] = strdup(SLNSubmissionGetPrimaryURI(sub));
+		if(!URIs[i]) rc = UV_ENOMEM;
+		if(rc < 0) break;
+		SLNSubmissionFree(&sub);
+	}
+	SLNSubmissionFree(&sub);
+	return rc;
+}
+static int wait_files(SLNSessionRef const session, str_t *const *const URIs, size_t const count) {
+	uint64_t const start = uv_now(async_loop);
+	size_t i = 0;
+	while(i < count) {
+		SLNFileInfo info[1] = {};
+		int rc = SLNSessionGetFileInfo(session, URIs[i], info);
+		SLNFileInfoCleanup(info);
+		if(rc >= 0) {
+			i++;
+			continue;
+		}
+		if(KVS_NOTFOUND != rc) return rc;
+		if(uv_now(async_loop) - start > TIMEOUT) return UV_ETIMEDOUT;
+		async_sleep(50);
+	}
+	return 0;
+}
+
+static int pull_all(str_t *const *const URIs, strarg_t const cookie) {
+	SLNRepoRef dst = NULL;
+	SLNSessionRef session = NULL;
+	SLNPullRef pulls[SERVER_COUNT] = {};
+	int rc = create_repo("dst", &dst, &session);
+	if(rc < 0) goto cleanup;
+
+	SLNPullSchedulerRef const sched = SLNRepoGetPullScheduler(dst);
+	SLNPullSchedulerConfig(sched, RATE, 0, ACTIVE, PEER_ACTIVE, ACTIVE);
+
+	for(size_t i = 0; i < SERVER_COUNT; i++) {
+		str_t host[31+1];
+		snprintf(host, sizeof(host), "127.0.0.1:%d", SERVER_PORT+(int)i);
+		rc = SLNPullCreate(SLNRepoGetSessionCache(dst), sched, SLNSessionGetID(session), NULL, host, "", "", cookie, &pulls[i]);
+		if(rc < 0) goto cleanup;
+	}
+
+	uint64_t const start = uv_hrtime();
+	for(size_t i = 0; i < SERVER_COUNT; i++) {
+		rc = SLNPullStart(pulls[i]);
+		if(rc < 0) goto cleanup;
+	}
+	rc = wait_files(session, URIs, FILE_COUNT);
+	uint64_t const elapsed = (uv_hrtime() - start) / 1000 / 1000;
+	if(rc < 0) goto cleanup;
+
+	unsigned files = 0;
+	for(size_t i = 0; i < SERVER_COUNT; i++) {
+		fprintf(stderr, "Peer %zu: %u files, %u at most at once\n",
+			i, servers[i].files, servers[i].peak);
+		files += servers[i].files;
+		if(servers[i].peak > PEER_ACTIVE) rc = UV_EIO;
+	}
+	// The bucket starts out with a second's worth.
+	uint64_t const expected = (uint64_t)FILE_COUNT * FILE_SIZE * 1000 / RATE - 1000;
+	fprintf(stderr, "%u files from %u peers in %llu ms (%u at most at once, %llu ms expected)\n",
+		files, SERVER_COUNT, (unsigned long long)elapsed, peak,
+		(unsigned long long)expected);
+	if(peak > ACTIVE) rc = UV_EIO;
+	// A few might slip through if they're queued again before the
+	// first copy is stored.
+	if(files > FILE_COUNT + FILE_COUNT / 10) rc = UV_EIO;
+	if(elapsed < expected) rc = UV_EIO;
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Pull error: %s\n", sln_strerror(rc));
+	for(size_t i = 0; i < SERVER_COUNT; i++) SLNPullFree(&pulls[i]);
+	SLNSessionRelease(&session);
+	SLNRepoFree(&dst);
+	return rc;
+}
+
+static void test(void *const unused) {
+	str_t *URIs[FILE_COUNT] = {};
+	SLNSessionRef session = NULL;
+	str_t *cookie = NULL;
+	int rc;
+
+	rc = async_random((byte_t *)&SLNSeed, sizeof(SLNSeed));
+	if(rc < 0) goto cleanup;
+	if(!mkdtemp(dir)) rc = -errno;
+	if(rc < 0) goto cleanup;
+
+	rc = create_repo("src", &src, &session);
+	rc = rc < 0 ? rc : add_files(session, URIs, FILE_COUNT);
+	if(rc < 0) goto cleanup;
+	// The pull adds "s=" itself.
+	str_t *full = SLNSessionCopyCookie(session);
+	cookie = full ? strdup(full+2) : NULL;
+	FREE(&full);
+	if(!cookie) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	for(size_t i = 0; i < SERVER_COUNT; i++) {
+		rc = HTTPServerCreate((HTTPListener)listener, &servers[i], &servers[i].server);
+		rc = rc < 0 ? rc : HTTPServerListen(servers[i].server, "127.0.0.1", SERVER_PORT+(int)i);
+		if(rc < 0) goto cleanup;
+	}
+
+	rc = pull_all(URIs, cookie);
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Pull scheduler test failed: %s\n", sln_strerror(rc));
+	else fprintf(stderr, "Pull scheduler test passed\n");
+	status = rc;
+	for(size_t i = 0; i < SERVER_COUNT; i++) {
+		HTTPServerClose(servers[i].server);
+		HTTPServerFree(&servers[i].server);
+	}
+	SLNSessionRelease(&session);
+	SLNRepoFree(&src);
+	for(size_t i = 0; i < FILE_COUNT; i++) FREE(&URIs[i]);
+	FREE(&cookie);
+	str_t cmd[63+1];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if('X' != dir[strlen(dir)-1]) system(cmd);
+	// Keep-alive connections would hold the loop open.
+	uv_stop(async_loop);
+}
+
+int main(int const argc, char const *const *const argv) {
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, test, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	return status < 0 ? 1 : 0;
+}
@@ -1,15 +1,25 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "util/bloom.h"
+#include "util/metrics.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
 
-#define CACHE_SIZE 1000
+#define CACHE_SIZE 1024 // Sessions, to start with
+#define CACHE_MAX (1024 * 64)
 #define PASS_LEN 16 // Default for auto-generated passwords
+#define PARTIAL_MAX_AGE (60 * 60 * 24 * 7) // Seconds without progress
 
 
 // TODO: Put this somewhere.
 #define ENTROPY_BYTES 8
+#define MAP_SIZE (1024 * 1024 * 1024 * 1)
+#define COMPACT_BATCH 10000 // Records per write transaction
 static char *tohex2(char const *const buf, size_t const len) {
 	char const map[] = "0123456789abcdef";
 	char *const hex = calloc(len*2+1, 1);
@@ -47,17 +57,25 @@ struct SLNRepo {
 	SLNSessionCacheRef session_cache;
 
 	KVS_env *db;
+	async_pool_t *bulk;
 
 	async_mutex_t sub_mutex[1];
 	async_cond_t sub_cond[1];
 	uint64_t sub_latest;
 
+	// Internal hashes of every stored file, built on first use.
+	async_mutex_t filter_mutex[1];
+	bloom_filter *filter;
+	bool filter_ready;
+
+	SLNPullSchedulerRef pull_sched;
 	SLNPullRef *pulls;
 	size_t pull_count;
 	size_t pull_size;
 };
 
 static int connect_db(SLNRepoRef const repo);
+static void sweep_partials(SLNRepoRef const repo);
 static int add_pull(SLNRepoRef const repo, SLNPullRef *const pull);
 static int load_pulls(SLNRepoRef const repo);
 static int debug_pulls(SLNRepoRef const repo);
@@ -89,12 +107,21 @@ int SLNRepoCreate(strarg_t const dir, strarg_t const name, SLNRepoRef *const out
 	// TODO: The ability to limit public registration
 	repo->pub_mode = 0;
 	repo->reg_mode = 0;
-	rc = SLNSessionCacheCreate(repo, CACHE_SIZE, &repo->session_cache);
+	rc = SLNSessionCacheCreate(repo, CACHE_SIZE, CACHE_MAX, &repo->session_cache);
+	if(rc < 0) goto cleanup;
+
+	repo->bulk = async_pool_create();
+	if(!repo->bulk) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
 
 	rc = connect_db(repo);
 	if(rc < 0) goto cleanup;
 
+	sweep_partials(repo);
+
+	rc = SLNPullSchedulerCreate(&repo->pull_sched);
+	if(rc < 0) goto cleanup;
+
 	rc = load_pulls(repo);
 	if(rc < 0) goto cleanup;
 
@@ -106,6 +133,7 @@ int SLNRepoCreate(strarg_t const dir, strarg_t const name, SLNRepoRef *const out
 
 	async_mutex_init(repo->sub_mutex, 0);
 	async_cond_init(repo->sub_cond, 0);
+	async_mutex_init(repo->filter_mutex, 0);
 
 	*out = repo; repo = NULL;
 cleanup:
@@ -130,12 +158,16 @@ void SLNRepoFree(SLNRepoRef *const repoptr) {
 	repo->reg_mode = 0;
 	SLNSessionCacheFree(&repo->session_cache);
 
-	kvs_env_close(repo->db); repo->db = NULL;
+	if(repo->db) kvs_env_close(repo->db); repo->db = NULL;
 
 	async_mutex_destroy(repo->sub_mutex);
 	async_cond_destroy(repo->sub_cond);
 	repo->sub_latest = 0;
 
+	async_mutex_destroy(repo->filter_mutex);
+	bloom_free(&repo->filter);
+	repo->filter_ready = false;
+
 	for(size_t i = 0; i < repo->pull_count; ++i) {
 		SLNPullFree(&repo->pulls[i]);
 	}
@@ -143,6 +175,10 @@ void SLNRepoFree(SLNRepoRef *const repoptr) {
 	FREE(&repo->pulls);
 	repo->pull_count = 0;
 	repo->pull_size = 0;
+	SLNPullSchedulerFree(&repo->pull_sched);
+
+	if(repo->bulk) async_pool_free(repo->bulk);
+	repo->bulk = NULL;
 
 	assert_zeroed(repo, 1);
 	FREE(repoptr); repo = NULL;
@@ -175,6 +211,43 @@ str_t *SLNRepoCopyTempPath(SLNRepoRef const repo) {
 	if(!repo) return NULL;
 	return async_fs_tempnam(repo->tempDir, "sln");
 }
+str_t *SLNRepoCopyPartialPath(SLNRepoRef const repo, strarg_t const URI) {
+	if(!repo) return NULL;
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	if(SLNParseURI(URI, algo, hash) < 0) return NULL;
+	// Algorithm names and hashes are safe for use in paths.
+	if(strchr(hash, '/') || strchr(hash, '.')) return NULL;
+	return aasprintf("%s/partial/%s-%s", repo->tempDir, algo, hash);
+}
+// Interrupted downloads are kept so they can be resumed, but the peer
+// might never come back, or the file might never be synced again.
+static void sweep_partials(SLNRepoRef const repo) {
+	str_t dir[PATH_MAX];
+	int rc = snprintf(dir, sizeof(dir), "%s/partial", repo->tempDir);
+	if(rc < 0 || rc >= sizeof(dir)) return;
+	time_t const cutoff = time(NULL) - PARTIAL_MAX_AGE;
+	size_t removed = 0;
+
+	async_pool_enter(NULL);
+	DIR *const d = opendir(dir);
+	for(struct dirent *e = d ? readdir(d) : NULL; e; e = readdir(d)) {
+		if('.' == e->d_name[0]) continue;
+		str_t path[PATH_MAX];
+		rc = snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if(rc < 0 || rc >= sizeof(path)) continue;
+		struct stat info[1];
+		if(stat(path, info) < 0) continue;
+		if(!S_ISREG(info->st_mode)) continue;
+		if(info->st_mtime >= cutoff) continue;
+		if(unlink(path) < 0) continue;
+		removed++;
+	}
+	if(d) closedir(d);
+	async_pool_leave(NULL);
+
+	if(removed) alogf("Removed %zu stale partial downloads\n", removed);
+}
 strarg_t SLNRepoGetCacheDir(SLNRepoRef const repo) {
 	if(!repo) return NULL;
 	return repo->cacheDir;
@@ -192,18 +265,28 @@ SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo) {
 	if(!repo) return NULL;
 	return repo->session_cache;
 }
+SLNPullSchedulerRef SLNRepoGetPullScheduler(SLNRepoRef const repo) {
+	if(!repo) return NULL;
+	return repo->pull_sched;
+}
 
-void SLNRepoDBOpenUnsafe(SLNRepoRef const repo, KVS_env **const dbptr) {
+async_pool_t *SLNRepoGetPool(SLNRepoRef const repo, SLNPriority const priority) {
+	if(!repo) return NULL;
+	if(SLN_BULK == priority) return repo->bulk;
+	return NULL; // Shared pool
+}
+void SLNRepoDBOpenUnsafe(SLNRepoRef const repo, SLNPriority const priority, KVS_env **const dbptr) {
 	assert(repo);
 	assert(dbptr);
-	async_pool_enter(NULL);
+	metrics_pool_enter(SLNRepoGetPool(repo, priority), SLN_BULK == priority ?
+		METRIC_POOL_BULK : METRIC_POOL_INTERACTIVE);
 	*dbptr = repo->db;
 }
-void SLNRepoDBClose(SLNRepoRef const repo, KVS_env **const dbptr) {
+void SLNRepoDBClose(SLNRepoRef const repo, SLNPriority const priority, KVS_env **const dbptr) {
 	assert(dbptr);
 	assert(repo || !*dbptr);
 	if(!*dbptr) return;
-	async_pool_leave(NULL);
+	async_pool_leave(SLNRepoGetPool(repo, priority));
 	*dbptr = NULL;
 }
 
@@ -220,6 +303,7 @@ int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t *const sortID, uint64_
 	assert(repo);
 	assert(sortID);
 	int rc = 0;
+	metrics_gauge(METRIC_SUBMISSION_WAITERS, +1);
 	async_mutex_lock(repo->sub_mutex);
 	while(repo->sub_latest <= *sortID) {
 		rc = async_cond_timedwait(repo->sub_cond, repo->sub_mutex, future);
@@ -227,8 +311,110 @@ int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t *const sortID, uint64_
 	}
 	*sortID = repo->sub_latest;
 	async_mutex_unlock(repo->sub_mutex);
+	metrics_gauge(METRIC_SUBMISSION_WAITERS, -1);
+	return rc;
+}
+uint64_t SLNRepoSubmissionLatest(SLNRepoRef const repo) {
+	assert(repo);
+	async_mutex_lock(repo->sub_mutex);
+	uint64_t const sortID = repo->sub_latest;
+	async_mutex_unlock(repo->sub_mutex);
+	return sortID;
+}
+
+static uint64_t get_stat(KVS_txn *const txn, strarg_t const name) {
+	KVS_val key[1], val[1];
+	SLNStatByNameKeyPack(key, txn, name);
+	int rc = kvs_get(txn, key, val);
+	if(rc < 0) return 0;
+	return SLNStatValUnpack(val, txn);
+}
+static int fill_filter(bloom_filter *const filter, KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	SLNFileByIDRange0(range, txn);
+	rc = kvs_cursor_firstr(cursor, range, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		strarg_t internalHash, type;
+		uint64_t size;
+		SLNFileByIDValUnpack(val, txn, &internalHash, &type, &size);
+		bloom_add(filter, internalHash, strlen(internalHash));
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+cleanup:
+	kvs_cursor_close(cursor); cursor = NULL;
+	return rc;
+}
+int SLNRepoLoadFileFilter(SLNRepoRef const repo) {
+	assert(repo);
+	if(__atomic_load_n(&repo->filter_ready, __ATOMIC_ACQUIRE)) return 0;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc = 0;
+
+	async_mutex_lock(repo->filter_mutex);
+	if(repo->filter_ready) goto cleanup;
+
+	// Scans every file, so it happens in the background.
+	SLNRepoDBOpenUnsafe(repo, SLN_BULK, &db);
+	if(!repo->filter) {
+		rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+		if(rc < 0) goto cleanup;
+		uint64_t const files = get_stat(txn, SLN_STAT_FILES);
+		kvs_txn_abort(txn); txn = NULL;
+
+		// Leave room to grow before it gets less selective.
+		bloom_filter *const filter = bloom_create(files * 2, SLNSeed);
+		if(!filter) rc = UV_ENOMEM;
+		if(rc < 0) goto cleanup;
+		// Publish it first, so that anything stored after the scan
+		// starts is added as it happens. Once published, it's never
+		// freed until the repo is, even if the scan fails.
+		__atomic_store_n(&repo->filter, filter, __ATOMIC_RELEASE);
+
+		// Stores add to the filter from inside their transaction, so
+		// one that was already underway might have found it missing.
+		// Write transactions are serialized, so once we get one, any
+		// of those have finished and our snapshot will include them.
+		rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+		if(rc < 0) goto cleanup;
+		kvs_txn_abort(txn); txn = NULL;
+	}
+
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = fill_filter(repo->filter, txn);
+	if(rc < 0) goto cleanup;
+
+	__atomic_store_n(&repo->filter_ready, true, __ATOMIC_RELEASE);
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	async_mutex_unlock(repo->filter_mutex);
 	return rc;
 }
+void SLNRepoFileFilterAdd(SLNRepoRef const repo, strarg_t const internalHash) {
+	assert(repo);
+	assert(internalHash);
+	bloom_filter *const filter = __atomic_load_n(&repo->filter, __ATOMIC_ACQUIRE);
+	bloom_add(filter, internalHash, strlen(internalHash));
+}
+bool SLNRepoFileFilterMaybe(SLNRepoRef const repo, strarg_t const URI) {
+	assert(repo);
+	if(!__atomic_load_n(&repo->filter_ready, __ATOMIC_ACQUIRE)) return true;
+	// Only internal hashes are in the filter.
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	if(SLNParseURI(URI, algo, hash) < 0) return true;
+	if(0 != strcmp(SLN_INTERNAL_ALGO, algo)) return true;
+	if(SLN_INTERNAL_HASH_LEN != strlen(hash)) return true;
+	return bloom_maybe(repo->filter, hash, strlen(hash));
+}
 
 void SLNRepoPullsStart(SLNRepoRef const repo) {
 	if(!repo) return;
@@ -243,6 +429,445 @@ void SLNRepoPullsStop(SLNRepoRef const repo) {
 	}
 }
 
+static int clear_stats(KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+	KVS_range stats[1], types[1], digests[1], buckets[1];
+	SLNStatByNameRange0(stats, txn);
+	SLNFileCountByTypeRange0(types, txn);
+	SLNDigestByPrefixRange0(digests, txn);
+	SLNBucketAndFileIDRange0(buckets, txn);
+	for(;;) {
+		rc = kvs_cursor_firstr(cursor, stats, NULL, NULL, +1);
+		if(KVS_NOTFOUND == rc) rc = kvs_cursor_firstr(cursor, types, NULL, NULL, +1);
+		if(KVS_NOTFOUND == rc) rc = kvs_cursor_firstr(cursor, digests, NULL, NULL, +1);
+		if(KVS_NOTFOUND == rc) rc = kvs_cursor_firstr(cursor, buckets, NULL, NULL, +1);
+		if(KVS_NOTFOUND == rc) return 0;
+		if(rc < 0) return rc;
+		rc = kvs_cursor_del(cursor, 0);
+		if(rc < 0) return rc;
+	}
+}
+// Repos only have a handful of types, so they're counted in memory
+// instead of updating a row for every file.
+typedef struct {
+	str_t *type;
+	uint64_t count;
+} type_count;
+
+static int count_type(type_count **const types, size_t *const count, strarg_t const type) {
+	for(size_t i = 0; i < *count; i++) {
+		if(0 != strcmp((*types)[i].type, type)) continue;
+		(*types)[i].count++;
+		return 0;
+	}
+	type_count *const x = reallocarray(*types, *count+1, sizeof(**types));
+	if(!x) return UV_ENOMEM;
+	*types = x;
+	x[*count].type = strdup(type);
+	if(!x[*count].type) return UV_ENOMEM;
+	x[*count].count = 1;
+	(*count)++;
+	return 0;
+}
+static int count_files(KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	uint64_t files = 0, bytes = 0;
+	type_count *types = NULL;
+	size_t ntypes = 0;
+	int rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	SLNFileByIDRange0(range, txn);
+	rc = kvs_cursor_firstr(cursor, range, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		strarg_t internalHash, type;
+		uint64_t size;
+		SLNFileByIDValUnpack(val, txn, &internalHash, &type, &size);
+		files++;
+		bytes += size;
+		uint64_t fileID;
+		SLNFileByIDKeyUnpack(key, txn, &fileID);
+		rc = count_type(&types, &ntypes, type);
+		rc = rc < 0 ? rc : SLNDigestAdd(txn, internalHash, fileID);
+		if(rc < 0) goto cleanup;
+	}
+	if(KVS_NOTFOUND != rc) goto cleanup;
+	rc = SLNStatAdd(txn, SLN_STAT_FILES, files);
+	rc = rc < 0 ? rc : SLNStatAdd(txn, SLN_STAT_BYTES, bytes);
+	for(size_t i = 0; i < ntypes; i++) {
+		rc = rc < 0 ? rc : SLNStatAddType(txn, types[i].type, types[i].count);
+	}
+cleanup:
+	kvs_cursor_close(cursor); cursor = NULL;
+	for(size_t i = 0; i < ntypes; i++) FREE(&types[i].type);
+	FREE(&types);
+	return rc;
+}
+static int count_metafiles(KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	uint64_t metafiles = 0;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+
+	KVS_range range[1];
+	SLNMetaFileByIDRange0(range, txn);
+	rc = kvs_cursor_firstr(cursor, range, NULL, NULL, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, NULL, NULL, +1)) {
+		metafiles++;
+	}
+	if(KVS_NOTFOUND != rc) return rc;
+	return SLNStatAdd(txn, SLN_STAT_METAFILES, metafiles);
+}
+static int count_terms(KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	uint64_t terms = 0;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+
+	// Jump from each term directly to the next one, instead of
+	// visiting every file that contains it.
+	KVS_range range[1];
+	KVS_val key[1];
+	SLNTermMetaFileIDAndPositionRange0(range, txn);
+	rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+	while(rc >= 0) {
+		strarg_t token;
+		uint64_t metaFileID, position;
+		SLNTermMetaFileIDAndPositionKeyUnpack(key, txn, &token, &metaFileID, &position);
+		terms++;
+		KVS_range same[1];
+		SLNTermMetaFileIDAndPositionRange1(same, txn, token);
+		*key = *same->max;
+		rc = kvs_cursor_seekr(cursor, range, key, NULL, +1);
+	}
+	if(KVS_NOTFOUND != rc) return rc;
+	return SLNStatAdd(txn, SLN_STAT_TERMS, terms);
+}
+static int count_fields(KVS_txn *const txn) {
+	KVS_cursor *cursor = NULL;
+	uint64_t fields = 0;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) return rc;
+
+	KVS_range range[1];
+	KVS_val key[1];
+	SLNFieldValueAndMetaFileIDRange0(range, txn);
+	rc = kvs_cursor_firstr(cursor, range, key, NULL, +1);
+	while(rc >= 0) {
+		strarg_t field, value;
+		uint64_t metaFileID;
+		SLNFieldValueAndMetaFileIDKeyUnpack(key, txn, &field, &value, &metaFileID);
+		fields++;
+		KVS_range same[1];
+		SLNFieldValueAndMetaFileIDRange1(same, txn, field);
+		*key = *same->max;
+		rc = kvs_cursor_seekr(cursor, range, key, NULL, +1);
+	}
+	if(KVS_NOTFOUND != rc) return rc;
+	return SLNStatAdd(txn, SLN_STAT_FIELDS, fields);
+}
+int SLNRepoRebuildStats(SLNRepoRef const repo) {
+	assert(repo);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc;
+
+	// Scans everything, so this is meant to be run offline.
+	SLNRepoDBOpenUnsafe(repo, SLN_BULK, &db);
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+
+	rc = clear_stats(txn);
+	rc = rc < 0 ? rc : count_files(txn);
+	rc = rc < 0 ? rc : count_metafiles(txn);
+	rc = rc < 0 ? rc : count_terms(txn);
+	rc = rc < 0 ? rc : count_fields(txn);
+	rc = rc < 0 ? rc : SLNStatAdd(txn, SLN_STAT_VERSION, SLN_STATS_VERSION);
+	if(rc < 0) goto cleanup;
+
+	rc = kvs_txn_commit(txn); txn = NULL;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	return rc;
+}
+int SLNRepoCheckStats(SLNRepoRef const repo) {
+	assert(repo);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	uint64_t version = 0;
+	bool empty = false;
+	SLNRepoDBOpenUnsafe(repo, SLN_BULK, &db);
+	int rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	version = get_stat(txn, SLN_STAT_VERSION);
+	if(SLN_STATS_VERSION == version) goto cleanup;
+
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+	KVS_range files[1], metafiles[1];
+	SLNFileByIDRange0(files, txn);
+	SLNMetaFileByIDRange0(metafiles, txn);
+	rc = kvs_cursor_firstr(cursor, files, NULL, NULL, +1);
+	if(KVS_NOTFOUND == rc) rc = kvs_cursor_firstr(cursor, metafiles, NULL, NULL, +1);
+	if(KVS_NOTFOUND == rc) empty = true;
+	if(KVS_NOTFOUND == rc) rc = 0;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	if(rc < 0) return rc;
+	if(SLN_STATS_VERSION == version) return 0;
+	// A new repo has nothing to count.
+	if(empty) return SLNRepoRebuildStats(repo);
+	// Rebuilding scans everything in one transaction, which is too slow
+	// to do on every upgraded server's startup. Until then, stats are
+	// wrong and peers fall back to full listings instead of digests.
+	alogf("Repository statistics are out of date, run with --rebuild-stats\n");
+	return 0;
+}
+
+typedef struct {
+	uint64_t sessionID;
+	uint64_t hintID;
+	str_t metaURI[SLN_URI_MAX];
+	str_t targetURI[SLN_URI_MAX];
+} hint_row;
+
+// Once a target has synced its hints for a session, its hints are never
+// looked at again (see SLNSyncFileAvailable and SLNSyncStoreSubmission).
+static int hint_satisfied(KVS_txn *const txn, hint_row const *const hint) {
+	uint64_t fileID = 0;
+	int rc = SLNURIGetFileID(hint->targetURI, txn, &fileID);
+	if(KVS_NOTFOUND == rc) return 0;
+	if(rc < 0) return rc;
+	KVS_val key[1];
+	SLNSessionIDAndHintsSyncedFileIDKeyPack(key, txn, hint->sessionID, fileID);
+	rc = kvs_get(txn, key, NULL);
+	if(KVS_NOTFOUND == rc) return 0;
+	if(rc < 0) return rc;
+	return 1;
+}
+static int hint_delete(KVS_txn *const txn, hint_row const *const hint) {
+	KVS_val mainkey[1];
+	SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyPack(mainkey, txn, hint->sessionID, hint->hintID);
+	int rc = kvs_del(txn, mainkey, 0);
+	if(rc < 0) return rc;
+
+	// Older versions of add_hint() could leave extra hints for a
+	// meta-file that the index doesn't point to.
+	KVS_val fwdkey[1], fwdval[1];
+	SLNMetaURIAndSessionIDToHintIDKeyPack(fwdkey, txn, hint->metaURI, hint->sessionID);
+	rc = kvs_get(txn, fwdkey, fwdval);
+	if(rc >= 0 && kvs_read_uint64(fwdval) == hint->hintID) {
+		rc = kvs_del(txn, fwdkey, 0);
+	}
+	if(rc < 0 && KVS_NOTFOUND != rc) return rc;
+
+	KVS_val revkey[1];
+	SLNTargetURISessionIDAndHintIDKeyPack(revkey, txn, hint->targetURI, hint->sessionID, hint->hintID);
+	rc = kvs_del(txn, revkey, 0);
+	if(rc < 0 && KVS_NOTFOUND != rc) return rc;
+	return 0;
+}
+ssize_t SLNRepoSweepHints(SLNRepoRef const repo, uint64_t pos[2], size_t const max, uint64_t *const removed) {
+	assert(repo);
+	assert(pos);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	hint_row *rows = NULL;
+	size_t count = 0;
+	ssize_t rc = 0;
+
+	rows = calloc(max, sizeof(*rows));
+	if(!rows) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	SLNRepoDBOpenUnsafe(repo, SLN_BULK, &db);
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+
+	// Read first, since deleting would move the cursor.
+	KVS_cursor *cursor = NULL;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+	KVS_range range[1];
+	KVS_val key[1], val[1];
+	SLNSessionIDAndHintIDToMetaURIAndTargetURIRange0(range, txn);
+	SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyPack(key, txn, pos[0], pos[1]);
+	rc = kvs_cursor_seekr(cursor, range, key, val, +1);
+	for(; rc >= 0 && count < max; rc = kvs_cursor_nextr(cursor, range, key, val, +1)) {
+		hint_row *const row = &rows[count++];
+		strarg_t metaURI, targetURI;
+		SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyUnpack(key, txn, &row->sessionID, &row->hintID);
+		SLNSessionIDAndHintIDToMetaURIAndTargetURIValUnpack(val, txn, &metaURI, &targetURI);
+		strlcpy(row->metaURI, metaURI, sizeof(row->metaURI));
+		strlcpy(row->targetURI, targetURI, sizeof(row->targetURI));
+	}
+	if(rc < 0 && KVS_NOTFOUND != rc) goto cleanup;
+	rc = 0;
+
+	size_t deleted = 0;
+	for(size_t i = 0; i < count; i++) {
+		rc = hint_satisfied(txn, &rows[i]);
+		if(rc < 0) goto cleanup;
+		if(!rc) continue;
+		rc = hint_delete(txn, &rows[i]);
+		if(rc < 0) goto cleanup;
+		deleted++;
+	}
+	if(deleted) {
+		rc = kvs_txn_commit(txn); txn = NULL;
+		if(rc < 0) goto cleanup;
+	}
+
+	if(count) {
+		pos[0] = rows[count-1].sessionID;
+		pos[1] = rows[count-1].hintID+1;
+	}
+	if(removed) *removed += deleted;
+	rc = count;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	FREE(&rows);
+	return rc;
+}
+
+static int copy_db(KVS_txn *const src, KVS_env *const dst, uint64_t *const total) {
+	KVS_cursor *cursor = NULL;
+	KVS_txn *txn = NULL;
+	uint64_t count = 0;
+	int rc = kvs_cursor_open(src, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_val key[1], val[1];
+	rc = kvs_cursor_first(cursor, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_next(cursor, key, val, +1)) {
+		if(!txn) rc = kvs_txn_begin(dst, NULL, KVS_RDWR, &txn);
+		if(rc < 0) goto cleanup;
+		rc = kvs_put(txn, key, val, 0);
+		if(rc < 0) goto cleanup;
+		if(0 == ++count % COMPACT_BATCH) {
+			rc = kvs_txn_commit(txn); txn = NULL;
+			if(rc < 0) goto cleanup;
+		}
+	}
+	if(KVS_NOTFOUND != rc) goto cleanup;
+	rc = txn ? kvs_txn_commit(txn) : 0; txn = NULL;
+	if(rc < 0) goto cleanup;
+	*total = count;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	kvs_cursor_close(cursor); cursor = NULL;
+	return rc;
+}
+static int env_open(strarg_t const path, size_t const size, KVS_env **const out) {
+	KVS_env *env = NULL;
+	size_t mapsize = size;
+	int rc = kvs_env_create(&env);
+	rc = rc < 0 ? rc : kvs_env_set_config(env, KVS_CFG_MAPSIZE, &mapsize);
+	rc = rc < 0 ? rc : kvs_env_open(env, path, 0, 0600);
+	if(rc < 0) {
+		if(env) kvs_env_close(env);
+		return rc;
+	}
+	*out = env;
+	return 0;
+}
+int SLNRepoCompact(SLNRepoRef const repo) {
+	assert(repo);
+	KVS_env *db = NULL;
+	KVS_env *dst = NULL;
+	KVS_txn *txn = NULL;
+	str_t *tmpPath = NULL;
+	str_t *tmpLockPath = NULL;
+	str_t *oldPath = NULL;
+	uint64_t removed = 0;
+	uint64_t records = 0;
+	ssize_t rc = 0;
+
+	// Get rid of anything we don't need before copying.
+	uint64_t pos[2] = { 0, 0 };
+	do rc = SLNRepoSweepHints(repo, pos, COMPACT_BATCH, &removed);
+	while(rc > 0);
+	if(rc < 0) goto cleanup;
+	alogf("Removed %llu satisfied sync hints\n", (unsigned long long)removed);
+
+	// Rewriting every record into a new database leaves out all of the
+	// free pages, which the old one can't give back on its own.
+	tmpPath = aasprintf("%s.compact", repo->DBPath);
+	tmpLockPath = aasprintf("%s.compact-lock", repo->DBPath);
+	oldPath = aasprintf("%s.old", repo->DBPath);
+	if(!tmpPath || !tmpLockPath || !oldPath) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	uv_fs_t req[1];
+	rc = async_fs_stat(tmpPath, req);
+	if(rc >= 0) alogf("Please remove %s first\n", tmpPath);
+	if(rc >= 0) rc = UV_EEXIST;
+	if(UV_ENOENT == rc) rc = async_fs_stat(oldPath, req);
+	if(rc >= 0) alogf("Please remove %s first\n", oldPath);
+	if(rc >= 0) rc = UV_EEXIST;
+	if(UV_ENOENT == rc) rc = 0;
+	if(rc < 0) goto cleanup;
+
+	// Everything in the old map has to fit in the new one. It's
+	// usually opened with MAP_SIZE, unless it grew past it somehow.
+	rc = async_fs_stat(repo->DBPath, req);
+	if(rc < 0) goto cleanup;
+	uint64_t const mapsize = MAX(MAP_SIZE, (uint64_t)req->statbuf.st_size);
+	rc = env_open(tmpPath, mapsize, &dst);
+	if(rc < 0) goto cleanup;
+
+	SLNRepoDBOpenUnsafe(repo, SLN_BULK, &db);
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = copy_db(txn, dst, &records);
+	if(rc < 0) goto cleanup;
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	kvs_env_close(dst); dst = NULL;
+	// The lock file is only meaningful while the database is open,
+	// and nothing will open this path again.
+	rc = async_fs_unlink(tmpLockPath);
+	if(UV_ENOENT == rc) rc = 0;
+	if(rc < 0) goto cleanup;
+
+	// Nothing else uses the database during maintenance, so we can
+	// close it and swap in the copy. The lock file stays, since it
+	// goes with the path rather than the contents.
+	kvs_env_close(repo->db); repo->db = NULL;
+	// Keep the old one until the user has checked the new one.
+	rc = async_fs_rename(repo->DBPath, oldPath);
+	if(rc >= 0) {
+		rc = async_fs_rename(tmpPath, repo->DBPath);
+		if(rc < 0) async_fs_rename(oldPath, repo->DBPath);
+	}
+	int const rc2 = env_open(repo->DBPath, mapsize, &repo->db);
+	if(rc2 < 0) alogf("Database reopen error (%s)\n", sln_strerror(rc2));
+	if(rc >= 0) rc = rc2;
+	if(rc < 0) goto cleanup;
+	alogf("Copied %llu records, old database kept at %s\n",
+		(unsigned long long)records, oldPath);
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNRepoDBClose(repo, SLN_BULK, &db);
+	if(dst) kvs_env_close(dst); dst = NULL;
+	FREE(&tmpPath);
+	FREE(&tmpLockPath);
+	FREE(&oldPath);
+	return rc;
+}
 
 static int create_admin(SLNRepoRef const repo, KVS_txn *const txn) {
 	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
@@ -272,7 +897,7 @@ static int create_admin(SLNRepoRef const repo, KVS_txn *const txn) {
 }
 static int connect_db(SLNRepoRef const repo) {
 	assert(repo);
-	size_t mapsize = 1024 * 1024 * 1024 * 1;
+	size_t mapsize = MAP_SIZE;
 	int rc = kvs_env_create(&repo->db);
 	rc = rc < 0 ? rc : kvs_env_set_config(repo->db, KVS_CFG_MAPSIZE, &mapsize);
 	if(rc < 0) {
@@ -286,11 +911,11 @@ static int connect_db(SLNRepoRef const repo) {
 	}
 
 	KVS_env *db = NULL;
-	SLNRepoDBOpenUnsafe(repo, &db);
+	SLNRepoDBOpenUnsafe(repo, SLN_INTERACTIVE, &db);
 	KVS_txn *txn = NULL;
 	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
 	if(rc < 0) {
-		SLNRepoDBClose(repo, &db);
+		SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 		alogf("Database transaction error (%s)\n", sln_strerror(rc));
 		return rc;
 	}
@@ -298,13 +923,13 @@ static int connect_db(SLNRepoRef const repo) {
 	rc = kvs_schema_verify(txn);
 	if(KVS_VERSION_MISMATCH == rc) {
 		kvs_txn_abort(txn); txn = NULL;
-		SLNRepoDBClose(repo, &db);
+		SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 		alogf("Database incompatible with this software version\n");
 		return rc;
 	}
 	if(rc < 0) {
 		kvs_txn_abort(txn); txn = NULL;
-		SLNRepoDBClose(repo, &db);
+		SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 		alogf("Database schema layer error (%s)\n", sln_strerror(rc));
 		return rc;
 	}
@@ -315,7 +940,7 @@ static int connect_db(SLNRepoRef const repo) {
 	rc = kvs_txn_cursor(txn, &cursor);
 	if(rc < 0) {
 		kvs_txn_abort(txn); txn = NULL;
-		SLNRepoDBClose(repo, &db);
+		SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 		alogf("Database cursor error (%s)\n", sln_strerror(rc));
 		return rc;
 	}
@@ -328,13 +953,13 @@ static int connect_db(SLNRepoRef const repo) {
 	}
 	if(rc < 0) {
 		kvs_txn_abort(txn); txn = NULL;
-		SLNRepoDBClose(repo, &db);
+		SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 		alogf("Database user error (%s)\n", sln_strerror(rc));
 		return rc;
 	}
 
 	rc = kvs_txn_commit(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 	if(rc < 0) {
 		alogf("Database commit error (%s)\n", sln_strerror(rc));
 		return rc;
@@ -362,7 +987,7 @@ static int load_pulls(SLNRepoRef const repo) {
 	SLNPullRef pull = NULL;
 	int rc;
 
-	SLNRepoDBOpenUnsafe(repo, &db);
+	SLNRepoDBOpenUnsafe(repo, SLN_INTERACTIVE, &db);
 	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
 	if(rc < 0) goto cleanup;
 	rc = kvs_cursor_open(txn, &cur);
@@ -384,7 +1009,7 @@ static int load_pulls(SLNRepoRef const repo) {
 		strarg_t cookie;
 		SLNPullByIDValUnpack(pull_val, txn, &userID, &certhash, &host, &path, &query, &cookie);
 
-		rc = SLNPullCreate(repo->session_cache, pullID, certhash, host, path, query, cookie, &pull);
+		rc = SLNPullCreate(repo->session_cache, repo->pull_sched, pullID, certhash, host, path, query, cookie, &pull);
 		if(rc < 0) goto cleanup;
 
 		rc = add_pull(repo, &pull);
@@ -398,14 +1023,14 @@ static int load_pulls(SLNRepoRef const repo) {
 cleanup:
 	kvs_cursor_close(cur); cur = NULL;
 	kvs_txn_abort(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 	SLNPullFree(&pull);
 	return rc;
 }
 static int debug_pulls(SLNRepoRef const repo) {
 	assert(repo);
 	SLNPullRef pull = NULL;
-	int rc = SLNPullCreate(repo->session_cache, 1, NULL, "localhost:7999", "", NULL, NULL, &pull);
+	int rc = SLNPullCreate(repo->session_cache, repo->pull_sched, 1, NULL, "localhost:7999", "", NULL, NULL, &pull);
 	if(rc < 0) return rc;
 	rc = add_pull(repo, &pull);
 	SLNPullFree(&pull);
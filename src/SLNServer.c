@@ -2,13 +2,19 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include <ctype.h>
 #include "common.h"
+#include "util/httplog.h"
+#include "util/metrics.h"
 #include "StrongLink.h"
 #include "async/http/HTTP.h"
 #include "async/http/MultipartForm.h"
 #include "async/http/QueryString.h"
 
 #define QUERY_BATCH_SIZE 50
+#define FILE_BATCH_MAX 64
+#define HAVE_BODY_MAX (1024 * 1024 * 1)
+#define DIGEST_PREFIX_MAX 256
 #define AUTH_FORM_MAX (1023+1)
 
 
@@ -32,7 +38,7 @@
 	str_t *values[numberof(fields)] = {};
 	QSValuesParse(formdata, values, fields, numberof(fields));
 	SLNSessionRef s;
-	int rc = SLNSessionCacheCreateSession(cache, values[0], values[1], &s);
+	int rc = SLNSessionCacheCreateSession(cache, values[0], values[1], NULL, &s);
 	QSValuesCleanup(values, numberof(values));
 
 	if(rc < 0) return 403;
@@ -41,15 +47,66 @@
 	SLNSessionRelease(&s);
 	if(!cookie) return 500;
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
+	httplog_response(conn, 200, "OK");
 	HTTPConnectionWriteSetCookie(conn, cookie, "/", 60 * 60 * 24 * 365);
-	HTTPConnectionWriteContentLength(conn, 0);
+	httplog_content_length(conn, 0);
 	HTTPConnectionBeginBody(conn);
 	HTTPConnectionEnd(conn);
 
 	FREE(&cookie);
 	return 0;
 }*/
+// Only single byte ranges, which is all resuming downloads needs.
+// Returns false to ignore the header and send the whole file.
+static bool parseRange(strarg_t const range, uint64_t const size, uint64_t *const start, uint64_t *const end) {
+	if(!range) return false;
+	if(0 != strncmp(range, "bytes=", 6)) return false;
+	if(strchr(range, ',')) return false;
+	if('-' == range[6]) {
+		unsigned long long suffix = 0;
+		int len = 0;
+		if(1 != sscanf(range+6, "-%llu%n", &suffix, &len)) return false;
+		if('\0' != range[6+len]) return false;
+		*start = size - MIN(suffix, size);
+		*end = size;
+		return true;
+	}
+	if(!isdigit((unsigned char)range[6])) return false;
+	unsigned long long a = 0, b = 0;
+	int len = 0;
+	if(2 == sscanf(range, "bytes=%llu-%llu%n", &a, &b, &len) && '\0' == range[len]) {
+		if(b < a) return false;
+		*start = a;
+		*end = MIN(b+1, size);
+		return true;
+	}
+	len = 0;
+	if(1 == sscanf(range, "bytes=%llu-%n", &a, &len) && len && '\0' == range[len]) {
+		*start = a;
+		*end = size;
+		return true;
+	}
+	return false;
+}
+static int writeFileRange(HTTPConnectionRef const conn, uv_file const file, uint64_t const start, uint64_t const end) {
+	size_t const max = 1024 * 64;
+	byte_t *buf = malloc(max);
+	if(!buf) return UV_ENOMEM;
+	uint64_t pos = start;
+	int rc = 0;
+	while(pos < end) {
+		uv_buf_t parts[] = { uv_buf_init((char *)buf, MIN(max, end - pos)) };
+		ssize_t const len = async_fs_read(file, parts, numberof(parts), pos);
+		if(0 == len) rc = UV_EOF;
+		if(len < 0) rc = len;
+		if(rc < 0) break;
+		rc = HTTPConnectionWrite(conn, buf, len);
+		if(rc < 0) break;
+		pos += len;
+	}
+	FREE(&buf);
+	return rc;
+}
 static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
 	int len = 0;
@@ -97,12 +154,38 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	// TODO: Use Content-Disposition to suggest a filename, for file types
 	// that aren't useful to view inline.
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
-	HTTPConnectionWriteContentLength(conn, info->size);
+	// Files never change, so there's no need to check If-Range.
+	uint64_t start = 0, end = info->size;
+	bool const ranged = parseRange(HTTPHeadersGet(headers, "range"), info->size, &start, &end);
+	if(ranged && start >= end) {
+		str_t unsatisfied[64];
+		snprintf(unsatisfied, sizeof(unsatisfied), "bytes */%llu",
+			(unsigned long long)info->size);
+		httplog_response(conn, 416, "Range Not Satisfiable");
+		HTTPConnectionWriteHeader(conn, "Content-Range", unsatisfied);
+		httplog_content_length(conn, 0);
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		SLNFileInfoCleanup(info);
+		async_fs_close(file);
+		return 0;
+	}
+
+	if(ranged) {
+		str_t contentRange[128];
+		snprintf(contentRange, sizeof(contentRange), "bytes %llu-%llu/%llu",
+			(unsigned long long)start, (unsigned long long)end-1,
+			(unsigned long long)info->size);
+		httplog_response(conn, 206, "Partial Content");
+		HTTPConnectionWriteHeader(conn, "Content-Range", contentRange);
+	} else {
+		httplog_response(conn, 200, "OK");
+	}
+	httplog_content_length(conn, end - start);
 	HTTPConnectionWriteHeader(conn, "Content-Type", info->type);
 	HTTPConnectionWriteHeader(conn, "Cache-Control", "max-age=31536000");
 	HTTPConnectionWriteHeader(conn, "ETag", "1");
-//	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes"); // TODO
+	HTTPConnectionWriteHeader(conn, "Accept-Ranges", "bytes");
 	HTTPConnectionWriteHeader(conn, "Content-Security-Policy", "'none'");
 	HTTPConnectionWriteHeader(conn, "X-Content-Type-Options", "nosniff");
 //	HTTPConnectionWriteHeader(conn, "Vary", "Accept, Accept-Ranges");
@@ -110,7 +193,8 @@ static int GET_file(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 	// Also do we need to change the ETag?
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		HTTPConnectionWriteFile(conn, file);
+		if(ranged) writeFileRange(conn, file, start, end);
+		else HTTPConnectionWriteFile(conn, file);
 	}
 	HTTPConnectionEnd(conn);
 
@@ -150,10 +234,10 @@ static int GET_alts(SLNRepoRef const repo, SLNSessionRef const session, HTTPConn
 }
 
 static void created(strarg_t const URI, HTTPConnectionRef const conn) {
-	HTTPConnectionWriteResponse(conn, 201, "Created");
+	httplog_response(conn, 201, "Created");
 	HTTPConnectionWriteHeader(conn, "X-Location", URI);
 	// TODO: X-Content-Address or something? Or X-Name?
-	HTTPConnectionWriteContentLength(conn, 0);
+	httplog_content_length(conn, 0);
 	HTTPConnectionBeginBody(conn);
 	HTTPConnectionEnd(conn);
 }
@@ -235,7 +319,14 @@ cleanup:
 	return 0;
 }
 
-static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn, HTTPMethod const method) {
+static bool acceptsBinaryURIs(HTTPHeadersRef const headers) {
+	// Only sent by clients that specifically ask for it, so we don't
+	// bother with full content negotiation.
+	strarg_t const accept = HTTPHeadersGet(headers, "accept");
+	if(!accept) return false;
+	return NULL != strstr(accept, SLN_URI_LIST_BINARY_TYPE);
+}
+static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter, strarg_t const qs, bool const meta, HTTPConnectionRef const conn, HTTPMethod const method, HTTPHeadersRef const headers) {
 	SLNFilterPosition pos[1] = {{ .dir = +1 }};
 	uint64_t count = UINT64_MAX;
 	int dir = +1;
@@ -259,16 +350,17 @@ static void sendURIList(SLNSessionRef const session, SLNFilterRef const filter,
 	// cached. It DOES break if a proxy tries to buffer the whole response
 	// before passing it back to the client. I'd be curious to know whether
 	// such proxies still exist in 2015.
-	HTTPConnectionWriteResponse(conn, 200, "OK");
+	bool const binary = acceptsBinaryURIs(headers);
+	httplog_response(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
-	HTTPConnectionWriteHeader(conn,
-		"Content-Type", "text/uri-list; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Content-Type", binary ?
+		SLN_URI_LIST_BINARY_TYPE : "text/uri-list; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
 	HTTPConnectionWriteHeader(conn, "Vary", "*");
 	HTTPConnectionBeginBody(conn);
 
 	if(HTTP_HEAD != method) {
-		int rc = SLNFilterWriteURIs(filter, session, pos, meta, count, wait, (SLNFilterWriteCB)HTTPConnectionWriteChunkv, (SLNFilterFlushCB)HTTPConnectionFlush, conn);
+		int rc = SLNFilterWriteURIs(filter, session, pos, meta, binary, count, wait, (SLNFilterWriteCB)httplog_chunkv, (SLNFilterFlushCB)HTTPConnectionFlush, conn);
 		if(rc < 0) {
 			alogf("Query response error: %s\n", sln_strerror(rc));
 		}
@@ -317,7 +409,7 @@ static int GET_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPCon
 	if(KVS_EACCES == rc) return 403;
 	if(rc < 0) return 500;
 
-	sendURIList(session, filter, qs, false, conn, method);
+	sendURIList(session, filter, qs, false, conn, method, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
@@ -330,7 +422,7 @@ static int POST_query(SLNRepoRef const repo, SLNSessionRef const session, HTTPCo
 	int rc = parseFilter(session, conn, method, headers, &filter);
 	if(KVS_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn, method);
+	sendURIList(session, filter, qs, false, conn, method, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
@@ -343,7 +435,7 @@ static int GET_metafiles(SLNRepoRef const repo, SLNSessionRef const session, HTT
 	int rc = SLNFilterCreate(session, SLNMetaFileFilterType, &filter);
 	if(KVS_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, true, conn, method);
+	sendURIList(session, filter, qs, true, conn, method, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
@@ -356,11 +448,420 @@ static int GET_all(SLNRepoRef const repo, SLNSessionRef const session, HTTPConne
 	int rc = SLNFilterCreate(session, SLNAllFilterType, &filter);
 	if(KVS_EACCES == rc) return 403;
 	if(rc < 0) return 500;
-	sendURIList(session, filter, qs, false, conn, method);
+	sendURIList(session, filter, qs, false, conn, method, headers);
 	SLNFilterFree(&filter);
 	return 0;
 }
 
+// URIs can be separated by any whitespace, or commas in query strings.
+// Lines starting with # are comments, as in text/uri-list.
+static int parseURIList(strarg_t const str, str_t (*const URIs)[SLN_URI_MAX], size_t const max, size_t *const count) {
+	strarg_t const sep = " \t\r\n,";
+	strarg_t pos = str;
+	*count = 0;
+	for(;;) {
+		pos += strspn(pos, sep);
+		if('\0' == pos[0]) return 0;
+		if('#' == pos[0]) {
+			pos += strcspn(pos, "\n");
+			continue;
+		}
+		if(*count >= max) return UV_EMSGSIZE;
+		int len = 0;
+		URIs[*count][0] = '\0';
+		sscanf(pos, SLN_URI_FMT "%n", URIs[*count], &len);
+		if(!len) return UV_EINVAL;
+		pos += len;
+		if('\0' != pos[0] && !strchr(sep, pos[0])) return UV_EINVAL;
+		(*count)++;
+	}
+}
+// Each frame is a header line, "<status> <URI> <size> <type>", followed
+// by exactly <size> bytes and a CRLF. Files we can't send only get the
+// status and URI, so that one missing file doesn't fail the whole batch.
+static int writeBatchFrame(HTTPConnectionRef const conn, strarg_t const URI, SLNFileInfo const *const info, int const result) {
+	uv_file file = -1;
+	int status = 200;
+	if(KVS_NOTFOUND == result) status = 404;
+	else if(result < 0) status = 500;
+	else {
+		file = async_fs_open(info->path, O_RDONLY, 0000);
+		if(UV_ENOENT == file) status = 410; // Gone
+		else if(file < 0) status = 500;
+	}
+
+	str_t head[SLN_URI_MAX+URI_MAX];
+	int len = 200 == status ?
+		snprintf(head, sizeof(head), "%d %s %llu %s\r\n",
+			status, URI, (unsigned long long)info->size, info->type) :
+		snprintf(head, sizeof(head), "%d %s\r\n", status, URI);
+	if(len < 0 || len >= sizeof(head)) {
+		if(file >= 0) async_fs_close(file);
+		return UV_ENAMETOOLONG;
+	}
+
+	int rc;
+	if(file < 0) {
+		uv_buf_t const parts[] = { uv_buf_init(head, len) };
+		return httplog_chunkv(conn, parts, numberof(parts));
+	}
+	// One chunk per file, so the content can be sent straight from disk.
+	rc = httplog_chunk_length(conn, len + info->size + 2);
+	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)head, len);
+	rc = rc < 0 ? rc : HTTPConnectionWriteFile(conn, file);
+	// End of the frame, then end of the chunk.
+	rc = rc < 0 ? rc : HTTPConnectionWrite(conn, (byte_t const *)"\r\n\r\n", 4);
+	async_fs_close(file);
+	return rc;
+}
+static int sendFileBatch(SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, str_t (*const list)[SLN_URI_MAX], size_t const count) {
+	assert(count <= FILE_BATCH_MAX);
+	strarg_t URIs[FILE_BATCH_MAX];
+	SLNFileInfo infos[FILE_BATCH_MAX];
+	int results[FILE_BATCH_MAX];
+	for(size_t i = 0; i < count; i++) URIs[i] = list[i];
+
+	// Look everything up in one transaction before we start writing.
+	int rc = SLNSessionGetFileInfoBatch(session, URIs, infos, results, count);
+	if(KVS_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+
+	httplog_response(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", SLN_BATCH_TYPE);
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionWriteHeader(conn, "X-Content-Type-Options", "nosniff");
+	HTTPConnectionBeginBody(conn);
+	if(HTTP_HEAD != method) {
+		for(size_t i = 0; i < count; i++) {
+			rc = writeBatchFrame(conn, URIs[i], &infos[i], results[i]);
+			if(rc < 0) break;
+		}
+		if(rc < 0) {
+			alogf("Batch response error: %s\n", sln_strerror(rc));
+		} else {
+			HTTPConnectionWriteChunkEnd(conn);
+		}
+	}
+	HTTPConnectionEnd(conn);
+
+	for(size_t i = 0; i < count; i++) SLNFileInfoCleanup(&infos[i]);
+	return 0;
+}
+static int GET_batch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
+	strarg_t qs;
+	if(0 != uripathcmp("/sln/batch", URI, &qs)) return -1;
+
+	str_t (*list)[SLN_URI_MAX] = calloc(FILE_BATCH_MAX, sizeof(*list));
+	if(!list) return 500;
+	static strarg_t const fields[] = { "uris" };
+	str_t *values[numberof(fields)] = {};
+	QSValuesParse(qs, values, fields, numberof(fields));
+	size_t count = 0;
+	int rc = parseURIList(values[0] ? values[0] : "", list, FILE_BATCH_MAX, &count);
+	QSValuesCleanup(values, numberof(values));
+	int status = 0;
+	if(UV_EMSGSIZE == rc) status = 414; // URI Too Long
+	else if(rc < 0) status = 400;
+	else status = sendFileBatch(session, conn, method, list, count);
+	FREE(&list);
+	return status;
+}
+static int POST_batch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_POST != method) return -1;
+	if(0 != uripathcmp("/sln/batch", URI, NULL)) return -1;
+
+	size_t const max = FILE_BATCH_MAX * SLN_URI_MAX;
+	str_t *body = malloc(max);
+	str_t (*list)[SLN_URI_MAX] = calloc(FILE_BATCH_MAX, sizeof(*list));
+	int status = 0;
+	if(!body || !list) status = 500;
+	if(status) goto cleanup;
+
+	ssize_t len = HTTPConnectionReadBodyStatic(conn, (byte_t *)body, max-1);
+	if(UV_EMSGSIZE == len) status = 413; // Request Entity Too Large
+	else if(len < 0) status = 400;
+	if(status) goto cleanup;
+	body[len] = '\0';
+
+	size_t count = 0;
+	int rc = parseURIList(body, list, FILE_BATCH_MAX, &count);
+	if(UV_EMSGSIZE == rc) status = 413;
+	else if(rc < 0) status = 400;
+	else status = sendFileBatch(session, conn, method, list, count);
+
+cleanup:
+	FREE(&body);
+	FREE(&list);
+	return status;
+}
+
+static int POST_have(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_POST != method) return -1;
+	if(0 != uripathcmp("/sln/have", URI, NULL)) return -1;
+
+	str_t *body = malloc(HAVE_BODY_MAX);
+	strarg_t *URIs = NULL;
+	bool *have = NULL;
+	size_t count = 0;
+	int status = 0;
+	if(!body) status = 500;
+	if(status) goto cleanup;
+
+	ssize_t len = HTTPConnectionReadBodyStatic(conn, (byte_t *)body, HAVE_BODY_MAX-1);
+	if(UV_EMSGSIZE == len) status = 413; // Request Entity Too Large
+	else if(len < 0) status = 400;
+	if(status) goto cleanup;
+	body[len] = '\0';
+
+	// Split the list in place. Every URI takes at least two bytes
+	// including its separator, which bounds the count.
+	size_t const max = len/2+1;
+	URIs = reallocarray(NULL, max, sizeof(*URIs));
+	have = reallocarray(NULL, max, sizeof(*have));
+	if(!URIs || !have) status = 500;
+	if(status) goto cleanup;
+	for(str_t *pos = body; ; ) {
+		pos += strspn(pos, " \t\r\n");
+		if('\0' == pos[0]) break;
+		if('#' == pos[0]) { // Comment line.
+			pos += strcspn(pos, "\r\n");
+			continue;
+		}
+		size_t const n = strcspn(pos, " \t\r\n");
+		if(n >= SLN_URI_MAX) status = 400;
+		if(status) goto cleanup;
+		URIs[count++] = pos;
+		pos += n;
+		if('\0' == pos[0]) break;
+		*pos++ = '\0';
+	}
+
+	int rc = SLNSessionHaveFiles(session, URIs, have, count);
+	if(UV_EACCES == rc) status = 403;
+	else if(rc < 0) status = 500;
+	if(status) goto cleanup;
+
+	// Only the ones we have are listed, in the order they were asked.
+	httplog_response(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn,
+		"Content-Type", "text/uri-list; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionBeginBody(conn);
+	str_t buf[1024*8];
+	size_t used = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(!have[i]) continue;
+		size_t const n = strlen(URIs[i]);
+		if(used + n + 2 > sizeof(buf)) {
+			uv_buf_t const parts[] = { uv_buf_init(buf, used) };
+			httplog_chunkv(conn, parts, numberof(parts));
+			used = 0;
+		}
+		memcpy(buf+used, URIs[i], n);
+		memcpy(buf+used+n, "\r\n", 2);
+		used += n+2;
+	}
+	if(used > 0) {
+		uv_buf_t const parts[] = { uv_buf_init(buf, used) };
+		httplog_chunkv(conn, parts, numberof(parts));
+	}
+	HTTPConnectionWriteChunkEnd(conn);
+	HTTPConnectionEnd(conn);
+
+cleanup:
+	FREE(&body);
+	FREE(&URIs);
+	FREE(&have);
+	return status;
+}
+
+// Splits a comma-separated list in place.
+static size_t splitList(str_t *const str, strarg_t *const out, size_t const max) {
+	size_t count = 0;
+	if(!str || '\0' == str[0]) return 0;
+	for(str_t *pos = str; count < max; ) {
+		out[count++] = pos;
+		pos += strcspn(pos, ",");
+		if('\0' == pos[0]) break;
+		*pos++ = '\0';
+	}
+	return count;
+}
+static int GET_digest(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
+	strarg_t qs;
+	if(0 != uripathcmp("/sln/digest", URI, &qs)) return -1;
+
+	static strarg_t const fields[] = { "prefix", "bucket" };
+	str_t *values[numberof(fields)] = {};
+	QSValuesParse(qs, values, fields, numberof(fields));
+	strarg_t prefixes[DIGEST_PREFIX_MAX];
+	strarg_t buckets[DIGEST_PREFIX_MAX];
+	size_t prefixCount = splitList(values[0], prefixes, numberof(prefixes));
+	size_t const bucketCount = splitList(values[1], buckets, numberof(buckets));
+	SLNDigest *digests = NULL;
+	uint64_t files = 0;
+	int status = 0;
+	int rc = 0;
+
+	// With no parameters, start from the top.
+	if(!values[0] && !values[1]) {
+		values[0] = strdup("");
+		if(!values[0]) status = 500;
+		if(status) goto cleanup;
+		prefixes[0] = values[0];
+		prefixCount = 1;
+	}
+
+	if(prefixCount) {
+		digests = reallocarray(NULL, prefixCount, sizeof(*digests) * SLN_DIGEST_CHILDREN);
+		if(!digests) status = 500;
+		if(status) goto cleanup;
+		rc = SLNSessionGetDigests(session, prefixes, digests, prefixCount, &files);
+		if(KVS_EACCES == rc) status = 403;
+		else if(KVS_EINVAL == rc) status = 400;
+		else if(rc < 0) status = 500;
+		if(status) goto cleanup;
+	}
+	// Check buckets up front, so we can still send an error status.
+	for(size_t i = 0; i < bucketCount; i++) {
+		if(SLN_DIGEST_DEPTH != strlen(buckets[i])) status = 400;
+		if(status) goto cleanup;
+	}
+
+	httplog_response(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/plain; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionBeginBody(conn);
+	if(HTTP_HEAD == method) goto done;
+
+	// Peers shouldn't trust our digests unless they're complete, so
+	// say how many files they cover first. Older peers skip comments.
+	if(prefixCount && files) {
+		str_t buf[64];
+		int const len = snprintf(buf, sizeof(buf), "# files %llu\n", (unsigned long long)files);
+		uv_buf_t const parts[] = { uv_buf_init(buf, len) };
+		rc = httplog_chunkv(conn, parts, numberof(parts));
+		if(rc < 0) goto done;
+	}
+
+	// One line per child prefix: "<prefix> <count> <sum>".
+	// Empty ones are left out.
+	for(size_t i = 0; i < prefixCount; i++) {
+		str_t buf[SLN_DIGEST_CHILDREN * 64];
+		size_t len = 0;
+		for(size_t j = 0; j < SLN_DIGEST_CHILDREN; j++) {
+			SLNDigest const *const d = &digests[i*SLN_DIGEST_CHILDREN+j];
+			if(!d->count) continue;
+			len += snprintf(buf+len, sizeof(buf)-len, "%s%x %llu %016llx\n",
+				prefixes[i], (unsigned)j,
+				(unsigned long long)d->count,
+				(unsigned long long)d->sum);
+		}
+		if(!len) continue;
+		uv_buf_t const parts[] = { uv_buf_init(buf, len) };
+		rc = httplog_chunkv(conn, parts, numberof(parts));
+		if(rc < 0) goto done;
+	}
+	// Then every file in each bucket, in /sln/metafiles syntax.
+	for(size_t i = 0; i < bucketCount; i++) {
+		str_t *list = NULL;
+		rc = SLNSessionCopyBucket(session, buckets[i], &list);
+		if(rc < 0) goto done;
+		uv_buf_t const parts[] = { uv_buf_init(list, strlen(list)) };
+		if(parts[0].len) rc = httplog_chunkv(conn, parts, numberof(parts));
+		FREE(&list);
+		if(rc < 0) goto done;
+	}
+	HTTPConnectionWriteChunkEnd(conn);
+
+done:
+	if(rc < 0) alogf("Digest response error: %s\n", sln_strerror(rc));
+	HTTPConnectionEnd(conn);
+cleanup:
+	QSValuesCleanup(values, numberof(values));
+	FREE(&digests);
+	return status;
+}
+
+static int GET_metrics(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
+	if(0 != uripathcmp("/sln/metrics", URI, NULL)) return -1;
+	if(!SLNSessionHasPermission(session, SLN_ROOT)) return 403;
+
+	str_t *report = metrics_format();
+	if(!report) return 500;
+
+	httplog_response(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn,
+		"Content-Type", "text/plain; version=0.0.4");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-store");
+	HTTPConnectionBeginBody(conn);
+	if(HTTP_HEAD != method) {
+		uv_buf_t const parts[] = { uv_buf_init(report, strlen(report)) };
+		httplog_chunkv(conn, parts, numberof(parts));
+		HTTPConnectionWriteChunkEnd(conn);
+	}
+	HTTPConnectionEnd(conn);
+	FREE(&report);
+	return 0;
+}
+
+static int GET_stats(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
+	if(0 != uripathcmp("/sln/stats", URI, NULL)) return -1;
+
+	SLNStats stats[1];
+	int rc = SLNSessionGetStats(session, stats);
+	if(UV_EACCES == rc) return 403;
+	if(rc < 0) return 500;
+
+	httplog_response(conn, 200, "OK");
+	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
+	HTTPConnectionWriteHeader(conn, "Content-Type", "text/plain; charset=utf-8");
+	HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache");
+	HTTPConnectionBeginBody(conn);
+	if(HTTP_HEAD != method) {
+		// One stat per line. Types go last because they can contain spaces.
+		str_t buf[1024*4];
+		int len = snprintf(buf, sizeof(buf),
+			"files %llu\n" "bytes %llu\n" "metafiles %llu\n"
+			"terms %llu\n" "fields %llu\n",
+			(unsigned long long)stats->files,
+			(unsigned long long)stats->bytes,
+			(unsigned long long)stats->metaFiles,
+			(unsigned long long)stats->terms,
+			(unsigned long long)stats->fields);
+		for(size_t i = 0; i < stats->typeCount; i++) {
+			if(len >= sizeof(buf) - URI_MAX) {
+				uv_buf_t const parts[] = { uv_buf_init(buf, len) };
+				httplog_chunkv(conn, parts, numberof(parts));
+				len = 0;
+			}
+			len += snprintf(buf+len, sizeof(buf)-len, "type %llu %s\n",
+				(unsigned long long)stats->types[i].count,
+				stats->types[i].type);
+			if(len >= sizeof(buf)) { // Truncated
+				len = sizeof(buf)-1;
+				buf[len-1] = '\n';
+			}
+		}
+		if(len > 0) {
+			uv_buf_t const parts[] = { uv_buf_init(buf, len) };
+			httplog_chunkv(conn, parts, numberof(parts));
+		}
+		HTTPConnectionWriteChunkEnd(conn);
+	}
+	HTTPConnectionEnd(conn);
+	SLNStatsCleanup(stats);
+	return 0;
+}
+
 
 int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	int rc = -1;
@@ -374,6 +875,12 @@ int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPCo
 	rc = rc >= 0 ? rc : POST_query(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_metafiles(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : GET_all(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_batch(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : POST_batch(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : POST_have(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_digest(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_metrics(repo, session, conn, method, URI, headers);
+	rc = rc >= 0 ? rc : GET_stats(repo, session, conn, method, URI, headers);
 	if(rc >= 0) return rc;
 
 	// We "own" the /sln prefix.
@@ -2,6 +2,7 @@
 // MIT licensed (see LICENSE for details)
 
 #include <openssl/sha.h>
+#include "util/metrics.h"
 #include "util/pass.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
@@ -20,6 +21,7 @@ struct SLNSession {
 	uint64_t userID;
 	SLNMode mode;
 	str_t *username;
+	SLNPriority priority;
 };
 
 int SLNSessionCreateInternal(SLNSessionCacheRef const cache, uint64_t const sessionID, byte_t const *const sessionKeyRaw, byte_t const *const sessionKeyEnc, uint64_t const userID, SLNMode const mode_trusted, strarg_t const username, SLNSessionRef *const out) {
@@ -64,17 +66,29 @@ cleanup:
 	SLNSessionRelease(&session);
 	return rc;
 }
+int SLNSessionCopyWithPriority(SLNSessionRef const session, SLNPriority const priority, SLNSessionRef *const out) {
+	if(!session) return UV_EINVAL;
+	assert(out);
+	// Sessions are shared through the cache, so we make a private copy
+	// rather than changing the priority for everyone.
+	SLNSessionRef copy = NULL;
+	int rc = SLNSessionCreateInternal(session->cache, session->sessionID, session->sessionKeyRaw, session->sessionKeyEnc, session->userID, session->mode, session->username, &copy);
+	if(rc < 0) return rc;
+	copy->priority = priority;
+	*out = copy; copy = NULL;
+	return 0;
+}
 SLNSessionRef SLNSessionRetain(SLNSessionRef const session) {
 	if(!session) return NULL;
 	assert(session->refcount);
-	session->refcount++;
+	__atomic_add_fetch(&session->refcount, 1, __ATOMIC_RELAXED);
 	return session;
 }
 void SLNSessionRelease(SLNSessionRef *const sessionptr) {
 	SLNSessionRef session = *sessionptr;
 	if(!session) return;
 	assert(session->refcount);
-	if(--session->refcount) {
+	if(__atomic_sub_fetch(&session->refcount, 1, __ATOMIC_ACQ_REL)) {
 		*sessionptr = NULL;
 		return;
 	}
@@ -85,6 +99,7 @@ void SLNSessionRelease(SLNSessionRef *const sessionptr) {
 	session->userID = 0;
 	session->mode = 0;
 	FREE(&session->username);
+	session->priority = 0;
 	assert_zeroed(session, 1);
 	FREE(sessionptr); session = NULL;
 }
@@ -101,6 +116,13 @@ uint64_t SLNSessionGetID(SLNSessionRef const session) {
 	if(!session) return 0;
 	return session->sessionID;
 }
+SLNPriority SLNSessionGetPriority(SLNSessionRef const session) {
+	if(!session) return SLN_INTERACTIVE;
+	return session->priority;
+}
+async_pool_t *SLNSessionGetPool(SLNSessionRef const session) {
+	return SLNRepoGetPool(SLNSessionGetRepo(session), SLNSessionGetPriority(session));
+}
 int SLNSessionKeyValid(SLNSessionRef const session, byte_t const *const enc) {
 	if(!session) return UV_EINVAL;
 	if(!enc) return UV_EINVAL;
@@ -135,13 +157,15 @@ str_t *SLNSessionCopyCookie(SLNSessionRef const session) {
 int SLNSessionDBOpen(SLNSessionRef const session, SLNMode const mode, KVS_env **const dbptr) {
 	if(!SLNSessionHasPermission(session, mode)) return KVS_EACCES;
 	assert(session);
-	SLNRepoDBOpenUnsafe(SLNSessionGetRepo(session), dbptr);
+	SLNRepoDBOpenUnsafe(SLNSessionGetRepo(session), session->priority, dbptr);
+	metrics_txn_begin(mode & SLN_WRONLY);
 	return 0;
 }
 void SLNSessionDBClose(SLNSessionRef const session, KVS_env **const dbptr) {
 	assert(dbptr);
 	assert(session || !*dbptr);
-	SLNRepoDBClose(SLNSessionGetRepo(session), dbptr);
+	if(*dbptr) metrics_txn_end();
+	SLNRepoDBClose(SLNSessionGetRepo(session), SLNSessionGetPriority(session), dbptr);
 }
 
 
@@ -167,22 +191,25 @@ int SLNSessionCreateUserInternal(SLNSessionRef const session, KVS_txn *const txn
 
 	uint64_t const userID = kvs_next_id(SLNUserByID, txn);
 	if(!userID) return KVS_EACCES;
-	str_t *passhash = pass_hash(password);
-	if(!passhash) return KVS_ENOMEM;
+	str_t *passhash = NULL;
+	int rc = pass_hash(password, &passhash);
+	if(rc < 0) return rc;
 
 	KVS_val username_key[1], userID_val[1];
 	SLNUserIDByNameKeyPack(username_key, txn, username);
 	SLNUserIDByNameValPack(userID_val, txn, userID);
-	int rc = kvs_put(txn, username_key, userID_val, KVS_NOOVERWRITE);
-	if(rc < 0) return rc;
+	rc = kvs_put(txn, username_key, userID_val, KVS_NOOVERWRITE);
+	if(rc < 0) goto cleanup;
 
 	KVS_val userID_key[1], user_val[1];
 	SLNUserByIDKeyPack(userID_key, txn, userID);
 	SLNUserByIDValPack(user_val, txn, username, passhash, NULL, mode, parent, time);
 	rc = kvs_put(txn, userID_key, user_val, KVS_NOOVERWRITE);
-	if(rc < 0) return rc;
+	if(rc < 0) goto cleanup;
 
-	return 0;
+cleanup:
+	FREE(&passhash);
+	return rc;
 }
 int SLNSessionCreateSession(SLNSessionRef const session, SLNSessionRef *const out) {
 	assert(out);
@@ -235,32 +262,17 @@ cleanup:
 	return rc;
 }
 
-int SLNSessionGetFileInfo(SLNSessionRef const session, strarg_t const URI, SLNFileInfo *const info) {
-	KVS_env *db = NULL;
-	KVS_txn *txn = NULL;
-	KVS_cursor *cursor = NULL;
-	int rc;
-
-	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
-	if(rc < 0) goto cleanup;
-	rc = kvs_txn_cursor(txn, &cursor);
-	if(rc < 0) goto cleanup;
-
+static int get_file_info(SLNSessionRef const session, KVS_txn *const txn, strarg_t const URI, SLNFileInfo *const info) {
 	uint64_t fileID = 0;
 	KVS_val file_val[1];
-	rc = SLNURIGetFileID(URI, txn, &fileID);
-	if(rc < 0) goto cleanup;
-	if(!info) {
-		rc = 0;
-		goto cleanup;
-	}
+	int rc = SLNURIGetFileID(URI, txn, &fileID);
+	if(rc < 0) return rc;
+	if(!info) return 0;
 
 	KVS_val fileID_key[1];
 	SLNFileByIDKeyPack(fileID_key, txn, fileID);
 	rc = kvs_get(txn, fileID_key, file_val);
-	if(rc < 0) goto cleanup;
+	if(rc < 0) return rc;
 	strarg_t const internalHash = kvs_read_string(file_val, txn);
 	strarg_t const type = kvs_read_string(file_val, txn);
 	uint64_t const size = kvs_read_uint64(file_val);
@@ -273,16 +285,249 @@ int SLNSessionGetFileInfo(SLNSessionRef const session, strarg_t const URI, SLNFi
 	info->size = size;
 	if(!info->hash || !info->path || !info->type) {
 		SLNFileInfoCleanup(info);
-		rc = KVS_ENOMEM;
-		goto cleanup;
+		return KVS_ENOMEM;
 	}
+	return 0;
+}
+int SLNSessionGetFileInfo(SLNSessionRef const session, strarg_t const URI, SLNFileInfo *const info) {
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc;
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	rc = get_file_info(session, txn, URI, info);
 
 cleanup:
-	cursor = NULL; // txn-cursor doesn't need to be closed.
 	kvs_txn_abort(txn); txn = NULL;
 	SLNSessionDBClose(session, &db);
 	return rc;
 }
+int SLNSessionGetFileInfoBatch(SLNSessionRef const session, strarg_t const *const URIs, SLNFileInfo *const infos, int *const results, size_t const count) {
+	assert(URIs || 0 == count);
+	assert(infos || 0 == count);
+	assert(results || 0 == count);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc;
+
+	// Zero everything first so the caller can always clean up.
+	if(count) memset(infos, 0, sizeof(*infos) * count);
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	// One transaction for the whole list. Missing files are
+	// reported individually rather than failing the batch.
+	for(size_t i = 0; i < count; i++) {
+		results[i] = get_file_info(session, txn, URIs[i], &infos[i]);
+		if(KVS_ENOMEM == results[i]) rc = KVS_ENOMEM;
+		if(rc < 0) goto cleanup;
+	}
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	if(rc < 0) {
+		for(size_t i = 0; i < count; i++) SLNFileInfoCleanup(&infos[i]);
+	}
+	return rc;
+}
+typedef struct {
+	strarg_t URI;
+	size_t i;
+} have_entry;
+static int have_entry_cmp(void const *const a, void const *const b) {
+	return strcmp(((have_entry const *)a)->URI, ((have_entry const *)b)->URI);
+}
+int SLNSessionHaveFiles(SLNSessionRef const session, strarg_t const *const URIs, bool *const have, size_t const count) {
+	assert(URIs || 0 == count);
+	assert(have || 0 == count);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return UV_EACCES;
+	SLNRepoRef const repo = SLNSessionGetRepo(session);
+	have_entry *entries = NULL;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	size_t n = 0;
+	int rc = 0;
+
+	if(!count) goto cleanup;
+	entries = reallocarray(NULL, count, sizeof(*entries));
+	if(!entries) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	// Definite misses don't need the database at all.
+	for(size_t i = 0; i < count; i++) {
+		have[i] = false;
+		if(!URIs[i]) continue;
+		if(!SLNRepoFileFilterMaybe(repo, URIs[i])) continue;
+		entries[n++] = (have_entry){ URIs[i], i };
+	}
+	if(!n) goto cleanup;
+
+	// Look up the rest in order, so that each seek lands
+	// close to the last one instead of all over the table.
+	qsort(entries, n, sizeof(*entries), have_entry_cmp);
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	for(size_t j = 0; j < n; j++) {
+		KVS_range files[1];
+		SLNURIAndFileIDRange1(files, txn, entries[j].URI);
+		rc = kvs_cursor_firstr(cursor, files, NULL, NULL, +1);
+		if(KVS_NOTFOUND == rc) continue;
+		if(rc < 0) goto cleanup;
+		have[entries[j].i] = true;
+	}
+	rc = 0;
+
+cleanup:
+	kvs_cursor_close(cursor); cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	FREE(&entries);
+	return rc;
+}
+int SLNSessionGetDigests(SLNSessionRef const session, strarg_t const *const prefixes, SLNDigest *const out, size_t const count, uint64_t *const files) {
+	assert(prefixes || 0 == count);
+	assert(out || 0 == count);
+	assert(files);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc;
+
+	for(size_t i = 0; i < count; i++) {
+		size_t const len = strlen(prefixes[i]);
+		if(len >= SLN_DIGEST_DEPTH) return KVS_EINVAL;
+		if(UINT64_MAX == SLNHexPrefix(prefixes[i], len)) return KVS_EINVAL;
+	}
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	// Digests are only complete once the stats have been rebuilt.
+	*files = 0;
+	KVS_val statkey[1], statval[1];
+	SLNStatByNameKeyPack(statkey, txn, SLN_STAT_VERSION);
+	rc = kvs_get(txn, statkey, statval);
+	if(rc >= 0 && SLN_STATS_VERSION == SLNStatValUnpack(statval, txn)) {
+		SLNStatByNameKeyPack(statkey, txn, SLN_STAT_FILES);
+		rc = kvs_get(txn, statkey, statval);
+		if(rc >= 0) *files = SLNStatValUnpack(statval, txn);
+	}
+	if(rc < 0 && KVS_NOTFOUND != rc) goto cleanup;
+
+	// Fills in the children of each prefix, which are one digit longer.
+	for(size_t i = 0; i < count; i++) {
+		size_t const len = strlen(prefixes[i]);
+		uint64_t const prefix = SLNHexPrefix(prefixes[i], len);
+		for(uint64_t j = 0; j < SLN_DIGEST_CHILDREN; j++) {
+			SLNDigest *const digest = &out[i*SLN_DIGEST_CHILDREN+j];
+			KVS_val key[1], val[1];
+			SLNDigestByPrefixKeyPack(key, txn, len+1, prefix*SLN_DIGEST_CHILDREN+j);
+			rc = kvs_get(txn, key, val);
+			if(KVS_NOTFOUND == rc) {
+				digest->count = 0;
+				digest->sum = 0;
+				continue;
+			}
+			if(rc < 0) goto cleanup;
+			SLNDigestValUnpack(val, txn, &digest->count, &digest->sum);
+		}
+	}
+	rc = 0;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	return rc;
+}
+int SLNSessionCopyBucket(SLNSessionRef const session, strarg_t const bucket, str_t **const out) {
+	assert(out);
+	if(!bucket) return KVS_EINVAL;
+	if(SLN_DIGEST_DEPTH != strlen(bucket)) return KVS_EINVAL;
+	uint64_t const b = SLNHexPrefix(bucket, SLN_DIGEST_DEPTH);
+	if(UINT64_MAX == b) return KVS_EINVAL;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	str_t *list = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	int rc;
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	// Same syntax as /sln/metafiles, except that plain files are
+	// listed without a target.
+	KVS_range files[1];
+	KVS_val key[1];
+	SLNBucketAndFileIDRange1(files, txn, b);
+	rc = kvs_cursor_firstr(cursor, files, key, NULL, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, files, key, NULL, +1)) {
+		uint64_t x, fileID;
+		SLNBucketAndFileIDKeyUnpack(key, txn, &x, &fileID);
+
+		KVS_val file_key[1], file_val[1];
+		SLNFileByIDKeyPack(file_key, txn, fileID);
+		rc = kvs_get(txn, file_key, file_val);
+		if(rc < 0) goto cleanup;
+		strarg_t internalHash, type;
+		uint64_t size_ignored;
+		SLNFileByIDValUnpack(file_val, txn, &internalHash, &type, &size_ignored);
+
+		strarg_t targetURI = NULL;
+		KVS_val meta_key[1], meta_val[1];
+		SLNMetaFileByIDKeyPack(meta_key, txn, fileID);
+		rc = kvs_get(txn, meta_key, meta_val);
+		if(rc >= 0) SLNMetaFileByIDValUnpack(meta_val, txn, &targetURI);
+		else if(KVS_NOTFOUND != rc) goto cleanup;
+
+		size_t const max = strlen(internalHash) + (targetURI ? strlen(targetURI) : 0) + 32;
+		if(len + max > size) {
+			size = MAX(size*2, len + max);
+			str_t *tmp = realloc(list, size);
+			if(!tmp) rc = KVS_ENOMEM;
+			if(rc < 0) goto cleanup;
+			list = tmp;
+		}
+		len += snprintf(list+len, size-len,
+			targetURI ? "hash://%s/%s -> %s\n" : "hash://%s/%s\n",
+			SLN_INTERNAL_ALGO, internalHash, targetURI);
+	}
+	if(KVS_NOTFOUND != rc) goto cleanup;
+	rc = 0;
+
+	if(!list) list = calloc(1, 1);
+	if(!list) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+	*out = list; list = NULL;
+
+cleanup:
+	kvs_cursor_close(cursor); cursor = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	FREE(&list);
+	return rc;
+}
 void SLNFileInfoCleanup(SLNFileInfo *const info) {
 	if(!info) return;
 	FREE(&info->hash);
@@ -292,6 +537,81 @@ void SLNFileInfoCleanup(SLNFileInfo *const info) {
 	assert_zeroed(info, 1);
 }
 
+int SLNSessionGetStats(SLNSessionRef const session, SLNStats *const stats) {
+	assert(stats);
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return UV_EACCES;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *cursor = NULL;
+	int rc;
+
+	// Clear padding for later assert_zeroed.
+	memset(stats, 0, sizeof(*stats));
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_cursor(txn, &cursor);
+	if(rc < 0) goto cleanup;
+
+	KVS_range names[1];
+	KVS_val key[1], val[1];
+	SLNStatByNameRange0(names, txn);
+	rc = kvs_cursor_firstr(cursor, names, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, names, key, val, +1)) {
+		strarg_t name;
+		SLNStatByNameKeyUnpack(key, txn, &name);
+		uint64_t const count = SLNStatValUnpack(val, txn);
+		if(0 == strcmp(SLN_STAT_FILES, name)) stats->files = count;
+		else if(0 == strcmp(SLN_STAT_BYTES, name)) stats->bytes = count;
+		else if(0 == strcmp(SLN_STAT_METAFILES, name)) stats->metaFiles = count;
+		else if(0 == strcmp(SLN_STAT_TERMS, name)) stats->terms = count;
+		else if(0 == strcmp(SLN_STAT_FIELDS, name)) stats->fields = count;
+	}
+	if(KVS_NOTFOUND != rc) goto cleanup;
+
+	size_t size = 0;
+	KVS_range types[1];
+	SLNFileCountByTypeRange0(types, txn);
+	rc = kvs_cursor_firstr(cursor, types, key, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, types, key, val, +1)) {
+		if(stats->typeCount+1 > size) {
+			size = (stats->typeCount+1) * 2;
+			SLNTypeCount *x = reallocarray(stats->types, size, sizeof(SLNTypeCount));
+			if(!x) rc = KVS_ENOMEM;
+			if(rc < 0) goto cleanup;
+			stats->types = x; x = NULL;
+		}
+		strarg_t type;
+		SLNFileCountByTypeKeyUnpack(key, txn, &type);
+		SLNTypeCount *const x = &stats->types[stats->typeCount];
+		x->type = strdup(type);
+		x->count = SLNStatValUnpack(val, txn);
+		if(!x->type) rc = KVS_ENOMEM;
+		if(rc < 0) goto cleanup;
+		stats->typeCount++;
+	}
+	if(KVS_NOTFOUND != rc) goto cleanup;
+	rc = 0;
+
+cleanup:
+	cursor = NULL; // txn-cursor doesn't need to be closed.
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	if(rc < 0) SLNStatsCleanup(stats);
+	return rc;
+}
+void SLNStatsCleanup(SLNStats *const stats) {
+	if(!stats) return;
+	for(size_t i = 0; i < stats->typeCount; i++) {
+		FREE(&stats->types[i].type);
+		stats->types[i].count = 0;
+	}
+	FREE(&stats->types);
+	memset(stats, 0, sizeof(*stats));
+}
+
 int SLNSessionGetValueForField(SLNSessionRef const session, KVS_txn *const txn, strarg_t const fileURI, strarg_t const field, str_t *out, size_t const max) {
 	int rc = 0;
 	KVS_cursor *metafiles = NULL;
@@ -334,4 +654,82 @@ done:
 	kvs_cursor_close(metafiles); metafiles = NULL;
 	return rc;
 }
+static ssize_t field_index(strarg_t const *const fields, size_t const count, strarg_t const field) {
+	for(size_t i = 0; i < count; i++) {
+		if(0 == strcmp(fields[i], field)) return i;
+	}
+	return -1;
+}
+int SLNSessionCopyValuesForFields(SLNSessionRef const session, strarg_t const fileURI, strarg_t const *const fields, str_t **const values, size_t const count, SLNFileInfo *const info) {
+	assert(fields || 0 == count);
+	assert(values || 0 == count);
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	KVS_cursor *metafiles = NULL;
+	KVS_cursor *pairs = NULL;
+	size_t remaining = count;
+	int rc;
+
+	if(count) memset(values, 0, sizeof(*values) * count);
+	if(info) memset(info, 0, sizeof(*info));
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	if(info) {
+		rc = get_file_info(session, txn, fileURI, info);
+		if(rc < 0) goto cleanup;
+	}
+
+	rc = kvs_cursor_open(txn, &metafiles);
+	if(rc < 0) goto cleanup;
+	rc = kvs_cursor_open(txn, &pairs);
+	if(rc < 0) goto cleanup;
+
+	// Same order as SLNSessionGetValueForField, so each field gets
+	// the same value: the first non-empty one from the oldest
+	// meta-file that has any.
+	KVS_range metaFileIDs[1];
+	SLNTargetURIAndMetaFileIDRange1(metaFileIDs, txn, fileURI);
+	KVS_val metaFileID_key[1];
+	rc = kvs_cursor_firstr(metafiles, metaFileIDs, metaFileID_key, NULL, +1);
+	for(; rc >= 0 && remaining; rc = kvs_cursor_nextr(metafiles, metaFileIDs, metaFileID_key, NULL, +1)) {
+		strarg_t u;
+		uint64_t metaFileID;
+		SLNTargetURIAndMetaFileIDKeyUnpack(metaFileID_key, txn, &u, &metaFileID);
+		assert(0 == strcmp(fileURI, u));
+		KVS_range prange[1];
+		SLNMetaFileIDFieldAndValueRange1(prange, txn, metaFileID);
+		KVS_val pair_key[1];
+		rc = kvs_cursor_firstr(pairs, prange, pair_key, NULL, +1);
+		for(; rc >= 0 && remaining; rc = kvs_cursor_nextr(pairs, prange, pair_key, NULL, +1)) {
+			uint64_t m;
+			strarg_t f, v;
+			SLNMetaFileIDFieldAndValueKeyUnpack(pair_key, txn, &m, &f, &v);
+			assert(metaFileID == m);
+			if(!v || '\0' == v[0]) continue;
+			ssize_t const i = field_index(fields, count, f);
+			if(i < 0 || values[i]) continue;
+			values[i] = strdup(v);
+			if(!values[i]) rc = KVS_ENOMEM;
+			if(rc < 0) goto cleanup;
+			remaining--;
+		}
+		if(rc < 0 && KVS_NOTFOUND != rc) goto cleanup;
+	}
+	if(KVS_NOTFOUND == rc) rc = 0;
+
+cleanup:
+	kvs_cursor_close(pairs); pairs = NULL;
+	kvs_cursor_close(metafiles); metafiles = NULL;
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+	if(rc < 0) {
+		for(size_t i = 0; i < count; i++) FREE(&values[i]);
+		if(info) SLNFileInfoCleanup(info);
+	}
+	return rc;
+}
 
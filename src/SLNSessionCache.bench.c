@@ -0,0 +1,134 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Per-request auth overhead in SLNSessionCacheCopyActiveSession. A
+// cookie that already checked out only needs its MAC compared, while
+// one that doesn't match has its key hashed with SHA-256 every time,
+// like every request used to. Requests without a cookie are the floor.
+// Usage: make bench (or build/bench/SLNSessionCache.bench)
+
+#include "StrongLink.h"
+
+#define ITERATIONS (1000 * 1000)
+
+#define USERNAME "bench"
+#define PASSWORD "bench"
+
+static str_t dir[] = "/tmp/sln-session-bench-XXXXXX";
+static int status = 0;
+
+static int create_repo(SLNRepoRef *const out, SLNSessionRef *const sessionptr) {
+	str_t *path = aasprintf("%s/repo", dir);
+	SLNRepoRef repo = NULL;
+	SLNSessionRef root = NULL;
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	int rc = path ? 0 : UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = async_fs_mkdir(path, 0700);
+	if(rc < 0) goto cleanup;
+	rc = SLNRepoCreate(path, "bench", &repo);
+	if(rc < 0) goto cleanup;
+
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
+	rc = SLNSessionCreateInternal(cache, 0, NULL, NULL, 0, SLN_ROOT, NULL, &root);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionDBOpen(root, SLN_RDWR, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNSessionCreateUserInternal(root, txn, USERNAME, PASSWORD, SLN_ROOT);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_commit(txn); txn = NULL;
+	if(rc < 0) goto cleanup;
+	SLNSessionDBClose(root, &db);
+
+	rc = SLNSessionCacheCreateSession(cache, USERNAME, PASSWORD, NULL, sessionptr);
+	if(rc < 0) goto cleanup;
+
+	*out = repo; repo = NULL;
+
+cleanup:
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(root, &db);
+	SLNSessionRelease(&root);
+	SLNRepoFree(&repo);
+	FREE(&path);
+	return rc;
+}
+
+static int run(strarg_t const name, SLNSessionCacheRef const cache, strarg_t const cookie, uint64_t const expected) {
+	// Once to warm up, which also verifies a good cookie.
+	SLNSessionRef session = NULL;
+	int rc = SLNSessionCacheCopyActiveSession(cache, cookie, &session);
+	if(rc < 0) return rc;
+	if(expected != SLNSessionGetUserID(session)) rc = UV_EINVAL;
+	SLNSessionRelease(&session);
+	if(rc < 0) return rc;
+
+	uint64_t const start = uv_hrtime();
+	for(size_t i = 0; i < ITERATIONS; i++) {
+		rc = SLNSessionCacheCopyActiveSession(cache, cookie, &session);
+		SLNSessionRelease(&session);
+		if(rc < 0) return rc;
+	}
+	uint64_t const elapsed = uv_hrtime() - start;
+	fprintf(stderr, "%-12s %8.1f ns/request, %9.0f requests/s\n", name,
+		(double)elapsed / ITERATIONS, ITERATIONS / (elapsed / 1e9));
+	return 0;
+}
+
+static void bench(void *const unused) {
+	SLNRepoRef repo = NULL;
+	SLNSessionRef session = NULL;
+	str_t *cookie = NULL;
+	str_t *forged = NULL;
+	int rc;
+
+	rc = async_random((byte_t *)&SLNSeed, sizeof(SLNSeed));
+	if(rc < 0) goto cleanup;
+	if(!mkdtemp(dir)) rc = -errno;
+	if(rc < 0) goto cleanup;
+
+	rc = create_repo(&repo, &session);
+	if(rc < 0) goto cleanup;
+	cookie = SLNSessionCopyCookie(session);
+	if(!cookie) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	// Same session, wrong key, so it's never verified.
+	forged = strdup(cookie);
+	if(!forged) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	size_t const last = strlen(forged)-1;
+	forged[last] = '0' == forged[last] ? '1' : '0';
+
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(repo);
+	uint64_t const userID = SLNSessionGetUserID(session);
+	rc = rc < 0 ? rc : run("no cookie", cache, NULL, 0);
+	rc = rc < 0 ? rc : run("verified", cache, cookie, userID);
+	rc = rc < 0 ? rc : run("unverified", cache, forged, 0);
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Session cache benchmark failed: %s\n", sln_strerror(rc));
+	status = rc;
+	SLNSessionRelease(&session);
+	SLNRepoFree(&repo);
+	FREE(&cookie);
+	FREE(&forged);
+	str_t cmd[63+1];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if('X' != dir[strlen(dir)-1]) system(cmd);
+	uv_stop(async_loop);
+}
+
+int main(int const argc, char const *const *const argv) {
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, bench, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	return status < 0 ? 1 : 0;
+}
@@ -4,36 +4,59 @@
 #include <assert.h>
 #include <openssl/sha.h>
 #include "../deps/smhasher/MurmurHash3.h"
+#include "util/metrics.h"
 #include "util/pass.h"
+#include "util/siphash.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
 
-#define SEARCH_DIST 16
-
-#define EXPIRE_TIMEOUT (1000 * 60 * 4)
+// Cached sessions are dropped after sitting unused for IDLE_TIMEOUT,
+// and reloaded from the database after LIFETIME regardless, so that
+// changes to users (like permissions) eventually take effect.
+#define IDLE_TIMEOUT (1000 * 60 * 15)
+#define LIFETIME (1000 * 60 * 60)
 #define SWEEP_DELAY (1000 * 60 * 1)
 
 uint32_t SLNSeed = 0;
 
+typedef struct {
+	uint64_t id;
+	SLNSessionRef session;
+	uint64_t loaded;
+	uint64_t used;
+	bool ref; // Used since the clock hand last passed
+	uint64_t tag; // MAC of the last cookie key that checked out
+	bool tagged;
+} entry;
+
+// Entries are kept packed at the front of the array, with an open
+// addressing index (twice as big) from session IDs into it. Eviction
+// uses the CLOCK algorithm. If every entry has been used since the hand
+// last went around, the working set doesn't fit and we grow instead.
+// Only held briefly and never across a yield, so it's a plain mutex
+// and the cache can be shared between threads.
 struct SLNSessionCache {
 	SLNRepoRef repo;
 	SLNSessionRef public;
 
-	async_mutex_t lock[1];
-	uint16_t size;
-	uint16_t pos;
-	uint64_t *ids;
-	SLNSessionRef *sessions;
+	uv_mutex_t lock[1];
+	size_t size;
+	size_t max;
+	size_t count;
+	size_t hand;
+	entry *entries;
+	size_t *index; // Entry position+1, or 0 for empty
 	uv_timer_t timer[1];
-	uint64_t *timeouts;
-	uint16_t *active;
+	// Random per process, so tags are useless anywhere else.
+	byte_t mackey[SIPHASH_KEY_LEN];
 };
 
+static void sweep(uv_timer_t *const timer);
 
-
-int SLNSessionCacheCreate(SLNRepoRef const repo, uint16_t const size, SLNSessionCacheRef *const out) {
+int SLNSessionCacheCreate(SLNRepoRef const repo, size_t const size, size_t const max, SLNSessionCacheRef *const out) {
 	if(!repo) return UV_EINVAL;
 	if(size < 10) return UV_EINVAL;
+	if(max < size) return UV_EINVAL;
 	SLNSessionCacheRef cache = calloc(1, sizeof(struct SLNSessionCache));
 	if(!cache) return UV_ENOMEM;
 	int rc = 0;
@@ -46,20 +69,24 @@ int SLNSessionCacheCreate(SLNRepoRef const repo, uint16_t const size, SLNSession
 		if(rc < 0) goto cleanup;
 	}
 
-	async_mutex_init(cache->lock, 0);
+	rc = async_random(cache->mackey, sizeof(cache->mackey));
+	if(rc < 0) goto cleanup;
+
+	rc = uv_mutex_init(cache->lock);
+	if(rc < 0) goto cleanup;
 	cache->size = size;
-	cache->ids = calloc(size, sizeof(uint64_t));
-	cache->sessions = calloc(size, sizeof(*cache->sessions));
-	if(!cache->ids || !cache->sessions) rc = UV_ENOMEM;
+	cache->max = max;
+	cache->count = 0;
+	cache->hand = 0;
+	cache->entries = calloc(size, sizeof(*cache->entries));
+	cache->index = calloc(size*2, sizeof(*cache->index));
+	if(!cache->entries || !cache->index) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
 
 	cache->timer->data = cache;
 	uv_timer_init(async_loop, cache->timer);
-	cache->timeouts = calloc(size, sizeof(*cache->timeouts));
-	cache->active = calloc(size, sizeof(*cache->active));
-	cache->pos = 0;
-	if(!cache->timeouts || !cache->active) rc = UV_ENOMEM;
-	if(rc < 0) goto cleanup;
+	uv_timer_start(cache->timer, sweep, SWEEP_DELAY, SWEEP_DELAY);
+	uv_unref((uv_handle_t *)cache->timer);
 
 	*out = cache; cache = NULL;
 cleanup:
@@ -73,19 +100,30 @@ void SLNSessionCacheFree(SLNSessionCacheRef *const cacheptr) {
 	cache->repo = NULL;
 	SLNSessionRelease(&cache->public);
 
-	async_mutex_destroy(cache->lock);
-	FREE(&cache->ids);
-	for(uint16_t i = 0; i < cache->size; i++) {
-		SLNSessionRelease(&cache->sessions[i]);
+	if(cache->timer->data) {
+		uv_timer_stop(cache->timer);
+		async_close((uv_handle_t *)cache->timer);
+		cache->timer->data = NULL;
 	}
-	assert_zeroed(cache->sessions, cache->size);
-	FREE(&cache->sessions);
+	if(cache->size) uv_mutex_destroy(cache->lock);
+	memset(cache->lock, 0, sizeof(cache->lock));
+	for(size_t i = 0; i < cache->count; i++) {
+		SLNSessionRelease(&cache->entries[i].session);
+		cache->entries[i].id = 0;
+		cache->entries[i].loaded = 0;
+		cache->entries[i].used = 0;
+		cache->entries[i].ref = false;
+		cache->entries[i].tag = 0;
+		cache->entries[i].tagged = false;
+	}
+	assert_zeroed(cache->entries, cache->size);
+	FREE(&cache->entries);
+	FREE(&cache->index);
 	cache->size = 0;
-
-	async_close((uv_handle_t *)cache->timer);
-	FREE(&cache->timeouts);
-	FREE(&cache->active);
-	cache->pos = 0;
+	cache->max = 0;
+	cache->count = 0;
+	cache->hand = 0;
+	memset(cache->mackey, 0, sizeof(cache->mackey));
 
 	assert_zeroed(cache, 1);
 	FREE(cacheptr); cache = NULL;
@@ -96,31 +134,137 @@ SLNRepoRef SLNSessionCacheGetRepo(SLNSessionCacheRef const cache) {
 	return cache->repo;
 }
 
-static uint16_t session_pos(SLNSessionCacheRef const cache, uint64_t const sessionID) {
+static uint64_t now_ms(void) {
+	// uv_now() belongs to one loop, so it isn't safe across threads.
+	return uv_hrtime() / 1000000;
+}
+static size_t index_pos(SLNSessionCacheRef const cache, uint64_t const sessionID) {
 	uint32_t hash;
 	MurmurHash3_x86_32(&sessionID, sizeof(sessionID), SLNSeed, &hash);
-	return hash % cache->size;
+	return hash % (cache->size*2);
+}
+static size_t *index_find(SLNSessionCacheRef const cache, uint64_t const sessionID) {
+	// Returns the slot for the session, or the empty slot where it goes.
+	// The index is never more than half full, so there's always one.
+	size_t const n = cache->size*2;
+	for(size_t i = index_pos(cache, sessionID);; i = (i+1) % n) {
+		size_t *const x = &cache->index[i];
+		if(!*x) return x;
+		if(sessionID == cache->entries[*x-1].id) return x;
+	}
 }
+static void index_remove(SLNSessionCacheRef const cache, size_t *const x) {
+	// Backward shift deletion, so that lookups never need tombstones.
+	size_t const n = cache->size*2;
+	size_t i = x - cache->index;
+	for(size_t j = (i+1) % n; cache->index[j]; j = (j+1) % n) {
+		size_t const k = index_pos(cache, cache->entries[cache->index[j]-1].id);
+		// Leave it if its home is cyclically in (i, j].
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+		cache->index[i] = cache->index[j];
+		i = j;
+	}
+	cache->index[i] = 0;
+}
+static void entry_remove(SLNSessionCacheRef const cache, size_t const i) {
+	assert(i < cache->count);
+	index_remove(cache, index_find(cache, cache->entries[i].id));
+	SLNSessionRelease(&cache->entries[i].session);
+	// Keep the array packed by moving the last entry into the hole.
+	size_t const last = --cache->count;
+	if(i != last) {
+		cache->entries[i] = cache->entries[last];
+		*index_find(cache, cache->entries[i].id) = i+1;
+	}
+	memset(&cache->entries[last], 0, sizeof(cache->entries[last]));
+	if(cache->hand >= cache->count) cache->hand = 0;
+	metrics_gauge(METRIC_SESSION_CACHED, -1);
+}
+static bool entry_expired(entry const *const e, uint64_t const now) {
+	if(now - e->loaded >= LIFETIME) return true;
+	if(now - e->used >= IDLE_TIMEOUT) return true;
+	return false;
+}
+static int resize(SLNSessionCacheRef const cache, size_t const size) {
+	assert(size >= cache->count);
+	entry *entries = calloc(size, sizeof(*entries));
+	size_t *index = calloc(size*2, sizeof(*index));
+	if(!entries || !index) {
+		FREE(&entries);
+		FREE(&index);
+		return UV_ENOMEM;
+	}
+	memcpy(entries, cache->entries, sizeof(*entries) * cache->count);
+	FREE(&cache->entries);
+	FREE(&cache->index);
+	cache->entries = entries;
+	cache->index = index;
+	cache->size = size;
+	for(size_t i = 0; i < cache->count; i++) {
+		*index_find(cache, entries[i].id) = i+1;
+	}
+	return 0;
+}
+static void make_room(SLNSessionCacheRef const cache) {
+	if(cache->count < cache->size) return;
+	// One full turn of the clock, clearing reference bits as we go.
+	for(size_t n = 0; n < cache->count; n++) {
+		entry *const e = &cache->entries[cache->hand];
+		if(e->ref) {
+			e->ref = false;
+			cache->hand = (cache->hand+1) % cache->count;
+			continue;
+		}
+		entry_remove(cache, cache->hand);
+		metrics_count(METRIC_SESSION_EVICTIONS, 1);
+		return;
+	}
+	// Everything is in use. If we can't grow, evict where the hand is.
+	// Growing is best effort too.
+	if(cache->size < cache->max) {
+		if(resize(cache, MIN(cache->size*2, cache->max)) >= 0) return;
+	}
+	entry_remove(cache, cache->hand);
+	metrics_count(METRIC_SESSION_EVICTIONS, 1);
+}
+static void sweep(uv_timer_t *const timer) {
+	SLNSessionCacheRef const cache = timer->data;
+	uint64_t const now = now_ms();
+	uv_mutex_lock(cache->lock);
+	// Backwards, because removing moves the last entry forward.
+	for(size_t i = cache->count; i-- > 0;) {
+		if(!entry_expired(&cache->entries[i], now)) continue;
+		entry_remove(cache, i);
+		metrics_count(METRIC_SESSION_EXPIRATIONS, 1);
+	}
+	uv_mutex_unlock(cache->lock);
+}
+
 static void session_cache(SLNSessionCacheRef const cache, SLNSessionRef const session) {
 	uint64_t const id = SLNSessionGetID(session);
-	uint16_t const pos = session_pos(cache, id);
-	uint16_t i = pos;
-//	for(; i < pos+SEARCH_DIST; i++) {
-		uint16_t const x = i % cache->size;
-		if(id == cache->ids[x]) return;
-//		if(0 != cache->ids[x]) continue; // TODO: Hack to work without session expiration.
-		cache->ids[x] = id;
-		SLNSessionRelease(&cache->sessions[x]);
-		cache->sessions[x] = SLNSessionRetain(session);
-		cache->active[cache->pos] = x;
-		cache->timeouts[cache->pos] = uv_now(async_loop) + EXPIRE_TIMEOUT;
-//		cache->pos++; // TODO: Is this a ring buffer?
-		// TODO: Start timer if necessary.
-		return;
-//	}
+	uint64_t const now = now_ms();
+	uv_mutex_lock(cache->lock);
+	size_t *x = index_find(cache, id);
+	if(!*x) {
+		make_room(cache);
+		x = index_find(cache, id);
+		*x = ++cache->count;
+		metrics_gauge(METRIC_SESSION_CACHED, +1);
+	}
+	// If it's already there, the one we just loaded is newer.
+	entry *const e = &cache->entries[*x-1];
+	SLNSessionRelease(&e->session);
+	e->id = id;
+	e->session = SLNSessionRetain(session);
+	e->loaded = now;
+	e->used = now;
+	e->ref = true;
+	e->tag = 0;
+	e->tagged = false;
+	uv_mutex_unlock(cache->lock);
 }
 
-int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const username, strarg_t const password, SLNSessionRef *const out) {
+int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const username, strarg_t const password, strarg_t const client, SLNSessionRef *const out) {
 	assert(out);
 	if(!cache) return KVS_EINVAL;
 	if(!username) return KVS_EINVAL;
@@ -131,15 +275,22 @@ int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const
 	KVS_txn *txn = NULL;
 	SLNSessionRef tmp = NULL;
 	SLNSessionRef session = NULL;
+	str_t *passhash = NULL;
 	int rc;
 
-	SLNRepoDBOpenUnsafe(repo, &db);
+	// Refuse before touching the database or the hashing pool.
+	rc = pass_throttle_check(username, client);
+	if(rc < 0) return rc;
+
+	SLNRepoDBOpenUnsafe(repo, SLN_INTERACTIVE, &db);
 	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
 	if(rc < 0) goto cleanup;
 
 	KVS_val username_key[1], userID_val[1];
 	SLNUserIDByNameKeyPack(username_key, txn, username);
 	rc = kvs_get(txn, username_key, userID_val);
+	// Made-up usernames would only fill up the buckets of real ones.
+	if(KVS_NOTFOUND == rc) pass_throttle_failed(NULL, client);
 	if(rc < 0) goto cleanup;
 	uint64_t const userID = kvs_read_uint64(userID_val);
 	kvs_assert(userID);
@@ -148,22 +299,29 @@ int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const
 	SLNUserByIDKeyPack(userID_key, txn, userID);
 	rc = kvs_get(txn, userID_key, user_val);
 	if(rc < 0) goto cleanup;
-	strarg_t u, passhash, ignore1;
+	strarg_t u, h, ignore1;
 	uint64_t ignore2, ignore3;
 	SLNMode mode;
-	SLNUserByIDValUnpack(user_val, txn, &u, &passhash, &ignore1, &mode, &ignore2, &ignore3);
+	SLNUserByIDValUnpack(user_val, txn, &u, &h, &ignore1, &mode, &ignore2, &ignore3);
 	kvs_assert(0 == strcmp(username, u));
-	kvs_assert(passhash);
-
-	if(0 != pass_hashcmp(password, passhash)) rc = KVS_EACCES;
+	kvs_assert(h);
+	passhash = strdup(h);
+	if(!passhash) rc = KVS_ENOMEM;
 	if(rc < 0) goto cleanup;
 
 	rc = SLNSessionCreateInternal(cache, 0, NULL, NULL, userID, mode, username, &tmp);
 	if(rc < 0) goto cleanup;
 
+	// Don't hold the database while hashing.
 	kvs_txn_abort(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 
+	rc = pass_hashcmp(password, passhash);
+	if(UV_EACCES == rc) {
+		pass_throttle_failed(username, client);
+		rc = KVS_EACCES;
+	}
+	if(rc < 0) goto cleanup;
 
 	rc = SLNSessionCreateSession(tmp, &session);
 	if(rc < 0) goto cleanup;
@@ -173,15 +331,17 @@ int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const
 
 cleanup:
 	kvs_txn_abort(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 	SLNSessionRelease(&tmp);
 	SLNSessionRelease(&session);
+	FREE(&passhash);
 	return rc;
 }
 
 
 
 static int cookie_parse(strarg_t const cookie, uint64_t *const sessionID, byte_t sessionKey[SESSION_KEY_LEN]) {
+	// Returns the raw key, see key_encode().
 	unsigned long long id = 0;
 	str_t key_str[SESSION_KEY_HEX+1];
 	key_str[0] = '\0';
@@ -189,26 +349,63 @@ static int cookie_parse(strarg_t const cookie, uint64_t *const sessionID, byte_t
 	if(0 == id) return KVS_EINVAL;
 	if(strlen(key_str) != SESSION_KEY_HEX) return KVS_EINVAL;
 	*sessionID = (uint64_t)id;
-	byte_t key_raw[SESSION_KEY_LEN];
-	tobin(key_raw, key_str, SESSION_KEY_HEX);
-	byte_t key_enc[SHA256_DIGEST_LENGTH];
-	SHA256(key_raw, SESSION_KEY_LEN, key_enc);
-	memcpy(sessionKey, key_enc, SESSION_KEY_LEN);
+	tobin(sessionKey, key_str, SESSION_KEY_HEX);
 	return 0;
 }
+static void key_encode(byte_t const raw[SESSION_KEY_LEN], byte_t enc[SESSION_KEY_LEN]) {
+	// Sessions only store a hash of the key.
+	byte_t hash[SHA256_DIGEST_LENGTH];
+	SHA256(raw, SESSION_KEY_LEN, hash);
+	memcpy(enc, hash, SESSION_KEY_LEN);
+}
+// Once a cookie's key has been checked against the session, we keep a
+// MAC of it in the cache entry. Later requests with the same cookie only
+// need to compute and compare the MAC (one fixed-size integer comparison,
+// so still constant-time) instead of hashing the key again.
 static int session_lookup(SLNSessionCacheRef const cache, uint64_t const id, byte_t const key[SESSION_KEY_LEN], SLNSessionRef *const out) {
-	uint16_t const pos = session_pos(cache, id);
-	// TODO: Locking (not really necessary but just good practice).
-	for(uint16_t i = pos; i < pos+SEARCH_DIST; i++) {
-		uint16_t const x = i % cache->size;
-		if(id != cache->ids[x]) continue;
-		SLNSessionRef const s = cache->sessions[x];
-		int rc = SLNSessionKeyValid(s, key);
-		if(rc < 0) return rc;
-		*out = SLNSessionRetain(s);
+	uint64_t const now = now_ms();
+	uint64_t const tag = siphash24(cache->mackey, key, SESSION_KEY_LEN);
+	SLNSessionRef s = NULL;
+	bool verified = false;
+	uv_mutex_lock(cache->lock);
+	size_t *const x = index_find(cache, id);
+	if(*x) {
+		entry *const e = &cache->entries[*x-1];
+		if(entry_expired(e, now)) {
+			entry_remove(cache, *x-1);
+			metrics_count(METRIC_SESSION_EXPIRATIONS, 1);
+		} else {
+			e->used = now;
+			e->ref = true;
+			s = SLNSessionRetain(e->session);
+			verified = e->tagged & (e->tag == tag);
+		}
+	}
+	uv_mutex_unlock(cache->lock);
+	if(!s) return KVS_NOTFOUND;
+	if(verified) {
+		*out = s;
 		return 0;
 	}
-	return KVS_NOTFOUND;
+
+	byte_t enc[SESSION_KEY_LEN];
+	key_encode(key, enc);
+	int rc = SLNSessionKeyValid(s, enc);
+	if(rc < 0) {
+		SLNSessionRelease(&s);
+		return rc;
+	}
+
+	uv_mutex_lock(cache->lock);
+	size_t *const y = index_find(cache, id);
+	// Unless it was replaced in the meantime.
+	if(*y && s == cache->entries[*y-1].session) {
+		cache->entries[*y-1].tag = tag;
+		cache->entries[*y-1].tagged = true;
+	}
+	uv_mutex_unlock(cache->lock);
+	*out = s;
+	return 0;
 }
 
 int SLNSessionCacheLoadSessionUnsafe(SLNSessionCacheRef const cache, uint64_t const id, SLNSessionRef *const out) {
@@ -220,7 +417,7 @@ int SLNSessionCacheLoadSessionUnsafe(SLNSessionCacheRef const cache, uint64_t co
 	byte_t key_enc[SESSION_KEY_LEN] = {0};
 	int rc;
 
-	SLNRepoDBOpenUnsafe(repo, &db);
+	SLNRepoDBOpenUnsafe(repo, SLN_INTERACTIVE, &db);
 	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
 	if(rc < 0) goto cleanup;
 
@@ -256,7 +453,7 @@ int SLNSessionCacheLoadSessionUnsafe(SLNSessionCacheRef const cache, uint64_t co
 	tobin(key_enc, key_str, SESSION_KEY_HEX);
 
 	kvs_txn_abort(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 
 	SLNSessionRef session = NULL;
 	rc = SLNSessionCreateInternal(cache, id, NULL, key_enc, userID, mode, username, &session);
@@ -267,7 +464,7 @@ int SLNSessionCacheLoadSessionUnsafe(SLNSessionCacheRef const cache, uint64_t co
 
 cleanup:
 	kvs_txn_abort(txn); txn = NULL;
-	SLNRepoDBClose(repo, &db);
+	SLNRepoDBClose(repo, SLN_INTERACTIVE, &db);
 	FREE(&username);
 	return rc;
 }
@@ -304,6 +501,9 @@ int SLNSessionCacheCopyActiveSession(SLNSessionCacheRef const cache, strarg_t co
 
 	SLNSessionRef session = NULL;
 	rc = session_lookup(cache, sessionID, sessionKey, &session);
+	metrics_count(KVS_NOTFOUND == rc ?
+		METRIC_SESSION_MISSES :
+		METRIC_SESSION_HITS, 1);
 	if(rc >= 0) {
 		*out = session; session = NULL;
 		return 0;
@@ -317,7 +517,9 @@ int SLNSessionCacheCopyActiveSession(SLNSessionCacheRef const cache, strarg_t co
 		return rc;
 	}
 
-	rc = SLNSessionCacheLoadSession(cache, sessionID, sessionKey, &session);
+	byte_t sessionKeyEnc[SESSION_KEY_LEN];
+	key_encode(sessionKey, sessionKeyEnc);
+	rc = SLNSessionCacheLoadSession(cache, sessionID, sessionKeyEnc, &session);
 	if(rc >= 0) {
 		*out = session; session = NULL;
 		return 0;
@@ -3,7 +3,11 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "util/metrics.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
 
@@ -16,8 +20,10 @@ struct SLNSubmission {
 	str_t *tmppath;
 	uv_file tmpfile;
 	uint64_t size;
+	bool partial; // tmppath is kept if we fail, see CreateResumable
 
 	SLNHasherRef hasher;
+	uint64_t hashed; // Any more is hashed from the file in End
 	uint64_t fileID;
 	uint64_t metaFileID; // TODO: Don't store both of these...
 
@@ -28,7 +34,35 @@ struct SLNSubmission {
 
 int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, KVS_txn *const txn, uint64_t *const out);
 
-int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, SLNSubmissionRef *const out) {
+static int open_partial(SLNSubmissionRef const sub) {
+	SLNRepoRef const repo = SLNSessionGetRepo(sub->session);
+	str_t *path = SLNRepoCopyPartialPath(repo, sub->knownURI);
+	if(!path) return UV_EINVAL;
+	// Needs to be writable so that we can reopen it.
+	// Made read-only before it's moved into place.
+	uv_file const file = async_fs_open_mkdirp(path, O_CREAT | O_RDWR, 0600);
+	if(file < 0) {
+		FREE(&path);
+		return file;
+	}
+	// Some other pull might be downloading the same file.
+	// Lock is released when the file is closed.
+	int rc = flock(file, LOCK_EX | LOCK_NB);
+	if(rc < 0) rc = -errno;
+	uv_fs_t req[1];
+	rc = rc < 0 ? rc : async_fs_fstat(file, req);
+	if(rc < 0) {
+		async_fs_close(file);
+		FREE(&path);
+		return rc;
+	}
+	sub->tmppath = path; path = NULL;
+	sub->tmpfile = file;
+	sub->size = req->statbuf.st_size;
+	sub->partial = true;
+	return 0;
+}
+static int create(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, bool const resumable, SLNSubmissionRef *const out) {
 	assert(out);
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return UV_EACCES;
 
@@ -49,6 +83,13 @@ int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, st
 	}
 	sub->type = NULL;
 
+	// If we can't get the partial file for whatever reason, we can
+	// still download it the normal way.
+	if(resumable && knownURI && open_partial(sub) >= 0) {
+		*out = sub; sub = NULL;
+		return 0;
+	}
+
 	sub->tmppath = SLNRepoCopyTempPath(SLNSessionGetRepo(session));
 	if(!sub->tmppath) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
@@ -64,6 +105,12 @@ cleanup:
 	SLNSubmissionFree(&sub);
 	return rc;
 }
+int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, SLNSubmissionRef *const out) {
+	return create(session, knownURI, knownTarget, false, out);
+}
+int SLNSubmissionCreateResumable(SLNSessionRef const session, strarg_t const knownURI, SLNSubmissionRef *const out) {
+	return create(session, knownURI, NULL, true, out);
+}
 int SLNSubmissionCreateQuick(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, strarg_t const type, ssize_t (*read)(void *, byte_t const **), void *const context, SLNSubmissionRef *const out) {
 	assert(out);
 	SLNSubmissionRef sub = NULL;
@@ -87,13 +134,16 @@ void SLNSubmissionFree(SLNSubmissionRef *const subptr) {
 	FREE(&sub->knownTarget);
 	FREE(&sub->type);
 
-	if(sub->tmppath) async_fs_unlink(sub->tmppath);
+	// Keep partial downloads so they can be resumed later.
+	if(sub->tmppath && (!sub->partial || !sub->size)) async_fs_unlink(sub->tmppath);
 	FREE(&sub->tmppath);
 	if(sub->tmpfile >= 0) async_fs_close(sub->tmpfile);
 	sub->tmpfile = 0;
 	sub->size = 0;
+	sub->partial = false;
 
 	SLNHasherFree(&sub->hasher);
+	sub->hashed = 0;
 	sub->fileID = 0;
 	sub->metaFileID = 0;
 
@@ -125,13 +175,19 @@ strarg_t SLNSubmissionGetType(SLNSubmissionRef const sub) {
 int SLNSubmissionSetType(SLNSubmissionRef const sub, strarg_t const type) {
 	if(!sub) return UV_EINVAL;
 	if(!type) return UV_EINVAL;
-	assert(!sub->hasher);
+	if(sub->hasher) {
+		// Resuming after SLNSubmissionInterrupt.
+		assert(sub->partial);
+		if(0 == strcmp(sub->type, type)) return 0;
+		SLNHasherFree(&sub->hasher);
+		sub->hashed = 0;
+	}
 
 	FREE(&sub->type);
 	sub->type = strdup(type);
 	if(!sub->type) return UV_ENOMEM;
 
-	sub->hasher = SLNHasherCreate(sub->type);
+	sub->hasher = SLNHasherCreate(sub->type, SLNSessionGetPool(sub->session), SLNSessionGetPriority(sub->session));
 	if(!sub->hasher) return UV_ENOMEM;
 
 	return 0;
@@ -144,6 +200,10 @@ uint64_t SLNSubmissionGetFileID(SLNSubmissionRef const sub) {
 	assert(sub);
 	return sub->fileID;
 }
+uint64_t SLNSubmissionGetSize(SLNSubmissionRef const sub) {
+	assert(sub);
+	return sub->size;
+}
 
 int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len) {
 	if(!sub) return 0;
@@ -151,17 +211,96 @@ int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size
 	assert(sub->type);
 	assert(sub->hasher);
 
+	// Explicit offset so that resetting doesn't leave a hole.
 	uv_buf_t parts[] = { uv_buf_init((char *)buf, len) };
-	int rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), -1);
+	int rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), sub->size);
 	if(rc < 0) {
 		alogf("SLNSubmission write error: %s\n", sln_strerror(rc));
 		return rc;
 	}
 
+	// If we're behind, End will catch up from the file instead.
+	if(sub->hashed == sub->size) {
+		SLNHasherWrite(sub->hasher, buf, len);
+		sub->hashed += len;
+	}
 	sub->size += len;
-	SLNHasherWrite(sub->hasher, buf, len);
 	return 0;
 }
+int SLNSubmissionWriteAt(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len, uint64_t const offset) {
+	if(!sub) return 0;
+	assert(sub->tmpfile >= 0);
+	assert(sub->type);
+	assert(offset >= sub->size);
+	uv_buf_t parts[] = { uv_buf_init((char *)buf, len) };
+	int rc = async_fs_writeall(sub->tmpfile, parts, numberof(parts), offset);
+	if(rc < 0) {
+		alogf("SLNSubmission write error: %s\n", sln_strerror(rc));
+		return rc;
+	}
+	return 0;
+}
+int SLNSubmissionSetSize(SLNSubmissionRef const sub, uint64_t const size) {
+	if(!sub) return UV_EINVAL;
+	if(!sub->tmppath) return UV_EINVAL; // Already ended
+	assert(sub->tmpfile >= 0);
+	int rc = async_fs_ftruncate(sub->tmpfile, size);
+	if(rc < 0) return rc;
+	sub->size = size;
+	if(sub->hashed > size) {
+		// Can't un-hash, so start over.
+		sub->hashed = 0;
+		if(sub->type) {
+			SLNHasherFree(&sub->hasher);
+			sub->hasher = SLNHasherCreate(sub->type, SLNSessionGetPool(sub->session), SLNSessionGetPriority(sub->session));
+			if(!sub->hasher) return UV_ENOMEM;
+		}
+	}
+	return 0;
+}
+int SLNSubmissionInterrupt(SLNSubmissionRef const sub) {
+	if(!sub) return UV_EINVAL;
+	if(!sub->partial) return SLNSubmissionReset(sub);
+	// Drop anything written past the end by WriteAt.
+	return SLNSubmissionSetSize(sub, sub->size);
+}
+bool SLNSubmissionIsResumable(SLNSubmissionRef const sub) {
+	if(!sub) return false;
+	return sub->partial;
+}
+int SLNSubmissionReset(SLNSubmissionRef const sub) {
+	// Throws away everything written so far, e.g. to retry a download.
+	if(!sub) return UV_EINVAL;
+	if(!sub->tmppath) return UV_EINVAL; // Already ended
+	assert(sub->tmpfile >= 0);
+	int rc = async_fs_ftruncate(sub->tmpfile, 0);
+	if(rc < 0) return rc;
+	sub->size = 0;
+	SLNHasherFree(&sub->hasher);
+	sub->hashed = 0;
+	FREE(&sub->type);
+	return 0;
+}
+static int catch_up(SLNSubmissionRef const sub) {
+	// Rehashing from disk is much cheaper than downloading again.
+	if(sub->hashed >= sub->size) return 0;
+	size_t const max = 1024 * 64;
+	byte_t *buf = malloc(max);
+	if(!buf) return UV_ENOMEM;
+	int rc = 0;
+	while(sub->hashed < sub->size) {
+		uv_buf_t parts[] = { uv_buf_init((char *)buf, MIN(max, sub->size - sub->hashed)) };
+		ssize_t const len = async_fs_read(sub->tmpfile, parts, numberof(parts), sub->hashed);
+		if(0 == len) rc = UV_EOF; // Truncated by someone else?
+		if(len < 0) rc = len;
+		if(rc < 0) break;
+		rc = SLNHasherWrite(sub->hasher, buf, len);
+		if(rc < 0) break;
+		sub->hashed += len;
+	}
+	FREE(&buf);
+	return rc;
+}
 static int verify(SLNSubmissionRef const sub) {
 	assert(sub->URIs);
 	if(!sub->knownURI) return 0;
@@ -182,15 +321,17 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 	assert(sub->type);
 	assert(sub->hasher);
 
+	int rc = catch_up(sub);
+	if(rc < 0) return rc;
 	sub->URIs = SLNHasherEnd(sub->hasher);
 	sub->internalHash = strdup(SLNHasherGetInternalHash(sub->hasher));
 	SLNHasherFree(&sub->hasher);
 	if(!sub->URIs || !sub->internalHash) return UV_ENOMEM;
 
 	SLNRepoRef const repo = SLNSubmissionGetRepo(sub);
+	async_pool_t *const pool = SLNSessionGetPool(sub->session);
 	str_t *internalPath = NULL;
 	bool worker = false;
-	int rc = 0;
 
 	rc = verify(sub);
 	if(rc < 0) goto cleanup;
@@ -199,10 +340,16 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 	if(!internalPath) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
 
-	async_pool_enter(NULL); worker = true;
+	metrics_pool_enter(pool, SLN_BULK == SLNSessionGetPriority(sub->session) ?
+		METRIC_POOL_BULK : METRIC_POOL_INTERACTIVE);
+	worker = true;
 
 	rc = async_fs_fdatasync(sub->tmpfile);
 	if(rc < 0) goto cleanup;
+	if(sub->partial && fchmod(sub->tmpfile, 0400) < 0) {
+		rc = -errno;
+		goto cleanup;
+	}
 
 	// We use link(2) rather than rename(2) because link gives an error
 	// if there's a name collision, rather than overwriting. We want to
@@ -220,13 +367,59 @@ int SLNSubmissionEnd(SLNSubmissionRef const sub) {
 	rc = async_fs_sync_dirname(internalPath);
 
 cleanup:
-	if(worker) { async_pool_leave(NULL); worker = false; }
+	if(worker) { async_pool_leave(pool); worker = false; }
 	FREE(&internalPath);
+	if(rc >= 0) {
+		metrics_count(METRIC_SUBMISSIONS, 1);
+		metrics_count(METRIC_SUBMISSION_BYTES, sub->size);
+	}
 
 	async_fs_unlink(sub->tmppath);
 	FREE(&sub->tmppath);
 	return rc;
 }
+int SLNSubmissionEndExisting(SLNSubmissionRef const sub, SLNFileInfo const *const info, str_t const *const *const URIs) {
+	if(!sub) return 0;
+	if(!info || !URIs) return UV_EINVAL;
+	assert(sub->tmppath);
+	assert(sub->tmpfile >= 0);
+	assert(!sub->URIs);
+
+	// Throw away anything we already downloaded ourselves.
+	int rc = SLNSubmissionReset(sub);
+	if(rc < 0) return rc;
+	async_fs_unlink(sub->tmppath);
+	FREE(&sub->tmppath);
+	async_fs_close(sub->tmpfile);
+	sub->tmpfile = -1;
+	sub->partial = false;
+
+	size_t count = 0;
+	while(URIs[count]) count++;
+	sub->URIs = calloc(count+1, sizeof(str_t *));
+	if(!sub->URIs) return UV_ENOMEM;
+	for(size_t i = 0; i < count; i++) {
+		sub->URIs[i] = strdup(URIs[i]);
+		if(!sub->URIs[i]) return UV_ENOMEM;
+	}
+	sub->internalHash = strdup(info->hash);
+	sub->type = strdup(info->type);
+	if(!sub->internalHash || !sub->type) return UV_ENOMEM;
+	sub->size = info->size;
+
+	rc = verify(sub);
+	if(rc < 0) return rc;
+
+	// Meta-files are parsed from the file when they're stored.
+	rc = async_fs_open(info->path, O_RDONLY, 0000);
+	if(rc < 0) return rc;
+	sub->tmpfile = rc;
+	return 0;
+}
+str_t const *const *SLNSubmissionGetURIs(SLNSubmissionRef const sub) {
+	if(!sub) return NULL;
+	return (str_t const *const *)sub->URIs;
+}
 int SLNSubmissionWriteFrom(SLNSubmissionRef const sub, ssize_t (*read)(void *, byte_t const **), void *const context) {
 	if(!sub) return 0;
 	assert(read);
@@ -286,6 +479,16 @@ int SLNSubmissionStore(SLNSubmissionRef const sub, KVS_txn *const txn) {
 		SLNFileByIDValPack(file_val, txn, sub->internalHash, sub->type, sub->size);
 		rc = kvs_put(txn, fileID_key, file_val, KVS_NOOVERWRITE_FAST);
 		if(rc < 0) return rc;
+
+		rc = SLNStatAdd(txn, SLN_STAT_FILES, 1);
+		rc = rc < 0 ? rc : SLNStatAdd(txn, SLN_STAT_BYTES, sub->size);
+		rc = rc < 0 ? rc : SLNStatAddType(txn, sub->type, 1);
+		rc = rc < 0 ? rc : SLNDigestAdd(txn, sub->internalHash, fileID);
+		if(rc < 0) return rc;
+
+		// Before commit, so the filter never misses a stored file.
+		// If the transaction fails, it's just a false positive.
+		SLNRepoFileFilterAdd(SLNSubmissionGetRepo(sub), sub->internalHash);
 	} else if(KVS_KEYEXIST == rc) {
 		fileID = kvs_read_uint64(dupFileID_val);
 	} else return rc;
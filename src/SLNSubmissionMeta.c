@@ -18,14 +18,17 @@ typedef struct {
 	strarg_t targetURI;
 	str_t *fields[DEPTH_MAX];
 	int depth;
+	uint64_t newTerms;
+	uint64_t newFields;
 } parser_t;
 
 static yajl_callbacks const callbacks;
 
 // TODO: Error handling.
 static int add_metafile(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const targetURI);
-static void add_metadata(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value);
-static void add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len);
+// These return the number of previously unseen fields or terms.
+static uint64_t add_metadata(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value);
+static uint64_t add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len);
 
 
 int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID, KVS_txn *const txn, uint64_t *const out) {
@@ -145,6 +148,11 @@ int SLNSubmissionParseMetaFile(SLNSubmissionRef const sub, uint64_t const fileID
 		goto cleanup;
 	}
 
+	// Summed up front so each stat is only written once per meta-file.
+	rc = SLNStatAdd(txn, SLN_STAT_TERMS, ctx->newTerms);
+	rc = rc < 0 ? rc : SLNStatAdd(txn, SLN_STAT_FIELDS, ctx->newFields);
+	if(rc < 0) goto cleanup;
+
 	*out = metaFileID;
 
 cleanup:
@@ -170,11 +178,11 @@ static int yajl_map_key(parser_t *const ctx, strarg_t const key, size_t const le
 		strarg_t const field = ctx->fields[ctx->depth-1];
 		assert(field);
 		if(0 == strcmp("fulltext", field)) {
-			add_fulltext(ctx->txn, ctx->metaFileID, key, len);
+			ctx->newTerms += add_fulltext(ctx->txn, ctx->metaFileID, key, len);
 		} else {
 			str_t *x = strndup(key, len);
 			if(!x) return false;
-			add_metadata(ctx->txn, ctx->metaFileID, field, x);
+			ctx->newFields += add_metadata(ctx->txn, ctx->metaFileID, field, x);
 			FREE(&x);
 		}
 	}
@@ -276,16 +284,28 @@ static int add_metafile(KVS_txn *const txn, uint64_t const metaFileID, strarg_t
 	rc = kvs_cursor_put(cursor, targetURI_key, &null, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
 
+	rc = SLNStatAdd(txn, SLN_STAT_METAFILES, 1);
+	if(rc < 0) return rc;
+
 	return 0;
 }
-static void add_metadata(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value) {
+static uint64_t add_metadata(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const field, strarg_t const value) {
 	assert(metaFileID);
 	assert(field);
 	assert(value);
-	if('\0' == value[0]) return;
+	if('\0' == value[0]) return 0;
 
 	KVS_val null = { 0, NULL };
-	int rc;
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_txn_cursor(txn, &cursor);
+	assertf(rc >= 0, "Database error %s", sln_strerror(rc));
+
+	// Has this field ever been used before (including by this file)?
+	KVS_range existing[1];
+	SLNFieldValueAndMetaFileIDRange1(existing, txn, field);
+	rc = kvs_cursor_firstr(cursor, existing, NULL, NULL, +1);
+	assertf(rc >= 0 || KVS_NOTFOUND == rc, "Database error %s", sln_strerror(rc));
+	uint64_t const new = KVS_NOTFOUND == rc ? 1 : 0;
 
 	KVS_val fwd[1];
 	SLNMetaFileIDFieldAndValueKeyPack(fwd, txn, metaFileID, field, value);
@@ -296,13 +316,16 @@ static void add_metadata(KVS_txn *const txn, uint64_t const metaFileID, strarg_t
 	SLNFieldValueAndMetaFileIDKeyPack(rev, txn, field, value, metaFileID);
 	rc = kvs_put(txn, rev, &null, KVS_NOOVERWRITE_FAST);
 	assertf(rc >= 0 || KVS_KEYEXIST == rc, "Database error %s", sln_strerror(rc));
+
+	return new;
 }
-static void add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len) {
+static uint64_t add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t const str, size_t const len) {
 	assert(metaFileID);
 
-	if(0 == len) return;
+	if(0 == len) return 0;
 	assert(str);
 
+	uint64_t new = 0;
 	int rc;
 
 	sqlite3_tokenizer_module const *fts = NULL;
@@ -326,6 +349,12 @@ static void add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t
 		if(SQLITE_OK != rc) break;
 
 		assert('\0' == token[tlen]); // Assumption
+		KVS_range existing[1];
+		SLNTermMetaFileIDAndPositionRange1(existing, txn, token);
+		rc = kvs_cursor_firstr(cursor, existing, NULL, NULL, +1);
+		assert(rc >= 0 || KVS_NOTFOUND == rc);
+		if(KVS_NOTFOUND == rc) new++;
+
 		KVS_val token_val[1];
 		SLNTermMetaFileIDAndPositionKeyPack(token_val, txn, token, metaFileID, 0);
 		// TODO: Record tpos. Requires changes to SLNFulltextFilter so that each document only gets returned once, no matter how many times the token appears within it.
@@ -337,5 +366,7 @@ static void add_fulltext(KVS_txn *const txn, uint64_t const metaFileID, strarg_t
 	kvs_cursor_close(cursor); cursor = NULL;
 
 	fts->xClose(tcur); tcur = NULL;
+
+	return new;
 }
 
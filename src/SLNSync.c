@@ -2,66 +2,225 @@
 // MIT licensed (see LICENSE for details)
 
 #include <assert.h>
+#include "util/metrics.h"
 #include "StrongLink.h"
 #include "SLNDB.h"
 
+#define QUEUE_SIZE 64 // Submissions in flight per queue
+
+// Finished submissions are stored together in one transaction,
+// waiting briefly for stragglers if the batch isn't full.
+#define BATCH_COUNT 32
+#define BATCH_BYTES (1024 * 1024 * 32)
+#define BATCH_LATENCY 100 // Milliseconds
+
+// Submissions are handed out to workers in order, but can finish in any
+// order. They're stored strictly in order, as soon as every earlier one
+// has finished, so the last URI we record is never ahead of a gap.
 typedef struct {
-	SLNSubmissionRef sub;
+	SLNSubmissionRef subs[QUEUE_SIZE];
+	bool done[QUEUE_SIZE];
+	bool skip[QUEUE_SIZE]; // Unavailable, so done without storing
+	bool reconciled[QUEUE_SIZE]; // See SLNSyncIngestReconciledURI
+	size_t size;
+	uint64_t head; // Next to store
+	uint64_t work; // Next to hand to a worker
+	uint64_t tail; // Next free
+	bool storing;
+	async_mutex_t mutex[1];
+	async_cond_t cond[1]; // Signaled when a submission is done
 	async_sem_t ingest_sem[1];
 	async_sem_t work_sem[1];
-	async_sem_t done_sem[1];
 } sync_queue;
 
 struct SLNSync {
 	SLNSessionRef session;
 	sync_queue fileq[1];
 	sync_queue metaq[1];
+	sync_queue depq[1]; // Hinted meta-files of stored files
 	async_sem_t shared_sem[1];
+	unsigned waiting; // In SLNSyncWorkAwait
+	unsigned wakeups; // Posted to shared_sem without any work
+
+	// Reconciled submissions come in bucket order, not the order we
+	// resume in. Until all of them are stored, recording a last URI
+	// could skip past them after a restart.
+	uint64_t reconciling;
+
+	// Stored files whose hinted meta-files aren't all stored yet, so
+	// their hints can't be marked synced. Only touched on the event
+	// loop, and loaded from the database on the first store.
+	str_t **pending;
+	size_t pending_count;
+	size_t pending_size;
+	bool pending_loaded;
 };
 
-static void queue_init(SLNSyncRef const sync, sync_queue *const queue) {
-	queue->sub = NULL;
-	async_sem_init(queue->ingest_sem, 1, 0);
+static void queue_init(SLNSyncRef const sync, sync_queue *const queue, size_t const size) {
+	assert(size <= QUEUE_SIZE);
+	memset(queue->subs, 0, sizeof(queue->subs));
+	memset(queue->done, 0, sizeof(queue->done));
+	memset(queue->skip, 0, sizeof(queue->skip));
+	memset(queue->reconciled, 0, sizeof(queue->reconciled));
+	queue->size = size;
+	queue->head = 0;
+	queue->work = 0;
+	queue->tail = 0;
+	queue->storing = false;
+	async_mutex_init(queue->mutex, 0);
+	async_cond_init(queue->cond, 0);
+	async_sem_init(queue->ingest_sem, size, 0);
 	async_sem_init(queue->work_sem, 0, 0);
-	async_sem_init(queue->done_sem, 0, 0);
 }
 static void queue_destroy(SLNSyncRef const sync, sync_queue *const queue) {
-	queue->sub = NULL;
+	for(size_t i = 0; i < QUEUE_SIZE; i++) {
+		SLNSubmissionFree(&queue->subs[i]);
+		queue->done[i] = false;
+		queue->skip[i] = false;
+		queue->reconciled[i] = false;
+	}
+	queue->size = 0;
+	queue->head = 0;
+	queue->work = 0;
+	queue->tail = 0;
+	queue->storing = false;
+	async_mutex_destroy(queue->mutex);
+	async_cond_destroy(queue->cond);
 	async_sem_destroy(queue->ingest_sem);
 	async_sem_destroy(queue->work_sem);
-	async_sem_destroy(queue->done_sem);
 }
-static int queue_submission(SLNSyncRef const sync, sync_queue *const queue, SLNSubmissionRef const sub) {
-	int rc = async_sem_wait(queue->ingest_sem);
-	if(rc < 0) return rc;
-
-	assert(!queue->sub);
-	queue->sub = sub; //sub = NULL;
+static metric_gauge queue_gauge(SLNSyncRef const sync, sync_queue *const queue) {
+	return queue == sync->fileq ?
+		METRIC_SYNC_QUEUED_FILE :
+		METRIC_SYNC_QUEUED_META;
+}
+static bool queue_idle(sync_queue *const queue) {
+	return queue->head == queue->tail;
+}
+static void queue_put(SLNSyncRef const sync, sync_queue *const queue, SLNSubmissionRef *const subptr, bool const reconciled) {
+	// The caller has taken a slot from ingest_sem.
+	size_t const i = queue->tail++ % queue->size;
+	assert(!queue->subs[i]);
+	queue->subs[i] = *subptr; *subptr = NULL;
+	queue->done[i] = false;
+	queue->skip[i] = false;
+	queue->reconciled[i] = reconciled;
+	if(reconciled) sync->reconciling++;
+	metrics_gauge(queue_gauge(sync, queue), +1);
 	async_sem_post(queue->work_sem);
 	async_sem_post(sync->shared_sem);
-
-	rc = async_sem_wait(queue->done_sem);
-	assert(rc >= 0); // TODO: Clarify ownership
-
-	//sub = queue->sub;
-	queue->sub = NULL;
-	async_sem_post(queue->ingest_sem);
-
+}
+static int queue_push(SLNSyncRef const sync, sync_queue *const queue, SLNSubmissionRef *const subptr, bool const reconciled) {
+	// Blocks while the queue is full.
+	int rc = async_sem_wait(queue->ingest_sem);
+	if(rc < 0) return rc;
+	queue_put(sync, queue, subptr, reconciled);
+	return 0;
+}
+static int queue_try_push(SLNSyncRef const sync, sync_queue *const queue, SLNSubmissionRef *const subptr) {
+	// Returns UV_EAGAIN instead of blocking.
+	int rc = async_sem_trywait(queue->ingest_sem);
+	if(rc < 0) return UV_EAGAIN;
+	queue_put(sync, queue, subptr, false);
+	return 0;
+}
+static bool queue_has(sync_queue *const queue, strarg_t const URI) {
+	for(uint64_t x = queue->head; x < queue->tail; x++) {
+		SLNSubmissionRef const sub = queue->subs[x % queue->size];
+		if(sub && 0 == strcmp(URI, SLNSubmissionGetKnownURI(sub))) return true;
+	}
+	return false;
+}
+static SLNSubmissionRef queue_pop_work(sync_queue *const queue) {
+	int rc = async_sem_trywait(queue->work_sem);
+	if(rc < 0) return NULL;
+	assert(queue->work < queue->tail);
+	return queue->subs[queue->work++ % queue->size];
+}
+static bool queue_mark_done(sync_queue *const queue, SLNSubmissionRef const sub, bool const skip) {
+	for(uint64_t x = queue->head; x < queue->work; x++) {
+		size_t const i = x % queue->size;
+		if(sub != queue->subs[i]) continue;
+		queue->done[i] = true;
+		queue->skip[i] = skip;
+		async_mutex_lock(queue->mutex);
+		async_cond_broadcast(queue->cond);
+		async_mutex_unlock(queue->mutex);
+		return true;
+	}
+	return false;
+}
+// Returns the number of finished slots, of which `*stored` are in `batch`.
+static size_t queue_batch(sync_queue *const queue, SLNSubmissionRef *const batch, size_t *const stored) {
+	size_t count = 0;
+	uint64_t bytes = 0;
+	*stored = 0;
+	while(count < BATCH_COUNT && bytes < BATCH_BYTES) {
+		if(queue->head+count >= queue->work) break;
+		size_t const i = (queue->head+count) % queue->size;
+		if(!queue->done[i]) break;
+		count++;
+		if(queue->skip[i]) continue;
+		batch[(*stored)++] = queue->subs[i];
+		bytes += SLNSubmissionGetSize(queue->subs[i]);
+	}
+	return count;
+}
+static int store_batch(SLNSyncRef const sync, SLNSubmissionRef const *const list, size_t const count, bool const record);
+static int queue_store(SLNSyncRef const sync, sync_queue *const queue) {
+	// Whoever finishes the oldest submission stores it, along with any
+	// others that finish while it's in progress.
+	if(queue->storing) return 0;
+	queue->storing = true;
+	SLNSubmissionRef batch[BATCH_COUNT];
+	size_t stored = 0;
+	int rc = 0;
+	for(;;) {
+		uint64_t const future = uv_now(async_loop) + BATCH_LATENCY;
+		size_t count = queue_batch(queue, batch, &stored);
+		async_mutex_lock(queue->mutex);
+		while(count > 0 && count < BATCH_COUNT) {
+			// Don't wait if nothing else is coming.
+			if(queue->head+count >= queue->tail) break;
+			if(async_cond_timedwait(queue->cond, queue->mutex, future) < 0) break;
+			count = queue_batch(queue, batch, &stored);
+		}
+		async_mutex_unlock(queue->mutex);
+		if(!count) break;
+
+		// Dependencies are stored out of order with everything else,
+		// so they don't count toward where we resume.
+		if(stored) rc = store_batch(sync, batch, stored, queue != sync->depq);
+		if(rc < 0) break;
+		for(size_t j = 0; j < count; j++) {
+			size_t const i = queue->head % queue->size;
+			SLNSubmissionFree(&queue->subs[i]);
+			queue->done[i] = false;
+			queue->skip[i] = false;
+			if(queue->reconciled[i]) sync->reconciling--;
+			queue->reconciled[i] = false;
+			queue->head++;
+			metrics_gauge(queue_gauge(sync, queue), -1);
+			async_sem_post(queue->ingest_sem);
+		}
+	}
+	queue->storing = false;
 	return rc;
 }
-static int queue_ingest(SLNSyncRef const sync, sync_queue *const queue, strarg_t const URI, strarg_t const targetURI) {
+static int queue_ingest(SLNSyncRef const sync, sync_queue *const queue, strarg_t const URI, strarg_t const targetURI, bool const reconciled) {
 	SLNSubmissionRef sub = NULL;
-	int rc = SLNSubmissionCreate(sync->session, URI, targetURI, &sub);
-	if(rc < 0) return rc;
-
-	rc = queue_submission(sync, queue, sub);
+	// Large files might take several tries.
+	int rc = targetURI ?
+		SLNSubmissionCreate(sync->session, URI, targetURI, &sub) :
+		SLNSubmissionCreateResumable(sync->session, URI, &sub);
 	if(rc < 0) return rc;
 
-	rc = SLNSyncStoreSubmission(sync, sub);
+	// Stored later, once it and everything before it is downloaded.
+	rc = queue_push(sync, queue, &sub, reconciled);
 	SLNSubmissionFree(&sub);
 	if(rc < 0) return rc;
 
-	return rc;
+	return 1; // Queued
 }
 
 static int record_last(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const URI, bool const isMeta) {
@@ -101,13 +260,23 @@ static int set_hints_synced(SLNSyncRef const sync, KVS_txn *const txn, strarg_t
 	rc = kvs_put(txn, key, val, 0);
 	return rc;
 }
-static int add_hint(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const metaURI, strarg_t const targetURI) {
+static int add_hint(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const metaURI, strarg_t const targetURI, bool const record) {
 	if(!sync) return KVS_EINVAL;
 	if(!metaURI) return KVS_EINVAL;
 	if(!targetURI) return KVS_EINVAL;
 	uint64_t const sessionID = SLNSessionGetID(sync->session);
 	int rc;
 
+	// We might see the same meta-file again after a restart, since
+	// the last meta-file URI isn't always recorded (see below).
+	// Check before using up a hint ID, so there are never hints that
+	// the meta-file index doesn't point to.
+	KVS_val fwdkey[1], fwdval[1];
+	SLNMetaURIAndSessionIDToHintIDKeyPack(fwdkey, txn, metaURI, sessionID);
+	rc = kvs_get(txn, fwdkey, NULL);
+	if(rc >= 0) return 0;
+	if(KVS_NOTFOUND != rc) return rc;
+
 	uint64_t nextID = SLNNextHintID(txn, sessionID);
 	if(!nextID) return KVS_EIO;
 
@@ -117,8 +286,6 @@ static int add_hint(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const me
 	rc = kvs_put(txn, mainkey, mainval, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
 
-	KVS_val fwdkey[1], fwdval[1];
-	SLNMetaURIAndSessionIDToHintIDKeyPack(fwdkey, txn, metaURI, sessionID);
 	SLNMetaURIAndSessionIDToHintIDValPack(fwdval, txn, nextID);
 	rc = kvs_put(txn, fwdkey, fwdval, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
@@ -129,8 +296,12 @@ static int add_hint(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const me
 	rc = kvs_put(txn, revkey, revval, KVS_NOOVERWRITE_FAST);
 	if(rc < 0) return rc;
 
-	rc = record_last(sync, txn, metaURI, true);
-	if(rc < 0) return rc;
+	// Earlier meta-files that are still in the queue might not be
+	// stored yet, in which case we can't skip past them.
+	if(record && queue_idle(sync->metaq)) {
+		rc = record_last(sync, txn, metaURI, true);
+		if(rc < 0) return rc;
+	}
 
 	return 0;
 }
@@ -142,8 +313,9 @@ int SLNSyncCreate(SLNSessionRef const session, SLNSyncRef *const out) {
 	SLNSyncRef sync = calloc(1, sizeof(struct SLNSync));
 	if(!sync) return KVS_ENOMEM;
 	sync->session = session;
-	queue_init(sync, sync->fileq);
-	queue_init(sync, sync->metaq);
+	queue_init(sync, sync->fileq, QUEUE_SIZE);
+	queue_init(sync, sync->metaq, QUEUE_SIZE);
+	queue_init(sync, sync->depq, QUEUE_SIZE);
 	async_sem_init(sync->shared_sem, 0, 0);
 	*out = sync;
 	return 0;
@@ -155,11 +327,21 @@ void SLNSyncFree(SLNSyncRef *const syncptr) {
 	sync->session = NULL;
 	queue_destroy(sync, sync->fileq);
 	queue_destroy(sync, sync->metaq);
+	queue_destroy(sync, sync->depq);
 	async_sem_destroy(sync->shared_sem);
+	sync->waiting = 0;
+	sync->wakeups = 0;
+	sync->reconciling = 0;
+	for(size_t i = 0; i < sync->pending_count; i++) FREE(&sync->pending[i]);
+	assert_zeroed(sync->pending, sync->pending_count);
+	FREE(&sync->pending);
+	sync->pending_count = 0;
+	sync->pending_size = 0;
+	sync->pending_loaded = false;
 	assert_zeroed(sync, 1);
 	FREE(syncptr); sync = NULL;
 }
-int SLNSyncFileAvailable(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI) {
+static int file_available(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI, bool const reconciled) {
 	if(!URI) return KVS_EINVAL;
 	KVS_env *db = NULL;
 	KVS_txn *txn = NULL;
@@ -173,6 +355,12 @@ int SLNSyncFileAvailable(SLNSyncRef const sync, strarg_t const URI, strarg_t con
 	bool const isMeta = !!targetURI;
 	unsigned const mode = isMeta ? KVS_RDWR : KVS_RDONLY;
 
+	// During an initial sync, most files are new, and for those
+	// we can usually skip the transaction entirely.
+	SLNRepoRef const repo = SLNSessionGetRepo(sync->session);
+	if(!isMeta && !SLNRepoFileFilterMaybe(repo, URI)) return KVS_NOTFOUND;
+	bool const record = !reconciled && !sync->reconciling;
+
 	rc = SLNSessionDBOpen(sync->session, SLN_RDWR, &db);
 	if(rc < 0) goto cleanup;
 	rc = kvs_txn_begin(db, NULL, mode, &txn);
@@ -199,7 +387,7 @@ int SLNSyncFileAvailable(SLNSyncRef const sync, strarg_t const URI, strarg_t con
 			} else if(KVS_NOTFOUND == rc) {
 				// We don't have the previous hints,
 				// meaning we should queue ours.
-				rc = add_hint(sync, txn, URI, targetURI);
+				rc = add_hint(sync, txn, URI, targetURI, record);
 				if(KVS_NOTFOUND == rc) rc = KVS_PANIC;
 				if(rc < 0) goto cleanup;
 				rc = kvs_txn_commit(txn); txn = NULL;
@@ -217,57 +405,100 @@ cleanup:
 	return rc;
 }
 
+int SLNSyncFileAvailable(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI) {
+	return file_available(sync, URI, targetURI, false);
+}
+
 int SLNSyncIngestFileURI(SLNSyncRef const sync, strarg_t const fileURI) {
 	if(!sync) return KVS_EINVAL;
 	if(!fileURI) return KVS_EINVAL;
 	alogf("file: %s\n", fileURI);
-	int rc = SLNSyncFileAvailable(sync, fileURI, NULL);
+	int rc = file_available(sync, fileURI, NULL, false);
 	if(rc >= 0) return rc;
 	if(KVS_NOTFOUND != rc) return rc;
-	return queue_ingest(sync, sync->fileq, fileURI, NULL);
+	return queue_ingest(sync, sync->fileq, fileURI, NULL, false);
 }
 int SLNSyncIngestMetaURI(SLNSyncRef const sync, strarg_t const metaURI, strarg_t const targetURI) {
 	if(!sync) return KVS_EINVAL;
 	if(!metaURI) return KVS_EINVAL;
 	if(!targetURI) return KVS_EINVAL;
 	alogf("meta: %s -> %s\n", metaURI, targetURI);
-	int rc = SLNSyncFileAvailable(sync, metaURI, targetURI);
+	int rc = file_available(sync, metaURI, targetURI, false);
 	if(rc >= 0) return rc;
 	if(KVS_NOTFOUND != rc) return rc;
-	return queue_ingest(sync, sync->metaq, metaURI, targetURI);
+	return queue_ingest(sync, sync->metaq, metaURI, targetURI, false);
+}
+int SLNSyncIngestReconciledURI(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI) {
+	if(!sync) return KVS_EINVAL;
+	if(!URI) return KVS_EINVAL;
+	int rc = file_available(sync, URI, targetURI, true);
+	if(rc >= 0) return rc;
+	if(KVS_NOTFOUND != rc) return rc;
+	sync_queue *const queue = targetURI ? sync->metaq : sync->fileq;
+	return queue_ingest(sync, queue, URI, targetURI, true);
+}
+static int take_work(SLNSyncRef const sync, SLNSubmissionRef *const out) {
+	// Dependencies first, since they're holding up everything else.
+	// Then meta-files, which are small and make files show up.
+	SLNSubmissionRef sub = NULL;
+	if(!sub) sub = queue_pop_work(sync->depq);
+	if(!sub) sub = queue_pop_work(sync->metaq);
+	if(!sub) sub = queue_pop_work(sync->fileq);
+	if(sub) {
+		*out = sub;
+		return 0;
+	}
+	assert(sync->wakeups > 0);
+	sync->wakeups--;
+	return UV_ECANCELED;
 }
 int SLNSyncWorkAwait(SLNSyncRef const sync, SLNSubmissionRef *const out) {
 	if(!sync) return KVS_EINVAL;
+	sync->waiting++;
 	int rc = async_sem_wait(sync->shared_sem);
+	sync->waiting--;
 	if(rc < 0) return rc;
-
-	// TODO: Pretty hacky...
-	rc = async_sem_trywait(sync->fileq->work_sem);
-	if(rc >= 0) {
-		*out = sync->fileq->sub;
-		return 0;
-	}
-	rc = async_sem_trywait(sync->metaq->work_sem);
-	if(rc >= 0) {
-		*out = sync->metaq->sub;
-		return 0;
+	return take_work(sync, out);
+}
+void SLNSyncWorkWake(SLNSyncRef const sync) {
+	if(!sync) return;
+	while(sync->wakeups < sync->waiting) {
+		sync->wakeups++;
+		async_sem_post(sync->shared_sem);
 	}
-	assert(!"sync scheduling");
-	return -1;
 }
-int SLNSyncWorkDone(SLNSyncRef const sync, SLNSubmissionRef const sub) {
+int SLNSyncWorkTryAwait(SLNSyncRef const sync, SLNSubmissionRef *const out) {
+	// Returns UV_EAGAIN if there's no work available right now.
 	if(!sync) return KVS_EINVAL;
-	// TODO: Copy and paste...
-	if(sub == sync->fileq->sub) {
-		async_sem_post(sync->fileq->done_sem);
-		return 0;
+	int rc = async_sem_trywait(sync->shared_sem);
+	if(rc < 0) return UV_EAGAIN;
+	return take_work(sync, out);
+}
+static void pending_remove(SLNSyncRef const sync, strarg_t const URI);
+static int work_finished(SLNSyncRef const sync, SLNSubmissionRef const sub, bool const skip) {
+	if(queue_mark_done(sync->depq, sub, skip)) {
+		// If the peer doesn't have it, leave the target's hints
+		// unsynced and try again after a restart, instead of
+		// asking over and over.
+		if(skip) pending_remove(sync, SLNSubmissionGetKnownTarget(sub));
+		return queue_store(sync, sync->depq);
 	}
-	if(sub == sync->metaq->sub) {
-		async_sem_post(sync->metaq->done_sem);
-		return 0;
+	if(queue_mark_done(sync->fileq, sub, skip)) {
+		return queue_store(sync, sync->fileq);
+	}
+	if(queue_mark_done(sync->metaq, sub, skip)) {
+		return queue_store(sync, sync->metaq);
 	}
 	return KVS_EINVAL;
 }
+int SLNSyncWorkDone(SLNSyncRef const sync, SLNSubmissionRef const sub) {
+	if(!sync) return KVS_EINVAL;
+	return work_finished(sync, sub, false);
+}
+int SLNSyncWorkSkip(SLNSyncRef const sync, SLNSubmissionRef const sub) {
+	if(!sync) return KVS_EINVAL;
+	return work_finished(sync, sub, true);
+}
 
 int SLNSyncNextHintID(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const targetURI, uint64_t *const hintID) {
 	assert(hintID);
@@ -322,103 +553,259 @@ cleanup:
 	cursor = NULL; // txn-cursor doesn't need closing.
 	return rc;
 }
-int SLNSyncStoreSubmission(SLNSyncRef const sync, SLNSubmissionRef const sub) {
-	if(!sync) return KVS_EINVAL;
-	if(!sub) return KVS_EINVAL;
+// A stored file's hints are synced once every hinted meta-file is stored.
+// Until then, the missing ones are downloaded through the dependency
+// queue, and the file stays pending. Each store checks every pending
+// file again, in the same transaction as it marks them synced.
+typedef struct {
+	str_t *URI;
+	bool resolved;
+} hint_target;
+typedef struct {
+	str_t *metaURI;
+	str_t *targetURI;
+} hint_dependency;
+
+static int targets_add(hint_target **const list, size_t *const count, size_t *const size, strarg_t const URI) {
+	for(size_t i = 0; i < *count; i++) {
+		if(0 == strcmp(URI, (*list)[i].URI)) return 0;
+	}
+	if(*count >= *size) {
+		size_t const x = MAX(16, *size * 2);
+		hint_target *const tmp = reallocarray(*list, x, sizeof(**list));
+		if(!tmp) return KVS_ENOMEM;
+		*list = tmp;
+		*size = x;
+	}
+	(*list)[*count].URI = strdup(URI);
+	(*list)[*count].resolved = false;
+	if(!(*list)[*count].URI) return KVS_ENOMEM;
+	(*count)++;
+	return 0;
+}
+static int pending_add(SLNSyncRef const sync, strarg_t const URI) {
+	for(size_t i = 0; i < sync->pending_count; i++) {
+		if(0 == strcmp(URI, sync->pending[i])) return 0;
+	}
+	if(sync->pending_count >= sync->pending_size) {
+		size_t const size = MAX(16, sync->pending_size * 2);
+		str_t **const x = reallocarray(sync->pending, size, sizeof(*x));
+		if(!x) return KVS_ENOMEM;
+		sync->pending = x;
+		sync->pending_size = size;
+	}
+	sync->pending[sync->pending_count] = strdup(URI);
+	if(!sync->pending[sync->pending_count]) return KVS_ENOMEM;
+	sync->pending_count++;
+	return 0;
+}
+static void pending_remove(SLNSyncRef const sync, strarg_t const URI) {
+	if(!URI) return;
+	for(size_t i = 0; i < sync->pending_count; i++) {
+		if(0 != strcmp(URI, sync->pending[i])) continue;
+		FREE(&sync->pending[i]);
+		sync->pending_count--;
+		sync->pending[i] = sync->pending[sync->pending_count];
+		sync->pending[sync->pending_count] = NULL;
+		return;
+	}
+}
+// Stored files with unsynced hints, left over from before a restart.
+static int load_pending(SLNSyncRef const sync, KVS_txn *const txn, hint_target **const list, size_t *const count, size_t *const size) {
 	uint64_t const sessionID = SLNSessionGetID(sync->session);
+	KVS_cursor *cursor = NULL;
+	int rc = kvs_cursor_open(txn, &cursor);
+	if(rc < 0) return rc;
+
+	KVS_range range[1];
+	KVS_val val[1];
+	SLNSessionIDAndHintIDToMetaURIAndTargetURIRange1(range, txn, sessionID);
+	rc = kvs_cursor_firstr(cursor, range, NULL, val, +1);
+	for(; rc >= 0; rc = kvs_cursor_nextr(cursor, range, NULL, val, +1)) {
+		strarg_t metaURI, targetURI;
+		SLNSessionIDAndHintIDToMetaURIAndTargetURIValUnpack(val, txn, &metaURI, &targetURI);
+		uint64_t fileID = 0;
+		rc = SLNURIGetFileID(targetURI, txn, &fileID);
+		if(KVS_NOTFOUND == rc) continue;
+		if(rc < 0) break;
+		rc = get_hints_synced(sync, txn, targetURI);
+		if(rc >= 0) continue;
+		if(KVS_NOTFOUND != rc) break;
+		rc = targets_add(list, count, size, targetURI);
+		if(rc < 0) break;
+	}
+	kvs_cursor_close(cursor); cursor = NULL;
+	if(KVS_NOTFOUND == rc) rc = 0;
+	return rc;
+}
+static int resolve_hints(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const URI, hint_dependency *const deps, size_t *const ndeps, bool *const resolved) {
+	uint64_t const sessionID = SLNSessionGetID(sync->session);
+	bool missing = false;
+	uint64_t hintID = 0;
+	int rc;
+	*resolved = false;
+	for(;;) {
+		rc = SLNSyncNextHintID(sync, txn, URI, &hintID);
+		if(KVS_NOTFOUND == rc) break;
+		if(rc < 0) return rc;
+
+		KVS_val hintkey[1], hintval[1];
+		SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyPack(hintkey, txn, sessionID, hintID);
+		rc = kvs_get(txn, hintkey, hintval);
+		if(rc < 0) return rc;
+		strarg_t metaURI, targetURI;
+		SLNSessionIDAndHintIDToMetaURIAndTargetURIValUnpack(hintval, txn, &metaURI, &targetURI);
+
+		KVS_cursor *cursor = NULL;
+		rc = kvs_txn_cursor(txn, &cursor);
+		if(rc < 0) return rc;
+		KVS_range exists[1];
+		SLNURIAndFileIDRange1(exists, txn, metaURI);
+		rc = kvs_cursor_firstr(cursor, exists, NULL, NULL, +1);
+		if(rc >= 0) continue;
+		if(KVS_NOTFOUND != rc) return rc;
+
+		// Anything past a full queue is picked up by a later store.
+		missing = true;
+		if(*ndeps >= QUEUE_SIZE) break;
+		hint_dependency *const dep = &deps[(*ndeps)++];
+		dep->metaURI = strdup(metaURI);
+		dep->targetURI = strdup(targetURI);
+		if(!dep->metaURI || !dep->targetURI) return KVS_ENOMEM;
+	}
+	if(missing) return 0;
+
+	// It's critical that this happens in the same transaction
+	// as the previous call to SLNSyncNextHintID()!
+	rc = set_hints_synced(sync, txn, URI);
+	if(rc < 0) return rc;
+	*resolved = true;
+	return 0;
+}
+static int store_batch(SLNSyncRef const sync, SLNSubmissionRef const *const list, size_t const count, bool const record) {
+	if(!sync) return KVS_EINVAL;
+	if(!count) return 0;
+	hint_target *targets = NULL;
+	size_t ntargets = 0;
+	size_t targets_size = 0;
+	hint_dependency deps[QUEUE_SIZE];
+	size_t ndeps = 0;
 	SLNSubmissionRef dep = NULL;
 	KVS_env *db = NULL;
 	KVS_txn *txn = NULL;
 	uint64_t maxFileID = 0;
+	strarg_t lastFileURI = NULL;
+	strarg_t lastMetaURI = NULL;
+	bool const recording = record && !sync->reconciling;
+	bool const load = !sync->pending_loaded;
+	bool committed = false;
 	int rc = 0;
 
+	// Copied, because the list can change while we're in the database.
+	for(size_t i = 0; i < sync->pending_count; i++) {
+		rc = targets_add(&targets, &ntargets, &targets_size, sync->pending[i]);
+		if(rc < 0) goto cleanup;
+	}
+
 	rc = SLNSessionDBOpen(sync->session, SLN_RDWR, &db);
 	if(rc < 0) goto cleanup;
 	rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
 	if(rc < 0) goto cleanup;
 
-	rc = SLNSubmissionStore(sub, txn);
-	if(rc < 0) goto cleanup;
-	maxFileID = MAX(maxFileID, SLNSubmissionGetFileID(sub));
-
-	strarg_t const URI = SLNSubmissionGetPrimaryURI(sub);
-
-	// TODO: SLNSubmissionIsMetafile() ?
-	bool const isMeta = !!SLNSubmissionGetKnownTarget(sub);
-	if(!isMeta) {
-		// Keeping this in the same function makes sense
-		// because we need to manipulate the outer txn.
-		uint64_t hintID = 0;
-		for(;;) {
-			rc = SLNSyncNextHintID(sync, txn, URI, &hintID);
-			if(KVS_NOTFOUND == rc) break;
-			if(rc < 0) goto cleanup;
-
-			KVS_val hintkey[1], hintval[1];
-			SLNSessionIDAndHintIDToMetaURIAndTargetURIKeyPack(hintkey, txn, sessionID, hintID);
-			rc = kvs_get(txn, hintkey, hintval);
-			if(rc < 0) goto cleanup;
-			strarg_t u, t;
-			SLNSessionIDAndHintIDToMetaURIAndTargetURIValUnpack(hintval, txn, &u, &t);
-			assert(0 == strcmp(URI, t));
-			str_t metaURI[SLN_URI_MAX];
-			strlcpy(metaURI, u, sizeof(metaURI));
-
-			KVS_cursor *cursor = NULL;
-			rc = kvs_txn_cursor(txn, &cursor);
-			if(rc < 0) goto cleanup;
-			KVS_range exists[1];
-			SLNURIAndFileIDRange1(exists, txn, metaURI);
-			rc = kvs_cursor_firstr(cursor, exists, NULL, NULL, +1);
-			if(rc >= 0) continue;
-			if(KVS_NOTFOUND != rc) goto cleanup;
-
-			rc = kvs_txn_commit(txn); txn = NULL;
-			if(rc < 0) goto cleanup;
-			SLNSessionDBClose(sync->session, &db);
-
-
-			rc = SLNSubmissionCreate(sync->session, metaURI, URI, &dep);
-			if(rc < 0) goto cleanup;
-
-			// This skips any checks about whether we have
-			// the meta-file or target.
-			// It'd be nice to jump the queue in this case.
-			// Just as an optimization.
-			rc = queue_submission(sync, sync->metaq, dep);
-			if(rc < 0) goto cleanup;
-
-
-			rc = SLNSessionDBOpen(sync->session, SLN_RDWR, &db);
-			if(rc < 0) goto cleanup;
-			rc = kvs_txn_begin(db, NULL, KVS_RDWR, &txn);
-			if(rc < 0) goto cleanup;
-
-			rc = SLNSubmissionStore(dep, txn);
-			maxFileID = MAX(maxFileID, SLNSubmissionGetFileID(dep));
-			SLNSubmissionFree(&dep);
-			if(rc < 0) goto cleanup;
+	if(load) {
+		rc = load_pending(sync, txn, &targets, &ntargets, &targets_size);
+		if(rc < 0) goto cleanup;
+	}
+
+	for(size_t i = 0; i < count; i++) {
+		SLNSubmissionRef const sub = list[i];
+		if(!sub) rc = KVS_EINVAL;
+		if(rc < 0) goto cleanup;
+
+		rc = SLNSubmissionStore(sub, txn);
+		if(rc < 0) goto cleanup;
+		maxFileID = MAX(maxFileID, SLNSubmissionGetFileID(sub));
+
+		strarg_t const URI = SLNSubmissionGetPrimaryURI(sub);
+
+		// TODO: SLNSubmissionIsMetafile() ?
+		bool const isMeta = !!SLNSubmissionGetKnownTarget(sub);
+		if(isMeta) {
+			lastMetaURI = URI;
+			continue;
 		}
+		lastFileURI = URI;
+		rc = targets_add(&targets, &ntargets, &targets_size, URI);
+		if(rc < 0) goto cleanup;
+	}
 
-		// It's critical that this happens in the same transaction
-		// as the previous call to SLNSessionNextHintID()!
-		rc = set_hints_synced(sync, txn, URI);
+	for(size_t i = 0; i < ntargets; i++) {
+		rc = resolve_hints(sync, txn, targets[i].URI, deps, &ndeps, &targets[i].resolved);
 		if(rc < 0) goto cleanup;
 	}
 
-	// It's critical that this happens after set_hints_synced,
-	// so we restart the hints e.g. in the event of a crash.
-	rc = record_last(sync, txn, URI, isMeta);
-	if(rc < 0) goto cleanup;
+	// Files are recorded even if their hints aren't synced yet,
+	// since pending files are found again after a restart.
+	// Only the last of each kind needs recording, since the batch
+	// is committed all at once.
+	if(recording && lastFileURI) {
+		rc = record_last(sync, txn, lastFileURI, false);
+		if(rc < 0) goto cleanup;
+	}
+	if(recording && lastMetaURI) {
+		rc = record_last(sync, txn, lastMetaURI, true);
+		if(rc < 0) goto cleanup;
+	}
 
 	rc = kvs_txn_commit(txn); txn = NULL;
+	if(rc < 0) goto cleanup;
+	committed = true;
+	SLNSessionDBClose(sync->session, &db);
+
+	// Back on the event loop.
+	sync->pending_loaded = true;
+	for(size_t i = 0; i < ntargets; i++) {
+		if(targets[i].resolved) pending_remove(sync, targets[i].URI);
+		else rc = pending_add(sync, targets[i].URI);
+		if(rc < 0) goto cleanup;
+	}
+
+	// Start downloading whatever isn't already, without waiting.
+	for(size_t i = 0; i < ndeps; i++) {
+		if(queue_has(sync->depq, deps[i].metaURI)) continue;
+		// This skips any checks about whether we have
+		// the meta-file or target.
+		rc = SLNSubmissionCreate(sync->session, deps[i].metaURI, deps[i].targetURI, &dep);
+		if(rc < 0) goto cleanup;
+		rc = queue_try_push(sync, sync->depq, &dep);
+		SLNSubmissionFree(&dep);
+		if(UV_EAGAIN == rc) {
+			rc = 0;
+			break;
+		}
+		if(rc < 0) goto cleanup;
+	}
+
 cleanup:
 	kvs_txn_abort(txn); txn = NULL;
 	SLNSessionDBClose(sync->session, &db);
 	SLNSubmissionFree(&dep);
-	if(rc >= 0) SLNRepoSubmissionEmit(SLNSessionGetRepo(sync->session), maxFileID);
+	for(size_t i = 0; i < ntargets; i++) FREE(&targets[i].URI);
+	FREE(&targets);
+	for(size_t i = 0; i < ndeps; i++) {
+		FREE(&deps[i].metaURI);
+		FREE(&deps[i].targetURI);
+	}
+	if(committed) SLNRepoSubmissionEmit(SLNSessionGetRepo(sync->session), maxFileID);
 	return rc;
 }
+int SLNSyncStoreSubmission(SLNSyncRef const sync, SLNSubmissionRef const sub) {
+	if(!sub) return KVS_EINVAL;
+	return SLNSyncStoreSubmissionBatch(sync, &sub, 1);
+}
+int SLNSyncStoreSubmissionBatch(SLNSyncRef const sync, SLNSubmissionRef const *const list, size_t const count) {
+	return store_batch(sync, list, count, true);
+}
 int SLNSyncCopyLastSubmissionURIs(SLNSyncRef const sync, str_t *const outFileURI, str_t *const outMetaURI) {
 	uint64_t const sessionID = SLNSessionGetID(sync->session);
 	KVS_env *db = NULL;
@@ -11,6 +11,8 @@
 #define URI_MAX (1023+1)
 
 #define SLN_META_TYPE "application/vnd.stronglink.meta"
+#define SLN_BATCH_TYPE "application/vnd.stronglink.batch"
+#define SLN_URI_LIST_BINARY_TYPE "application/vnd.stronglink.uri-list"
 
 extern uint32_t SLNSeed;
 
@@ -22,6 +24,13 @@ enum {
 	SLN_ROOT = 0xFF,
 };
 
+// Background work (replication, preview generation) runs on its own
+// thread pool so that it can't hold up interactive requests.
+typedef enum {
+	SLN_INTERACTIVE = 0,
+	SLN_BULK,
+} SLNPriority;
+
 typedef struct SLNRepo* SLNRepoRef;
 typedef struct SLNSessionCache* SLNSessionCacheRef;
 typedef struct SLNSession* SLNSessionRef;
@@ -31,6 +40,7 @@ typedef struct SLNFilter* SLNFilterRef;
 typedef struct SLNJSONFilterParser* SLNJSONFilterParserRef;
 typedef struct SLNSync* SLNSyncRef;
 typedef struct SLNPull* SLNPullRef;
+typedef struct SLNPullScheduler* SLNPullSchedulerRef;
 
 // BerkeleyDB uses -30800 to -30999
 // MDB uses -30600 to -30799?
@@ -56,17 +66,33 @@ strarg_t SLNRepoGetDataDir(SLNRepoRef const repo);
 str_t *SLNRepoCopyInternalPath(SLNRepoRef const repo, strarg_t const internalHash);
 strarg_t SLNRepoGetTempDir(SLNRepoRef const repo);
 str_t *SLNRepoCopyTempPath(SLNRepoRef const repo);
+str_t *SLNRepoCopyPartialPath(SLNRepoRef const repo, strarg_t const URI);
 strarg_t SLNRepoGetCacheDir(SLNRepoRef const repo);
 strarg_t SLNRepoGetName(SLNRepoRef const repo);
 SLNMode SLNRepoGetPublicMode(SLNRepoRef const repo);
 SLNMode SLNRepoGetRegistrationMode(SLNRepoRef const repo);
 SLNSessionCacheRef SLNRepoGetSessionCache(SLNRepoRef const repo);
-void SLNRepoDBOpenUnsafe(SLNRepoRef const repo, KVS_env **const dbptr);
-void SLNRepoDBClose(SLNRepoRef const repo, KVS_env **const dbptr);
+SLNPullSchedulerRef SLNRepoGetPullScheduler(SLNRepoRef const repo);
+async_pool_t *SLNRepoGetPool(SLNRepoRef const repo, SLNPriority const priority);
+void SLNRepoDBOpenUnsafe(SLNRepoRef const repo, SLNPriority const priority, KVS_env **const dbptr);
+void SLNRepoDBClose(SLNRepoRef const repo, SLNPriority const priority, KVS_env **const dbptr);
 void SLNRepoSubmissionEmit(SLNRepoRef const repo, uint64_t const sortID);
 int SLNRepoSubmissionWait(SLNRepoRef const repo, uint64_t *const sortID, uint64_t const future);
+uint64_t SLNRepoSubmissionLatest(SLNRepoRef const repo);
 void SLNRepoPullsStart(SLNRepoRef const repo);
 void SLNRepoPullsStop(SLNRepoRef const repo);
+int SLNRepoRebuildStats(SLNRepoRef const repo);
+// Warns if the stats are out of date and need to be rebuilt by hand.
+int SLNRepoCheckStats(SLNRepoRef const repo);
+// Deletes sync hints that will never be needed again, up to max per
+// write transaction, starting from and updating pos. Returns how many
+// hints were checked, which is zero once it reaches the end.
+ssize_t SLNRepoSweepHints(SLNRepoRef const repo, uint64_t pos[2], size_t const max, uint64_t *const removed);
+// Offline only. Sweeps hints and rewrites the database to reclaim space.
+int SLNRepoCompact(SLNRepoRef const repo);
+int SLNRepoLoadFileFilter(SLNRepoRef const repo);
+void SLNRepoFileFilterAdd(SLNRepoRef const repo, strarg_t const internalHash);
+bool SLNRepoFileFilterMaybe(SLNRepoRef const repo, strarg_t const URI);
 
 
 // TODO: Make this private (and maybe clean it up).
@@ -74,10 +100,13 @@ void SLNRepoPullsStop(SLNRepoRef const repo);
 #define SESSION_KEY_HEX (SESSION_KEY_LEN*2)
 #define SESSION_KEY_FMT "%32[0-9a-fA-F]"
 
-int SLNSessionCacheCreate(SLNRepoRef const repo, uint16_t const size, SLNSessionCacheRef *const out);
+// Starts with room for size sessions and grows up to max as needed.
+int SLNSessionCacheCreate(SLNRepoRef const repo, size_t const size, size_t const max, SLNSessionCacheRef *const out);
 void SLNSessionCacheFree(SLNSessionCacheRef *const cacheptr);
 SLNRepoRef SLNSessionCacheGetRepo(SLNSessionCacheRef const cache);
-int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const username, strarg_t const password, SLNSessionRef *const out);
+// Returns UV_EPERM if the user or client (optional) has failed too many
+// times recently, or UV_EAGAIN if too many logins are already waiting.
+int SLNSessionCacheCreateSession(SLNSessionCacheRef const cache, strarg_t const username, strarg_t const password, strarg_t const client, SLNSessionRef *const out);
 int SLNSessionCacheLoadSessionUnsafe(SLNSessionCacheRef const cache, uint64_t const id, SLNSessionRef *const out);
 int SLNSessionCacheLoadSession(SLNSessionCacheRef const cache, uint64_t const id, byte_t const *const key, SLNSessionRef *const out);
 int SLNSessionCacheCopyActiveSession(SLNSessionCacheRef const cache, strarg_t const cookie, SLNSessionRef *const out);
@@ -90,13 +119,39 @@ typedef struct {
 	uint64_t size;
 } SLNFileInfo;
 
+typedef struct {
+	str_t *type;
+	uint64_t count;
+} SLNTypeCount;
+
+typedef struct {
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t metaFiles;
+	uint64_t terms; // Distinct
+	uint64_t fields; // Distinct
+	SLNTypeCount *types;
+	size_t typeCount;
+} SLNStats;
+
+// See SLNDigestByPrefix in SLNDB.h.
+#define SLN_DIGEST_DEPTH 4 // Hex digits per bucket
+#define SLN_DIGEST_CHILDREN 16
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+} SLNDigest;
+
 
 int SLNSessionCreateInternal(SLNSessionCacheRef const cache, uint64_t const sessionID, byte_t const *const sessionKeyRaw, byte_t const *const sessionKeyEnc, uint64_t const userID, SLNMode const mode_trusted, strarg_t const username, SLNSessionRef *const out);
+int SLNSessionCopyWithPriority(SLNSessionRef const session, SLNPriority const priority, SLNSessionRef *const out);
 SLNSessionRef SLNSessionRetain(SLNSessionRef const session);
 void SLNSessionRelease(SLNSessionRef *const sessionptr);
 SLNSessionCacheRef SLNSessionGetCache(SLNSessionRef const session);
 SLNRepoRef SLNSessionGetRepo(SLNSessionRef const session);
 uint64_t SLNSessionGetID(SLNSessionRef const session);
+SLNPriority SLNSessionGetPriority(SLNSessionRef const session);
+async_pool_t *SLNSessionGetPool(SLNSessionRef const session);
 int SLNSessionKeyValid(SLNSessionRef const session, byte_t const *const enc);
 uint64_t SLNSessionGetUserID(SLNSessionRef const session);
 bool SLNSessionHasPermission(SLNSessionRef const session, SLNMode const mask) __attribute__((warn_unused_result));
@@ -108,8 +163,20 @@ int SLNSessionCreateUser(SLNSessionRef const session, KVS_txn *const txn, strarg
 int SLNSessionCreateUserInternal(SLNSessionRef const session, KVS_txn *const txn, strarg_t const username, strarg_t const password, SLNMode const mode_unsafe);
 int SLNSessionCreateSession(SLNSessionRef const session, SLNSessionRef *const out);
 int SLNSessionGetFileInfo(SLNSessionRef const session, strarg_t const URI, SLNFileInfo *const info);
+int SLNSessionGetFileInfoBatch(SLNSessionRef const session, strarg_t const *const URIs, SLNFileInfo *const infos, int *const results, size_t const count);
+int SLNSessionHaveFiles(SLNSessionRef const session, strarg_t const *const URIs, bool *const have, size_t const count);
+// Also sets files to how many files the digests cover, or 0 if they
+// haven't been built (or the repo is empty).
+int SLNSessionGetDigests(SLNSessionRef const session, strarg_t const *const prefixes, SLNDigest *const out, size_t const count, uint64_t *const files);
+int SLNSessionCopyBucket(SLNSessionRef const session, strarg_t const bucket, str_t **const out);
 void SLNFileInfoCleanup(SLNFileInfo *const info);
+int SLNSessionGetStats(SLNSessionRef const session, SLNStats *const stats);
+void SLNStatsCleanup(SLNStats *const stats);
 int SLNSessionGetValueForField(SLNSessionRef const session, KVS_txn *const txn, strarg_t const fileURI, strarg_t const field, str_t *out, size_t const max);
+// Like SLNSessionGetValueForField for several fields at once, in one
+// transaction and one pass over the file's meta-files. Also gets the
+// file's info if it isn't NULL. Missing fields are left NULL.
+int SLNSessionCopyValuesForFields(SLNSessionRef const session, strarg_t const fileURI, strarg_t const *const fields, str_t **const values, size_t const count, SLNFileInfo *const info);
 
 int SLNSubmissionCreate(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, SLNSubmissionRef *const out);
 int SLNSubmissionCreateQuick(SLNSessionRef const session, strarg_t const knownURI, strarg_t const knownTarget, strarg_t const type, ssize_t (*read)(void *, byte_t const **), void *const context, SLNSubmissionRef *const out);
@@ -121,8 +188,27 @@ strarg_t SLNSubmissionGetType(SLNSubmissionRef const sub);
 int SLNSubmissionSetType(SLNSubmissionRef const sub, strarg_t const type);
 uv_file SLNSubmissionGetFile(SLNSubmissionRef const sub);
 uint64_t SLNSubmissionGetFileID(SLNSubmissionRef const sub); // TODO: Should this actually be sortID? Or just a method to emit directly?
+uint64_t SLNSubmissionGetSize(SLNSubmissionRef const sub);
 int SLNSubmissionWrite(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len);
+int SLNSubmissionReset(SLNSubmissionRef const sub);
+// Resumable submissions keep what they've downloaded in a partial file
+// named after knownURI, which is picked up again by the next attempt.
+// Falls back to a normal submission if the partial file is in use.
+int SLNSubmissionCreateResumable(SLNSessionRef const session, strarg_t const knownURI, SLNSubmissionRef *const out);
+bool SLNSubmissionIsResumable(SLNSubmissionRef const sub);
+// After a failed download. Resets unless the submission is resumable.
+int SLNSubmissionInterrupt(SLNSubmissionRef const sub);
+// For downloading segments in parallel. Data written past the end
+// isn't included until SLNSubmissionSetSize, which also truncates.
+int SLNSubmissionWriteAt(SLNSubmissionRef const sub, byte_t const *const buf, size_t const len, uint64_t const offset);
+int SLNSubmissionSetSize(SLNSubmissionRef const sub, uint64_t const size);
 int SLNSubmissionEnd(SLNSubmissionRef const sub);
+// Ends with a file another submission already ended, such as one fetched
+// by another pull, instead of reading and hashing it again. Anything
+// written so far is thrown away. Still checked against knownURI.
+int SLNSubmissionEndExisting(SLNSubmissionRef const sub, SLNFileInfo const *const info, str_t const *const *const URIs);
+// NULL-terminated, or NULL before the submission ends.
+str_t const *const *SLNSubmissionGetURIs(SLNSubmissionRef const sub);
 int SLNSubmissionWriteFrom(SLNSubmissionRef const sub, ssize_t (*read)(void *, byte_t const **), void *const context);
 strarg_t SLNSubmissionGetPrimaryURI(SLNSubmissionRef const sub);
 int SLNSubmissionGetFileInfo(SLNSubmissionRef const sub, SLNFileInfo *const info);
@@ -137,7 +223,7 @@ typedef struct {
 	ssize_t (*final)(void *const ctx, byte_t *const out, size_t const max);
 } SLNAlgo;
 
-SLNHasherRef SLNHasherCreate(strarg_t const type);
+SLNHasherRef SLNHasherCreate(strarg_t const type, async_pool_t *const pool, SLNPriority const priority);
 void SLNHasherFree(SLNHasherRef *const hasherptr);
 int SLNHasherWrite(SLNHasherRef const hasher, byte_t const *const buf, size_t const len);
 str_t **SLNHasherEnd(SLNHasherRef const hasher);
@@ -219,8 +305,10 @@ int SLNFilterGetPosition(SLNFilterRef const filter, SLNFilterPosition *const pos
 int SLNFilterCopyNextURI(SLNFilterRef const filter, int const dir, bool const meta, KVS_txn *const txn, str_t **const out);
 
 ssize_t SLNFilterCopyURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, int const dir, bool const meta, str_t *URIs[], size_t const max);
-ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx);
-int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx);
+// If binary is set, writes records in SLN_URI_LIST_BINARY_TYPE format
+// instead of text/uri-list. See SLNURIRecord* below.
+ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, bool const binary, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx);
+int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, bool const binary, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx);
 
 int SLNFilterCopyURISynonyms(KVS_txn *const txn, strarg_t const URI, str_t ***const out);
 
@@ -236,22 +324,70 @@ int SLNUserFilterParse(SLNSessionRef const session, strarg_t const query, SLNFil
 int SLNSyncCreate(SLNSessionRef const session, SLNSyncRef *const out);
 void SLNSyncFree(SLNSyncRef *const syncptr);
 int SLNSyncFileAvailable(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI);
+// Returns 1 if the URI was queued for a worker, 0 if there's nothing to do.
 int SLNSyncIngestFileURI(SLNSyncRef const sync, strarg_t const fileURI);
 int SLNSyncIngestMetaURI(SLNSyncRef const sync, strarg_t const metaURI, strarg_t const targetURI);
+// For URIs found by comparing digests, which come in no useful order.
+// Where we resume isn't recorded until they're all stored, so after a
+// restart we reconcile again instead of skipping the rest.
+int SLNSyncIngestReconciledURI(SLNSyncRef const sync, strarg_t const URI, strarg_t const targetURI);
 int SLNSyncWorkAwait(SLNSyncRef const sync, SLNSubmissionRef *const out);
+int SLNSyncWorkTryAwait(SLNSyncRef const sync, SLNSubmissionRef *const out);
+// Wakes up everyone waiting for work, who get UV_ECANCELED if there
+// isn't any. If one of them gets work instead, a later call might get
+// UV_ECANCELED in its place.
+void SLNSyncWorkWake(SLNSyncRef const sync);
 int SLNSyncWorkDone(SLNSyncRef const sync, SLNSubmissionRef const sub);
+int SLNSyncWorkSkip(SLNSyncRef const sync, SLNSubmissionRef const sub);
 int SLNSyncNextHintID(SLNSyncRef const sync, KVS_txn *const txn, strarg_t const targetURI, uint64_t *const hintID);
 int SLNSyncStoreSubmission(SLNSyncRef const sync, SLNSubmissionRef const sub);
+int SLNSyncStoreSubmissionBatch(SLNSyncRef const sync, SLNSubmissionRef const *const list, size_t const count);
 int SLNSyncCopyLastSubmissionURIs(SLNSyncRef const sync, str_t *const outFileURI, str_t *const outMetaURI);
 
-int SLNPullCreate(SLNSessionCacheRef const cache, uint64_t const sessionID, strarg_t const certhash, strarg_t const host, strarg_t const path, strarg_t const query, strarg_t const cookie, SLNPullRef *const out);
+int SLNPullCreate(SLNSessionCacheRef const cache, SLNPullSchedulerRef const sched, uint64_t const sessionID, strarg_t const certhash, strarg_t const host, strarg_t const path, strarg_t const query, strarg_t const cookie, SLNPullRef *const out);
 void SLNPullFree(SLNPullRef *const pullptr);
 int SLNPullStart(SLNPullRef const pull);
 void SLNPullStop(SLNPullRef const pull);
 
+// Shared by all of a repo's pulls, so that a file wanted from several
+// peers is only fetched once, preferably from the fastest, and so that
+// bulk downloads can't crowd out meta-files and small files.
+typedef enum {
+	SLN_PULL_META = 0,
+	SLN_PULL_SMALL,
+	SLN_PULL_BULK, // Large or resumed files
+} SLNPullClass;
+#define SLN_PULL_CLASS_COUNT 3
+#define SLN_PULL_FETCHED 1 // Another peer fetched it, copy theirs
+
+int SLNPullSchedulerCreate(SLNPullSchedulerRef *const out);
+void SLNPullSchedulerFree(SLNPullSchedulerRef *const schedptr);
+// Rates are in bytes per second. 0 for unlimited.
+// Active is connections in total, peerActive per peer.
+void SLNPullSchedulerConfig(SLNPullSchedulerRef const sched, uint64_t const rate, uint64_t const peerRate, unsigned const active, unsigned const peerActive, unsigned const bulk);
+int SLNPullSchedulerAddPeer(SLNPullSchedulerRef const sched, size_t *const out);
+void SLNPullSchedulerRemovePeer(SLNPullSchedulerRef const sched, size_t const peer);
+// Once a URI is queued. Every Want or Claim needs a Release.
+int SLNPullSchedulerWant(SLNPullSchedulerRef const sched, size_t const peer, strarg_t const URI);
+// Returns 0 if we should fetch it, or SLN_PULL_FETCHED with the info
+// and URIs of the copy to use instead (see SLNSubmissionEndExisting).
+// Without wait, returns UV_EAGAIN if another peer is fetching it or should.
+int SLNPullSchedulerClaim(SLNPullSchedulerRef const sched, size_t const peer, strarg_t const URI, bool const wait, SLNFileInfo *const info, str_t ***const URIs);
+// Fetched is the ended submission, or NULL if we didn't fetch it.
+void SLNPullSchedulerRelease(SLNPullSchedulerRef const sched, size_t const peer, strarg_t const URI, SLNSubmissionRef const fetched);
+// Connection slots, with lower classes waiting for higher ones.
+int SLNPullSchedulerEnter(SLNPullSchedulerRef const sched, size_t const peer, SLNPullClass const class);
+bool SLNPullSchedulerTryEnter(SLNPullSchedulerRef const sched, size_t const peer, SLNPullClass const class);
+void SLNPullSchedulerLeave(SLNPullSchedulerRef const sched, size_t const peer, SLNPullClass const class);
+// Waits if the new class is bulk and full. Keeps the old class on error.
+int SLNPullSchedulerReclassify(SLNPullSchedulerRef const sched, size_t const peer, SLNPullClass const from, SLNPullClass const to);
+// Call after reading len bytes. Sleeps if over the rate limits.
+void SLNPullSchedulerThrottle(SLNPullSchedulerRef const sched, size_t const peer, size_t const len);
+
 #define SLN_URI_MAX (511+1) // Otherwise use URI_MAX.
 #define SLN_URI_FMT "%511[a-zA-Z0-9.%_:/-]"
 #define SLN_INTERNAL_ALGO "sha256" // Defines part of our on-disk format.
+#define SLN_INTERNAL_HASH_LEN 64 // Hex digits
 #define SLN_ALGO_SIZE (31+1)
 #define SLN_HASH_SIZE (255+1)
 #define SLN_ALGO_FMT "%31[a-zA-Z0-9.-]"
@@ -272,4 +408,55 @@ static str_t *SLNFormatURI(strarg_t const algo, strarg_t const hash) {
 	return aasprintf("hash://%s/%s", algo, hash);
 }
 
+// SLN_URI_LIST_BINARY_TYPE is a stream of records, each one a two byte
+// (big endian) length followed by that many bytes. Empty records are
+// keep-alives. A record is an algorithm ID, a digest length and the raw
+// digest. For meta-files, it's followed by the target: an algorithm ID
+// and the raw digest, or ID 0 and the URI as text, to the end.
+#define SLN_URI_RECORD_MAX (2+2+255+1+SLN_URI_MAX)
+static uint8_t SLNAlgoID(strarg_t const algo) {
+	// Never reuse or renumber these.
+	if(0 == strcmp(algo, "sha256")) return 1;
+	if(0 == strcmp(algo, "sha1")) return 2;
+	if(0 == strcmp(algo, "sha512")) return 3;
+	return 0;
+}
+static strarg_t SLNAlgoName(uint8_t const id) {
+	switch(id) {
+		case 1: return "sha256";
+		case 2: return "sha1";
+		case 3: return "sha512";
+		default: return NULL;
+	}
+}
+// Returns the number of bytes written (ID and digest), or UV_EINVAL if
+// the URI can't be represented exactly that way.
+static ssize_t SLNURIRecordPackHash(strarg_t const URI, byte_t *const out, size_t const max) {
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	int rc = SLNParseURI(URI, algo, hash);
+	if(rc < 0) return rc;
+	uint8_t const id = SLNAlgoID(algo);
+	size_t const len = strlen(hash);
+	if(!id) return UV_EINVAL;
+	if(len % 2 || 1+len/2 > max) return UV_EINVAL;
+	// Only lowercase hex survives the round trip.
+	if(strspn(hash, "0123456789abcdef") != len) return UV_EINVAL;
+	// Reject anything SLNParseURI allowed after the hash.
+	if(strlen(URI) != strlen("hash://")+strlen(algo)+1+len) return UV_EINVAL;
+	out[0] = id;
+	tobin(out+1, hash, len);
+	return 1+len/2;
+}
+static int SLNURIRecordUnpackHash(uint8_t const id, byte_t const *const buf, size_t const len, str_t *const out, size_t const max) {
+	strarg_t const algo = SLNAlgoName(id);
+	if(!algo) return UV_EINVAL;
+	size_t const prefix = strlen("hash://")+strlen(algo)+1;
+	if(prefix+len*2+1 > max) return UV_ENAMETOOLONG;
+	snprintf(out, max, "hash://%s/", algo);
+	tohex(out+prefix, buf, len);
+	out[prefix+len*2] = '\0';
+	return 0;
+}
+
 #endif
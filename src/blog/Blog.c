@@ -5,6 +5,7 @@
 #include <yajl/yajl_tree.h>
 #include <limits.h>
 #include <time.h>
+#include "../util/httplog.h"
 #include "Blog.h"
 #include "../../deps/content-disposition/content-disposition.h"
 
@@ -15,67 +16,18 @@
 #define RESULTS_MAX 10
 #define BUFFER_SIZE (1024 * 8)
 #define AUTH_FORM_MAX (1023+1)
+#define AUTH_RETRY_AFTER "60" // Seconds
 
 
-static str_t *BlogCopyPreviewPath(BlogRef const blog, strarg_t const hash) {
+str_t *BlogCopyPreviewPath(BlogRef const blog, strarg_t const hash) {
 	return aasprintf("%s/%.2s/%s", blog->cacheDir, hash, hash);
 }
 
 
-static bool gen_pending(BlogRef const blog, strarg_t const path) {
-	for(size_t i = 0; i < PENDING_MAX; i++) {
-		if(!blog->pending[i]) continue;
-		if(0 == strcmp(blog->pending[i], path)) return true;
-	}
-	return false;
-}
-static bool gen_available(BlogRef const blog, strarg_t const path, size_t *const slot) {
-	for(size_t i = 0; i < PENDING_MAX; i++) {
-		if(blog->pending[i]) continue;
-		blog->pending[i] = path;
-		*slot = i;
-		return true;
-	}
-	return false;
+static int write_template(PageRef const page, TemplateRef const t, TemplateArgCBs const *const cbs, void const *const actx) {
+	return TemplateWrite(t, cbs, actx, (TemplateWritev)PageWritev, page);
 }
-static void gen_preview(BlogRef const blog, SLNSessionRef const session, strarg_t const URI, strarg_t const path) {
-	// It's okay to accidentally regenerate a preview
-	// It's okay to send an error if another thread tried to gen and failed
-	// We want to minimize false positives and false negatives
-	// In particular, if a million connections request a new file at once,
-	// we want to avoid starting gen for each connection before any of them
-	// have finished
-	// Capping the total number of concurrent gens to PENDING_MAX is not
-	// a bad side effect
-	bool beat_us_to_it = false;
-	size_t slot = SIZE_MAX;
-	async_mutex_lock(blog->pending_mutex);
-	for(;; async_cond_wait(blog->pending_cond, blog->pending_mutex)) {
-		if(gen_pending(blog, path)) { beat_us_to_it = true; continue; }
-		if(beat_us_to_it) break;
-		if(gen_available(blog, path, &slot)) break;
-	}
-	async_mutex_unlock(blog->pending_mutex);
-
-	if(beat_us_to_it) return; // Note: we don't know their return status.
-	assert(slot < PENDING_MAX);
-
-	SLNFileInfo src[1];
-	int rc = SLNSessionGetFileInfo(session, URI, src);
-	if(rc >= 0) {
-		rc = -1;
-		rc = rc >= 0 ? rc : BlogConvert(blog, session, path, NULL, URI, src);
-		rc = rc >= 0 ? rc : BlogGeneric(blog, session, path, URI, src);
-		SLNFileInfoCleanup(src);
-	}
-
-	async_mutex_lock(blog->pending_mutex);
-	assert(path == blog->pending[slot]);
-	blog->pending[slot] = NULL;
-	async_cond_broadcast(blog->pending_cond);
-	async_mutex_unlock(blog->pending_mutex);
-}
-static int send_preview(BlogRef const blog, HTTPConnectionRef const conn, SLNSessionRef const session, strarg_t const URI, strarg_t const path) {
+static int send_preview(BlogRef const blog, PageRef const page, SLNSessionRef const session, strarg_t const URI, strarg_t const path) {
 	if(!path) return UV_EINVAL;
 
 	preview_state const state = {
@@ -83,25 +35,28 @@ static int send_preview(BlogRef const blog, HTTPConnectionRef const conn, SLNSes
 		.session = session,
 		.fileURI = URI,
 	};
-	int rc = TemplateWriteHTTPChunk(blog->entry_start, &preview_cbs, &state, conn);
+	int rc = write_template(page, blog->entry_start, &preview_cbs, &state);
 	if(rc < 0) return rc;
 
-	rc = HTTPConnectionWriteChunkFile(conn, path);
+	rc = PageWriteFile(page, path);
 	if(rc >= 0) {
-		rc = TemplateWriteHTTPChunk(blog->entry_end, &preview_cbs, &state, conn);
+		rc = write_template(page, blog->entry_end, &preview_cbs, &state);
 		return rc;
 	}
 	if(UV_ENOENT != rc) return rc;
 
-	gen_preview(blog, session, URI, path);
-
-	rc = HTTPConnectionWriteChunkFile(conn, path);
+	rc = BlogGenPreview(blog->gen, session, URI, path);
+	if(rc >= 0) rc = PageWriteFile(page, path);
+	else rc = UV_ENOENT; // Couldn't generate it (at least for now).
 	if(UV_ENOENT == rc) {
-		rc = TemplateWriteHTTPChunk(blog->empty, &preview_cbs, &state, conn);
+		// Don't cache the placeholder, the preview might turn up
+		// before anything else changes.
+		PageSetIncomplete(page);
+		rc = write_template(page, blog->empty, &preview_cbs, &state);
 	}
 	if(rc < 0) return rc;
 
-	rc = TemplateWriteHTTPChunk(blog->entry_end, &preview_cbs, &state, conn);
+	rc = write_template(page, blog->entry_end, &preview_cbs, &state);
 	if(rc < 0) return rc;
 	return 0;
 }
@@ -120,6 +75,7 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	str_t *query_HTMLSafe = NULL;
 	str_t *parsed_HTMLSafe = NULL;
 	SLNFilterRef filter = NULL;
+	PageRef page = NULL;
 	int rc;
 
 	static strarg_t const fields[] = {
@@ -165,6 +121,17 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	if(max > numberof(URIs)) max = numberof(URIs);
 	bool const has_start = !!pos->URI;
 
+	// Before we look at anything that a submission could change.
+	rc = PageCreate(blog->pages, &page);
+	if(rc < 0) {
+		SLNFilterPositionCleanup(pos);
+		FREE(&query);
+		FREE(&query_HTMLSafe);
+		FREE(&parsed_HTMLSafe);
+		SLNFilterFree(&filter);
+		return 500;
+	}
+
 	uint64_t const t1 = uv_hrtime();
 
 	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, outdir, false, URIs, (size_t)max);
@@ -174,6 +141,7 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 		FREE(&query_HTMLSafe);
 		FREE(&parsed_HTMLSafe);
 		SLNFilterFree(&filter);
+		PageFree(&page);
 		if(KVS_NOTFOUND == count) {
 			// Possibly a filter age-function bug.
 			alogf("Invalid start parameter? %s\n", URI);
@@ -244,38 +212,26 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 		{NULL, NULL},
 	};
 
-	if(count > 0) {
-		HTTPConnectionWriteResponse(conn, 200, "OK");
-	} else {
-		HTTPConnectionWriteResponse(conn, 404, "Not Found");
-	}
-	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
-	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
-	if(0 == SLNSessionGetUserID(session)) {
-		HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache, public");
-	} else {
-		HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache, private");
-	}
-	HTTPConnectionBeginBody(conn);
-	TemplateWriteHTTPChunk(blog->header, &TemplateStaticCBs, args, conn);
+	// The whole page is rendered before sending, so that anonymous
+	// readers can share it. See PageCache.h.
+	rc = write_template(page, blog->header, &TemplateStaticCBs, args);
 
-	if(0 == count) {
-		TemplateWriteHTTPChunk(blog->noresults, &TemplateStaticCBs, args, conn);
+	if(rc >= 0 && 0 == count) {
+		rc = write_template(page, blog->noresults, &TemplateStaticCBs, args);
 	}
-	for(size_t i = 0; i < count; i++) {
+	for(size_t i = 0; rc >= 0 && i < count; i++) {
 		str_t algo[SLN_ALGO_SIZE]; // SLN_INTERNAL_ALGO
 		str_t hash[SLN_HASH_SIZE];
 		SLNParseURI(URIs[i], algo, hash);
 		str_t *previewPath = BlogCopyPreviewPath(blog, hash);
-		rc = send_preview(blog, conn, session, URIs[i], previewPath);
+		rc = send_preview(blog, page, session, URIs[i], previewPath);
 		FREE(&previewPath);
-		if(rc < 0) break;
 	}
 
 	// TODO: HACK
 	// Hide the pagination buttons when there are less than one full page of results.
-	if(count >= max || has_start) {
-		TemplateWriteHTTPChunk(blog->footer, &TemplateStaticCBs, args, conn);
+	if(rc >= 0 && (count >= max || has_start)) {
+		rc = write_template(page, blog->footer, &TemplateStaticCBs, args);
 	}
 
 	FREE(&reponame_HTMLSafe);
@@ -289,11 +245,16 @@ static int GET_query(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	FREE(&lastpage_HTMLSafe);
 	FREE(&qs_HTMLSafe);
 
-	HTTPConnectionWriteChunkEnd(conn);
-	HTTPConnectionEnd(conn);
-
 	for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
 	assert_zeroed(URIs, count);
+
+	if(rc < 0) {
+		PageFree(&page);
+		return 500;
+	}
+	uint16_t const status = count > 0 ? 200 : 404;
+	PageSend(blog->pages, page, session, conn, method, URI, headers, status, "text/html; charset=utf-8");
+	PageFree(&page);
 	return 0;
 }
 
@@ -304,25 +265,21 @@ static int GET_compose(BlogRef const blog, SLNSessionRef const session, HTTPConn
 
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return 403;
 
-	str_t *reponame_HTMLSafe = htmlenc(SLNRepoGetName(blog->repo));
-	if(!reponame_HTMLSafe) return 500;
 	TemplateStaticArg const args[] = {
-		{"reponame", reponame_HTMLSafe},
+		{"reponame", SLNRepoGetName(blog->repo)},
 		{"token", "asdf"},
 		{NULL, NULL},
 	};
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
+	httplog_response(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		TemplateWriteHTTPChunk(blog->compose, &TemplateStaticCBs, args, conn);
+		TemplateWriteHTTPChunk(blog->compose, &TemplateEscapedCBs, args, conn);
 		HTTPConnectionWriteChunkEnd(conn);
 	}
 	HTTPConnectionEnd(conn);
-
-	FREE(&reponame_HTMLSafe);
 	return 0;
 }
 static int GET_upload(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
@@ -331,25 +288,21 @@ static int GET_upload(BlogRef const blog, SLNSessionRef const session, HTTPConne
 
 	if(!SLNSessionHasPermission(session, SLN_WRONLY)) return 403;
 
-	str_t *reponame_HTMLSafe = htmlenc(SLNRepoGetName(blog->repo));
-	if(!reponame_HTMLSafe) return 500;
 	TemplateStaticArg const args[] = {
-		{"reponame", reponame_HTMLSafe},
+		{"reponame", SLNRepoGetName(blog->repo)},
 		{"token", "asdf"},
 		{NULL, NULL},
 	};
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
+	httplog_response(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		TemplateWriteHTTPChunk(blog->upload, &TemplateStaticCBs, args, conn);
+		TemplateWriteHTTPChunk(blog->upload, &TemplateEscapedCBs, args, conn);
 		HTTPConnectionWriteChunkEnd(conn);
 	}
 	HTTPConnectionEnd(conn);
-
-	FREE(&reponame_HTMLSafe);
 	return 0;
 }
 
@@ -560,7 +513,7 @@ static int POST_post(BlogRef const blog,
 	if(!location) rc = UV_ENOMEM;
 	if(rc < 0) goto cleanup;
 
-	HTTPConnectionSendRedirect(conn, 303, location);
+	httplog_send_redirect(conn, 303, location);
 
 cleanup:
 	if(json) { yajl_gen_free(json); json = NULL; }
@@ -580,27 +533,23 @@ static int GET_account(BlogRef const blog, SLNSessionRef const session, HTTPConn
 	if(HTTP_GET != method && HTTP_HEAD != method) return -1;
 	if(0 != uripathcmp("/account", URI, NULL)) return -1;
 
-	str_t *reponame_HTMLSafe = htmlenc(SLNRepoGetName(blog->repo));
-	if(!reponame_HTMLSafe) return 500;
 	TemplateStaticArg const args[] = {
-		{"reponame", reponame_HTMLSafe},
+		{"reponame", SLNRepoGetName(blog->repo)},
 		{"token", "asdf"}, // TODO
 		{"userlen", "32"},
 		{"passlen", "64"},
 		{NULL, NULL},
 	};
 
-	HTTPConnectionWriteResponse(conn, 200, "OK");
+	httplog_response(conn, 200, "OK");
 	HTTPConnectionWriteHeader(conn, "Content-Type", "text/html; charset=utf-8");
 	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
 	HTTPConnectionBeginBody(conn);
 	if(HTTP_HEAD != method) {
-		TemplateWriteHTTPChunk(blog->login, &TemplateStaticCBs, args, conn);
+		TemplateWriteHTTPChunk(blog->login, &TemplateEscapedCBs, args, conn);
 		HTTPConnectionWriteChunkEnd(conn);
 	}
 	HTTPConnectionEnd(conn);
-
-	FREE(&reponame_HTMLSafe);
 	return 0;
 }
 static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
@@ -633,12 +582,32 @@ static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 		QSValuesCleanup(values, numberof(values));
 		return 400; // Not login?
 	}
+	// We don't get the peer address, so clients are only throttled
+	// behind our own proxy. It appends the address it saw, and anything
+	// before that came from the client.
+	str_t client[63+1]; client[0] = '\0';
+	strarg_t const forwarded = blog->proxied ?
+		HTTPHeadersGet(headers, "x-forwarded-for") : NULL;
+	if(forwarded) {
+		strarg_t const last = strrchr(forwarded, ',');
+		sscanf(last ? last+1 : forwarded, " %63[^, ]", client);
+	}
+
 	SLNSessionRef s;
-	int rc = SLNSessionCacheCreateSession(cache, values[2], values[3], &s); // TODO
+	int rc = SLNSessionCacheCreateSession(cache, values[2], values[3], client[0] ? client : NULL, &s); // TODO
 	QSValuesCleanup(values, numberof(values));
 
+	if(UV_EPERM == rc || UV_EAGAIN == rc) {
+		if(UV_EPERM == rc) httplog_response(conn, 429, "Too Many Requests");
+		else httplog_response(conn, 503, "Service Unavailable");
+		HTTPConnectionWriteHeader(conn, "Retry-After", AUTH_RETRY_AFTER);
+		httplog_content_length(conn, 0);
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		return 0;
+	}
 	if(rc < 0) {
-		HTTPConnectionSendRedirect(conn, 303, "/account?err=1");
+		httplog_send_redirect(conn, 303, "/account?err=1");
 		return 0;
 	}
 
@@ -646,10 +615,10 @@ static int POST_auth(BlogRef const blog, SLNSessionRef const session, HTTPConnec
 	SLNSessionRelease(&s);
 	if(!cookie) return 500;
 
-	HTTPConnectionWriteResponse(conn, 303, "See Other");
+	httplog_response(conn, 303, "See Other");
 	HTTPConnectionWriteHeader(conn, "Location", "/");
 	HTTPConnectionWriteSetCookie(conn, cookie, "/", 60 * 60 * 24 * 365);
-	HTTPConnectionWriteContentLength(conn, 0);
+	httplog_content_length(conn, 0);
 	HTTPConnectionBeginBody(conn);
 	HTTPConnectionEnd(conn);
 
@@ -677,12 +646,13 @@ static int load_template(BlogRef const blog, strarg_t const name, TemplateRef *c
 	*out = t; t = NULL;
 	return 0;
 }
-BlogRef BlogCreate(SLNRepoRef const repo) {
+BlogRef BlogCreate(SLNRepoRef const repo, PageCacheRef const pages) {
 	assertf(repo, "Blog requires valid repo");
 
 	BlogRef blog = calloc(1, sizeof(struct Blog));
 	if(!blog) return NULL;
 	blog->repo = repo;
+	blog->pages = pages;
 
 	blog->dir = aasprintf("%s/blog", SLNRepoGetDir(repo));
 	blog->cacheDir = aasprintf("%s/blog", SLNRepoGetCacheDir(repo));
@@ -713,8 +683,11 @@ BlogRef BlogCreate(SLNRepoRef const repo) {
 		return NULL;
 	}
 
-	async_mutex_init(blog->pending_mutex, 0);
-	async_cond_init(blog->pending_cond, 0);
+	rc = BlogGenCreate(blog, &blog->gen);
+	if(rc < 0) {
+		BlogFree(&blog);
+		return NULL;
+	}
 
 	return blog;
 }
@@ -739,8 +712,9 @@ void BlogFree(BlogRef *const blogptr) {
 	TemplateFree(&blog->notfound);
 	TemplateFree(&blog->noresults);
 
-	async_mutex_destroy(blog->pending_mutex);
-	async_cond_destroy(blog->pending_cond);
+	BlogGenFree(&blog->gen);
+	blog->pages = NULL;
+	blog->proxied = false;
 
 	assert_zeroed(blog, 1);
 	FREE(blogptr); blog = NULL;
@@ -772,7 +746,7 @@ int BlogDispatch(BlogRef const blog, SLNSessionRef const session, HTTPConnection
 	rc = rc >= 0 ? rc : POST_auth(blog, session, conn, method, URI, headers);
 
 	if(403 == rc) {
-		HTTPConnectionSendRedirect(conn, 303, "/account");
+		httplog_send_redirect(conn, 303, "/account");
 		return 0;
 	}
 	if(rc >= 0) return rc; // TODO: Pretty 404 pages, etc.
@@ -800,13 +774,13 @@ int BlogDispatch(BlogRef const blog, SLNSessionRef const session, HTTPConnection
 
 	strarg_t const ext = strrchr(path, '.');
 	strarg_t const type = exttype(ext);
-	rc = HTTPConnectionSendFile(conn, path, type, -1);
+	rc = httplog_send_file(conn, path, type, -1);
 	if(UV_EISDIR == rc) {
 		str_t location[URI_MAX];
 		rc = snprintf(location, sizeof(location), "%s/", URI);
 		if(rc >= sizeof(location)) return 414; // Request-URI Too Large
 		if(rc < 0) return 500;
-		HTTPConnectionSendRedirect(conn, 301, location);
+		httplog_send_redirect(conn, 301, location);
 		return 0;
 	}
 	if(rc < 0 && UV_EPIPE != rc) {
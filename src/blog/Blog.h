@@ -6,11 +6,11 @@
 #include <async/http/MultipartForm.h>
 #include <async/http/QueryString.h>
 #include "../StrongLink.h"
+#include "PageCache.h"
 #include "Template.h"
 
 typedef struct Blog* BlogRef;
-
-#define PENDING_MAX 4
+typedef struct BlogGen* BlogGenRef;
 
 struct Blog {
 	SLNRepoRef repo;
@@ -30,12 +30,12 @@ struct Blog {
 	TemplateRef notfound;
 	TemplateRef noresults;
 
-	async_mutex_t pending_mutex[1];
-	async_cond_t pending_cond[1];
-	strarg_t pending[PENDING_MAX];
+	BlogGenRef gen;
+	PageCacheRef pages; // Optional, not owned
+	bool proxied; // Trust X-Forwarded-For
 };
 
-BlogRef BlogCreate(SLNRepoRef const repo);
+BlogRef BlogCreate(SLNRepoRef const repo, PageCacheRef const pages);
 void BlogFree(BlogRef *const blogptr);
 int BlogDispatch(BlogRef const blog, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
 
@@ -51,11 +51,44 @@ int BlogGeneric(BlogRef const blog,
                 strarg_t const URI,
                 SLNFileInfo const *const src);
 
+str_t *BlogCopyPreviewPath(BlogRef const blog, strarg_t const hash);
+
+// Generates previews on a pool of worker fibers, one job per preview no
+// matter how many requests want it. Until configured with some workers,
+// the first request does the work itself. Recent failures are remembered
+// so broken files aren't converted again on every page view.
+// Up to background workers at a time generate previews nobody has asked
+// for yet, behind any that readers are waiting on.
+int BlogGenCreate(BlogRef const blog, BlogGenRef *const out);
+void BlogGenFree(BlogGenRef *const genptr);
+void BlogGenConfig(BlogGenRef const gen, unsigned const workers, unsigned const queue, unsigned const background);
+async_pool_t *BlogGenGetPool(BlogGenRef const gen);
+// Waits for the preview at path to be generated. Returns UV_EAGAIN if
+// too many are queued already, or why it couldn't be generated.
+int BlogGenPreview(BlogGenRef const gen, SLNSessionRef const session, strarg_t const URI, strarg_t const path);
+// Generates previews for new submissions in the background.
+void BlogGenWatch(BlogGenRef const gen);
+// Generates previews for every file in the repository and waits for them.
+int BlogGenPrewarm(BlogGenRef const gen, uint64_t *const count);
+
 // TODO: Get rid of this stuff, or refactor it.
+#define PREVIEW_FIELDS_MAX 32
+
+// Everything one template needs from the database, loaded at once.
+typedef struct {
+	strarg_t fields[PREVIEW_FIELDS_MAX];
+	str_t *values[PREVIEW_FIELDS_MAX];
+	size_t count;
+	SLNFileInfo info[1];
+} preview_meta;
+int preview_meta_load(preview_meta *const meta, SLNSessionRef const session, strarg_t const URI, TemplateRef const t);
+void preview_meta_cleanup(preview_meta *const meta);
+
 typedef struct {
 	BlogRef blog;
 	SLNSessionRef session;
 	strarg_t fileURI;
+	preview_meta const *meta; // Optional, otherwise looked up one by one
 } preview_state;
 extern TemplateArgCBs const preview_cbs;
 
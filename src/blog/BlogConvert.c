@@ -3,6 +3,7 @@
 
 #include <sys/mman.h>
 #include <yajl/yajl_gen.h>
+#include "../util/metrics.h"
 #include "Blog.h"
 
 typedef int (*BlogTypeCheck)(strarg_t const type);
@@ -88,11 +89,14 @@ static int convert(BlogRef const blog,
 	yajl_gen_config(json, yajl_gen_print_callback, (void (*)())SLNSubmissionWrite, meta);
 	yajl_gen_config(json, yajl_gen_beautify, (int)true);
 
-	async_pool_enter(NULL);
+	// Preview generation has its own pool even when a reader is waiting
+	// on it, so that a burst of new previews can't stall the whole server.
+	async_pool_t *const pool = BlogGenGetPool(blog->gen);
+	metrics_pool_enter(pool, METRIC_POOL_PREVIEW);
 	yajl_gen_map_open(json);
 	rc = converter(html, json, buf, src->size, src->type);
 	yajl_gen_map_close(json);
-	async_pool_leave(NULL);
+	async_pool_leave(pool);
 	if(rc < 0) goto cleanup;
 
 	rc = async_fs_fdatasync(html);
@@ -149,12 +153,17 @@ int BlogGeneric(BlogRef const blog,
 	if(rc < 0) goto cleanup;
 	html = rc;
 
+	// If this fails, variables are looked up individually instead.
+	preview_meta meta[1];
+	bool const loaded = preview_meta_load(meta, session, URI, blog->preview) >= 0;
 	preview_state const state = {
 		.blog = blog,
 		.session = session,
 		.fileURI = URI,
+		.meta = loaded ? meta : NULL,
 	};
 	rc = TemplateWriteFile(blog->preview, &preview_cbs, &state, html);
+	if(loaded) preview_meta_cleanup(meta);
 	if(rc < 0) goto cleanup;
 
 	rc = async_fs_fdatasync(html);
@@ -172,6 +181,34 @@ cleanup:
 
 
 
+int preview_meta_load(preview_meta *const meta, SLNSessionRef const session, strarg_t const URI, TemplateRef const t) {
+	assert(meta);
+	memset(meta, 0, sizeof(*meta));
+	size_t const count = TemplateGetVars(t, meta->fields, numberof(meta->fields));
+	// Any past the limit are looked up individually.
+	meta->count = MIN(count, numberof(meta->fields));
+	int rc = SLNSessionCopyValuesForFields(session, URI, meta->fields, meta->values, meta->count, meta->info);
+	if(rc < 0) memset(meta, 0, sizeof(*meta));
+	return rc;
+}
+void preview_meta_cleanup(preview_meta *const meta) {
+	if(!meta) return;
+	for(size_t i = 0; i < meta->count; i++) {
+		meta->fields[i] = NULL;
+		FREE(&meta->values[i]);
+	}
+	meta->count = 0;
+	SLNFileInfoCleanup(meta->info);
+	assert_zeroed(meta, 1);
+}
+static ssize_t preview_meta_find(preview_meta const *const meta, strarg_t const var) {
+	if(!meta) return -1;
+	for(size_t i = 0; i < meta->count; i++) {
+		if(0 == strcmp(meta->fields[i], var)) return i;
+	}
+	return -1;
+}
+
 // TODO
 static str_t *preview_metadata(preview_state const *const state, strarg_t const var) {
 	int rc;
@@ -215,7 +252,12 @@ static str_t *preview_metadata(preview_state const *const state, strarg_t const
 		// TODO: Really, we should already have this info from when
 		// we got the URI in the first place.
 		SLNFileInfo info[1];
-		rc = SLNSessionGetFileInfo(state->session, state->fileURI, info);
+		rc = 0;
+		if(state->meta) {
+			*info = *state->meta->info;
+		} else {
+			rc = SLNSessionGetFileInfo(state->session, state->fileURI, info);
+		}
 		if(rc >= 0) {
 			double const size = info->size;
 			double base = 1.0;
@@ -230,15 +272,17 @@ static str_t *preview_metadata(preview_state const *const state, strarg_t const
 			unsafe = buf;
 			// P.S. Fuck scientific prefixes.
 		}
-		SLNFileInfoCleanup(info);
+		if(rc >= 0 && !state->meta) SLNFileInfoCleanup(info);
 	}
 	if(unsafe) return htmlenc(unsafe);
 
 	str_t value[1024 * 4];
-	// TODO: Load all vars for the template in one transaction.
+	ssize_t const i = preview_meta_find(state->meta, var);
 	KVS_env *db = NULL;
-	rc = SLNSessionDBOpen(state->session, SLN_RDONLY, &db);
-	if(rc >= 0) {
+	rc = i >= 0 ? 0 : SLNSessionDBOpen(state->session, SLN_RDONLY, &db);
+	if(i >= 0) {
+		unsafe = state->meta->values[i];
+	} else if(rc >= 0) {
 		KVS_txn *txn = NULL;
 		rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
 		if(rc >= 0) {
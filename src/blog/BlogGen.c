@@ -0,0 +1,488 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "Blog.h"
+
+#define TABLE_SIZE 1024 // Hash buckets for previews in flight
+#define FAILED_MAX 1024 // Failures remembered at once
+#define FAILED_TTL (1000 * 60 * 10) // Before retrying a broken file
+#define PENDING 1
+#define WATCH_BATCH 64
+#define WATCH_TIMEOUT (1000 * 1) // Between checks for shutdown
+
+// A preview being generated, or one that failed recently.
+// Every request for the same preview waits on the same job, so
+// a million readers of a new post only cause one conversion.
+typedef struct job job;
+struct job {
+	job *next; // Hash chain
+	job *qnext; // Work queue
+	str_t *path;
+	str_t *URI;
+	SLNSessionRef session;
+	int status; // PENDING until done
+	uint64_t expires; // Non-zero for remembered failures
+	unsigned waiters;
+	bool linked; // Still in the table
+	bool queued;
+	bool background; // Nobody is waiting for it
+	async_cond_t cond[1]; // Broadcast when done
+};
+
+typedef struct {
+	job *head;
+	job *tail;
+	size_t count;
+} queue;
+
+struct BlogGen {
+	BlogRef blog;
+	async_pool_t *pool;
+	async_mutex_t mutex[1];
+	async_cond_t cond[1]; // For workers, and for Free to see them exit
+	async_cond_t idle[1]; // Broadcast as background jobs are taken
+	job *table[TABLE_SIZE];
+	queue urgent[1];
+	queue background[1];
+	size_t failed;
+	unsigned workers; // Running
+	unsigned target; // 0 to convert on the requesting fiber
+	unsigned queue_max;
+	unsigned background_active;
+	unsigned background_max; // 0 for no background generation
+	SLNSessionRef session; // For background jobs
+	bool watching;
+};
+
+static void worker(void *const arg);
+static void watcher(void *const arg);
+
+int BlogGenCreate(BlogRef const blog, BlogGenRef *const out) {
+	assert(out);
+	BlogGenRef gen = calloc(1, sizeof(struct BlogGen));
+	if(!gen) return UV_ENOMEM;
+	gen->pool = async_pool_create();
+	if(!gen->pool) {
+		FREE(&gen);
+		return UV_ENOMEM;
+	}
+	gen->blog = blog;
+	async_mutex_init(gen->mutex, 0);
+	async_cond_init(gen->cond, 0);
+	async_cond_init(gen->idle, 0);
+	// Previews are the same for everyone, so background jobs only
+	// need to be able to read.
+	SLNSessionCacheRef const cache = SLNRepoGetSessionCache(blog->repo);
+	int rc = SLNSessionCreateInternal(cache, 0, NULL, NULL, 0, SLN_RDONLY, NULL, &gen->session);
+	if(rc < 0) {
+		BlogGenFree(&gen);
+		return rc;
+	}
+	*out = gen;
+	return 0;
+}
+static void job_free(job **const jptr);
+void BlogGenFree(BlogGenRef *const genptr) {
+	assert(genptr);
+	BlogGenRef gen = *genptr;
+	if(!gen) return;
+
+	async_mutex_lock(gen->mutex);
+	gen->target = 0;
+	gen->background_max = 0;
+	async_cond_broadcast(gen->cond);
+	while(gen->workers || gen->watching) async_cond_wait(gen->cond, gen->mutex);
+	async_mutex_unlock(gen->mutex);
+
+	// Queued jobs are also in the table.
+	memset(gen->urgent, 0, sizeof(gen->urgent));
+	memset(gen->background, 0, sizeof(gen->background));
+	for(size_t i = 0; i < TABLE_SIZE; i++) {
+		while(gen->table[i]) {
+			job *j = gen->table[i];
+			gen->table[i] = j->next;
+			assert(0 == j->waiters);
+			job_free(&j);
+		}
+	}
+	gen->failed = 0;
+	gen->queue_max = 0;
+	SLNSessionRelease(&gen->session);
+
+	async_pool_free(gen->pool); gen->pool = NULL;
+	async_mutex_destroy(gen->mutex);
+	async_cond_destroy(gen->cond);
+	async_cond_destroy(gen->idle);
+	gen->blog = NULL;
+	assert_zeroed(gen, 1);
+	FREE(genptr); gen = NULL;
+}
+void BlogGenConfig(BlogGenRef const gen, unsigned const workers, unsigned const queue, unsigned const background) {
+	if(!gen) return;
+	async_mutex_lock(gen->mutex);
+	gen->target = workers;
+	gen->queue_max = queue;
+	gen->background_max = workers ? MIN(background, workers) : 0;
+	while(gen->workers < gen->target) {
+		gen->workers++;
+		async_spawn(STACK_DEFAULT, worker, gen);
+	}
+	// Extra workers exit.
+	async_cond_broadcast(gen->cond);
+	async_mutex_unlock(gen->mutex);
+}
+async_pool_t *BlogGenGetPool(BlogGenRef const gen) {
+	if(!gen) return NULL;
+	return gen->pool;
+}
+
+static size_t hash_path(strarg_t const path) {
+	// FNV-1a
+	uint32_t h = 2166136261;
+	for(size_t i = 0; path[i]; i++) {
+		h ^= (unsigned char)path[i];
+		h *= 16777619;
+	}
+	return h % TABLE_SIZE;
+}
+static job **job_find(BlogGenRef const gen, strarg_t const path) {
+	job **jptr = &gen->table[hash_path(path)];
+	while(*jptr && 0 != strcmp((*jptr)->path, path)) jptr = &(*jptr)->next;
+	return jptr;
+}
+static void job_free(job **const jptr) {
+	job *j = *jptr;
+	if(!j) return;
+	FREE(&j->path);
+	FREE(&j->URI);
+	SLNSessionRelease(&j->session);
+	async_cond_destroy(j->cond);
+	j->next = NULL;
+	j->status = 0;
+	j->expires = 0;
+	j->linked = false;
+	assert_zeroed(j, 1);
+	FREE(jptr); j = NULL;
+}
+static void job_unlink(BlogGenRef const gen, job **const jptr) {
+	job *const j = *jptr;
+	*jptr = j->next;
+	j->next = NULL;
+	j->linked = false;
+	if(j->expires) gen->failed--;
+}
+static void job_gc(job **const jptr) {
+	job *const j = *jptr;
+	if(j->linked) return;
+	if(j->waiters) return;
+	if(PENDING == j->status) return;
+	job_free(jptr);
+}
+static void queue_push(queue *const q, job *const j) {
+	assert(!j->queued);
+	if(q->tail) q->tail->qnext = j;
+	else q->head = j;
+	q->tail = j;
+	q->count++;
+	j->queued = true;
+}
+static job *queue_pop(queue *const q) {
+	job *const j = q->head;
+	if(!j) return NULL;
+	q->head = j->qnext;
+	if(!q->head) q->tail = NULL;
+	q->count--;
+	j->qnext = NULL;
+	j->queued = false;
+	return j;
+}
+static void queue_remove(queue *const q, job *const j) {
+	job *prev = NULL;
+	for(job *x = q->head; x; prev = x, x = x->qnext) {
+		if(x != j) continue;
+		if(prev) prev->qnext = j->qnext;
+		else q->head = j->qnext;
+		if(q->tail == j) q->tail = prev;
+		q->count--;
+		j->qnext = NULL;
+		j->queued = false;
+		return;
+	}
+	assert(0);
+}
+static job *job_create(BlogGenRef const gen, job **const jptr, SLNSessionRef const session, strarg_t const URI, strarg_t const path) {
+	job *j = calloc(1, sizeof(job));
+	if(!j) return NULL;
+	j->path = strdup(path);
+	j->URI = strdup(URI);
+	j->session = SLNSessionRetain(session);
+	j->status = PENDING;
+	async_cond_init(j->cond, 0);
+	if(!j->path || !j->URI) {
+		job_free(&j);
+		return NULL;
+	}
+	j->next = *jptr;
+	*jptr = j;
+	j->linked = true;
+	return j;
+}
+static bool remember(int const rc) {
+	// Only failures that would happen again for anyone.
+	if(UV_EACCES == rc) return false;
+	if(UV_ENOMEM == rc) return false;
+	if(UV_ECANCELED == rc) return false;
+	return true;
+}
+static void job_done(BlogGenRef const gen, job *j, int const rc) {
+	j->status = rc;
+	SLNSessionRelease(&j->session);
+	if(rc < 0 && remember(rc) && gen->failed < FAILED_MAX) {
+		j->expires = uv_now(async_loop) + FAILED_TTL;
+		gen->failed++;
+	} else {
+		// On success, the file itself is the result.
+		job_unlink(gen, job_find(gen, j->path));
+	}
+	async_cond_broadcast(j->cond);
+	job_gc(&j);
+}
+static int job_run(BlogGenRef const gen, job *const j) {
+	BlogRef const blog = gen->blog;
+	// A previous job might have finished after our caller looked.
+	uv_fs_t req[1];
+	int rc = async_fs_stat(j->path, req);
+	if(rc >= 0) return 0;
+
+	SLNFileInfo src[1];
+	rc = SLNSessionGetFileInfo(j->session, j->URI, src);
+	if(rc < 0) return rc;
+	rc = -1;
+	rc = rc >= 0 ? rc : BlogConvert(blog, j->session, j->path, NULL, j->URI, src);
+	rc = rc >= 0 ? rc : BlogGeneric(blog, j->session, j->path, j->URI, src);
+	SLNFileInfoCleanup(src);
+	if(UV_EEXIST == rc) rc = 0; // Lost a race with another job.
+	return rc;
+}
+static void worker(void *const arg) {
+	BlogGenRef const gen = arg;
+	async_mutex_lock(gen->mutex);
+	for(;;) {
+		// Background jobs only get a few of the workers, so that
+		// readers never wait behind a whole import. Jobs somebody is
+		// waiting on are finished even if we're supposed to exit.
+		bool background = false;
+		job *j = queue_pop(gen->urgent);
+		if(!j && gen->workers > gen->target) break;
+		if(!j && gen->background_active < gen->background_max) {
+			j = queue_pop(gen->background);
+			background = !!j;
+		}
+		if(!j) {
+			async_cond_wait(gen->cond, gen->mutex);
+			continue;
+		}
+		if(background) {
+			gen->background_active++;
+			async_cond_broadcast(gen->idle);
+		}
+		async_mutex_unlock(gen->mutex);
+		int const rc = job_run(gen, j);
+		async_mutex_lock(gen->mutex);
+		job_done(gen, j, rc);
+		if(background) {
+			gen->background_active--;
+			async_cond_broadcast(gen->idle);
+			async_cond_signal(gen->cond);
+		}
+	}
+	gen->workers--;
+	async_cond_broadcast(gen->cond);
+	async_mutex_unlock(gen->mutex);
+}
+
+int BlogGenPreview(BlogGenRef const gen, SLNSessionRef const session, strarg_t const URI, strarg_t const path) {
+	if(!gen) return UV_EINVAL;
+	if(!URI) return UV_EINVAL;
+	if(!path) return UV_EINVAL;
+	int rc = 0;
+	async_mutex_lock(gen->mutex);
+	job **const jptr = job_find(gen, path);
+	job *j = *jptr;
+	if(j && j->expires && uv_now(async_loop) >= j->expires) {
+		job_unlink(gen, jptr);
+		job_gc(&j);
+		j = NULL;
+	}
+	if(j && j->queued && j->background) {
+		// Somebody is waiting for it now.
+		queue_remove(gen->background, j);
+		j->background = false;
+		goto start;
+	}
+	if(j) goto wait;
+
+	if(gen->target && gen->urgent->count >= gen->queue_max) {
+		rc = UV_EAGAIN;
+		goto cleanup;
+	}
+	j = job_create(gen, jptr, session, URI, path);
+	if(!j) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+start:
+	if(!gen->target) {
+		// No workers, so we do it ourselves.
+		j->waiters++;
+		async_mutex_unlock(gen->mutex);
+		rc = job_run(gen, j);
+		async_mutex_lock(gen->mutex);
+		j->waiters--;
+		job_done(gen, j, rc);
+		goto cleanup;
+	}
+	queue_push(gen->urgent, j);
+	async_cond_signal(gen->cond);
+
+wait:
+	j->waiters++;
+	while(PENDING == j->status) async_cond_wait(j->cond, gen->mutex);
+	j->waiters--;
+	rc = j->status;
+	job_gc(&j);
+cleanup:
+	async_mutex_unlock(gen->mutex);
+	return rc;
+}
+
+static int enqueue(BlogGenRef const gen, strarg_t const URI) {
+	// Returns UV_EAGAIN if the background queue is full.
+	str_t algo[SLN_ALGO_SIZE];
+	str_t hash[SLN_HASH_SIZE];
+	int rc = SLNParseURI(URI, algo, hash);
+	if(rc < 0) return rc;
+	str_t *path = BlogCopyPreviewPath(gen->blog, hash);
+	if(!path) return UV_ENOMEM;
+
+	async_mutex_lock(gen->mutex);
+	job **const jptr = job_find(gen, path);
+	if(*jptr) goto cleanup; // In progress or failed recently.
+	if(gen->background->count >= gen->queue_max) {
+		rc = UV_EAGAIN;
+		goto cleanup;
+	}
+	job *const j = job_create(gen, jptr, gen->session, URI, path);
+	if(!j) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+	j->background = true;
+	queue_push(gen->background, j);
+	async_cond_signal(gen->cond);
+cleanup:
+	async_mutex_unlock(gen->mutex);
+	FREE(&path);
+	return rc;
+}
+static void watcher(void *const arg) {
+	// Queues previews for new files as they're submitted, so the
+	// first reader doesn't have to wait for them. If we fall behind,
+	// files are skipped and generated on demand instead.
+	BlogGenRef const gen = arg;
+	SLNRepoRef const repo = gen->blog->repo;
+	SLNFilterRef filter = NULL;
+	SLNFilterPosition pos[1];
+	str_t *URIs[WATCH_BATCH];
+	int rc = SLNFilterCreate(gen->session, SLNVisibleFilterType, &filter);
+	if(rc < 0) goto cleanup;
+
+	// Start from the newest file.
+	SLNFilterPositionInit(pos, -1);
+	ssize_t count = SLNFilterCopyURIs(filter, gen->session, pos, -1, false, URIs, 1);
+	if(count > 0) FREE(&URIs[0]);
+	if(count < 0) rc = count;
+	if(rc < 0) goto cleanup;
+	if(0 == count) SLNFilterPositionInit(pos, +1);
+	else pos->dir = +1;
+
+	while(gen->background_max) {
+		uint64_t latest = pos->sortID;
+		rc = SLNRepoSubmissionWait(repo, &latest, uv_now(async_loop) + WATCH_TIMEOUT);
+		if(UV_ETIMEDOUT == rc) continue;
+		if(rc < 0) break;
+		do {
+			count = SLNFilterCopyURIs(filter, gen->session, pos, +1, false, URIs, WATCH_BATCH);
+			if(count < 0) rc = count;
+			for(size_t i = 0; i < MAX(count, 0); i++) {
+				if(rc >= 0) rc = enqueue(gen, URIs[i]);
+				if(UV_EAGAIN == rc) rc = 0;
+				FREE(&URIs[i]);
+			}
+			if(rc < 0) goto cleanup;
+		} while(WATCH_BATCH == count);
+		// This is how far we scanned, even if we didn't find anything.
+		if(pos->sortID < latest) {
+			pos->sortID = latest;
+			pos->fileID = 0;
+		}
+	}
+
+cleanup:
+	if(rc < 0) alogf("Preview watcher error: %s\n", sln_strerror(rc));
+	if(filter) SLNFilterPositionCleanup(pos);
+	SLNFilterFree(&filter);
+	async_mutex_lock(gen->mutex);
+	gen->watching = false;
+	async_cond_broadcast(gen->cond);
+	async_mutex_unlock(gen->mutex);
+}
+void BlogGenWatch(BlogGenRef const gen) {
+	if(!gen) return;
+	async_mutex_lock(gen->mutex);
+	if(!gen->watching && gen->background_max) {
+		gen->watching = true;
+		async_spawn(STACK_DEFAULT, watcher, gen);
+	}
+	async_mutex_unlock(gen->mutex);
+}
+
+int BlogGenPrewarm(BlogGenRef const gen, uint64_t *const out) {
+	// Uses every worker for background jobs, so only for offline use.
+	if(!gen) return UV_EINVAL;
+	if(!gen->background_max) return UV_EINVAL;
+	SLNFilterRef filter = NULL;
+	SLNFilterPosition pos[1];
+	str_t *URIs[WATCH_BATCH];
+	uint64_t total = 0;
+	int rc = SLNFilterCreate(gen->session, SLNVisibleFilterType, &filter);
+	if(rc < 0) return rc;
+	SLNFilterPositionInit(pos, +1);
+	for(;;) {
+		ssize_t const count = SLNFilterCopyURIs(filter, gen->session, pos, +1, false, URIs, WATCH_BATCH);
+		if(count < 0) rc = count;
+		for(size_t i = 0; i < MAX(count, 0); i++) {
+			while(rc >= 0) {
+				rc = enqueue(gen, URIs[i]);
+				if(UV_EAGAIN != rc) break;
+				async_mutex_lock(gen->mutex);
+				while(gen->background->count >= gen->queue_max) {
+					async_cond_wait(gen->idle, gen->mutex);
+				}
+				async_mutex_unlock(gen->mutex);
+			}
+			FREE(&URIs[i]);
+			if(rc >= 0) total++;
+		}
+		if(rc < 0) break;
+		if(WATCH_BATCH != count) break;
+	}
+	async_mutex_lock(gen->mutex);
+	while(gen->background->count || gen->background_active) {
+		async_cond_wait(gen->idle, gen->mutex);
+	}
+	async_mutex_unlock(gen->mutex);
+	SLNFilterPositionCleanup(pos);
+	SLNFilterFree(&filter);
+	if(out) *out = total;
+	return rc;
+}
+
@@ -0,0 +1,426 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <zlib.h>
+#include "../util/httplog.h"
+#include "../util/metrics.h"
+#include "../util/siphash.h"
+#include "PageCache.h"
+
+#define PAGE_MAX (1024 * 1024 * 2) // Bigger pages aren't cached
+#define PAGE_INITIAL (1024 * 8)
+#define SEEN_RATIO 4 // Slots in the admission table per entry
+#define ETAG_SIZE (1+16+3+1+1)
+#define GZIP_MIN 1024 // Smaller pages aren't compressed
+
+struct Page {
+	unsigned refcount; // atomic
+	uint64_t stamp;
+	bool complete;
+	bool public;
+	uint16_t status;
+	strarg_t type; // Static
+	str_t etag[ETAG_SIZE];
+	byte_t *buf;
+	size_t len;
+	size_t size;
+	// Cached pages are compressed once up front.
+	str_t gzetag[ETAG_SIZE];
+	byte_t *gz;
+	size_t gzlen;
+};
+
+typedef struct {
+	uint64_t hash;
+	str_t *key;
+	PageRef page;
+	uint64_t used;
+} entry;
+
+// There are only ever a handful of popular pages, so entries are kept
+// packed in a small array and found by comparing hashes, which is as
+// fast as a real table at this size. The least recently used entry is
+// evicted when it's full, preferring ones that are already stale.
+// Keys still include the client's Host, so a page is only admitted on
+// its second miss. Hosts that are only seen once, like made-up ones,
+// just overwrite each other in the admission table.
+// Only held briefly and never across a yield, so it's a plain mutex.
+// Cached pages are immutable and reference counted, so they can be
+// sent while being evicted.
+struct PageCache {
+	SLNRepoRef repo;
+	uv_mutex_t lock[1];
+	size_t max;
+	size_t count;
+	entry *entries;
+	uint64_t *seen; // Key hashes missed once, max * SEEN_RATIO
+	byte_t hashkey[SIPHASH_KEY_LEN];
+};
+
+// ETags should survive restarts, so they use a fixed key.
+static byte_t const etagkey[SIPHASH_KEY_LEN] = {0};
+
+int PageCacheCreate(SLNRepoRef const repo, size_t const max, PageCacheRef *const out) {
+	if(!repo) return UV_EINVAL;
+	if(!max) return UV_EINVAL;
+	PageCacheRef cache = calloc(1, sizeof(struct PageCache));
+	if(!cache) return UV_ENOMEM;
+	int rc = 0;
+
+	cache->repo = repo;
+	rc = async_random(cache->hashkey, sizeof(cache->hashkey));
+	if(rc < 0) goto cleanup;
+
+	rc = uv_mutex_init(cache->lock);
+	if(rc < 0) goto cleanup;
+	cache->max = max;
+	cache->count = 0;
+	cache->entries = calloc(max, sizeof(*cache->entries));
+	cache->seen = calloc(max * SEEN_RATIO, sizeof(*cache->seen));
+	if(!cache->entries || !cache->seen) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	*out = cache; cache = NULL;
+cleanup:
+	PageCacheFree(&cache);
+	return rc;
+}
+static void entry_clear(entry *const e) {
+	e->hash = 0;
+	FREE(&e->key);
+	PageFree(&e->page);
+	e->used = 0;
+}
+void PageCacheFree(PageCacheRef *const cacheptr) {
+	PageCacheRef cache = *cacheptr;
+	if(!cache) return;
+
+	cache->repo = NULL;
+	if(cache->max) uv_mutex_destroy(cache->lock);
+	memset(cache->lock, 0, sizeof(cache->lock));
+	for(size_t i = 0; i < cache->count; i++) {
+		entry_clear(&cache->entries[i]);
+	}
+	assert_zeroed(cache->entries, cache->max);
+	FREE(&cache->entries);
+	FREE(&cache->seen);
+	cache->max = 0;
+	cache->count = 0;
+	memset(cache->hashkey, 0, sizeof(cache->hashkey));
+
+	assert_zeroed(cache, 1);
+	FREE(cacheptr); cache = NULL;
+}
+
+str_t *PageCacheCopyKey(SLNSessionRef const session, HTTPConnectionRef const conn, strarg_t const URI, HTTPHeadersRef const headers) {
+	// Logged in users see their own names, at least.
+	if(!session) return NULL;
+	if(0 != SLNSessionGetUserID(session)) return NULL;
+	bool const r = SLNSessionHasPermission(session, SLN_RDONLY);
+	bool const w = SLNSessionHasPermission(session, SLN_WRONLY);
+
+	size_t const pathlen = strcspn(URI, "?");
+	if('?' == URI[pathlen] && '\0' != URI[pathlen+1]) return NULL;
+
+	// Feeds have absolute links, so the host matters too.
+	strarg_t const proto = HTTPConnectionGetProtocol(conn);
+	strarg_t const host = HTTPHeadersGet(headers, "host");
+	str_t key[URI_MAX * 2];
+	int const len = snprintf(key, sizeof(key), "%c%c %s://%s%.*s",
+		r ? 'r' : '-', w ? 'w' : '-',
+		proto ? proto : "", host ? host : "", (int)pathlen, URI);
+	if(len < 0 || len >= sizeof(key)) return NULL;
+	return strdup(key);
+}
+
+static void cache_remove(PageCacheRef const cache, size_t const i) {
+	assert(i < cache->count);
+	entry_clear(&cache->entries[i]);
+	cache->count--;
+	cache->entries[i] = cache->entries[cache->count];
+	memset(&cache->entries[cache->count], 0, sizeof(entry));
+}
+static PageRef cache_get(PageCacheRef const cache, strarg_t const key) {
+	uint64_t const latest = SLNRepoSubmissionLatest(cache->repo);
+	uint64_t const hash = siphash24(cache->hashkey, key, strlen(key));
+	PageRef page = NULL;
+	uv_mutex_lock(cache->lock);
+	for(size_t i = 0; i < cache->count; i++) {
+		entry *const e = &cache->entries[i];
+		if(hash != e->hash) continue;
+		if(0 != strcmp(key, e->key)) continue;
+		if(latest != e->page->stamp) {
+			cache_remove(cache, i);
+			break;
+		}
+		e->used = uv_hrtime();
+		page = PageRetain(e->page);
+		break;
+	}
+	uv_mutex_unlock(cache->lock);
+	return page;
+}
+static void cache_put(PageCacheRef const cache, strarg_t const key, PageRef const page) {
+	// Don't bother if it went stale while we were rendering it.
+	if(SLNRepoSubmissionLatest(cache->repo) != page->stamp) return;
+	uint64_t const hash = siphash24(cache->hashkey, key, strlen(key));
+	uint64_t *const seen = &cache->seen[hash % (cache->max * SEEN_RATIO)];
+	uv_mutex_lock(cache->lock);
+	bool const again = hash == *seen;
+	*seen = hash;
+	uv_mutex_unlock(cache->lock);
+	if(!again) return;
+	str_t *const dup = strdup(key);
+	if(!dup) return;
+	uv_mutex_lock(cache->lock);
+	size_t pos = cache->count;
+	size_t victim = 0;
+	uint64_t oldest = UINT64_MAX;
+	for(size_t i = 0; i < cache->count; i++) {
+		entry const *const e = &cache->entries[i];
+		if(hash == e->hash && 0 == strcmp(key, e->key)) {
+			pos = i;
+			break;
+		}
+		uint64_t const used = e->page->stamp < page->stamp ? 0 : e->used;
+		if(used >= oldest) continue;
+		oldest = used;
+		victim = i;
+	}
+	if(pos >= cache->max) pos = victim;
+	if(pos < cache->count) entry_clear(&cache->entries[pos]);
+	else cache->count++;
+	entry *const e = &cache->entries[pos];
+	e->hash = hash;
+	e->key = dup;
+	e->page = PageRetain(page);
+	e->used = uv_hrtime();
+	uv_mutex_unlock(cache->lock);
+}
+
+static strarg_t status_message(uint16_t const status) {
+	switch(status) {
+		case 200: return "OK";
+		case 404: return "Not Found";
+		default: return "Unknown";
+	}
+}
+static int page_compress(PageRef const page) {
+	if(page->gz) return 0;
+	if(page->len < GZIP_MIN) return 0;
+	z_stream z[1];
+	memset(z, 0, sizeof(z));
+	// 16 to add the gzip header.
+	int rc = deflateInit2(z, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS+16, 8, Z_DEFAULT_STRATEGY);
+	if(Z_OK != rc) return UV_ENOMEM;
+	size_t const size = deflateBound(z, page->len);
+	byte_t *gz = malloc(size);
+	if(!gz) {
+		deflateEnd(z);
+		return UV_ENOMEM;
+	}
+	z->next_in = page->buf;
+	z->avail_in = page->len;
+	z->next_out = gz;
+	z->avail_out = size;
+	rc = deflate(z, Z_FINISH);
+	size_t const len = z->total_out;
+	deflateEnd(z);
+	if(Z_STREAM_END != rc || len >= page->len) {
+		FREE(&gz);
+		return 0;
+	}
+	page->gz = gz; gz = NULL;
+	page->gzlen = len;
+	// Different bytes, so it needs a different tag.
+	snprintf(page->gzetag, sizeof(page->gzetag), "%.17s-gz\"", page->etag);
+	return 0;
+}
+static bool accepts_gzip(HTTPHeadersRef const headers) {
+	strarg_t const encoding = HTTPHeadersGet(headers, "accept-encoding");
+	// TODO: Parse q-values. Nobody sends gzip;q=0 in practice.
+	return encoding && strstr(encoding, "gzip");
+}
+static int page_send(PageRef const page, HTTPConnectionRef const conn, HTTPMethod const method, HTTPHeadersRef const headers) {
+	strarg_t const cache_control = page->public ? "no-cache, public" : "no-cache, private";
+	bool const gzip = page->gz && accepts_gzip(headers);
+	strarg_t const etag = gzip ? page->gzetag : page->etag;
+	byte_t const *const body = gzip ? page->gz : page->buf;
+	size_t const len = gzip ? page->gzlen : page->len;
+
+	strarg_t const match = HTTPHeadersGet(headers, "if-none-match");
+	if(200 == page->status && match && (0 == strcmp(match, "*") || strstr(match, etag))) {
+		httplog_response(conn, 304, "Not Modified");
+		HTTPConnectionWriteHeader(conn, "ETag", etag);
+		HTTPConnectionWriteHeader(conn, "Cache-Control", cache_control);
+		if(page->gz) HTTPConnectionWriteHeader(conn, "Vary", "Accept-Encoding");
+		HTTPConnectionBeginBody(conn);
+		HTTPConnectionEnd(conn);
+		return 0;
+	}
+	int rc = 0;
+	httplog_response(conn, page->status, status_message(page->status));
+	HTTPConnectionWriteHeader(conn, "Content-Type", page->type);
+	if(gzip) HTTPConnectionWriteHeader(conn, "Content-Encoding", "gzip");
+	httplog_content_length(conn, len);
+	HTTPConnectionWriteHeader(conn, "ETag", etag);
+	HTTPConnectionWriteHeader(conn, "Cache-Control", cache_control);
+	if(page->gz) HTTPConnectionWriteHeader(conn, "Vary", "Accept-Encoding");
+	HTTPConnectionBeginBody(conn);
+	if(HTTP_HEAD != method && len) rc = HTTPConnectionWrite(conn, body, len);
+	HTTPConnectionEnd(conn);
+	return rc;
+}
+int PageCacheSend(PageCacheRef const cache, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
+	if(!cache) return UV_ENOENT;
+	if(HTTP_GET != method && HTTP_HEAD != method) return UV_ENOENT;
+	str_t *key = PageCacheCopyKey(session, conn, URI, headers);
+	if(!key) return UV_ENOENT;
+	PageRef page = cache_get(cache, key);
+	FREE(&key);
+	// Misses are counted when the page is rendered instead, since
+	// most requests here are for pages we never cache.
+	if(!page) return UV_ENOENT;
+	metrics_count(METRIC_PAGE_HITS, 1);
+	int rc = page_send(page, conn, method, headers);
+	PageFree(&page);
+	return rc;
+}
+
+int PageCreate(PageCacheRef const cache, PageRef *const out) {
+	PageRef page = calloc(1, sizeof(struct Page));
+	if(!page) return UV_ENOMEM;
+	page->refcount = 1;
+	page->stamp = cache ? SLNRepoSubmissionLatest(cache->repo) : 0;
+	page->complete = true;
+	page->public = false;
+	page->status = 0;
+	page->type = NULL;
+	page->buf = NULL;
+	page->len = 0;
+	page->size = 0;
+	page->gz = NULL;
+	page->gzlen = 0;
+	*out = page;
+	return 0;
+}
+PageRef PageRetain(PageRef const page) {
+	if(!page) return NULL;
+	assert(page->refcount);
+	__atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+	return page;
+}
+void PageFree(PageRef *const pageptr) {
+	PageRef page = *pageptr;
+	*pageptr = NULL;
+	if(!page) return;
+	assert(page->refcount);
+	if(__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL)) return;
+	page->stamp = 0;
+	page->complete = false;
+	page->public = false;
+	page->status = 0;
+	page->type = NULL;
+	memset(page->etag, 0, sizeof(page->etag));
+	FREE(&page->buf);
+	page->len = 0;
+	page->size = 0;
+	memset(page->gzetag, 0, sizeof(page->gzetag));
+	FREE(&page->gz);
+	page->gzlen = 0;
+	assert_zeroed(page, 1);
+	FREE(&page);
+}
+static int reserve(PageRef const page, size_t const len) {
+	if(page->size - page->len >= len) return 0;
+	size_t size = MAX(PAGE_INITIAL, page->size * 2);
+	while(size - page->len < len) size *= 2;
+	byte_t *const x = realloc(page->buf, size);
+	if(!x) return UV_ENOMEM;
+	page->buf = x;
+	page->size = size;
+	return 0;
+}
+int PageWritev(PageRef const page, uv_buf_t parts[], unsigned int const count) {
+	if(!page) return UV_EINVAL;
+	size_t total = 0;
+	for(unsigned i = 0; i < count; i++) total += parts[i].len;
+	int rc = reserve(page, total);
+	if(rc < 0) return rc;
+	for(unsigned i = 0; i < count; i++) {
+		if(!parts[i].len) continue;
+		memcpy(page->buf+page->len, parts[i].base, parts[i].len);
+		page->len += parts[i].len;
+	}
+	return 0;
+}
+int PageWriteFile(PageRef const page, strarg_t const path) {
+	if(!page) return UV_EINVAL;
+	uv_file const file = async_fs_open(path, O_RDONLY, 0000);
+	if(file < 0) return (int)file;
+	uv_fs_t req;
+	int rc = async_fs_fstat(file, &req);
+	if(rc < 0) goto cleanup;
+	size_t const size = req.statbuf.st_size;
+	rc = reserve(page, size);
+	if(rc < 0) goto cleanup;
+	uv_buf_t info = uv_buf_init((char *)page->buf+page->len, size);
+	ssize_t const len = async_fs_readall_simple(file, &info);
+	if(len < 0) rc = (int)len;
+	if(rc < 0) goto cleanup;
+	page->len += len;
+cleanup:
+	async_fs_close(file);
+	return rc;
+}
+int PageWritePage(PageRef const page, PageRef const other) {
+	if(!other) return page ? 0 : UV_EINVAL;
+	return PageWritePageRange(page, other, 0, other->len);
+}
+int PageWritePageRange(PageRef const page, PageRef const other, size_t const start, size_t const end) {
+	if(!page) return UV_EINVAL;
+	if(!other) return 0;
+	if(start > end || end > other->len) return UV_EINVAL;
+	uv_buf_t parts[] = { uv_buf_init((char *)other->buf+start, end-start) };
+	int rc = PageWritev(page, parts, numberof(parts));
+	if(rc < 0) return rc;
+	if(!other->complete) page->complete = false;
+	return 0;
+}
+size_t PageGetLength(PageRef const page) {
+	if(!page) return 0;
+	return page->len;
+}
+void PageSetIncomplete(PageRef const page) {
+	if(!page) return;
+	page->complete = false;
+}
+bool PageIsComplete(PageRef const page) {
+	if(!page) return false;
+	return page->complete;
+}
+int PageSend(PageCacheRef const cache, PageRef const page, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers, uint16_t const status, strarg_t const type) {
+	if(!page) return UV_EINVAL;
+	page->status = status;
+	page->type = type;
+	page->public = 0 == SLNSessionGetUserID(session);
+	uint64_t const hash = siphash24(etagkey, page->buf, page->len);
+	snprintf(page->etag, sizeof(page->etag), "\"%016llx\"", (unsigned long long)hash);
+
+	str_t *key = cache ? PageCacheCopyKey(session, conn, URI, headers) : NULL;
+	if(key) {
+		metrics_count(METRIC_PAGE_MISSES, 1);
+		bool const cacheable = (200 == status || 404 == status);
+		if(cacheable && page->complete && page->len <= PAGE_MAX) {
+			// Compressed once here, instead of for every reader.
+			async_pool_enter(NULL);
+			int rc = page_compress(page);
+			async_pool_leave(NULL);
+			if(rc < 0) alogf("Page compression error: %s\n", uv_strerror(rc));
+			cache_put(cache, key, page);
+		}
+		FREE(&key);
+	}
+	return page_send(page, conn, method, headers);
+}
@@ -0,0 +1,38 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <async/http/HTTPServer.h>
+#include "../StrongLink.h"
+
+// Whole responses for anonymous readers, which come out the same until
+// the next submission. Pages are stamped with the latest submission when
+// they start rendering, and are stale as soon as there's a newer one.
+typedef struct PageCache* PageCacheRef;
+typedef struct Page* PageRef;
+
+int PageCacheCreate(SLNRepoRef const repo, size_t const max, PageCacheRef *const out);
+void PageCacheFree(PageCacheRef *const cacheptr);
+// Keyed by permission class, host and route. Only requests without a
+// query are cached (e.g. the front page and the default feed), so that
+// searches and made-up queries can't push those out.
+// Returns NULL if the request can't share pages with anyone else.
+str_t *PageCacheCopyKey(SLNSessionRef const session, HTTPConnectionRef const conn, strarg_t const URI, HTTPHeadersRef const headers);
+// Returns UV_ENOENT if there's no current page for the request.
+int PageCacheSend(PageCacheRef const cache, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
+
+// Pages are built up in memory and then sent, which caches them too if
+// the request allows it. The cache is optional. Cached pages are also
+// kept gzipped, for clients that accept it.
+int PageCreate(PageCacheRef const cache, PageRef *const out);
+PageRef PageRetain(PageRef const page);
+void PageFree(PageRef *const pageptr);
+int PageWritev(PageRef const page, uv_buf_t parts[], unsigned int const count);
+int PageWriteFile(PageRef const page, strarg_t const path);
+// Copies the body of another page, which shouldn't be sent yet.
+int PageWritePage(PageRef const page, PageRef const other);
+int PageWritePageRange(PageRef const page, PageRef const other, size_t const start, size_t const end);
+size_t PageGetLength(PageRef const page);
+// For pages missing something temporarily, which shouldn't be cached.
+void PageSetIncomplete(PageRef const page);
+bool PageIsComplete(PageRef const page);
+int PageSend(PageCacheRef const cache, PageRef const page, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers, uint16_t const status, strarg_t const type);
@@ -3,12 +3,17 @@
 
 #include <limits.h>
 #include <async/http/QueryString.h>
+#include "PageCache.h"
 #include "RSSServer.h"
 #include "Template.h"
 
 #define RESULTS_MAX 10
+// Rendered items are reused for the default feed, but metadata can
+// still change after submission, so they're redone eventually.
+#define ITEM_LIFETIME (1000 * 60 * 60)
+#define ITEM_LINKS_MAX 4 // Places in an item that need the host
 
-static int write_cdata(HTTPConnectionRef const conn, uv_buf_t const *const buf) {
+static int write_cdata(PageRef const page, uv_buf_t const *const buf) {
 	if(!buf->len) return 0;
 	char const *pos = buf->base;
 	for(size_t i = 2; i < buf->len; i++) {
@@ -20,7 +25,7 @@ static int write_cdata(HTTPConnectionRef const conn, uv_buf_t const *const buf)
 			uv_buf_init((char *)pos, i-(pos-buf->base)),
 			UV_BUF_STATIC("]]>"),
 		};
-		int rc = HTTPConnectionWriteChunkv(conn, parts, numberof(parts));
+		int rc = PageWritev(page, parts, numberof(parts));
 		if(rc < 0) return rc;
 		pos = buf->base+i;
 	}
@@ -29,12 +34,12 @@ static int write_cdata(HTTPConnectionRef const conn, uv_buf_t const *const buf)
 		uv_buf_init((char *)pos, buf->len-(pos-buf->base)),
 		UV_BUF_STATIC("]]>"),
 	};
-	return HTTPConnectionWriteChunkv(conn, last, numberof(last));
+	return PageWritev(page, last, numberof(last));
 }
 // TODO: HACK
 #define BUFFER_SIZE (1024*8)
-static int write_file_cdata(HTTPConnectionRef const conn, uv_file const file) {
-	if(!conn) return 0;
+static int write_file_cdata(PageRef const page, uv_file const file) {
+	if(!page) return 0;
 	char *buf = malloc(BUFFER_SIZE);
 	if(!buf) return UV_ENOMEM;
 	uv_buf_t const info = uv_buf_init(buf, BUFFER_SIZE);
@@ -44,13 +49,29 @@ static int write_file_cdata(HTTPConnectionRef const conn, uv_file const file) {
 		if(0 == len) break;
 		if(rc < 0) break;
 		uv_buf_t write = uv_buf_init(buf, len);
-		rc = write_cdata(conn, &write);
+		rc = write_cdata(page, &write);
 		if(rc < 0) break;
 	}
 	FREE(&buf);
 	return rc;
 }
 
+// Items are rendered without the host, which is filled in at each
+// link when the feed is put together.
+typedef struct {
+	str_t *URI;
+	PageRef page;
+	size_t links[ITEM_LINKS_MAX];
+	size_t nlinks;
+	uint64_t rendered;
+} feed_item;
+
+// The default feed (no query, anonymous) is kept as rendered items,
+// newest first. When a submission arrives, only the new entries are
+// rendered and the ones that fell off the end are dropped. The whole
+// document is then cached by the page cache until the next submission.
+// The items are shared by every host, and the mutex is only held to
+// copy or replace them, so rendering never waits for another request.
 struct RSSServer {
 	SLNRepoRef repo;
 	str_t *dir;
@@ -59,8 +80,22 @@ struct RSSServer {
 	TemplateRef tail;
 	TemplateRef item_start;
 	TemplateRef item_end;
+	PageCacheRef pages; // Optional, not owned
+
+	async_mutex_t mutex[1];
+	feed_item items[RESULTS_MAX];
+	size_t count;
+	uint64_t stamp; // Latest submission when the items were rendered
 };
 
+static void feed_item_clear(feed_item *const item) {
+	FREE(&item->URI);
+	PageFree(&item->page);
+	memset(item->links, 0, sizeof(item->links));
+	item->nlinks = 0;
+	item->rendered = 0;
+}
+
 // TODO: Basically identical to version in Blog.c.
 static int load_template(RSSServerRef const rss, strarg_t const name, TemplateRef *const out) {
 	assert(rss);
@@ -80,13 +115,17 @@ static int load_template(RSSServerRef const rss, strarg_t const name, TemplateRe
 	*out = t; t = NULL;
 	return 0;
 }
-int RSSServerCreate(SLNRepoRef const repo, RSSServerRef *const out) {
+int RSSServerCreate(SLNRepoRef const repo, PageCacheRef const pages, RSSServerRef *const out) {
 	assert(repo);
 	RSSServerRef rss = calloc(1, sizeof(struct RSSServer));
 	if(!rss) return UV_ENOMEM;
 	int rc = 0;
 
 	rss->repo = repo;
+	rss->pages = pages;
+	async_mutex_init(rss->mutex, 0);
+	rss->count = 0;
+	rss->stamp = 0;
 	rss->dir = aasprintf("%s/blog", SLNRepoGetDir(repo));
 	rss->cacheDir = aasprintf("%s/rss", SLNRepoGetCacheDir(repo));
 	if(!rss->dir || !rss->cacheDir) rc = UV_ENOMEM;
@@ -115,10 +154,162 @@ void RSSServerFree(RSSServerRef *const rssptr) {
 	TemplateFree(&rss->tail);
 	TemplateFree(&rss->item_start);
 	TemplateFree(&rss->item_end);
+	rss->pages = NULL;
+	async_mutex_destroy(rss->mutex);
+	memset(rss->mutex, 0, sizeof(rss->mutex));
+	for(size_t i = 0; i < rss->count; i++) feed_item_clear(&rss->items[i]);
+	rss->count = 0;
+	rss->stamp = 0;
+	assert_zeroed(rss->items, numberof(rss->items));
 	assert_zeroed(rss, 1);
 	FREE(rssptr); rss = NULL;
 }
 
+typedef struct {
+	feed_item *item;
+	strarg_t link; // Compared by address
+} item_writer;
+static int item_writev(item_writer *const w, uv_buf_t parts[], unsigned int const count) {
+	feed_item *const item = w->item;
+	size_t pos = PageGetLength(item->page);
+	for(unsigned i = 0; i < count; i++) {
+		if(parts[i].base == w->link) {
+			if(item->nlinks >= numberof(item->links)) return UV_ENOBUFS;
+			item->links[item->nlinks++] = pos;
+		}
+		pos += parts[i].len;
+	}
+	return PageWritev(item->page, parts, count);
+}
+static int render_item(RSSServerRef const rss, SLNSessionRef const session, strarg_t const URI, feed_item *const out) {
+	out->URI = strdup(URI);
+	if(!out->URI) return UV_ENOMEM;
+	out->rendered = uv_now(async_loop);
+	int rc = PageCreate(NULL, &out->page);
+	if(rc < 0) return rc;
+
+	// Already safe for XML, since QSEscape leaves nothing to escape.
+	str_t link[URI_MAX];
+	str_t *escaped = QSEscape(URI, strlen(URI), true);
+	snprintf(link, sizeof(link), "/?q=%s", escaped);
+	FREE(&escaped);
+
+	strarg_t const fields[] = { "title", "description" };
+	str_t *values[numberof(fields)] = {};
+	rc = SLNSessionCopyValuesForFields(session, URI, fields, values, numberof(fields), NULL);
+	if(rc < 0) alogf("Feed metadata error: %s\n", sln_strerror(rc));
+	if(rc < 0) PageSetIncomplete(out->page);
+	str_t *title = htmlenc(values[0] ? values[0] : "(title)");
+	str_t *description = htmlenc(values[1] ? values[1] : "(description)");
+	str_t *hashURI = htmlenc(URI);
+	rc = title && description && hashURI ? 0 : UV_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	// Values are escaped up front, so the link is written as is and
+	// can be found by its address.
+	TemplateStaticArg const itemargs[] = {
+		{"title", title},
+		{"description", description},
+		{"queryURI", link},
+		{"hashURI", hashURI},
+		{NULL, NULL},
+	};
+	item_writer w[1] = {{ out, link }};
+
+	rc = TemplateWrite(rss->item_start, &TemplateStaticCBs, itemargs, (TemplateWritev)item_writev, w);
+	if(rc < 0) goto cleanup;
+
+	// TODO: HACK
+	str_t algo[SLN_ALGO_SIZE]; // SLN_INTERNAL_ALGO
+	str_t hash[SLN_HASH_SIZE];
+	SLNParseURI(URI, algo, hash);
+	str_t path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/blog/%.2s/%s", SLNRepoGetCacheDir(rss->repo), hash, hash);
+
+	uv_file const file = async_fs_open(path, O_RDONLY, 0000);
+	// Previews are generated in the background, so one that's
+	// missing now might not be for long. One we couldn't read all of
+	// is left out of the cache too.
+	if(file < 0) {
+		PageSetIncomplete(out->page);
+	} else {
+		int const err = write_file_cdata(out->page, file);
+		if(err < 0) alogf("Feed preview error: %s\n", uv_strerror(err));
+		if(err < 0) PageSetIncomplete(out->page);
+		async_fs_close(file);
+	}
+
+	rc = TemplateWrite(rss->item_end, &TemplateStaticCBs, itemargs, (TemplateWritev)item_writev, w);
+	if(rc < 0) goto cleanup;
+
+cleanup:
+	for(size_t i = 0; i < numberof(values); i++) FREE(&values[i]);
+	FREE(&title);
+	FREE(&description);
+	FREE(&hashURI);
+	return rc;
+}
+static int write_item(PageRef const page, feed_item const *const item, strarg_t const base) {
+	size_t pos = 0;
+	int rc = 0;
+	for(size_t i = 0; i < item->nlinks; i++) {
+		uv_buf_t parts[] = { uv_buf_init((char *)base, strlen(base)) };
+		rc = PageWritePageRange(page, item->page, pos, item->links[i]);
+		if(rc < 0) return rc;
+		rc = PageWritev(page, parts, numberof(parts));
+		if(rc < 0) return rc;
+		pos = item->links[i];
+	}
+	return PageWritePageRange(page, item->page, pos, PageGetLength(item->page));
+}
+
+static size_t feed_copy(RSSServerRef const rss, feed_item *const out) {
+	size_t n = 0;
+	async_mutex_lock(rss->mutex);
+	for(size_t i = 0; i < rss->count; i++) {
+		out[n] = rss->items[i];
+		out[n].URI = strdup(rss->items[i].URI);
+		if(!out[n].URI) {
+			memset(&out[n], 0, sizeof(out[n]));
+			continue;
+		}
+		out[n].page = PageRetain(rss->items[i].page);
+		n++;
+	}
+	async_mutex_unlock(rss->mutex);
+	return n;
+}
+static void feed_replace(RSSServerRef const rss, feed_item *const items, size_t const count, uint64_t const stamp) {
+	// Items that are no longer in the feed are dropped, and any that
+	// couldn't be finished are tried again next time. If someone
+	// rendered a newer feed in the meantime, theirs wins.
+	async_mutex_lock(rss->mutex);
+	if(stamp >= rss->stamp) {
+		for(size_t i = 0; i < rss->count; i++) feed_item_clear(&rss->items[i]);
+		rss->count = 0;
+		rss->stamp = stamp;
+		for(size_t i = 0; i < count; i++) {
+			if(!items[i].page || !PageIsComplete(items[i].page)) continue;
+			rss->items[rss->count++] = items[i];
+			memset(&items[i], 0, sizeof(items[i]));
+		}
+	}
+	async_mutex_unlock(rss->mutex);
+}
+static int get_item(RSSServerRef const rss, SLNSessionRef const session, strarg_t const URI, feed_item *const cached, size_t const ncached, feed_item *const out) {
+	uint64_t const now = uv_now(async_loop);
+	for(size_t i = 0; i < ncached; i++) {
+		feed_item *const item = &cached[i];
+		if(!item->URI) continue; // Already taken
+		if(0 != strcmp(URI, item->URI)) continue;
+		if(now - item->rendered >= ITEM_LIFETIME) break;
+		*out = *item;
+		memset(item, 0, sizeof(*item));
+		return 0;
+	}
+	return render_item(rss, session, URI, out);
+}
+
 static int GET_feed(RSSServerRef const rss, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers) {
 	if(HTTP_GET != method) return -1;
 	strarg_t qs = NULL;
@@ -127,14 +318,21 @@ static int GET_feed(RSSServerRef const rss, SLNSessionRef const session, HTTPCon
 	int rc = 0;
 	int status = 0;
 	SLNFilterRef filter = NULL;
+	PageRef page = NULL;
+	str_t *base = NULL;
 	str_t *URIs[RESULTS_MAX] = {};
 	ssize_t count = 0;
+	feed_item items[RESULTS_MAX] = {};
+	feed_item cached[RESULTS_MAX] = {};
+	size_t ncached = 0;
 
 	static strarg_t const fields[] = {
 		"q",
 	};
 	str_t *values[numberof(fields)] = {};
 	QSValuesParse(qs, values, fields, numberof(fields));
+	bool const latest = (!values[0] || '\0' == values[0][0]) &&
+		0 == SLNSessionGetUserID(session);
 	rc = SLNUserFilterParse(session, values[0], &filter);
 	QSValuesCleanup(values, numberof(values));
 	if(KVS_EACCES == rc) {
@@ -147,6 +345,25 @@ static int GET_feed(RSSServerRef const rss, SLNSessionRef const session, HTTPCon
 		goto cleanup;
 	}
 
+	// It's insane that RSS apparently doesn't support relative URLs.
+	str_t tmp[URI_MAX];
+	strarg_t const proto = HTTPConnectionGetProtocol(conn);
+	strarg_t const host = HTTPHeadersGet(headers, "host");
+	snprintf(tmp, sizeof(tmp), "%s://%s", proto, host);
+	base = htmlenc(tmp);
+	if(!base) {
+		status = 500;
+		goto cleanup;
+	}
+
+	// Before we look at anything that a submission could change.
+	uint64_t const stamp = SLNRepoSubmissionLatest(rss->repo);
+	rc = PageCreate(rss->pages, &page);
+	if(rc < 0) {
+		status = 500;
+		goto cleanup;
+	}
+	if(latest) ncached = feed_copy(rss, cached);
 
 	SLNFilterPosition pos[1];
 	SLNFilterPositionInit(pos, -1);
@@ -154,83 +371,46 @@ static int GET_feed(RSSServerRef const rss, SLNSessionRef const session, HTTPCon
 	SLNFilterPositionCleanup(pos);
 	if(count < 0) {
 		alogf("Filter error: %s\n", sln_strerror(count));
+		count = 0;
 		status = 500;
 		goto cleanup;
 	}
 	SLNFilterFree(&filter);
 
-	// TODO: Load all meta-data up front, in the same transaction?
-	// How are we going to handle coming up with titles and descriptions for everything?
-	// Also we need to escape the content for the CDATA section...
-
-
-	HTTPConnectionWriteResponse(conn, 200, "OK");
-	HTTPConnectionWriteHeader(conn, "Content-Type", "application/rss+xml");
-	HTTPConnectionWriteHeader(conn, "Transfer-Encoding", "chunked");
-	if(0 == SLNSessionGetUserID(session)) {
-		HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache, public");
-	} else {
-		HTTPConnectionWriteHeader(conn, "Cache-Control", "no-cache, private");
-	}
-	HTTPConnectionBeginBody(conn);
+	// Titles and descriptions are loaded per item, each in a single
+	// transaction, as we go. Items without them get placeholders.
+	// TODO: Also we need to escape the content for the CDATA section...
+	// The whole feed is rendered before sending, so that anonymous
+	// readers can share it. See PageCache.h.
 
-	str_t *reponame_encoded = htmlenc(SLNRepoGetName(rss->repo));
 	TemplateStaticArg const args[] = {
-		{"reponame", reponame_encoded},
+		{"reponame", SLNRepoGetName(rss->repo)},
 		{NULL, NULL},
 	};
 
-	TemplateWriteHTTPChunk(rss->head, &TemplateStaticCBs, args, conn);
-
-	for(size_t i = 0; i < count; i++) {
-
-		str_t tmp[URI_MAX];
-		// It's insane that RSS apparently doesn't support relative URLs.
-		strarg_t const proto = HTTPConnectionGetProtocol(conn);
-		strarg_t const host = HTTPHeadersGet(headers, "host");
-		str_t *escaped = QSEscape(URIs[i], strlen(URIs[i]), true);
-		snprintf(tmp, sizeof(tmp), "%s://%s/?q=%s", proto, host, escaped);
-		FREE(&escaped);
-		str_t *queryURI_encoded = htmlenc(tmp);
-
-		str_t *hashURI_encoded = htmlenc(URIs[i]);
-		TemplateStaticArg const itemargs[] = {
-			{"title", "(title)"},
-			{"description", "(description)"},
-			{"queryURI", queryURI_encoded},
-			{"hashURI", hashURI_encoded},
-			{NULL, NULL},
-		};
-
-		TemplateWriteHTTPChunk(rss->item_start, &TemplateStaticCBs, itemargs, conn);
-
-		// TODO: HACK
-		str_t algo[SLN_ALGO_SIZE]; // SLN_INTERNAL_ALGO
-		str_t hash[SLN_HASH_SIZE];
-		SLNParseURI(URIs[i], algo, hash);
-		str_t path[PATH_MAX];
-		snprintf(path, sizeof(path), "%s/blog/%.2s/%s", SLNRepoGetCacheDir(rss->repo), hash, hash);
-
-		uv_file file = async_fs_open(path, O_RDONLY, 0000);
-		write_file_cdata(conn, file);
-		async_fs_close(file);
-
-		TemplateWriteHTTPChunk(rss->item_end, &TemplateStaticCBs, itemargs, conn);
-
-		FREE(&queryURI_encoded);
-		FREE(&hashURI_encoded);
+	rc = TemplateWrite(rss->head, &TemplateEscapedCBs, args, (TemplateWritev)PageWritev, page);
+	for(size_t i = 0; rc >= 0 && i < count; i++) {
+		rc = get_item(rss, session, URIs[i], cached, ncached, &items[i]);
+		if(rc >= 0) rc = write_item(page, &items[i], base);
+	}
+	if(rc >= 0) {
+		rc = TemplateWrite(rss->tail, &TemplateEscapedCBs, args, (TemplateWritev)PageWritev, page);
+	}
+	if(rc < 0) {
+		status = 500;
+		goto cleanup;
 	}
 
+	if(latest) feed_replace(rss, items, count, stamp);
 
-	TemplateWriteHTTPChunk(rss->tail, &TemplateStaticCBs, args, conn);
-	FREE(&reponame_encoded);
-
-	HTTPConnectionWriteChunkEnd(conn);
-	HTTPConnectionEnd(conn);
-
+	PageSend(rss->pages, page, session, conn, method, URI, headers, 200, "application/rss+xml");
 
 cleanup:
 	SLNFilterFree(&filter);
+	PageFree(&page);
+	FREE(&base);
+	for(size_t i = 0; i < count; i++) feed_item_clear(&items[i]);
+	for(size_t i = 0; i < ncached; i++) feed_item_clear(&cached[i]);
 	for(size_t i = 0; i < count; i++) FREE(&URIs[i]);
 	assert_zeroed(URIs, count);
 	return status;
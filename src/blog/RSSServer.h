@@ -3,10 +3,11 @@
 
 #include <async/http/HTTP.h>
 #include "../StrongLink.h"
+// Needs PageCache.h (or Blog.h) first.
 
 typedef struct RSSServer *RSSServerRef;
 
-int RSSServerCreate(SLNRepoRef const repo, RSSServerRef *const out);
+int RSSServerCreate(SLNRepoRef const repo, PageCacheRef const pages, RSSServerRef *const out);
 void RSSServerFree(RSSServerRef *const rssptr);
 
 int RSSServerDispatch(RSSServerRef const rss, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
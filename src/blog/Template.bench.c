@@ -0,0 +1,125 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Renders the blog's entry templates (entry-start.html and
+// entry-end.html) ITERATIONS times into a reused buffer, with values
+// that are already escaped, escaped while writing, or copied by the
+// lookup callback like the preview metadata is.
+// Usage: make bench (or build/bench/blog/Template.bench [template dir])
+
+#include "../StrongLink.h"
+#include "Template.h"
+
+#define ITERATIONS (1000 * 1000)
+#define TEMPLATE_DIR "res/blog/template"
+#define OUTPUT_MAX (1024 * 8)
+
+#define HASH "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+typedef struct {
+	char buf[OUTPUT_MAX];
+	size_t len;
+	uint64_t total;
+} sink;
+
+static strarg_t dir = TEMPLATE_DIR;
+static int status = 0;
+
+static int sink_writev(sink *const s, uv_buf_t parts[], unsigned int const count) {
+	for(unsigned i = 0; i < count; i++) {
+		if(parts[i].len > sizeof(s->buf) - s->len) return UV_ENOBUFS;
+		memcpy(s->buf+s->len, parts[i].base, parts[i].len);
+		s->len += parts[i].len;
+	}
+	return 0;
+}
+
+static str_t *copy_lookup(void const *const ctx, strarg_t const var) {
+	TemplateStaticArg const *const args = ctx;
+	for(size_t i = 0; args[i].var; i++) {
+		if(0 == strcmp(args[i].var, var)) return htmlenc(args[i].val);
+	}
+	return NULL;
+}
+static void copy_free(void const *const ctx, strarg_t const var, str_t **const val) {
+	FREE(val);
+}
+static TemplateArgCBs const copy_cbs = {
+	.lookup = copy_lookup,
+	.free = copy_free,
+	.escape = false,
+};
+
+static int run(strarg_t const name, TemplateRef const start, TemplateRef const end, TemplateArgCBs const *const cbs, TemplateStaticArg const *const args) {
+	sink s[1] = {{ .len = 0 }};
+	uint64_t const t = uv_hrtime();
+	for(size_t i = 0; i < ITERATIONS; i++) {
+		s->len = 0;
+		int rc = TemplateWrite(start, cbs, args, (TemplateWritev)sink_writev, s);
+		if(rc >= 0) rc = TemplateWrite(end, cbs, args, (TemplateWritev)sink_writev, s);
+		if(rc < 0) return rc;
+		s->total += s->len;
+	}
+	uint64_t const elapsed = uv_hrtime() - t;
+	fprintf(stderr, "%-8s %7.1f ns/entry, %6.1f MB/s (%zu bytes each)\n", name,
+		(double)elapsed / ITERATIONS, s->total / (elapsed / 1e9) / 1e6, s->len);
+	return 0;
+}
+
+static int load(strarg_t const name, TemplateRef *const out) {
+	str_t *path = aasprintf("%s/%s", dir, name);
+	if(!path) return UV_ENOMEM;
+	int rc = TemplateCreateFromPath(path, out);
+	if(rc < 0) fprintf(stderr, "Can't load %s: %s\n", path, uv_strerror(rc));
+	FREE(&path);
+	return rc;
+}
+
+static void bench(void *const unused) {
+	TemplateRef start = NULL;
+	TemplateRef end = NULL;
+	int rc = 0;
+
+	rc = rc < 0 ? rc : load("entry-start.html", &start);
+	rc = rc < 0 ? rc : load("entry-end.html", &end);
+	if(rc < 0) goto cleanup;
+
+	// The query URI needs escaping, so the values aren't all free.
+	TemplateStaticArg const raw[] = {
+		{"queryURI", "/?q=hash://sha256/" HASH "&start=-"},
+		{"shortURI", "/?q=hash://sha256/" HASH},
+		{"hashURI", "hash://sha256/" HASH},
+		{"rawURI", "/sln/file/sha256/" HASH},
+		{NULL, NULL},
+	};
+	TemplateStaticArg const escaped[] = {
+		{"queryURI", "/?q=hash://sha256/" HASH "&amp;start=-"},
+		{"shortURI", "/?q=hash://sha256/" HASH},
+		{"hashURI", "hash://sha256/" HASH},
+		{"rawURI", "/sln/file/sha256/" HASH},
+		{NULL, NULL},
+	};
+
+	rc = rc < 0 ? rc : run("static", start, end, &TemplateStaticCBs, escaped);
+	rc = rc < 0 ? rc : run("escaped", start, end, &TemplateEscapedCBs, raw);
+	rc = rc < 0 ? rc : run("copied", start, end, &copy_cbs, raw);
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Template benchmark failed: %s\n", uv_strerror(rc));
+	status = rc;
+	TemplateFree(&start);
+	TemplateFree(&end);
+	uv_stop(async_loop);
+}
+
+int main(int const argc, char const *const *const argv) {
+	if(argc > 1) dir = argv[1];
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, bench, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	return status < 0 ? 1 : 0;
+}
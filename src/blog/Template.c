@@ -2,26 +2,49 @@
 // MIT licensed (see LICENSE for details)
 
 #include <regex.h>
+#include "../util/httplog.h"
 #include "Template.h"
 
 #define TEMPLATE_MAX (1024 * 512)
 
+// Renders smaller than this don't touch the heap (except for escaping).
+#define INLINE_STEPS 32
+
+// Each variable is resolved to a slot when the template is compiled,
+// so rendering looks up every distinct name once, not once per use.
 typedef struct {
 	str_t *str;
 	size_t len;
-	str_t *var;
+	ssize_t slot; // -1 for none
 } TemplateStep;
 struct Template {
 	size_t count;
 	TemplateStep *steps;
+	size_t nvars;
+	str_t **vars;
 };
 
+static ssize_t var_slot(TemplateRef const t, strarg_t const var, size_t const len) {
+	for(size_t i = 0; i < t->nvars; i++) {
+		if(0 == strncmp(t->vars[i], var, len) && '\0' == t->vars[i][len]) return i;
+	}
+	str_t **x = reallocarray(t->vars, t->nvars+1, sizeof(str_t *));
+	if(!x) return UV_ENOMEM;
+	t->vars = x; x = NULL;
+	t->vars[t->nvars] = strndup(var, len);
+	if(!t->vars[t->nvars]) return UV_ENOMEM;
+	return t->nvars++;
+}
+
 int TemplateCreate(strarg_t const str, TemplateRef *const out) {
 	TemplateRef t = calloc(1, sizeof(struct Template));
 	if(!t) return UV_ENOMEM;
 	t->count = 0;
 	t->steps = NULL;
+	t->nvars = 0;
+	t->vars = NULL;
 	size_t size = 0;
+	int rc = 0;
 
 	regex_t exp[1];
 	regcomp(exp, "\\{\\{[a-zA-Z0-9]+\\}\\}", REG_EXTENDED);
@@ -30,35 +53,40 @@ int TemplateCreate(strarg_t const str, TemplateRef *const out) {
 		if(t->count >= size) {
 			size = MAX(10, size * 2);
 			TemplateStep *x = reallocarray(t->steps, size, sizeof(TemplateStep));
-			if(!x) {
-				regfree(exp);
-				TemplateFree(&t);
-				return UV_ENOMEM;
-			}
+			if(!x) rc = UV_ENOMEM;
+			if(rc < 0) goto cleanup;
 			t->steps = x; x = NULL;
 		}
 
+		TemplateStep *const s = &t->steps[t->count];
 		regmatch_t match[1];
 		if(0 == regexec(exp, pos, 1, match, 0)) {
 			regoff_t const loc = match->rm_so;
 			regoff_t const len = match->rm_eo - loc;
-			t->steps[t->count].str = strndup(pos, loc);
-			t->steps[t->count].len = loc;
-			t->steps[t->count].var = strndup(pos+loc+2, len-4);
+			s->str = strndup(pos, loc);
+			s->len = loc;
+			s->slot = var_slot(t, pos+loc+2, len-4);
 			++t->count;
+			if(!s->str) rc = UV_ENOMEM;
+			if(s->slot < 0) rc = (int)s->slot;
+			if(rc < 0) goto cleanup;
 			pos += match->rm_eo;
 		} else {
-			t->steps[t->count].str = strdup(pos);
-			t->steps[t->count].len = strlen(pos);
-			t->steps[t->count].var = NULL;
+			s->str = strdup(pos);
+			s->len = strlen(pos);
+			s->slot = -1;
 			++t->count;
+			if(!s->str) rc = UV_ENOMEM;
+			if(rc < 0) goto cleanup;
 			break;
 		}
 	}
-	regfree(exp);
 
-	*out = t;
-	return 0;
+	*out = t; t = NULL;
+cleanup:
+	regfree(exp);
+	TemplateFree(&t);
+	return rc;
 }
 int TemplateCreateFromPath(strarg_t const path, TemplateRef *const out) {
 	int rc = 0;
@@ -94,51 +122,96 @@ void TemplateFree(TemplateRef *const tptr) {
 	for(size_t i = 0; i < t->count; ++i) {
 		FREE(&t->steps[i].str);
 		t->steps[i].len = 0;
-		FREE(&t->steps[i].var);
+		t->steps[i].slot = 0;
 	}
 	assert_zeroed(t->steps, t->count);
 	FREE(&t->steps);
 	t->count = 0;
+	for(size_t i = 0; i < t->nvars; ++i) {
+		FREE(&t->vars[i]);
+	}
+	assert_zeroed(t->vars, t->nvars);
+	FREE(&t->vars);
+	t->nvars = 0;
 	assert_zeroed(t, 1);
 	FREE(tptr); t = NULL;
 }
+
+#include "../../deps/cmark/src/houdini.h"
+#include "../../deps/cmark/src/buffer.h"
+
+// HACK
+extern cmark_mem DEFAULT_MEM_ALLOCATOR;
+
+static void escape(cmark_strbuf *const out, strarg_t const str, size_t const len) {
+	bufsize_t const old = out->size;
+	houdini_escape_html(out, (uint8_t const *)str, len);
+	// Some versions of houdini don't write anything when there's
+	// nothing to escape.
+	if(old == out->size) cmark_strbuf_put(out, (uint8_t const *)str, len);
+}
+
 int TemplateWrite(TemplateRef const t, TemplateArgCBs const *const cbs, void const *const actx, TemplateWritev const writev, void *wctx) {
 	if(!t) return 0;
 
-	uv_buf_t *output = calloc(t->count * 2, sizeof(uv_buf_t));
-	str_t **vals = calloc(t->count, sizeof(str_t *));
-	if(!output || !vals) {
-		FREE(&output);
-		FREE(&vals);
-		return UV_ENOMEM;
-	}
+	uv_buf_t output_inline[INLINE_STEPS * 2];
+	str_t *vals_inline[INLINE_STEPS];
+	uv_buf_t vars_inline[INLINE_STEPS];
+	bool const inline_ok = t->count <= INLINE_STEPS && t->nvars <= INLINE_STEPS;
+	uv_buf_t *output = inline_ok ? output_inline : calloc(t->count * 2, sizeof(uv_buf_t));
+	str_t **vals = inline_ok ? vals_inline : calloc(MAX(t->nvars, 1), sizeof(str_t *));
+	uv_buf_t *vars = inline_ok ? vars_inline : calloc(MAX(t->nvars, 1), sizeof(uv_buf_t));
+	cmark_strbuf escaped = CMARK_BUF_INIT(&DEFAULT_MEM_ALLOCATOR);
+	int rc = 0;
+	if(!output || !vals || !vars) rc = UV_ENOMEM;
+	if(rc < 0) goto cleanup;
 
-	for(size_t i = 0; i < t->count; i++) {
-		TemplateStep const *const s = &t->steps[i];
-		str_t *const val = s->var ? cbs->lookup(actx, s->var) : NULL;
+	for(size_t i = 0; i < t->nvars; i++) {
+		str_t *const val = cbs->lookup(actx, t->vars[i]);
 		size_t const len = val ? strlen(val) : 0;
-		output[i*2+0] = uv_buf_init((char *)s->str, s->len);
-		output[i*2+1] = uv_buf_init((char *)val, len);
 		vals[i] = val;
+		if(cbs->escape && len) {
+			bufsize_t const old = escaped.size;
+			escape(&escaped, val, len);
+			vars[i] = uv_buf_init(NULL, escaped.size - old);
+		} else {
+			vars[i] = uv_buf_init((char *)val, len);
+		}
+	}
+	// Escaped values all go in one buffer, which might move as it
+	// grows, so we only point into it once it's done.
+	size_t offset = 0;
+	for(size_t i = 0; cbs->escape && i < t->nvars; i++) {
+		if(!vars[i].len) continue;
+		vars[i].base = (char *)escaped.ptr + offset;
+		offset += vars[i].len;
 	}
 
-	int rc = writev(wctx, output, t->count * 2);
-
-	FREE(&output);
-
+	unsigned n = 0;
 	for(size_t i = 0; i < t->count; i++) {
 		TemplateStep const *const s = &t->steps[i];
-		if(!s->var) continue;
-		if(cbs->free) cbs->free(actx, s->var, &vals[i]);
+		if(s->len) output[n++] = uv_buf_init((char *)s->str, s->len);
+		if(s->slot >= 0 && vars[s->slot].len) output[n++] = vars[s->slot];
+	}
+
+	// Don't write an empty chunk, which would end the response.
+	if(n) rc = writev(wctx, output, n);
+
+	for(size_t i = 0; i < t->nvars; i++) {
+		if(cbs->free) cbs->free(actx, t->vars[i], &vals[i]);
 		else vals[i] = NULL;
 	}
-	assert_zeroed(vals, t->count);
-	FREE(&vals);
+	assert_zeroed(vals, t->nvars);
 
+cleanup:
+	cmark_strbuf_free(&escaped);
+	if(output != output_inline) FREE(&output);
+	if(vals != vals_inline) FREE(&vals);
+	if(vars != vars_inline) FREE(&vars);
 	return rc;
 }
 int TemplateWriteHTTPChunk(TemplateRef const t, TemplateArgCBs const *const cbs, void const *const actx, HTTPConnectionRef const conn) {
-	return TemplateWrite(t, cbs, actx, (TemplateWritev)HTTPConnectionWriteChunkv, conn);
+	return TemplateWrite(t, cbs, actx, (TemplateWritev)httplog_chunkv, conn);
 }
 static int async_fs_write_wrapper(uv_file const *const fdptr, uv_buf_t parts[], unsigned int const count) {
 	return async_fs_writeall(*fdptr, parts, count, -1);
@@ -148,6 +221,14 @@ int TemplateWriteFile(TemplateRef const t, TemplateArgCBs const *const cbs, void
 	return TemplateWrite(t, cbs, actx, (TemplateWritev)async_fs_write_wrapper, (uv_file *)&file);
 }
 
+size_t TemplateGetVars(TemplateRef const t, strarg_t *const vars, size_t const max) {
+	if(!t) return 0;
+	for(size_t i = 0; i < t->nvars && i < max; i++) {
+		vars[i] = t->vars[i];
+	}
+	return t->nvars;
+}
+
 static str_t *TemplateStaticLookup(void const *const ptr, strarg_t const var) {
 	TemplateStaticArg const *args = ptr;
 	assertf(args, "TemplateStaticLookup args required");
@@ -160,19 +241,18 @@ static str_t *TemplateStaticLookup(void const *const ptr, strarg_t const var) {
 TemplateArgCBs const TemplateStaticCBs = {
 	.lookup = TemplateStaticLookup,
 	.free = NULL,
+	.escape = false,
+};
+TemplateArgCBs const TemplateEscapedCBs = {
+	.lookup = TemplateStaticLookup,
+	.free = NULL,
+	.escape = true,
 };
 
 
-#include "../../deps/cmark/src/houdini.h"
-#include "../../deps/cmark/src/buffer.h"
-
-// HACK
-extern cmark_mem DEFAULT_MEM_ALLOCATOR;
-
 str_t *htmlenc(strarg_t const str) {
 	if(!str) return NULL;
 	cmark_strbuf out = CMARK_BUF_INIT(&DEFAULT_MEM_ALLOCATOR);
-	houdini_escape_html(&out, (uint8_t const *)str, strlen(str));
+	escape(&out, str, strlen(str));
 	return (str_t *)cmark_strbuf_detach(&out);
 }
-
@@ -10,6 +10,7 @@ typedef struct Template* TemplateRef;
 typedef struct {
 	str_t *(*lookup)(void const *const ctx, strarg_t const var);
 	void (*free)(void const *const ctx, strarg_t const var, str_t **const val);
+	bool escape; // HTML-escape values while writing
 } TemplateArgCBs;
 
 typedef int (*TemplateWritev)(void *, uv_buf_t[], unsigned int);
@@ -20,12 +21,18 @@ void TemplateFree(TemplateRef *const tptr);
 int TemplateWrite(TemplateRef const t, TemplateArgCBs const *const cbs, void const *const actx, TemplateWritev const writev, void *wctx);
 int TemplateWriteHTTPChunk(TemplateRef const t, TemplateArgCBs const *const cbs, void const *actx, HTTPConnectionRef const conn);
 int TemplateWriteFile(TemplateRef const t, TemplateArgCBs const *const cbs, void const *actx, uv_file const file);
+// Gets each distinct variable name, valid as long as the template.
+// Returns how many there are, even if that's more than max.
+size_t TemplateGetVars(TemplateRef const t, strarg_t *const vars, size_t const max);
 
 typedef struct {
 	strarg_t var;
 	strarg_t val;
 } TemplateStaticArg;
 extern TemplateArgCBs const TemplateStaticCBs;
+// Same as above, but values are raw and escaped for you, which saves
+// allocating an escaped copy of each.
+extern TemplateArgCBs const TemplateEscapedCBs;
 
 str_t *htmlenc(strarg_t const str);
 
@@ -0,0 +1,200 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Converts a corpus of large documents with the plaintext and markdown
+// converters, ITERATIONS times each, writing the HTML to /dev/null and
+// throwing the JSON away. Without arguments, the corpus is generated:
+// one plaintext and one markdown document, just under DOCUMENT_MAX,
+// with bare links and hash URIs mixed into the prose.
+// Usage: make bench (or build/bench/blog/converter.bench [file ...])
+
+#include <yajl/yajl_gen.h>
+#include "../StrongLink.h"
+
+#define ITERATIONS 10
+#define DOCUMENT_MAX (1024 * 1024 * 1) // LIMIT_DEFAULT in converter.h
+#define CORPUS_SIZE (1024 * 1000)
+#define FILES_MAX 32
+
+#define HASH "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+int blog_convert_markdown(
+	uv_file const html,
+	yajl_gen const json,
+	char const *const buf,
+	size_t const size,
+	char const *const type);
+int blog_convert_plaintext(
+	uv_file const html,
+	yajl_gen const json,
+	char const *const buf,
+	size_t const size,
+	char const *const type);
+
+typedef int (*BlogConverter)(
+	uv_file const html,
+	yajl_gen const json,
+	char const *const buf,
+	size_t const size,
+	char const *const type);
+
+typedef struct {
+	strarg_t name;
+	str_t *buf; // nul-terminated
+	size_t size;
+} document;
+
+static strarg_t const words[] = {
+	"the", "of", "and", "a", "to", "in", "is", "you", "that", "it",
+	"content", "addressing", "hash", "repository", "notes", "file",
+	"pull", "sync", "(parenthetical)", "don't", "\"quoted\",", "it's",
+	"a<b", "R&D", "end.", "well;", "why?", "«guillemets»", "“curly”",
+};
+static strarg_t const links[] = {
+	"http://example.com/",
+	"https://en.wikipedia.org/wiki/Hash_(disambiguation)",
+	"www.example.org/path?q=1&r=2",
+	"example.com/a/b/c.html",
+	"ftp://files.example.net/pub/",
+	"hash://sha256/" HASH,
+	"hash://sha256/" HASH "?type=text/plain",
+};
+static strarg_t const markdown[] = {
+	"\n\n# ", "\n\n## ", "\n\n* ", "\n\n1. ", "\n\n> ", "*", "**", "`",
+	"\n\n    ", "\n\n```\n", "\n```\n\n",
+};
+
+static document docs[FILES_MAX] = {};
+static size_t count = 0;
+static int status = 0;
+
+static uint64_t state = 1;
+static uint64_t next(void) {
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * UINT64_C(2685821657736338717);
+}
+
+static int generate(strarg_t const name, bool const md, document *const out) {
+	str_t *buf = malloc(CORPUS_SIZE+1);
+	if(!buf) return UV_ENOMEM;
+	size_t len = 0;
+	for(;;) {
+		strarg_t const *set = words;
+		size_t n = numberof(words);
+		uint64_t const r = next() % 100;
+		if(r < 4) { set = links; n = numberof(links); }
+		if(md && r >= 96) { set = markdown; n = numberof(markdown); }
+		strarg_t const str = set[next() % n];
+		if(md && r < 2) {
+			// Half the links in the markdown are explicit.
+			int const x = snprintf(buf+len, CORPUS_SIZE+1-len,
+				"[%s](%s) ", words[next() % numberof(words)], str);
+			if(x < 0 || (size_t)x > CORPUS_SIZE-len) break;
+			len += x;
+			continue;
+		}
+		size_t const slen = strlen(str);
+		if(slen+1 > CORPUS_SIZE-len) break;
+		memcpy(buf+len, str, slen);
+		len += slen;
+		buf[len++] = next() % 12 ? ' ' : '\n';
+	}
+	buf[len] = '\0';
+	out->name = name;
+	out->buf = buf;
+	out->size = len;
+	return 0;
+}
+
+static int load(strarg_t const path, document *const out) {
+	FILE *file = fopen(path, "rb");
+	str_t *buf = file ? malloc(DOCUMENT_MAX+1) : NULL;
+	size_t const len = buf ? fread(buf, 1, DOCUMENT_MAX+1, file) : 0;
+	int rc = 0;
+	if(!file) rc = -errno;
+	else if(!buf) rc = UV_ENOMEM;
+	else if(ferror(file)) rc = UV_EIO;
+	else if(len > DOCUMENT_MAX) rc = UV_EFBIG;
+	if(file) fclose(file);
+	file = NULL;
+	if(rc < 0) {
+		fprintf(stderr, "Can't load %s: %s\n", path, uv_strerror(rc));
+		FREE(&buf);
+		return rc;
+	}
+	buf[len] = '\0';
+	out->name = path;
+	out->buf = buf;
+	out->size = len;
+	return 0;
+}
+
+static void discard(void *const ctx, char const *const str, size_t const len) {}
+
+static int run(strarg_t const name, BlogConverter const convert, strarg_t const type, uv_file const html, document const *const doc) {
+	uint64_t const start = uv_hrtime();
+	for(size_t i = 0; i < ITERATIONS; i++) {
+		yajl_gen json = yajl_gen_alloc(NULL);
+		if(!json) return UV_ENOMEM;
+		yajl_gen_config(json, yajl_gen_print_callback, discard, NULL);
+		yajl_gen_map_open(json);
+		int rc = convert(html, json, doc->buf, doc->size, type);
+		yajl_gen_map_close(json);
+		yajl_gen_free(json); json = NULL;
+		if(rc < 0) return rc;
+	}
+	uint64_t const elapsed = uv_hrtime() - start;
+	fprintf(stderr, "%-10s %-24s %8.2f ms/document, %6.1f MB/s (%zu bytes)\n",
+		name, doc->name, elapsed / 1e6 / ITERATIONS,
+		(double)doc->size * ITERATIONS / (elapsed / 1e9) / 1e6, doc->size);
+	return 0;
+}
+
+static void bench(void *const unused) {
+	uv_file html = -1;
+	int rc = 0;
+
+	if(0 == count) {
+		rc = rc < 0 ? rc : generate("(generated plaintext)", false, &docs[count++]);
+		rc = rc < 0 ? rc : generate("(generated markdown)", true, &docs[count++]);
+		if(rc < 0) goto cleanup;
+	}
+
+	html = async_fs_open("/dev/null", O_WRONLY, 0000);
+	if(html < 0) rc = html;
+	if(rc < 0) goto cleanup;
+
+	for(size_t i = 0; i < count; i++) {
+		rc = rc < 0 ? rc : run("plaintext", blog_convert_plaintext, "text/plain; charset=utf-8", html, &docs[i]);
+		rc = rc < 0 ? rc : run("markdown", blog_convert_markdown, "text/markdown; charset=utf-8", html, &docs[i]);
+	}
+
+cleanup:
+	if(rc < 0) fprintf(stderr, "Converter benchmark failed: %s\n", uv_strerror(rc));
+	status = rc;
+	if(html >= 0) async_fs_close(html);
+	html = -1;
+	for(size_t i = 0; i < count; i++) FREE(&docs[i].buf);
+	uv_stop(async_loop);
+}
+
+int main(int const argc, char const *const *const argv) {
+	if(argc-1 > FILES_MAX) {
+		fprintf(stderr, "Too many files (at most %d)\n", FILES_MAX);
+		return 1;
+	}
+	for(int i = 1; i < argc; i++) {
+		if(load(argv[i], &docs[count++]) < 0) return 1;
+	}
+	int rc = async_process_init();
+	if(rc < 0) {
+		fprintf(stderr, "Initialization error: %s\n", uv_strerror(rc));
+		return 1;
+	}
+	async_spawn(STACK_DEFAULT, bench, NULL);
+	uv_run(async_loop, UV_RUN_DEFAULT);
+	return status < 0 ? 1 : 0;
+}
@@ -1,7 +1,7 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
-#include <regex.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -41,9 +41,10 @@
 #define STR_LEN(x) (x), (sizeof(x)-1)
 #define uv_buf_lit(str) uv_buf_init((char *)STR_LEN(str))
 
-// <http://daringfireball.net/2010/07/improved_regex_for_matching_urls>
-// Painstakingly ported to POSIX
-#define LINKIFY_RE "([a-z][a-z0-9_-]+:(/{1,3}|[a-z0-9%])|www[0-9]{0,3}[.]|[a-z0-9.-]+[.][a-z]{2,4}/)([^[:space:]()<>]+|\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\))+(\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\)|[^][[:space:]`!(){};:'\".,<>?«»“”‘’])"
+// Finds the next bare URL or hash URI in a nul-terminated string.
+// Matches the same as the old regex, in linkify.c, but much faster.
+// Keeps no state, so it's safe from any thread.
+bool linkify_next(char const *const str, size_t *const loc, size_t *const len);
 
 static int write_html(uv_file const file, char const *const buf, size_t const len) {
 	if(0 == len) return 0;
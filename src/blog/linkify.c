@@ -0,0 +1,165 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include "converter.h"
+
+// This used to be compiled with regcomp(3) for every document:
+// <http://daringfireball.net/2010/07/improved_regex_for_matching_urls>
+// Painstakingly ported to POSIX
+// ([a-z][a-z0-9_-]+:(/{1,3}|[a-z0-9%])|www[0-9]{0,3}[.]|[a-z0-9.-]+[.][a-z]{2,4}/)
+// ([^[:space:]()<>]+|\(([^[:space:]()<>]+|(\([^[:space:]()<>]+\)))*\))+
+// (\(([^[:space:]()<>]+|(\([^[:space:]()<>]+\)))*\)|[^][[:space:]`!(){};:'".,<>?«»“”‘’])
+// Case-insensitive, and in the C locale, so the fancy quotes at the end
+// are just a handful of excluded bytes.
+
+// After the prefix, the rest of a link is a run of "tokens", each either
+// one plain character or a parenthesized group (nested at most twice).
+// Splitting text into tokens is unambiguous, so for each place the prefix
+// could end, we take tokens as far as they go and keep the last point
+// where there were at least two and the last was a group or an "ending"
+// character. Of all of those, we take the longest, like regexec(3).
+
+static bool alpha(unsigned char const c) {
+	return (c|0x20) >= 'a' && (c|0x20) <= 'z';
+}
+static bool digit(unsigned char const c) {
+	return c >= '0' && c <= '9';
+}
+static bool scheme(unsigned char const c) {
+	return alpha(c) || digit(c) || '_' == c || '-' == c;
+}
+static bool domain(unsigned char const c) {
+	return alpha(c) || digit(c) || '.' == c || '-' == c;
+}
+static bool plain(unsigned char const c) {
+	if('\0' == c) return false;
+	if(' ' == c || ('\t' <= c && c <= '\r')) return false;
+	return '(' != c && ')' != c && '<' != c && '>' != c;
+}
+static bool ending(unsigned char const c) {
+	if(!plain(c)) return false;
+	switch(c) {
+		case '[': case ']': case '`': case '!': case '{': case '}':
+		case ';': case ':': case '\'': case '"': case '.': case ',':
+		case '?':
+		// The bytes of «»“”‘’ in UTF-8.
+		case 0xC2: case 0xAB: case 0xBB: case 0xE2: case 0x80:
+		case 0x9C: case 0x9D: case 0x98: case 0x99:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Returns the length of the group at str, or 0.
+static size_t group(unsigned char const *const str) {
+	if('(' != str[0]) return 0;
+	size_t i = 1;
+	for(;;) {
+		if(plain(str[i])) {
+			i++;
+		} else if(')' == str[i]) {
+			return i+1;
+		} else if('(' == str[i]) {
+			i++;
+			if(!plain(str[i])) return 0;
+			while(plain(str[i])) i++;
+			if(')' != str[i]) return 0;
+			i++;
+		} else {
+			return 0;
+		}
+	}
+}
+// Returns the length of the longest valid rest of a link, or 0.
+static size_t rest(unsigned char const *const str) {
+	size_t i = 0;
+	size_t tokens = 0;
+	size_t best = 0;
+	for(;;) {
+		bool end;
+		if(plain(str[i])) {
+			end = ending(str[i]);
+			i++;
+		} else {
+			size_t const len = group(str+i);
+			if(!len) break;
+			end = true;
+			i += len;
+		}
+		tokens++;
+		if(tokens >= 2 && end) best = i;
+	}
+	return best;
+}
+static void prefix_end(unsigned char const *const str, size_t const pos, size_t *const best) {
+	size_t const len = rest(str+pos);
+	if(len && pos+len > *best) *best = pos+len;
+}
+
+// Runs of scheme and domain characters are shared by every starting
+// point within them, so the caller remembers where they end.
+typedef struct {
+	size_t scheme_end;
+	size_t domain_end;
+} runs;
+
+static size_t match_at(unsigned char const *const str, size_t const start, runs *const r) {
+	unsigned char const *const s = str+start;
+	size_t best = 0;
+	if(r->domain_end <= start) {
+		r->domain_end = start;
+		while(domain(str[r->domain_end])) r->domain_end++;
+	}
+	if(r->scheme_end <= start) {
+		r->scheme_end = start;
+		while(scheme(str[r->scheme_end])) r->scheme_end++;
+	}
+
+	// [a-z][a-z0-9_-]+:(/{1,3}|[a-z0-9%])
+	size_t i = r->scheme_end - start;
+	if(alpha(s[0]) && i >= 2 && ':' == s[i]) {
+		i++;
+		for(size_t j = 0; j < 3 && '/' == s[i+j]; j++) {
+			prefix_end(s, i+j+1, &best);
+		}
+		if(alpha(s[i]) || digit(s[i]) || '%' == s[i]) {
+			prefix_end(s, i+1, &best);
+		}
+	}
+
+	// www[0-9]{0,3}[.]
+	if('w' == (s[0]|0x20) && 'w' == (s[1]|0x20) && 'w' == (s[2]|0x20)) {
+		i = 3;
+		while(i < 6 && digit(s[i])) i++;
+		if('.' == s[i]) prefix_end(s, i+1, &best);
+	}
+
+	// [a-z0-9.-]+[.][a-z]{2,4}/
+	i = r->domain_end - start;
+	if('/' == s[i]) {
+		for(size_t k = 1; k <= 4 && k+2 <= i; k++) {
+			if(!alpha(s[i-k])) break;
+			if(k < 2 || '.' != s[i-k-1]) continue;
+			prefix_end(s, i+1, &best);
+			break;
+		}
+	}
+
+	return best;
+}
+
+bool linkify_next(char const *const str, size_t *const loc, size_t *const len) {
+	unsigned char const *const s = (unsigned char const *)str;
+	runs r[1] = {{ 0, 0 }};
+	for(size_t i = 0; '\0' != s[i]; i++) {
+		// Every prefix starts with one of these.
+		if(!domain(s[i])) continue;
+		size_t const x = match_at(s, i, r);
+		if(!x) continue;
+		*loc = i;
+		*len = x;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,92 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+// Checks linkify_next against regexec(3) with the regex it replaced, on
+// random strings built from URL-like fragments. Every match in each
+// string has to come out the same, the way the converters walk them.
+// Usage: make test (or build/tests/blog/linkify.test [count [seed]])
+
+#include <regex.h>
+#include <stdio.h>
+#include "converter.h"
+
+#define COUNT (2300 * 1000)
+#define FRAGMENTS_MAX 16
+#define STRING_MAX (FRAGMENTS_MAX * 8 + 1)
+
+// <http://daringfireball.net/2010/07/improved_regex_for_matching_urls>
+// As it was before linkify.c, ported to POSIX.
+#define LINKIFY_RE "([a-z][a-z0-9_-]+:(/{1,3}|[a-z0-9%])|www[0-9]{0,3}[.]|[a-z0-9.-]+[.][a-z]{2,4}/)([^[:space:]()<>]+|\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\))+(\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\)|[^][[:space:]`!(){};:'\".,<>?«»“”‘’])"
+
+static char const *const fragments[] = {
+	"http", "HTTPS", "ftp", "hash", "sha256", "a", "Z", "x1", "9", "_", "-",
+	":", "://", "/", "//", "///", "%", "%20", "www", "WWW", "www1",
+	"www123", "www1234", "wwww", ".", "..", "com", "org", "Info", "c0m",
+	"example", "ab12cd", "q=", "&", "#", "=", "~", "+", "@",
+	"(", ")", "((", "))", "()", "<", ">", "[", "]", "`", "!", "{", "}",
+	";", "'", "\"", ",", "?", "*", "|",
+	" ", "\t", "\n", "\r\n", "\v", "\f",
+	"«", "»", "“", "”", "‘", "’", "é", "\xC2", "\x80", "\xFF",
+};
+
+static uint64_t state = 1;
+static uint64_t next(void) {
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * UINT64_C(2685821657736338717);
+}
+
+static void generate(char *const out) {
+	size_t const count = 1 + next() % FRAGMENTS_MAX;
+	size_t len = 0;
+	for(size_t i = 0; i < count; i++) {
+		char const *const f = fragments[next() % numberof(fragments)];
+		size_t const flen = strlen(f);
+		memcpy(out+len, f, flen);
+		len += flen;
+	}
+	out[len] = '\0';
+}
+
+static bool check(regex_t const *const re, char const *const str) {
+	char const *pos = str;
+	for(;;) {
+		regmatch_t match;
+		bool const expected = 0 == regexec(re, pos, 1, &match, 0);
+		size_t loc = 0, len = 0;
+		bool const actual = linkify_next(pos, &loc, &len);
+		if(expected != actual) return false;
+		if(!actual) return true;
+		if((size_t)match.rm_so != loc) return false;
+		if((size_t)(match.rm_eo - match.rm_so) != len) return false;
+		pos += loc+len;
+	}
+}
+
+int main(int const argc, char const *const *const argv) {
+	size_t const count = argc > 1 ? strtoull(argv[1], NULL, 10) : COUNT;
+	state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+	if(!state) state = 1;
+
+	regex_t re[1];
+	if(0 != regcomp(re, LINKIFY_RE, REG_ICASE | REG_EXTENDED)) {
+		fprintf(stderr, "Couldn't compile the regex\n");
+		return 1;
+	}
+	size_t failures = 0;
+	size_t matched = 0;
+	for(size_t i = 0; i < count; i++) {
+		char str[STRING_MAX];
+		generate(str);
+		size_t loc, len;
+		if(linkify_next(str, &loc, &len)) matched++;
+		if(check(re, str)) continue;
+		if(failures++ < 10) fprintf(stderr, "Mismatch: \"%s\"\n", str);
+	}
+	regfree(re);
+	fprintf(stderr, "Linkify: %zu strings, %zu with links, %zu mismatches\n",
+		count, matched, failures);
+	return failures ? 1 : 0;
+}
@@ -7,21 +7,81 @@
 #include <unistd.h> // Work around bad includes in libtls
 #include <tls.h>
 #include <async/http/HTTPServer.h>
+#include "../util/accesslog.h"
+#include "../util/admit.h"
 #include "../util/fts.h"
+#include "../util/httplog.h"
+#include "../util/metrics.h"
+#include "../util/pass.h"
 #include "../util/raiserlimit.h"
 #include "../StrongLink.h"
-#include "Blog.h"
+#include "Blog.h" // Includes PageCache.h
 #include "RSSServer.h"
 
 #define SERVER_ADDRESS NULL // NULL = public, "localhost" = private
 #define SERVER_PORT_RAW 8000 // HTTP default 80, 0 for disabled
 #define SERVER_PORT_TLS 0 // HTTPS default 443, 0 for disabled
 #define SERVER_LOG_FILE NULL // stdout or NULL for disabled
+#define SERVER_PROXIED 0 // 1 only if every request comes through a proxy that sets X-Forwarded-For
+
+// Concurrent requests per route class, 0 for unlimited.
+// Past the limit, requests wait in a bounded queue and get a
+// 503 Service Unavailable if it's full or they wait too long.
+#define ADMIT_QUERY_LIMIT 8
+#define ADMIT_STREAM_LIMIT 256 // Mostly idle, waiting for submissions
+#define ADMIT_UPLOAD_LIMIT 4
+#define ADMIT_PREVIEW_LIMIT 8
+#define ADMIT_QUEUE_MAX 32
+#define ADMIT_TIMEOUT (1000 * 5)
+#define ADMIT_RETRY_AFTER "5" // Seconds
+
+// Password checks get their own pool, so logins can't slow down queries.
+// Past the limit, they wait in a bounded queue and get a 503 if it's full.
+// Users or clients with too many failures within the window get a 429.
+#define PASS_LIMIT 2
+#define PASS_QUEUE_MAX 16
+#define PASS_FAILURES_MAX 10
+#define PASS_FAILURE_WINDOW (1000 * 60 * 5)
+
+// Workers generating blog previews, and how many previews can wait for
+// one before pages show them as unavailable. 0 workers to generate
+// previews on the requesting connection instead.
+// Of those workers, up to PREVIEW_BACKGROUND generate previews for new
+// submissions before anyone asks, 0 for disabled.
+#define PREVIEW_WORKERS 4
+#define PREVIEW_QUEUE_MAX 256
+#define PREVIEW_BACKGROUND 1
+
+// Rendered pages kept for anonymous readers, 0 for disabled.
+// They're served without admission control, since they're so cheap.
+#define PAGE_CACHE_MAX 64
+
+// Background removal of sync hints whose targets have arrived.
+// Each batch is one write transaction, so smaller batches and longer
+// delays mean less contention with syncs. 0 interval for disabled.
+#define HINT_SWEEP_BATCH 256
+#define HINT_SWEEP_DELAY 100 // Milliseconds between batches
+#define HINT_SWEEP_INTERVAL (1000 * 60 * 60) // Between full passes
+
+// Limits on pulling from other repositories, shared by all peers.
+// Rates are in bytes per second. 0 for unlimited.
+#define PULL_RATE 0
+#define PULL_PEER_RATE 0
+#define PULL_CONNECTIONS 32
+#define PULL_PEER_CONNECTIONS 12 // Of those, to any one peer
+#define PULL_BULK_CONNECTIONS 8 // Of those, for large files
 
 int SLNServerDispatch(SLNRepoRef const repo, SLNSessionRef const session, HTTPConnectionRef const conn, HTTPMethod const method, strarg_t const URI, HTTPHeadersRef const headers);
 
 static strarg_t path = NULL;
+static bool rebuild_stats = false;
+static bool compact = false;
+static bool prewarm = false;
+static int status = 0;
+static bool sweeping = false;
+static async_sem_t sweep_sem[1]; // Posted when sweep_hints() returns
 static SLNRepoRef repo = NULL;
+static PageCacheRef pages = NULL;
 static RSSServerRef rss = NULL;
 static BlogRef blog = NULL;
 static HTTPServerRef server_raw = NULL;
@@ -29,6 +89,121 @@ static HTTPServerRef server_tls = NULL;
 static uv_signal_t sigint[1] = {};
 static int sig = 0;
 
+static admit_class route_class(HTTPMethod const method, strarg_t const URI) {
+	strarg_t qs = NULL;
+	// These handle many files at once, so they're not cheap.
+	if(0 == uripathcmp("/sln/batch", URI, NULL)) return ADMIT_QUERY;
+	if(0 == uripathcmp("/sln/have", URI, NULL)) return ADMIT_QUERY;
+	if(0 == uripathcmp("/sln/digest", URI, NULL)) return ADMIT_QUERY;
+	if(HTTP_POST == method || HTTP_PUT == method) {
+		if(0 == uripathcmp("/post", URI, NULL)) return ADMIT_UPLOAD;
+		if(prefix("/sln/file", URI)) return ADMIT_UPLOAD;
+		if(0 != uripathcmp("/sln/query", URI, &qs)) return ADMIT_CHEAP;
+	} else if(0 != uripathcmp("/sln/query", URI, &qs) &&
+		0 != uripathcmp("/sln/metafiles", URI, &qs) &&
+		0 != uripathcmp("/sln/all", URI, &qs)) {
+		if(0 == uripathcmp("/", URI, NULL)) return ADMIT_PREVIEW;
+		return ADMIT_CHEAP;
+	}
+	// Long-polling queries spend most of their time asleep, so they
+	// shouldn't be counted against one-shot scans.
+	int dir = +1;
+	bool wait = true;
+	SLNFilterParseOptions(qs, NULL, NULL, &dir, &wait);
+	if(wait && dir > 0) return ADMIT_STREAM;
+	return ADMIT_QUERY;
+}
+static metric_histogram route_metric(strarg_t const URI) {
+	static struct {
+		strarg_t path;
+		metric_histogram metric;
+	} const routes[] = {
+		{ "/", METRIC_REQUEST_INDEX },
+		{ "/feed.xml", METRIC_REQUEST_FEED },
+		{ "/compose", METRIC_REQUEST_COMPOSE },
+		{ "/upload", METRIC_REQUEST_UPLOAD },
+		{ "/post", METRIC_REQUEST_POST },
+		{ "/account", METRIC_REQUEST_ACCOUNT },
+		{ "/auth", METRIC_REQUEST_AUTH },
+		{ "/sln/auth", METRIC_REQUEST_SLN_AUTH },
+		{ "/sln/file", METRIC_REQUEST_SLN_FILE },
+		{ "/sln/query", METRIC_REQUEST_SLN_QUERY },
+		{ "/sln/metafiles", METRIC_REQUEST_SLN_METAFILES },
+		{ "/sln/all", METRIC_REQUEST_SLN_ALL },
+		{ "/sln/batch", METRIC_REQUEST_SLN_BATCH },
+		{ "/sln/have", METRIC_REQUEST_SLN_HAVE },
+		{ "/sln/digest", METRIC_REQUEST_SLN_DIGEST },
+		{ "/sln/metrics", METRIC_REQUEST_SLN_METRICS },
+		{ "/sln/stats", METRIC_REQUEST_SLN_STATS },
+	};
+	for(size_t i = 0; i < numberof(routes); i++) {
+		if(0 == uripathcmp(routes[i].path, URI, NULL)) return routes[i].metric;
+	}
+	// These have the file's URI in the path.
+	if(prefix("/sln/file/", URI)) return METRIC_REQUEST_SLN_FILE;
+	if(prefix("/sln/meta/", URI)) return METRIC_REQUEST_SLN_META;
+	if(prefix("/sln/alts/", URI)) return METRIC_REQUEST_SLN_ALTS;
+	return METRIC_REQUEST_OTHER;
+}
+static void send_unavailable(HTTPConnectionRef const conn) {
+	httplog_response(conn, 503, "Service Unavailable");
+	HTTPConnectionWriteHeader(conn, "Retry-After", ADMIT_RETRY_AFTER);
+	// We didn't read the request body, which might be large.
+	HTTPConnectionWriteHeader(conn, "Connection", "close");
+	httplog_content_length(conn, 0);
+	HTTPConnectionBeginBody(conn);
+	HTTPConnectionEnd(conn);
+}
+
+static strarg_t method_str(HTTPMethod const method) {
+	switch(method) {
+		case HTTP_DELETE: return "DELETE";
+		case HTTP_GET: return "GET";
+		case HTTP_HEAD: return "HEAD";
+		case HTTP_POST: return "POST";
+		case HTTP_PUT: return "PUT";
+		default: return "-";
+	}
+}
+// Each line is:
+// time user "method URI" status bytes milliseconds "referer" "user-agent"
+// The byte count is the response body. Status and bytes are "-" when
+// the response came from the HTTP library and we don't know them.
+static void log_request(httplog_request const *const response, HTTPMethod const method, strarg_t const URI, strarg_t const username, HTTPHeadersRef const headers, uint64_t const start) {
+	if(!accesslog_enabled()) return;
+	if('\0' == URI[0]) return; // No request
+	uint64_t const elapsed = (uv_hrtime() - start) / 1000; // Microseconds
+	str_t t[31+1];
+	int rc = time_iso8601(t, sizeof(t));
+	if(rc < 0) return;
+	strarg_t const referer = headers ? HTTPHeadersGet(headers, "referer") : NULL;
+	strarg_t const agent = headers ? HTTPHeadersGet(headers, "user-agent") : NULL;
+	str_t status[15+1] = "-";
+	str_t bytes[31+1] = "-";
+	if(HTTPLOG_UNKNOWN != response->status) {
+		snprintf(status, sizeof(status), "%d", response->status);
+	}
+	if(HTTP_HEAD == method) {
+		strlcpy(bytes, "0", sizeof(bytes));
+	} else if(HTTPLOG_UNKNOWN != response->bytes) {
+		snprintf(bytes, sizeof(bytes), "%lld", (long long)response->bytes);
+	}
+	str_t line[1023+1];
+	rc = snprintf(line, sizeof(line),
+		"%s %s \"%s %s\" %s %s %llu.%03llu \"%s\" \"%s\"\n",
+		t, username ? username : "-", method_str(method), URI,
+		status, bytes,
+		(unsigned long long)elapsed / 1000,
+		(unsigned long long)elapsed % 1000,
+		referer ? referer : "-", agent ? agent : "-");
+	if(rc < 0) return;
+	if(rc >= sizeof(line)) { // Truncated
+		rc = sizeof(line)-1;
+		line[rc-1] = '\n';
+	}
+	accesslog_write(line, rc);
+}
+
 static void listener(void *ctx, HTTPServerRef const server, HTTPConnectionRef const conn) {
 	assert(server);
 	assert(conn);
@@ -36,10 +211,15 @@ static void listener(void *ctx, HTTPServerRef const server, HTTPConnectionRef co
 	str_t URI[URI_MAX]; URI[0] = '\0';
 	HTTPHeadersRef headers = NULL;
 	SLNSessionRef session = NULL;
+	httplog_request response[1] = {};
+	admit_class class = ADMIT_CHEAP;
+	bool admitted = false;
 	ssize_t len = 0;
 	int rc = 0;
 
 	len = HTTPConnectionReadRequest(conn, &method, URI, sizeof(URI));
+	uint64_t const start = uv_hrtime();
+	httplog_begin(response, conn);
 	if(UV_EOF == len) goto cleanup;
 	if(UV_ECONNRESET == len) goto cleanup;
 	if(len < 0) {
@@ -67,17 +247,36 @@ static void listener(void *ctx, HTTPServerRef const server, HTTPConnectionRef co
 	if(rc < 0) goto cleanup;
 	// Note: null session is valid (zero permissions).
 
+	rc = PageCacheSend(pages, session, conn, method, URI, headers);
+	if(UV_ENOENT != rc) goto cleanup;
+
+	class = route_class(method, URI);
+	rc = admit_enter(class);
+	if(UV_EAGAIN == rc || UV_ETIMEDOUT == rc) {
+		send_unavailable(conn);
+		rc = 0;
+		goto cleanup;
+	}
+	if(rc < 0) goto cleanup;
+	admitted = true;
+
 	rc = -1;
 	rc = rc >= 0 ? rc : SLNServerDispatch(repo, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : RSSServerDispatch(rss, session, conn, method, URI, headers);
 	rc = rc >= 0 ? rc : BlogDispatch(blog, session, conn, method, URI, headers);
 	if(rc < 0) rc = 404;
-	if(rc > 0) HTTPConnectionSendStatus(conn, rc);
+	if(rc > 0) httplog_send_status(conn, rc);
 
 cleanup:
-	if(rc < 0) HTTPConnectionSendStatus(conn, HTTPError(rc));
+	if(admitted) admit_leave(class);
+	if('\0' != URI[0]) {
+		uint64_t const elapsed = (uv_hrtime() - start) / 1000;
+		metrics_observe(route_metric(URI), elapsed);
+	}
+	if(rc < 0) httplog_send_status(conn, HTTPError(rc));
 	strarg_t const username = SLNSessionGetUsername(session);
-	HTTPConnectionLog(conn, URI, username, headers, SERVER_LOG_FILE);
+	log_request(response, method, URI, username, headers, start);
+	httplog_end(response);
 	SLNSessionRelease(&session);
 	HTTPHeadersFree(&headers);
 }
@@ -133,11 +332,39 @@ cleanup:
 	}
 	return 0;
 }
-static void init(void *const unused) {
+static void load_filter(void *const unused) {
+	// Lets sync and /sln/have rule out files we don't have without
+	// touching the database. Until it's ready, they just do lookups.
+	int rc = SLNRepoLoadFileFilter(repo);
+	if(rc < 0) alogf("File filter error: %s\n", sln_strerror(rc));
+}
+static void sleep_unless_stopped(uint64_t const ms) {
+	// Short steps so that we don't hold up shutting down.
+	for(uint64_t t = 0; t < ms && sweeping; t += 1000) {
+		async_sleep(MIN(ms - t, 1000));
+	}
+}
+static void sweep_hints(void *const unused) {
+	while(sweeping) {
+		uint64_t pos[2] = { 0, 0 };
+		uint64_t removed = 0;
+		ssize_t rc = 0;
+		while(sweeping) {
+			rc = SLNRepoSweepHints(repo, pos, HINT_SWEEP_BATCH, &removed);
+			if(rc <= 0) break;
+			sleep_unless_stopped(HINT_SWEEP_DELAY);
+		}
+		if(rc < 0) alogf("Hint sweep error: %s\n", sln_strerror(rc));
+		if(removed) alogf("Removed %llu satisfied sync hints\n", (unsigned long long)removed);
+		sleep_unless_stopped(HINT_SWEEP_INTERVAL);
+	}
+	async_sem_post(sweep_sem);
+}
+static int start(void) {
 	int rc = async_random((byte_t *)&SLNSeed, sizeof(SLNSeed));
 	if(rc < 0) {
 		alogf("Random seed error\n");
-		return;
+		return rc;
 	}
 
 	str_t *tmp = strdup(path);
@@ -146,30 +373,107 @@ static void init(void *const unused) {
 	FREE(&tmp);
 	if(rc < 0) {
 		alogf("Repository could not be opened: %s\n", sln_strerror(rc));
-		return;
+		return rc;
+	}
+	if(rebuild_stats) {
+		// Offline maintenance, don't start the servers.
+		alogf("Rebuilding repository statistics...\n");
+		rc = SLNRepoRebuildStats(repo);
+		if(rc < 0) alogf("Statistics error: %s\n", sln_strerror(rc));
+		else alogf("Statistics rebuilt\n");
+		return rc;
+	}
+	if(compact) {
+		alogf("Compacting repository database...\n");
+		rc = SLNRepoCompact(repo);
+		if(rc < 0) alogf("Compaction error: %s\n", sln_strerror(rc));
+		else alogf("Database compacted\n");
+		return rc;
+	}
+	rc = SLNRepoCheckStats(repo);
+	if(rc < 0) {
+		alogf("Statistics error: %s\n", sln_strerror(rc));
+		return rc;
+	}
+	if(PAGE_CACHE_MAX) {
+		rc = PageCacheCreate(repo, PAGE_CACHE_MAX, &pages);
+		if(rc < 0) {
+			alogf("Page cache error: %s\n", sln_strerror(rc));
+			return rc;
+		}
 	}
-	blog = BlogCreate(repo);
+	blog = BlogCreate(repo, pages);
 	if(!blog) {
 		alogf("Blog server could not be initialized\n");
-		return;
+		return UV_ENOMEM;
 	}
-	rc = RSSServerCreate(repo, &rss);
+	blog->proxied = SERVER_PROXIED;
+	if(prewarm) {
+		// Offline, so use every core.
+		long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		unsigned const workers = cpus > 0 ? cpus : 1;
+		BlogGenConfig(blog->gen, workers, workers*2, workers);
+		alogf("Generating previews with %u workers...\n", workers);
+		uint64_t count = 0;
+		rc = BlogGenPrewarm(blog->gen, &count);
+		if(rc < 0) alogf("Preview error: %s\n", sln_strerror(rc));
+		else alogf("Checked previews for %llu files\n", (unsigned long long)count);
+		BlogGenConfig(blog->gen, 0, 0, 0);
+		return rc;
+	}
+	BlogGenConfig(blog->gen, PREVIEW_WORKERS, PREVIEW_QUEUE_MAX, PREVIEW_BACKGROUND);
+	BlogGenWatch(blog->gen);
+	rc = RSSServerCreate(repo, pages, &rss);
 	if(rc < 0) {
 		alogf("RSS server error: %s\n", sln_strerror(rc));
-		return;
+		return rc;
+	}
+
+	rc = accesslog_open(SERVER_LOG_FILE);
+	if(rc < 0) {
+		alogf("Access log error: %s\n", sln_strerror(rc));
+		return rc;
+	}
+
+	admit_config(ADMIT_CHEAP, 0, 0, 0);
+	admit_config(ADMIT_QUERY, ADMIT_QUERY_LIMIT, ADMIT_QUEUE_MAX, ADMIT_TIMEOUT);
+	admit_config(ADMIT_STREAM, ADMIT_STREAM_LIMIT, ADMIT_QUEUE_MAX, ADMIT_TIMEOUT);
+	admit_config(ADMIT_UPLOAD, ADMIT_UPLOAD_LIMIT, ADMIT_QUEUE_MAX, ADMIT_TIMEOUT);
+	admit_config(ADMIT_PREVIEW, ADMIT_PREVIEW_LIMIT, ADMIT_QUEUE_MAX, ADMIT_TIMEOUT);
+
+	rc = pass_config(PASS_LIMIT, PASS_QUEUE_MAX, PASS_FAILURES_MAX, PASS_FAILURE_WINDOW);
+	if(rc < 0) {
+		alogf("Password hashing error: %s\n", sln_strerror(rc));
+		return rc;
 	}
 
-	if(init_http() < 0 || init_https() < 0) {
+	rc = init_http();
+	rc = rc < 0 ? rc : init_https();
+	if(rc < 0) {
 		HTTPServerClose(server_raw);
 		HTTPServerClose(server_tls);
-		return;
+		return rc;
 	}
 
+	async_spawn(STACK_DEFAULT, load_filter, NULL);
+	if(HINT_SWEEP_INTERVAL) {
+		async_sem_init(sweep_sem, 0, 0);
+		sweeping = true;
+		async_spawn(STACK_DEFAULT, sweep_hints, NULL);
+	}
+
+	SLNPullSchedulerConfig(SLNRepoGetPullScheduler(repo), PULL_RATE, PULL_PEER_RATE, PULL_CONNECTIONS, PULL_PEER_CONNECTIONS, PULL_BULK_CONNECTIONS);
 //	SLNRepoPullsStart(repo);
 
 	uv_signal_init(async_loop, sigint);
 	uv_signal_start(sigint, stop, SIGINT);
 	uv_unref((uv_handle_t *)sigint);
+	return 0;
+}
+static void init(void *const unused) {
+	// Reported by the exit status, so scripts can tell that
+	// maintenance commands failed.
+	status = start();
 }
 static void term(void *const unused) {
 	fprintf(stderr, "\n");
@@ -180,9 +484,19 @@ static void term(void *const unused) {
 	async_close((uv_handle_t *)sigint);
 
 	SLNRepoPullsStop(repo);
+	if(sweeping) {
+		// It might be in the middle of a batch, which has to finish
+		// before the repo can be freed.
+		sweeping = false;
+		async_sem_wait(sweep_sem);
+		async_sem_destroy(sweep_sem);
+	}
+	if(blog) BlogGenConfig(blog->gen, 0, 0, 0); // Stops the watcher too.
 	HTTPServerClose(server_raw);
 	HTTPServerClose(server_tls);
 
+	accesslog_close();
+
 	async_pool_enter(NULL);
 	fflush(NULL); // Everything.
 	async_pool_leave(NULL);
@@ -192,6 +506,7 @@ static void cleanup(void *const unused) {
 	HTTPServerFree(&server_tls);
 	RSSServerFree(&rss);
 	BlogFree(&blog);
+	PageCacheFree(&pages);
 	SLNRepoFree(&repo);
 
 	async_pool_enter(NULL);
@@ -213,11 +528,22 @@ int main(int const argc, char const *const *const argv) {
 		return 1;
 	}
 
-	if(2 != argc || '-' == argv[1][0]) {
-		fprintf(stderr, "Usage:\n\t" "%s repo\n", argv[0]);
+	int i = 1;
+	if(i < argc && 0 == strcmp("--rebuild-stats", argv[i])) {
+		rebuild_stats = true;
+		i++;
+	} else if(i < argc && 0 == strcmp("--compact", argv[i])) {
+		compact = true;
+		i++;
+	} else if(i < argc && 0 == strcmp("--prewarm-previews", argv[i])) {
+		prewarm = true;
+		i++;
+	}
+	if(i+1 != argc || '-' == argv[i][0]) {
+		fprintf(stderr, "Usage:\n\t" "%s [--rebuild-stats | --compact | --prewarm-previews] repo\n", argv[0]);
 		return 1;
 	}
-	path = argv[1];
+	path = argv[i];
 
 	// Even our init code wants to use async I/O.
 	async_spawn(STACK_DEFAULT, init, NULL);
@@ -248,5 +574,5 @@ int main(int const argc, char const *const *const argv) {
 	// TODO: Windows?
 	if(sig) raise(sig);
 
-	return 0;
+	return status < 0 ? 1 : 0;
 }
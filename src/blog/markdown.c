@@ -41,12 +41,6 @@ static void md_escape_inline(cmark_iter *const iter) {
 	}
 }
 static void md_autolink(cmark_iter *const iter) {
-	regex_t linkify[1];
-	// <http://daringfireball.net/2010/07/improved_regex_for_matching_urls>
-	// Painstakingly ported to POSIX
-	int rc = regcomp(linkify, "([a-z][a-z0-9_-]+:(/{1,3}|[a-z0-9%])|www[0-9]{0,3}[.]|[a-z0-9.-]+[.][a-z]{2,4}/)([^[:space:]()<>]+|\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\))+(\\(([^[:space:]()<>]+|(\\([^[:space:]()<>]+\\)))*\\)|[^][[:space:]`!(){};:'\".,<>?«»“”‘’])", REG_ICASE | REG_EXTENDED);
-	assert(0 == rc);
-
 	for(;;) {
 		cmark_event_type const event = cmark_iter_next(iter);
 		if(CMARK_EVENT_DONE == event) break;
@@ -56,11 +50,8 @@ static void md_autolink(cmark_iter *const iter) {
 
 		char const *const str = cmark_node_get_literal(node);
 		char const *pos = str;
-		regmatch_t match;
-		while(0 == regexec(linkify, pos, 1, &match, 0)) {
-			regoff_t const loc = match.rm_so;
-			regoff_t const len = match.rm_eo - match.rm_so;
-
+		size_t loc, len;
+		while(linkify_next(pos, &loc, &len)) {
 			char *a = strndup(pos, loc);
 			char *b = strndup(pos+loc, len);
 			assert(a);
@@ -90,7 +81,6 @@ static void md_autolink(cmark_iter *const iter) {
 		}
 
 	}
-	regfree(linkify);
 }
 static void md_block_external_images(cmark_iter *const iter) {
 	for(;;) {
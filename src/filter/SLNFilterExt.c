@@ -227,7 +227,103 @@ cleanup:
 
 	return rc;
 }
-ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+static ssize_t copy_record(uint64_t const fileID, bool const meta, KVS_txn *const txn, byte_t *const out) {
+	KVS_val fileID_key[1], file_val[1];
+	SLNFileByIDKeyPack(fileID_key, txn, fileID);
+	int rc = kvs_get(txn, fileID_key, file_val);
+	if(rc < 0) return rc;
+	strarg_t const hash = kvs_read_string(file_val, txn);
+	kvs_assert(hash);
+	size_t const hashlen = strlen(hash);
+	kvs_assert(SLN_INTERNAL_HASH_LEN == hashlen);
+
+	size_t len = 2;
+	out[len++] = SLNAlgoID(SLN_INTERNAL_ALGO);
+	out[len++] = hashlen/2;
+	tobin(out+len, hash, hashlen);
+	len += hashlen/2;
+
+	if(meta) {
+		KVS_val key[1], val[1];
+		SLNMetaFileByIDKeyPack(key, txn, fileID);
+		rc = kvs_get(txn, key, val);
+		if(rc < 0) return rc;
+		strarg_t target = NULL;
+		SLNMetaFileByIDValUnpack(val, txn, &target);
+		kvs_assert(target);
+		ssize_t const x = SLNURIRecordPackHash(target, out+len, SLN_URI_RECORD_MAX-len);
+		if(x >= 0) {
+			len += x;
+		} else {
+			size_t const targetlen = strlen(target);
+			if(len+1+targetlen > SLN_URI_RECORD_MAX) return KVS_EINVAL;
+			out[len++] = 0;
+			memcpy(out+len, target, targetlen);
+			len += targetlen;
+		}
+	}
+
+	out[0] = 0xff & ((len-2) >> 8);
+	out[1] = 0xff & ((len-2) >> 0);
+	return len;
+}
+static ssize_t write_record_batch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+	if(!SLNSessionHasPermission(session, SLN_RDONLY)) return KVS_EACCES;
+	if(0 == pos->dir) return KVS_EINVAL;
+	if(0 == max) return 0;
+
+	KVS_env *db = NULL;
+	KVS_txn *txn = NULL;
+	byte_t *buf = NULL;
+	size_t len = 0;
+	size_t i = 0;
+	ssize_t rc = 0;
+
+	// Too big for fiber stacks.
+	buf = malloc(BATCH_SIZE * SLN_URI_RECORD_MAX);
+	if(!buf) rc = KVS_ENOMEM;
+	if(rc < 0) goto cleanup;
+
+	rc = SLNSessionDBOpen(session, SLN_RDONLY, &db);
+	if(rc < 0) goto cleanup;
+	rc = kvs_txn_begin(db, NULL, KVS_RDONLY, &txn);
+	if(rc < 0) goto cleanup;
+
+	rc = SLNFilterPrepare(filter, txn);
+	if(rc < 0) goto cleanup;
+	rc = SLNFilterSeekToPosition(filter, pos, txn);
+	if(rc < 0) goto cleanup;
+
+	for(; i < MIN(max, BATCH_SIZE); i++) {
+		rc = SLNFilterGetPosition(filter, pos, txn);
+		if(KVS_NOTFOUND == rc) {
+			rc = 0;
+			break;
+		}
+		rc = copy_record(pos->fileID, meta, txn, buf+len);
+		if(rc < 0) goto cleanup;
+		len += rc;
+		SLNFilterStep(filter, pos->dir);
+	}
+
+	rc = 0;
+
+cleanup:
+	SLNFilterReset(filter);
+	kvs_txn_abort(txn); txn = NULL;
+	SLNSessionDBClose(session, &db);
+
+	// Don't hold the transaction open while writing.
+	if(rc >= 0 && len) {
+		uv_buf_t parts[] = { uv_buf_init((char *)buf, len) };
+		rc = writecb(ctx, parts, numberof(parts));
+	}
+	FREE(&buf);
+	if(rc < 0) return rc;
+	return i;
+}
+ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, bool const binary, uint64_t const max, SLNFilterWriteCB const writecb, void *ctx) {
+	if(binary) return write_record_batch(filter, session, pos, meta, max, writecb, ctx);
 	str_t *URIs[BATCH_SIZE];
 	ssize_t const count = SLNFilterCopyURIs(filter, session, pos, pos->dir, meta, URIs, MIN(max, BATCH_SIZE));
 	if(count <= 0) return count;
@@ -242,10 +338,10 @@ ssize_t SLNFilterWriteURIBatch(SLNFilterRef const filter, SLNSessionRef const se
 	if(rc < 0) return rc;
 	return count;
 }
-int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx) {
+int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, SLNFilterPosition *const pos, bool const meta, bool const binary, uint64_t const max, bool const wait, SLNFilterWriteCB const writecb, SLNFilterFlushCB const flushcb, void *ctx) {
 	uint64_t remaining = max;
 	for(;;) {
-		ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
+		ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, binary, remaining, writecb, ctx);
 		if(count < 0) return count;
 		remaining -= count;
 		if(!remaining) return 0;
@@ -263,7 +359,9 @@ int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, S
 		uint64_t const timeout = uv_now(async_loop)+(1000 * 30);
 		rc = SLNRepoSubmissionWait(repo, &latest, timeout);
 		if(UV_ETIMEDOUT == rc) {
-			uv_buf_t const parts[] = { UV_BUF_STATIC("\r\n") };
+			// An empty line or record.
+			uv_buf_t const parts[] = { binary ?
+				uv_buf_init((char *)"\0\0", 2) : UV_BUF_STATIC("\r\n") };
 			rc = writecb(ctx, parts, numberof(parts));
 			if(rc < 0) break;
 			continue;
@@ -271,7 +369,7 @@ int SLNFilterWriteURIs(SLNFilterRef const filter, SLNSessionRef const session, S
 		assert(rc >= 0); // TODO: Handle cancellation?
 
 		for(;;) {
-			ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, remaining, writecb, ctx);
+			ssize_t const count = SLNFilterWriteURIBatch(filter, session, pos, meta, binary, remaining, writecb, ctx);
 			if(count < 0) return count;
 			remaining -= count;
 			if(!remaining) return 0;
@@ -0,0 +1,106 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <async/async.h>
+#include "accesslog.h"
+
+#define BUFFER_SIZE (1024 * 256) // Memory ceiling
+#define FLUSH_INTERVAL 250 // Milliseconds
+
+// Single-producer, single-consumer ring.
+// `head` is only written by the producer and `tail` by the flusher.
+// Both count total bytes and wrap around the buffer on access.
+static char *buffer = NULL;
+static uint64_t head = 0;
+static uint64_t tail = 0;
+static uint64_t dropped = 0;
+
+static FILE *output = NULL;
+static uv_thread_t thread[1];
+static bool stop = false;
+
+static void flush(void) {
+	uint64_t const t = tail;
+	uint64_t const h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	if(h == t) return;
+	size_t const len = h - t;
+	size_t const pos = t % BUFFER_SIZE;
+	size_t const part = BUFFER_SIZE - pos;
+	if(len <= part) {
+		fwrite(buffer+pos, 1, len, output);
+	} else {
+		fwrite(buffer+pos, 1, part, output);
+		fwrite(buffer+0, 1, len-part, output);
+	}
+	fflush(output);
+	__atomic_store_n(&tail, h, __ATOMIC_RELEASE);
+}
+static void flusher(void *const arg) {
+	struct timespec const interval = {
+		.tv_sec = FLUSH_INTERVAL / 1000,
+		.tv_nsec = (FLUSH_INTERVAL % 1000) * 1000 * 1000,
+	};
+	for(;;) {
+		// Read the flag first so that anything written before
+		// closing makes it into the last flush.
+		bool const done = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+		flush();
+		if(done) break;
+		nanosleep(&interval, NULL);
+	}
+}
+
+int accesslog_open(FILE *const file) {
+	assert(!output);
+	if(!file) return 0;
+	buffer = malloc(BUFFER_SIZE);
+	if(!buffer) return UV_ENOMEM;
+	head = 0;
+	tail = 0;
+	stop = false;
+	output = file;
+	int rc = uv_thread_create(thread, flusher, NULL);
+	if(rc < 0) {
+		output = NULL;
+		free(buffer); buffer = NULL;
+		return rc;
+	}
+	return 0;
+}
+void accesslog_close(void) {
+	if(!output) return;
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	uv_thread_join(thread);
+	output = NULL;
+	free(buffer); buffer = NULL;
+}
+
+bool accesslog_enabled(void) {
+	return NULL != output;
+}
+void accesslog_write(char const *const str, size_t const len) {
+	if(!output) return;
+	uint64_t const h = head;
+	uint64_t const t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	if(len > BUFFER_SIZE - (h - t)) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	size_t const pos = h % BUFFER_SIZE;
+	size_t const part = BUFFER_SIZE - pos;
+	if(len <= part) {
+		memcpy(buffer+pos, str, len);
+	} else {
+		memcpy(buffer+pos, str, part);
+		memcpy(buffer+0, str+part, len-part);
+	}
+	__atomic_store_n(&head, h+len, __ATOMIC_RELEASE);
+}
+uint64_t accesslog_dropped(void) {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
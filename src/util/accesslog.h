@@ -0,0 +1,21 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Buffered access log. Lines are copied into a fixed-size ring and
+// written out in batches by a background thread, so requests never
+// block on the log file. If the ring is full, lines are dropped (and
+// counted) rather than growing without bound.
+// Writers must all be on the same thread (i.e. the event loop).
+
+// NULL disables logging.
+int accesslog_open(FILE *const file);
+void accesslog_close(void);
+
+bool accesslog_enabled(void);
+void accesslog_write(char const *const str, size_t const len);
+uint64_t accesslog_dropped(void);
+
@@ -0,0 +1,112 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <async/async.h>
+#include "admit.h"
+
+struct admit_queue {
+	bool init;
+	async_mutex_t mutex[1];
+	async_cond_t cond[1];
+	uint64_t timeout;
+	admit_stats stats[1];
+};
+
+static struct admit_queue queues[ADMIT_CLASS_COUNT] = {};
+
+static char const *const names[ADMIT_CLASS_COUNT] = {
+	[ADMIT_CHEAP] = "cheap",
+	[ADMIT_QUERY] = "query",
+	[ADMIT_STREAM] = "stream",
+	[ADMIT_UPLOAD] = "upload",
+	[ADMIT_PREVIEW] = "preview",
+};
+
+void admit_config(admit_class const class, unsigned const limit, unsigned const queue, uint64_t const timeout) {
+	assert(class < ADMIT_CLASS_COUNT);
+	struct admit_queue *const q = &queues[class];
+	if(!q->init) {
+		async_mutex_init(q->mutex, 0);
+		async_cond_init(q->cond, 0);
+		q->init = true;
+	}
+	async_mutex_lock(q->mutex);
+	q->stats->limit = limit;
+	q->stats->queue = queue;
+	q->timeout = timeout;
+	// Raising the limit might let some waiters in.
+	async_cond_broadcast(q->cond);
+	async_mutex_unlock(q->mutex);
+}
+
+static bool full(admit_stats const *const stats) {
+	if(!stats->limit) return false;
+	return stats->active >= stats->limit;
+}
+int admit_enter(admit_class const class) {
+	assert(class < ADMIT_CLASS_COUNT);
+	struct admit_queue *const q = &queues[class];
+	if(!q->init) return 0;
+	admit_stats *const stats = q->stats;
+	int rc = 0;
+	async_mutex_lock(q->mutex);
+	// Don't jump ahead of anyone already waiting.
+	if(!full(stats) && 0 == stats->waiting) goto admitted;
+	if(stats->waiting >= stats->queue) {
+		stats->rejected++;
+		rc = UV_EAGAIN;
+		goto cleanup;
+	}
+
+	uint64_t const future = uv_now(async_loop) + q->timeout;
+	stats->waiting++;
+	while(full(stats)) {
+		rc = async_cond_timedwait(q->cond, q->mutex, future);
+		if(rc < 0) break;
+	}
+	stats->waiting--;
+	if(full(stats)) {
+		stats->timedout++;
+		rc = UV_ETIMEDOUT;
+		goto cleanup;
+	}
+	rc = 0;
+
+admitted:
+	stats->active++;
+	stats->admitted++;
+cleanup:
+	async_mutex_unlock(q->mutex);
+	return rc;
+}
+void admit_leave(admit_class const class) {
+	assert(class < ADMIT_CLASS_COUNT);
+	struct admit_queue *const q = &queues[class];
+	if(!q->init) return;
+	async_mutex_lock(q->mutex);
+	assert(q->stats->active > 0);
+	q->stats->active--;
+	async_cond_signal(q->cond);
+	async_mutex_unlock(q->mutex);
+}
+
+char const *admit_class_name(admit_class const class) {
+	assert(class < ADMIT_CLASS_COUNT);
+	return names[class];
+}
+void admit_get_stats(admit_class const class, admit_stats *const out) {
+	assert(class < ADMIT_CLASS_COUNT);
+	assert(out);
+	struct admit_queue *const q = &queues[class];
+	if(!q->init) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	async_mutex_lock(q->mutex);
+	*out = *q->stats;
+	async_mutex_unlock(q->mutex);
+}
+
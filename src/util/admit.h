@@ -0,0 +1,40 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdint.h>
+
+// Requests are grouped into classes by how much of the thread pool and
+// database they tend to tie up. Each class has its own concurrency limit
+// and bounded wait queue, so that expensive requests can't starve cheap
+// ones (e.g. file requests behind a pile of full-text queries).
+typedef enum {
+	ADMIT_CHEAP = 0, // File and static requests
+	ADMIT_QUERY, // One-shot query scans
+	ADMIT_STREAM, // Long-polling query subscriptions
+	ADMIT_UPLOAD, // Submissions
+	ADMIT_PREVIEW, // Blog pages that may generate previews
+} admit_class;
+#define ADMIT_CLASS_COUNT 5
+
+typedef struct {
+	unsigned limit; // 0 for unlimited
+	unsigned queue; // Max waiting requests
+	unsigned active;
+	unsigned waiting;
+	uint64_t admitted;
+	uint64_t rejected; // Queue was full
+	uint64_t timedout; // Waited too long
+} admit_stats;
+
+// Must be called for each limited class before use.
+// Unconfigured classes are unlimited.
+void admit_config(admit_class const class, unsigned const limit, unsigned const queue, uint64_t const timeout);
+
+// Returns UV_EAGAIN if the queue is full, or UV_ETIMEDOUT if a slot
+// didn't become available in time. Only call admit_leave on success.
+int admit_enter(admit_class const class);
+void admit_leave(admit_class const class);
+
+char const *admit_class_name(admit_class const class);
+void admit_get_stats(admit_class const class, admit_stats *const out);
+
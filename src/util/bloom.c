@@ -0,0 +1,61 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include "../../deps/smhasher/MurmurHash3.h"
+#include "bloom.h"
+
+#define BITS_PER_ITEM 10
+#define HASH_COUNT 7 // Optimal for 10 bits per item
+#define BITS_MIN (1 << 16)
+
+struct bloom_filter {
+	uint64_t mask; // Bit count minus one
+	uint32_t seed;
+	uint64_t words[];
+};
+
+bloom_filter *bloom_create(uint64_t const items, uint32_t const seed) {
+	uint64_t bits = BITS_MIN;
+	while(bits < items * BITS_PER_ITEM && bits < (UINT64_C(1) << 40)) bits <<= 1;
+	bloom_filter *const bloom = calloc(1, sizeof(struct bloom_filter) + bits/8);
+	if(!bloom) return NULL;
+	bloom->mask = bits-1;
+	bloom->seed = seed;
+	return bloom;
+}
+void bloom_free(bloom_filter **const bloomptr) {
+	assert(bloomptr);
+	free(*bloomptr); *bloomptr = NULL;
+}
+
+// Double hashing, as in Kirsch and Mitzenmacher, "Less Hashing,
+// Same Performance". One 128-bit hash gives us all the bit positions.
+static void positions(bloom_filter const *const bloom, void const *const buf, size_t const len, uint64_t *const out) {
+	uint64_t h[2];
+	MurmurHash3_x64_128(buf, (int)len, bloom->seed, h);
+	for(size_t i = 0; i < HASH_COUNT; i++) {
+		out[i] = (h[0] + i*h[1]) & bloom->mask;
+	}
+}
+void bloom_add(bloom_filter *const bloom, void const *const buf, size_t const len) {
+	if(!bloom) return;
+	uint64_t pos[HASH_COUNT];
+	positions(bloom, buf, len, pos);
+	for(size_t i = 0; i < HASH_COUNT; i++) {
+		uint64_t const bit = UINT64_C(1) << (pos[i] % 64);
+		__atomic_fetch_or(&bloom->words[pos[i] / 64], bit, __ATOMIC_RELAXED);
+	}
+}
+bool bloom_maybe(bloom_filter const *const bloom, void const *const buf, size_t const len) {
+	if(!bloom) return true;
+	uint64_t pos[HASH_COUNT];
+	positions(bloom, buf, len, pos);
+	for(size_t i = 0; i < HASH_COUNT; i++) {
+		uint64_t const bit = UINT64_C(1) << (pos[i] % 64);
+		uint64_t const word = __atomic_load_n(&bloom->words[pos[i] / 64], __ATOMIC_RELAXED);
+		if(!(word & bit)) return false;
+	}
+	return true;
+}
+
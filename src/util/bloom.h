@@ -0,0 +1,21 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Bloom filter for answering "definitely not present" without a lookup.
+// Adding and checking are both lock-free, so any thread can use it.
+// It never shrinks, and if more items are added than it was sized for,
+// it just gets less selective.
+
+typedef struct bloom_filter bloom_filter;
+
+// Sized for about a 1% false positive rate at `items`.
+bloom_filter *bloom_create(uint64_t const items, uint32_t const seed);
+void bloom_free(bloom_filter **const bloomptr);
+
+void bloom_add(bloom_filter *const bloom, void const *const buf, size_t const len);
+bool bloom_maybe(bloom_filter const *const bloom, void const *const buf, size_t const len);
+
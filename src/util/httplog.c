@@ -0,0 +1,91 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdbool.h>
+#include "httplog.h"
+
+#define BUCKETS 64 // Chained, so it's only a speed limit
+
+// Requests live on the listener's stack and are linked in by connection.
+static httplog_request *buckets[BUCKETS] = {};
+
+static httplog_request **bucket(HTTPConnectionRef const conn) {
+	uintptr_t const x = (uintptr_t)conn;
+	return &buckets[(x >> 4) % BUCKETS];
+}
+static httplog_request *find(HTTPConnectionRef const conn) {
+	for(httplog_request *req = *bucket(conn); req; req = req->next) {
+		if(conn == req->conn) return req;
+	}
+	return NULL;
+}
+static void add_bytes(HTTPConnectionRef const conn, uint64_t const len) {
+	httplog_request *const req = find(conn);
+	if(!req) return;
+	if(HTTPLOG_UNKNOWN == req->bytes) return;
+	req->bytes += len;
+}
+static void set_status(HTTPConnectionRef const conn, uint16_t const status, bool const known) {
+	httplog_request *const req = find(conn);
+	if(!req) return;
+	req->status = status;
+	req->bytes = known ? 0 : HTTPLOG_UNKNOWN;
+}
+
+void httplog_begin(httplog_request *const req, HTTPConnectionRef const conn) {
+	assert(req);
+	assert(conn);
+	assert(!find(conn));
+	httplog_request **const head = bucket(conn);
+	req->conn = conn;
+	req->status = HTTPLOG_UNKNOWN;
+	req->bytes = 0;
+	req->next = *head;
+	*head = req;
+}
+void httplog_end(httplog_request *const req) {
+	if(!req->conn) return;
+	for(httplog_request **x = bucket(req->conn); *x; x = &(*x)->next) {
+		if(req != *x) continue;
+		*x = req->next;
+		break;
+	}
+	req->conn = NULL;
+	req->next = NULL;
+}
+
+int httplog_response(HTTPConnectionRef const conn, uint16_t const status, char const *const message) {
+	set_status(conn, status, true);
+	return HTTPConnectionWriteResponse(conn, status, message);
+}
+int httplog_content_length(HTTPConnectionRef const conn, uint64_t const length) {
+	add_bytes(conn, length);
+	return HTTPConnectionWriteContentLength(conn, length);
+}
+int httplog_chunk_length(HTTPConnectionRef const conn, uint64_t const length) {
+	add_bytes(conn, length);
+	return HTTPConnectionWriteChunkLength(conn, length);
+}
+int httplog_chunkv(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count) {
+	uint64_t len = 0;
+	for(unsigned int i = 0; i < count; i++) len += parts[i].len;
+	add_bytes(conn, len);
+	return HTTPConnectionWriteChunkv(conn, parts, count);
+}
+int httplog_send_status(HTTPConnectionRef const conn, uint16_t const status) {
+	set_status(conn, status, false);
+	return HTTPConnectionSendStatus(conn, status);
+}
+int httplog_send_redirect(HTTPConnectionRef const conn, uint16_t const status, char const *const location) {
+	set_status(conn, status, false);
+	return HTTPConnectionSendRedirect(conn, status, location);
+}
+int httplog_send_file(HTTPConnectionRef const conn, char const *const path, char const *const type, int64_t const size) {
+	int rc = HTTPConnectionSendFile(conn, path, type, size);
+	// Errors are sent by the caller.
+	if(rc >= 0) set_status(conn, 200, size >= 0);
+	if(rc >= 0 && size >= 0) add_bytes(conn, size);
+	return rc;
+}
+
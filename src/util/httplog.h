@@ -0,0 +1,35 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdint.h>
+#include <async/http/HTTP.h>
+
+// The HTTP library doesn't tell us what it sent, so the access log keeps
+// its own record. The listener registers each request while it's being
+// handled, and responses are written through these wrappers, which note
+// the status and body length for the request on that connection.
+// Canned responses from the library (redirects, status pages, static
+// files) have a known status but an unknown length.
+// Event loop only.
+
+#define HTTPLOG_UNKNOWN (-1)
+
+typedef struct httplog_request httplog_request;
+struct httplog_request {
+	HTTPConnectionRef conn;
+	int status; // Or HTTPLOG_UNKNOWN
+	int64_t bytes; // Body bytes, or HTTPLOG_UNKNOWN
+	httplog_request *next;
+};
+
+void httplog_begin(httplog_request *const req, HTTPConnectionRef const conn);
+void httplog_end(httplog_request *const req);
+
+int httplog_response(HTTPConnectionRef const conn, uint16_t const status, char const *const message);
+int httplog_content_length(HTTPConnectionRef const conn, uint64_t const length);
+int httplog_chunk_length(HTTPConnectionRef const conn, uint64_t const length);
+int httplog_chunkv(HTTPConnectionRef const conn, uv_buf_t const parts[], unsigned int const count);
+int httplog_send_status(HTTPConnectionRef const conn, uint16_t const status);
+int httplog_send_redirect(HTTPConnectionRef const conn, uint16_t const status, char const *const location);
+int httplog_send_file(HTTPConnectionRef const conn, char const *const path, char const *const type, int64_t const size);
+
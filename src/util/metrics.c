@@ -0,0 +1,318 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "accesslog.h"
+#include "admit.h"
+#include "metrics.h"
+
+#define thread_local __thread
+
+#define BUCKET_COUNT 11 // Including +Inf
+
+static uint64_t const bounds[BUCKET_COUNT-1] = { // Microseconds
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+};
+static char const *const bucket_names[BUCKET_COUNT] = {
+	"0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5", "+Inf",
+};
+
+typedef struct {
+	char const *name;
+	char const *labels;
+	char const *help;
+} metric_info;
+
+static metric_info const counters[METRIC_COUNTER_COUNT] = {
+	[METRIC_SUBMISSIONS] = { "sln_submissions_total", "", "Submissions written to disk" },
+	[METRIC_SUBMISSION_BYTES] = { "sln_submission_bytes_total", "", "Bytes of submissions written to disk" },
+	[METRIC_HASHED_BYTES] = { "sln_hashed_bytes_total", "", "Bytes hashed" },
+	[METRIC_SESSION_HITS] = { "sln_session_cache_total", "result=\"hit\"", "Session cache lookups" },
+	[METRIC_SESSION_MISSES] = { "sln_session_cache_total", "result=\"miss\"", "Session cache lookups" },
+	[METRIC_SESSION_EVICTIONS] = { "sln_session_cache_removed_total", "reason=\"evicted\"", "Sessions removed from the cache" },
+	[METRIC_SESSION_EXPIRATIONS] = { "sln_session_cache_removed_total", "reason=\"expired\"", "Sessions removed from the cache" },
+	[METRIC_PASS_BUSY] = { "sln_login_rejected_total", "reason=\"busy\"", "Login attempts refused before checking the password" },
+	[METRIC_PASS_THROTTLED] = { "sln_login_rejected_total", "reason=\"throttled\"", "Login attempts refused before checking the password" },
+	[METRIC_PAGE_HITS] = { "sln_page_cache_total", "result=\"hit\"", "Page cache lookups" },
+	[METRIC_PAGE_MISSES] = { "sln_page_cache_total", "result=\"miss\"", "Page cache lookups" },
+};
+static metric_info const gauges[METRIC_GAUGE_COUNT] = {
+	[METRIC_POOL_WAITING_INTERACTIVE] = { "sln_pool_waiting", "pool=\"interactive\"", "Tasks waiting for a worker thread" },
+	[METRIC_POOL_WAITING_BULK] = { "sln_pool_waiting", "pool=\"bulk\"", "Tasks waiting for a worker thread" },
+	[METRIC_POOL_WAITING_PREVIEW] = { "sln_pool_waiting", "pool=\"preview\"", "Tasks waiting for a worker thread" },
+	[METRIC_POOL_WAITING_PASS] = { "sln_pool_waiting", "pool=\"pass\"", "Tasks waiting for a worker thread" },
+	[METRIC_SYNC_QUEUED_FILE] = { "sln_sync_queued", "queue=\"file\"", "Pulled submissions waiting to be fetched" },
+	[METRIC_SYNC_QUEUED_META] = { "sln_sync_queued", "queue=\"meta\"", "Pulled submissions waiting to be fetched" },
+	[METRIC_SUBMISSION_WAITERS] = { "sln_submission_waiters", "", "Long-polling requests waiting for submissions" },
+	[METRIC_SESSION_CACHED] = { "sln_session_cache_size", "", "Sessions in the cache" },
+};
+static metric_info const histograms[METRIC_HISTOGRAM_COUNT] = {
+	[METRIC_REQUEST_OTHER] = { "sln_request_duration_seconds", "route=\"other\"", "Request latency by route" },
+	[METRIC_REQUEST_INDEX] = { "sln_request_duration_seconds", "route=\"/\"", "Request latency by route" },
+	[METRIC_REQUEST_FEED] = { "sln_request_duration_seconds", "route=\"/feed.xml\"", "Request latency by route" },
+	[METRIC_REQUEST_COMPOSE] = { "sln_request_duration_seconds", "route=\"/compose\"", "Request latency by route" },
+	[METRIC_REQUEST_UPLOAD] = { "sln_request_duration_seconds", "route=\"/upload\"", "Request latency by route" },
+	[METRIC_REQUEST_POST] = { "sln_request_duration_seconds", "route=\"/post\"", "Request latency by route" },
+	[METRIC_REQUEST_ACCOUNT] = { "sln_request_duration_seconds", "route=\"/account\"", "Request latency by route" },
+	[METRIC_REQUEST_AUTH] = { "sln_request_duration_seconds", "route=\"/auth\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_AUTH] = { "sln_request_duration_seconds", "route=\"/sln/auth\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_FILE] = { "sln_request_duration_seconds", "route=\"/sln/file\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_META] = { "sln_request_duration_seconds", "route=\"/sln/meta\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_ALTS] = { "sln_request_duration_seconds", "route=\"/sln/alts\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_QUERY] = { "sln_request_duration_seconds", "route=\"/sln/query\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_METAFILES] = { "sln_request_duration_seconds", "route=\"/sln/metafiles\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_ALL] = { "sln_request_duration_seconds", "route=\"/sln/all\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_BATCH] = { "sln_request_duration_seconds", "route=\"/sln/batch\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_HAVE] = { "sln_request_duration_seconds", "route=\"/sln/have\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_DIGEST] = { "sln_request_duration_seconds", "route=\"/sln/digest\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_METRICS] = { "sln_request_duration_seconds", "route=\"/sln/metrics\"", "Request latency by route" },
+	[METRIC_REQUEST_SLN_STATS] = { "sln_request_duration_seconds", "route=\"/sln/stats\"", "Request latency by route" },
+	[METRIC_TXN_READ] = { "sln_txn_duration_seconds", "mode=\"read\"", "Database access time" },
+	[METRIC_TXN_WRITE] = { "sln_txn_duration_seconds", "mode=\"write\"", "Database access time" },
+	[METRIC_POOL_WAIT_INTERACTIVE] = { "sln_pool_wait_seconds", "pool=\"interactive\"", "Time spent waiting for a worker thread" },
+	[METRIC_POOL_WAIT_BULK] = { "sln_pool_wait_seconds", "pool=\"bulk\"", "Time spent waiting for a worker thread" },
+	[METRIC_POOL_WAIT_PREVIEW] = { "sln_pool_wait_seconds", "pool=\"preview\"", "Time spent waiting for a worker thread" },
+	[METRIC_POOL_WAIT_PASS] = { "sln_pool_wait_seconds", "pool=\"pass\"", "Time spent waiting for a worker thread" },
+};
+
+typedef struct {
+	uint64_t buckets[BUCKET_COUNT];
+	uint64_t count;
+	uint64_t sum;
+} histogram;
+
+// One per thread. Only the owner writes to it, but anyone can read it.
+// Blocks are never freed because threads are never destroyed.
+struct block {
+	uint64_t counters[METRIC_COUNTER_COUNT];
+	int64_t gauges[METRIC_GAUGE_COUNT];
+	histogram histograms[METRIC_HISTOGRAM_COUNT];
+	struct block *next;
+};
+
+static struct block *blocks = NULL;
+static thread_local struct block *local = NULL;
+
+static thread_local unsigned txn_depth = 0;
+static thread_local bool txn_write = false;
+static thread_local uint64_t txn_start = 0;
+
+static struct block *get_local(void) {
+	if(local) return local;
+	struct block *const b = calloc(1, sizeof(struct block));
+	if(!b) return NULL;
+	b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&blocks, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	local = b;
+	return b;
+}
+static void add(uint64_t *const x, uint64_t const n) {
+	__atomic_store_n(x, *x + n, __ATOMIC_RELAXED);
+}
+
+void metrics_count(metric_counter const x, uint64_t const n) {
+	assert(x < METRIC_COUNTER_COUNT);
+	struct block *const b = get_local();
+	if(!b) return;
+	add(&b->counters[x], n);
+}
+void metrics_gauge(metric_gauge const x, int64_t const n) {
+	assert(x < METRIC_GAUGE_COUNT);
+	struct block *const b = get_local();
+	if(!b) return;
+	// Gauges are often raised on one thread and lowered on another,
+	// so individual blocks can go negative. Only the total matters.
+	__atomic_store_n(&b->gauges[x], b->gauges[x] + n, __ATOMIC_RELAXED);
+}
+void metrics_observe(metric_histogram const x, uint64_t const usec) {
+	assert(x < METRIC_HISTOGRAM_COUNT);
+	struct block *const b = get_local();
+	if(!b) return;
+	histogram *const h = &b->histograms[x];
+	size_t i = 0;
+	while(i < BUCKET_COUNT-1 && usec > bounds[i]) i++;
+	add(&h->buckets[i], 1);
+	add(&h->count, 1);
+	add(&h->sum, usec);
+}
+
+void metrics_pool_enter(async_pool_t *const pool, metric_pool const label) {
+	assert(label < METRIC_POOL_COUNT);
+	metric_gauge const gauge = METRIC_POOL_WAITING_INTERACTIVE + label;
+	metric_histogram const hist = METRIC_POOL_WAIT_INTERACTIVE + label;
+	uint64_t const start = uv_hrtime();
+	metrics_gauge(gauge, +1);
+	async_pool_enter(pool);
+	metrics_gauge(gauge, -1); // Now on a different thread.
+	metrics_observe(hist, (uv_hrtime() - start) / 1000);
+}
+
+void metrics_txn_begin(bool const write) {
+	if(0 == txn_depth++) {
+		txn_write = write;
+		txn_start = uv_hrtime();
+	}
+}
+void metrics_txn_end(void) {
+	assert(txn_depth > 0);
+	if(0 != --txn_depth) return;
+	metrics_observe(txn_write ? METRIC_TXN_WRITE : METRIC_TXN_READ,
+		(uv_hrtime() - txn_start) / 1000);
+}
+
+
+typedef struct {
+	char *str;
+	size_t len;
+	size_t size;
+	bool error;
+} outbuf;
+
+static void outf(outbuf *const out, char const *const fmt, ...) __attribute__((format(printf, 2, 3)));
+static void outf(outbuf *const out, char const *const fmt, ...) {
+	if(out->error) return;
+	for(;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int const rc = vsnprintf(out->str+out->len, out->size-out->len, fmt, ap);
+		va_end(ap);
+		if(rc < 0) {
+			out->error = true;
+			return;
+		}
+		if(out->len+rc < out->size) {
+			out->len += rc;
+			return;
+		}
+		size_t size = out->size*2;
+		if(size < out->len+rc+1) size = out->len+rc+1;
+		char *const str = realloc(out->str, size);
+		if(!str) {
+			out->error = true;
+			return;
+		}
+		out->str = str;
+		out->size = size;
+	}
+}
+static void header(outbuf *const out, metric_info const *const info, metric_info const *const prev, char const *const type) {
+	if(prev && 0 == strcmp(prev->name, info->name)) return;
+	outf(out, "# HELP %s %s\n", info->name, info->help);
+	outf(out, "# TYPE %s %s\n", info->name, type);
+}
+// Empty label sets are left out entirely.
+static char const *lbrace(char const *const labels) {
+	return '\0' == labels[0] ? "" : "{";
+}
+static char const *rbrace(char const *const labels) {
+	return '\0' == labels[0] ? "" : "}";
+}
+static char const *sep(char const *const labels) {
+	return '\0' == labels[0] ? "" : ",";
+}
+static void format_counters(outbuf *const out) {
+	for(size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+		uint64_t total = 0;
+		for(struct block *b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+			total += __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+		}
+		metric_info const *const info = &counters[i];
+		header(out, info, i ? &counters[i-1] : NULL, "counter");
+		outf(out, "%s%s%s%s %llu\n", info->name, lbrace(info->labels),
+			info->labels, rbrace(info->labels), (unsigned long long)total);
+	}
+}
+static void format_gauges(outbuf *const out) {
+	for(size_t i = 0; i < METRIC_GAUGE_COUNT; i++) {
+		int64_t total = 0;
+		for(struct block *b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+			total += __atomic_load_n(&b->gauges[i], __ATOMIC_RELAXED);
+		}
+		metric_info const *const info = &gauges[i];
+		header(out, info, i ? &gauges[i-1] : NULL, "gauge");
+		outf(out, "%s%s%s%s %lld\n", info->name, lbrace(info->labels),
+			info->labels, rbrace(info->labels), (long long)total);
+	}
+}
+static void format_histograms(outbuf *const out) {
+	for(size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+		histogram total = {};
+		for(struct block *b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+			histogram const *const h = &b->histograms[i];
+			for(size_t j = 0; j < BUCKET_COUNT; j++) {
+				total.buckets[j] += __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+			}
+			total.count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+			total.sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		}
+		metric_info const *const info = &histograms[i];
+		header(out, info, i ? &histograms[i-1] : NULL, "histogram");
+		uint64_t cumulative = 0;
+		for(size_t j = 0; j < BUCKET_COUNT; j++) {
+			cumulative += total.buckets[j];
+			outf(out, "%s_bucket{%s%sle=\"%s\"} %llu\n",
+				info->name, info->labels, sep(info->labels),
+				bucket_names[j], (unsigned long long)cumulative);
+		}
+		outf(out, "%s_sum%s%s%s %llu.%06llu\n", info->name,
+			lbrace(info->labels), info->labels, rbrace(info->labels),
+			(unsigned long long)total.sum / (1000 * 1000),
+			(unsigned long long)total.sum % (1000 * 1000));
+		outf(out, "%s_count%s%s%s %llu\n", info->name,
+			lbrace(info->labels), info->labels, rbrace(info->labels),
+			(unsigned long long)total.count);
+	}
+}
+static void format_admit(outbuf *const out) {
+	static struct {
+		char const *name;
+		char const *type;
+		char const *help;
+	} const fields[] = {
+		{ "sln_admit_active", "gauge", "Requests running by route class" },
+		{ "sln_admit_waiting", "gauge", "Requests queued by route class" },
+		{ "sln_admit_admitted_total", "counter", "Requests admitted by route class" },
+		{ "sln_admit_rejected_total", "counter", "Requests rejected because the queue was full" },
+		{ "sln_admit_timedout_total", "counter", "Requests rejected after waiting too long" },
+	};
+	admit_stats stats[ADMIT_CLASS_COUNT];
+	for(size_t i = 0; i < ADMIT_CLASS_COUNT; i++) {
+		admit_get_stats(i, &stats[i]);
+	}
+	for(size_t i = 0; i < sizeof(fields)/sizeof(*fields); i++) {
+		outf(out, "# HELP %s %s\n", fields[i].name, fields[i].help);
+		outf(out, "# TYPE %s %s\n", fields[i].name, fields[i].type);
+		for(size_t j = 0; j < ADMIT_CLASS_COUNT; j++) {
+			uint64_t const values[] = {
+				stats[j].active,
+				stats[j].waiting,
+				stats[j].admitted,
+				stats[j].rejected,
+				stats[j].timedout,
+			};
+			outf(out, "%s{class=\"%s\"} %llu\n", fields[i].name,
+				admit_class_name(j), (unsigned long long)values[i]);
+		}
+	}
+}
+char *metrics_format(void) {
+	outbuf out[1] = {};
+	format_counters(out);
+	format_gauges(out);
+	format_histograms(out);
+	format_admit(out);
+	outf(out, "# HELP sln_accesslog_dropped_total Access log lines dropped because the buffer was full\n");
+	outf(out, "# TYPE sln_accesslog_dropped_total counter\n");
+	outf(out, "sln_accesslog_dropped_total %llu\n",
+		(unsigned long long)accesslog_dropped());
+	if(out->error) {
+		free(out->str);
+		return NULL;
+	}
+	return out->str;
+}
+
@@ -0,0 +1,97 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <async/async.h>
+
+// Internal counters, reported in the Prometheus text format.
+// Each thread updates its own copy, which are only summed when
+// reporting, so recording is cheap and never contends.
+
+typedef enum {
+	METRIC_SUBMISSIONS = 0,
+	METRIC_SUBMISSION_BYTES,
+	METRIC_HASHED_BYTES,
+	METRIC_SESSION_HITS,
+	METRIC_SESSION_MISSES,
+	METRIC_SESSION_EVICTIONS,
+	METRIC_SESSION_EXPIRATIONS,
+	METRIC_PASS_BUSY,
+	METRIC_PASS_THROTTLED,
+	METRIC_PAGE_HITS,
+	METRIC_PAGE_MISSES,
+	METRIC_COUNTER_COUNT
+} metric_counter;
+
+// Thread pools we wait on, for labeling.
+typedef enum {
+	METRIC_POOL_INTERACTIVE = 0, // The shared pool
+	METRIC_POOL_BULK,
+	METRIC_POOL_PREVIEW,
+	METRIC_POOL_PASS,
+	METRIC_POOL_COUNT
+} metric_pool;
+
+typedef enum {
+	// In the same order as metric_pool.
+	METRIC_POOL_WAITING_INTERACTIVE = 0,
+	METRIC_POOL_WAITING_BULK,
+	METRIC_POOL_WAITING_PREVIEW,
+	METRIC_POOL_WAITING_PASS,
+	METRIC_SYNC_QUEUED_FILE,
+	METRIC_SYNC_QUEUED_META,
+	METRIC_SUBMISSION_WAITERS,
+	METRIC_SESSION_CACHED,
+	METRIC_GAUGE_COUNT
+} metric_gauge;
+
+typedef enum {
+	// Request latency by route. Static files, redirects and
+	// unknown paths all count as "other".
+	METRIC_REQUEST_OTHER = 0,
+	METRIC_REQUEST_INDEX,
+	METRIC_REQUEST_FEED,
+	METRIC_REQUEST_COMPOSE,
+	METRIC_REQUEST_UPLOAD,
+	METRIC_REQUEST_POST,
+	METRIC_REQUEST_ACCOUNT,
+	METRIC_REQUEST_AUTH,
+	METRIC_REQUEST_SLN_AUTH,
+	METRIC_REQUEST_SLN_FILE,
+	METRIC_REQUEST_SLN_META,
+	METRIC_REQUEST_SLN_ALTS,
+	METRIC_REQUEST_SLN_QUERY,
+	METRIC_REQUEST_SLN_METAFILES,
+	METRIC_REQUEST_SLN_ALL,
+	METRIC_REQUEST_SLN_BATCH,
+	METRIC_REQUEST_SLN_HAVE,
+	METRIC_REQUEST_SLN_DIGEST,
+	METRIC_REQUEST_SLN_METRICS,
+	METRIC_REQUEST_SLN_STATS,
+	METRIC_TXN_READ,
+	METRIC_TXN_WRITE,
+	// In the same order as metric_pool.
+	METRIC_POOL_WAIT_INTERACTIVE,
+	METRIC_POOL_WAIT_BULK,
+	METRIC_POOL_WAIT_PREVIEW,
+	METRIC_POOL_WAIT_PASS,
+	METRIC_HISTOGRAM_COUNT
+} metric_histogram;
+
+void metrics_count(metric_counter const x, uint64_t const n);
+void metrics_gauge(metric_gauge const x, int64_t const n);
+void metrics_observe(metric_histogram const x, uint64_t const usec);
+
+// Like async_pool_enter, but records how long we waited for a thread,
+// labeled as the given pool.
+void metrics_pool_enter(async_pool_t *const pool, metric_pool const label);
+
+// Times database access on the current worker thread.
+// Only the outermost begin/end pair is counted.
+void metrics_txn_begin(bool const write);
+void metrics_txn_end(void);
+
+// Returns a newly allocated report, or NULL.
+char *metrics_format(void);
+
@@ -1,42 +1,133 @@
 // Copyright 2014-2015 Ben Trask
 // MIT licensed (see LICENSE for details)
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../../deps/crypt_blowfish/ow-crypt.h"
 #include <async/async.h>
+#include "metrics.h"
 #include "pass.h"
+#include "siphash.h"
 
 #define BCRYPT_PREFIX "$2b$"
 #define BCRYPT_ROUNDS 13
 #define BCRYPT_SALT_LEN 16
 
+// Failures are counted in buckets by keyed hash, without storing the
+// keys. Colliding users or clients share a bucket, which can only make
+// throttling stricter, never looser.
+#define THROTTLE_SIZE 4096
+
+typedef struct {
+	uint32_t failures;
+	uint64_t start;
+} bucket;
+
+static bool init = false;
+static async_pool_t *pool = NULL;
+static async_mutex_t mutex[1];
+static async_cond_t cond[1];
+static unsigned limit = 0;
+static unsigned queue = 0;
+static unsigned active = 0;
+static unsigned waiting = 0;
+
+static unsigned failures_max = 0;
+static uint64_t window = 0;
+static unsigned char hashkey[SIPHASH_KEY_LEN];
+static bucket buckets[THROTTLE_SIZE] = {};
+
+int pass_config(unsigned const lim, unsigned const q, unsigned const failures, uint64_t const win) {
+	if(!init) {
+		int rc = async_random(hashkey, sizeof(hashkey));
+		if(rc < 0) return rc;
+		pool = async_pool_create();
+		if(!pool) return UV_ENOMEM;
+		async_mutex_init(mutex, 0);
+		async_cond_init(cond, 0);
+		init = true;
+	}
+	async_mutex_lock(mutex);
+	limit = lim;
+	queue = q;
+	failures_max = failures;
+	window = win;
+	async_cond_broadcast(cond);
+	async_mutex_unlock(mutex);
+	return 0;
+}
+
+static bool full(void) {
+	if(!limit) return false;
+	return active >= limit;
+}
+static int slot_enter(void) {
+	if(!init) {
+		metrics_pool_enter(NULL, METRIC_POOL_INTERACTIVE);
+		return 0;
+	}
+	int rc = 0;
+	async_mutex_lock(mutex);
+	// Hashing takes a predictable amount of time, so rather than
+	// timing out, we just refuse to queue up more than we can
+	// get through quickly.
+	if(!full() && 0 == waiting) goto entered;
+	if(waiting >= queue) {
+		metrics_count(METRIC_PASS_BUSY, 1);
+		rc = UV_EAGAIN;
+		goto cleanup;
+	}
+	waiting++;
+	while(full()) async_cond_wait(cond, mutex);
+	waiting--;
+entered:
+	active++;
+cleanup:
+	async_mutex_unlock(mutex);
+	if(rc < 0) return rc;
+	metrics_pool_enter(pool, METRIC_POOL_PASS);
+	return 0;
+}
+static void slot_leave(void) {
+	if(!init) {
+		async_pool_leave(NULL);
+		return;
+	}
+	async_pool_leave(pool);
+	async_mutex_lock(mutex);
+	assert(active > 0);
+	active--;
+	async_cond_signal(cond);
+	async_mutex_unlock(mutex);
+}
+
 int pass_hashcmp(char const *const pass, char const *const hash) {
-	async_pool_enter(NULL);
+	int rc = slot_enter();
+	if(rc < 0) return rc;
 	int size = 0;
 	void *data = NULL;
 	char const *attempt = crypt_ra(pass, hash, &data, &size);
 	bool const success = (attempt && 0 == strcmp(attempt, hash));
 	attempt = NULL;
 	free(data); data = NULL;
-	async_pool_leave(NULL);
-	if(!success) return -1;
+	slot_leave();
+	if(!success) return UV_EACCES;
 	return 0;
 }
-char *pass_hash(char const *const pass) {
+int pass_hash(char const *const pass, char **const out) {
+	assert(out);
 	// TODO: async_random isn't currently parallel or thread-safe
-//	async_pool_enter(NULL);
 	char input[BCRYPT_SALT_LEN];
-	if(async_random((unsigned char *)input, BCRYPT_SALT_LEN) < 0) {
-//		async_pool_leave(NULL);
-		return NULL;
-	}
-	async_pool_enter(NULL); // TODO (above)
+	int rc = async_random((unsigned char *)input, BCRYPT_SALT_LEN);
+	if(rc < 0) return rc;
+	rc = slot_enter();
+	if(rc < 0) return rc;
 
 	char *salt = crypt_gensalt_ra(BCRYPT_PREFIX, BCRYPT_ROUNDS, input, BCRYPT_SALT_LEN);
 	if(!salt) {
-		async_pool_leave(NULL);
-		return NULL;
+		slot_leave();
+		return UV_ENOMEM;
 	}
 	int size = 0;
 	void *data = NULL;
@@ -44,7 +135,40 @@ char *pass_hash(char const *const pass) {
 	char *hash = orig ? strdup(orig) : NULL;
 	free(salt); salt = NULL;
 	free(data); data = NULL;
-	async_pool_leave(NULL);
-	return hash;
+	slot_leave();
+	if(!hash) return UV_ENOMEM;
+	*out = hash;
+	return 0;
+}
+
+static bucket *bucket_get(char const kind, char const *const key, uint64_t const now) {
+	// Offset by kind so a username doesn't share a bucket with an
+	// identical client address.
+	uint64_t const h = siphash24(hashkey, key, strlen(key)) + kind;
+	bucket *const b = &buckets[h % THROTTLE_SIZE];
+	if(now - b->start >= window) {
+		b->failures = 0;
+		b->start = now;
+	}
+	return b;
+}
+int pass_throttle_check(char const *const username, char const *const client) {
+	if(!init || !failures_max) return 0;
+	uint64_t const now = uv_now(async_loop);
+	int rc = 0;
+	async_mutex_lock(mutex);
+	if(username && bucket_get('u', username, now)->failures >= failures_max) rc = UV_EPERM;
+	if(client && bucket_get('c', client, now)->failures >= failures_max) rc = UV_EPERM;
+	async_mutex_unlock(mutex);
+	if(rc < 0) metrics_count(METRIC_PASS_THROTTLED, 1);
+	return rc;
+}
+void pass_throttle_failed(char const *const username, char const *const client) {
+	if(!init || !failures_max) return;
+	uint64_t const now = uv_now(async_loop);
+	async_mutex_lock(mutex);
+	if(username) bucket_get('u', username, now)->failures++;
+	if(client) bucket_get('c', client, now)->failures++;
+	async_mutex_unlock(mutex);
 }
 
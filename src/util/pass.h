@@ -2,7 +2,22 @@
 // MIT licensed (see LICENSE for details)
 
 #include <stdbool.h>
+#include <stdint.h>
 
+// Password hashing runs on its own thread pool, so that a burst of
+// logins can't hold up other requests. Past the limit, callers wait in
+// a bounded queue and get UV_EAGAIN if it's full. Until configured,
+// hashing uses the shared pool without limits (e.g. for command line
+// tools).
+int pass_config(unsigned const limit, unsigned const queue, unsigned const failures, uint64_t const window);
+
+// Returns UV_EACCES if the password doesn't match.
 int pass_hashcmp(char const *const pass, char const *const hash);
-char *pass_hash(char const *const pass);
+// Returns UV_EAGAIN if the hashing queue is full.
+int pass_hash(char const *const pass, char **const out);
 
+// Returns UV_EPERM if either the username or the client (both optional)
+// has had too many failed attempts within the current window.
+// Check before doing anything expensive, and report failures after.
+int pass_throttle_check(char const *const username, char const *const client);
+void pass_throttle_failed(char const *const username, char const *const client);
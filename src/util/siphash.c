@@ -0,0 +1,55 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include "siphash.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t read64(unsigned char const *const p) {
+	// Little-endian, regardless of the platform.
+	uint64_t x = 0;
+	for(size_t i = 0; i < 8; i++) x |= (uint64_t)p[i] << (i*8);
+	return x;
+}
+
+#define SIPROUND() do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while(0)
+
+uint64_t siphash24(unsigned char const key[SIPHASH_KEY_LEN], void const *const buf, size_t const len) {
+	unsigned char const *const in = buf;
+	uint64_t const k0 = read64(key+0);
+	uint64_t const k1 = read64(key+8);
+	uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ k0;
+	uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ k1;
+	uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ k0;
+	uint64_t v3 = UINT64_C(0x7465646279746573) ^ k1;
+
+	size_t const end = len - (len % 8);
+	for(size_t i = 0; i < end; i += 8) {
+		uint64_t const m = read64(in+i);
+		v3 ^= m;
+		SIPROUND();
+		SIPROUND();
+		v0 ^= m;
+	}
+
+	// The last block has the length in its top byte.
+	uint64_t b = (uint64_t)len << 56;
+	for(size_t i = end; i < len; i++) b |= (uint64_t)in[i] << ((i-end)*8);
+	v3 ^= b;
+	SIPROUND();
+	SIPROUND();
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND();
+	SIPROUND();
+	SIPROUND();
+	SIPROUND();
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
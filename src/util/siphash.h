@@ -0,0 +1,14 @@
+// Copyright 2015 Ben Trask
+// MIT licensed (see LICENSE for details)
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// SipHash-2-4, a fast keyed MAC for short inputs.
+// Unlike a plain hash, the output can't be predicted (or forged)
+// without the key, so it's safe to use for checking secrets.
+
+#define SIPHASH_KEY_LEN 16
+
+uint64_t siphash24(unsigned char const key[SIPHASH_KEY_LEN], void const *const buf, size_t const len);
+